@@ -0,0 +1,855 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Performance measurements for serving static files.
+ *
+ * The "syscalls" benchmark counts the system calls it takes to serve a
+ * static file. Three document roots are set up the way cockpit-ws has them: an OS
+ * branding directory, the default branding and the static files. Files
+ * are then served from them with cockpit_web_response_file() and
+ * friends, and cockpit_web_response_negotiation() is used the way it is
+ * for login.html and po.js, first without and then with the roots in the
+ * static file index.
+ *
+ * The work is done in a child process that is traced with ptrace(), and
+ * the system calls of its main thread are counted. The child stops itself
+ * with SIGSTOP around each measured run of requests. An empty run is
+ * measured too, and subtracted, so the stopping isn't counted.
+ *
+ * The "download" benchmark serves large branding and asset files over a
+ * socket pair, with a thread on the other end reading them as fast as it
+ * can. Each file is sent straight from the disk with sendfile(), and
+ * once more through a stream that isn't a socket, which copies it the
+ * way it is done for TLS. It reports the throughput, and the CPU time
+ * that the serving thread took per download.
+ *
+ * The "encodings" benchmark compares the sizes of the bundles in the
+ * dist directory with each Content-Encoding, and how long it takes to
+ * serve each of them with cockpit_web_response_file_or_compressed().
+ * The shipped .gz files are unpacked, and packed again with the brotli and
+ * zstd tools when they are installed. "identity-from-gzip" is a client
+ * that doesn't take gzip being served a file that only exists as .gz.
+ *
+ * Each measurement is printed as one line of space separated key=value
+ * pairs. This is not run as part of the unit tests.
+ */
+
+#include "config.h"
+
+#include "common/cockpitwebindex.h"
+#include "common/cockpitwebresponse.h"
+#include "common/cockpitwebserver.h"
+
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static gchar *opt_benchmark = "syscalls";
+static gint opt_requests = 1000;
+static gint opt_downloads = 20;
+static gchar *opt_dist = SRCDIR "/dist";
+
+static GOptionEntry entries[] = {
+  { "benchmark", 0, 0, G_OPTION_ARG_STRING, &opt_benchmark, "Which benchmark to run: syscalls, download or encodings", "NAME" },
+  { "requests", 0, 0, G_OPTION_ARG_INT, &opt_requests, "Number of requests of each kind", "COUNT" },
+  { "downloads", 0, 0, G_OPTION_ARG_INT, &opt_downloads, "Number of downloads of each file", "COUNT" },
+  { "dist", 0, 0, G_OPTION_ARG_FILENAME, &opt_dist, "Directory with built bundles for the encodings benchmark", "DIR" },
+  { NULL }
+};
+
+static const gchar *root_names[] = {
+  "branding-os",
+  "branding-default",
+  "static",
+};
+
+static const gchar *files[] = {
+  "branding-os/branding.css",
+  "branding-default/branding.css",
+  "branding-default/logo.png",
+  "static/index.js",
+  "static/app.css.gz",
+  "static/login.html",
+  "static/po.js",
+  "static/po.de.js",
+};
+
+typedef enum {
+  REQUEST_NONE,
+  REQUEST_FILE,
+  REQUEST_GZIP,
+  REQUEST_MISSING,
+  REQUEST_LOGIN,
+  REQUEST_PO,
+  N_REQUESTS
+} RequestKind;
+
+static const gchar *request_names[] = {
+  "none",
+  "file",
+  "gzip",
+  "missing",
+  "login",
+  "po",
+};
+
+/* Each request kind is measured without and with the index */
+#define N_RUNS (N_REQUESTS * 2)
+
+static void
+serve_file (const gchar **roots,
+            const gchar *path,
+            gboolean or_gz)
+{
+  CockpitWebResponse *response;
+  GInputStream *input;
+  GOutputStream *output;
+  GIOStream *io;
+  GHashTable *headers;
+
+  headers = cockpit_web_server_new_table ();
+  input = g_memory_input_stream_new ();
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = g_simple_io_stream_new (input, output);
+
+  response = cockpit_web_response_new (io, path, path, headers, "GET", "https");
+  if (or_gz)
+    cockpit_web_response_file_or_gz (response, TRUE, path, roots);
+  else
+    cockpit_web_response_file (response, path, roots);
+
+  while (cockpit_web_response_get_state (response) != COCKPIT_WEB_RESPONSE_COMPLETE)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_object_unref (response);
+  g_object_unref (io);
+  g_object_unref (input);
+  g_object_unref (output);
+  g_hash_table_unref (headers);
+}
+
+static void
+negotiate (const gchar *static_root,
+           const gchar *name,
+           const gchar *language)
+{
+  g_autofree gchar *path = g_build_filename (static_root, name, NULL);
+  GError *error = NULL;
+  GBytes *bytes;
+
+  bytes = cockpit_web_response_negotiation (path, NULL, language, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (bytes != NULL);
+  g_bytes_unref (bytes);
+}
+
+static void
+perform (RequestKind kind,
+         const gchar **roots)
+{
+  switch (kind)
+    {
+    case REQUEST_NONE:
+      break;
+    case REQUEST_FILE:
+      serve_file (roots, "/index.js", FALSE);
+      break;
+    case REQUEST_GZIP:
+      serve_file (roots, "/app.css", TRUE);
+      break;
+    case REQUEST_MISSING:
+      serve_file (roots, "/missing.js", FALSE);
+      break;
+    case REQUEST_LOGIN:
+      negotiate (roots[2], "login.html", NULL);
+      break;
+    case REQUEST_PO:
+      negotiate (roots[2], "po.js", "de");
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+static void
+run_child (const gchar **roots)
+{
+  gint indexed;
+  gint kind;
+  gint i;
+
+  if (ptrace (PTRACE_TRACEME, 0, NULL, NULL) < 0)
+    {
+      g_printerr ("bench-webresponse: couldn't trace: %s\n", g_strerror (errno));
+      _exit (1);
+    }
+
+  /* Lets the parent set up tracing */
+  raise (SIGSTOP);
+
+  for (indexed = 0; indexed < 2; indexed++)
+    {
+      if (indexed)
+        cockpit_web_index_add_roots (roots);
+
+      for (kind = 0; kind < N_REQUESTS; kind++)
+        {
+          /* Warm up, the first request allocates things */
+          perform (kind, roots);
+
+          raise (SIGSTOP);
+          for (i = 0; kind != REQUEST_NONE && i < opt_requests; i++)
+            perform (kind, roots);
+          raise (SIGSTOP);
+        }
+    }
+
+  cockpit_web_index_cleanup ();
+  _exit (0);
+}
+
+static gboolean
+trace_child (GPid pid,
+             guint64 *counts)
+{
+  gboolean attached = FALSE;
+  gboolean counting = FALSE;
+  guint64 stops = 0;
+  guint run = 0;
+  int status;
+  int sig;
+
+  for (;;)
+    {
+      if (waitpid (pid, &status, 0) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          g_printerr ("bench-webresponse: couldn't wait for child: %s\n", g_strerror (errno));
+          return FALSE;
+        }
+
+      if (WIFEXITED (status))
+        return WEXITSTATUS (status) == 0 && run == N_RUNS;
+      if (WIFSIGNALED (status))
+        return FALSE;
+
+      sig = 0;
+
+      /* Entering and leaving a system call each stop the child */
+      if (WSTOPSIG (status) == (SIGTRAP | 0x80))
+        {
+          if (counting)
+            stops++;
+        }
+      else if (WSTOPSIG (status) == SIGSTOP)
+        {
+          if (!attached)
+            {
+              ptrace (PTRACE_SETOPTIONS, pid, NULL,
+                      (void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+              attached = TRUE;
+            }
+          else if (!counting)
+            {
+              stops = 0;
+              counting = TRUE;
+            }
+          else
+            {
+              if (run < N_RUNS)
+                counts[run++] = stops / 2;
+              counting = FALSE;
+            }
+        }
+      else
+        {
+          sig = WSTOPSIG (status);
+        }
+
+      ptrace (PTRACE_SYSCALL, pid, NULL, GINT_TO_POINTER (sig));
+    }
+}
+
+static gchar *
+setup_roots (void)
+{
+  g_autoptr(GError) error = NULL;
+  gchar *directory;
+  gchar *path;
+  guint i;
+
+  directory = g_dir_make_tmp ("bench-cockpit-webresponse.XXXXXX", &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < G_N_ELEMENTS (root_names); i++)
+    {
+      path = g_build_filename (directory, root_names[i], NULL);
+      g_assert_cmpint (g_mkdir (path, 0755), ==, 0);
+      g_free (path);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (files); i++)
+    {
+      path = g_build_filename (directory, files[i], NULL);
+      g_file_set_contents (path, files[i], -1, &error);
+      g_assert_no_error (error);
+      g_free (path);
+    }
+
+  return directory;
+}
+
+static void
+cleanup_roots (const gchar *directory)
+{
+  gchar *path;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (files); i++)
+    {
+      path = g_build_filename (directory, files[i], NULL);
+      g_unlink (path);
+      g_free (path);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (root_names); i++)
+    {
+      path = g_build_filename (directory, root_names[i], NULL);
+      g_rmdir (path);
+      g_free (path);
+    }
+
+  g_rmdir (directory);
+}
+
+static gint
+run_syscalls (void)
+{
+  guint64 counts[N_RUNS] = { 0, };
+  g_autofree gchar *directory = NULL;
+  gchar *input[G_N_ELEMENTS (root_names) + 1] = { NULL, };
+  gchar **roots;
+  gboolean ret;
+  gint indexed;
+  gint kind;
+  guint64 baseline;
+  guint i;
+  GPid pid;
+
+  directory = setup_roots ();
+  for (i = 0; i < G_N_ELEMENTS (root_names); i++)
+    input[i] = g_build_filename (directory, root_names[i], NULL);
+  roots = cockpit_web_response_resolve_roots ((const gchar **)input);
+  g_assert_cmpuint (g_strv_length (roots), ==, G_N_ELEMENTS (root_names));
+
+  pid = fork ();
+  if (pid < 0)
+    g_error ("couldn't fork: %s", g_strerror (errno));
+  else if (pid == 0)
+    run_child ((const gchar **)roots);
+
+  ret = trace_child (pid, counts);
+
+  if (ret)
+    {
+      for (indexed = 0; indexed < 2; indexed++)
+        {
+          baseline = counts[indexed * N_REQUESTS + REQUEST_NONE];
+          for (kind = REQUEST_NONE + 1; kind < N_REQUESTS; kind++)
+            {
+              g_print ("index=%s request=%s requests=%d syscalls_per_request=%.2f\n",
+                       indexed ? "yes" : "no", request_names[kind], opt_requests,
+                       ((gdouble)counts[indexed * N_REQUESTS + kind] - baseline) / opt_requests);
+            }
+        }
+    }
+  else
+    {
+      g_printerr ("bench-webresponse: tracing the child failed\n");
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (root_names); i++)
+    g_free (input[i]);
+  g_strfreev (roots);
+  cleanup_roots (directory);
+
+  return ret ? 0 : 1;
+}
+
+typedef struct {
+  const gchar *name;
+  gsize size;
+} DownloadFile;
+
+/* Roughly the sizes of a branding image, a large page and a bundle */
+static const DownloadFile download_files[] = {
+  { "logo.png", 256 * 1024 },
+  { "index.js", 4 * 1024 * 1024 },
+  { "vendor.js", 32 * 1024 * 1024 },
+};
+
+static gdouble
+thread_cpu_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void
+on_download_done (CockpitWebResponse *response,
+                  gboolean reusable,
+                  gpointer user_data)
+{
+  gboolean *done = user_data;
+  *done = TRUE;
+}
+
+/* Plays the browser, reads until the connection is closed */
+static gpointer
+drain_socket (gpointer data)
+{
+  gint fd = GPOINTER_TO_INT (data);
+  static guint8 buffer[256 * 1024];
+  gsize total = 0;
+  gssize count;
+
+  for (;;)
+    {
+      count = read (fd, buffer, sizeof (buffer));
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count <= 0)
+        break;
+      total += count;
+    }
+
+  close (fd);
+  return GSIZE_TO_POINTER (total);
+}
+
+static gsize
+download_file (const gchar *root,
+               const gchar *name,
+               gboolean copy)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *path = g_strconcat ("/", name, NULL);
+  const gchar *roots[] = { root, NULL };
+  GSocketConnection *connection;
+  CockpitWebResponse *response;
+  gboolean done = FALSE;
+  GSocket *socket;
+  GIOStream *io;
+  GThread *thread;
+  gint fds[2];
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    g_error ("couldn't create socket pair: %s", g_strerror (errno));
+
+  socket = g_socket_new_from_fd (fds[0], &error);
+  g_assert_no_error (error);
+  connection = g_socket_connection_factory_create_connection (socket);
+  g_object_unref (socket);
+
+  /* Not a socket connection, so the file is copied through the stream */
+  if (copy)
+    io = g_simple_io_stream_new (g_io_stream_get_input_stream (G_IO_STREAM (connection)),
+                                 g_io_stream_get_output_stream (G_IO_STREAM (connection)));
+  else
+    io = g_object_ref (G_IO_STREAM (connection));
+
+  thread = g_thread_new ("drain", drain_socket, GINT_TO_POINTER (fds[1]));
+
+  response = cockpit_web_response_new (io, path, path, NULL, "GET", "http");
+  g_signal_connect (response, "done", G_CALLBACK (on_download_done), &done);
+  cockpit_web_response_file (response, path, roots);
+
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_object_unref (response);
+  g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+  g_object_unref (io);
+  g_object_unref (connection);
+
+  return GPOINTER_TO_SIZE (g_thread_join (thread));
+}
+
+static gint
+run_download (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *directory = NULL;
+  gchar *root;
+  gchar *path;
+  gchar *data;
+  gint64 start;
+  gdouble seconds;
+  gdouble cpu;
+  gsize total;
+  guint copy;
+  guint i;
+  gint j;
+
+  directory = g_dir_make_tmp ("bench-cockpit-webresponse.XXXXXX", &error);
+  g_assert_no_error (error);
+  root = realpath (directory, NULL);
+  g_assert (root != NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (download_files); i++)
+    {
+      path = g_build_filename (root, download_files[i].name, NULL);
+      data = g_malloc (download_files[i].size);
+      memset (data, 'x', download_files[i].size);
+      g_file_set_contents (path, data, download_files[i].size, &error);
+      g_assert_no_error (error);
+      g_free (data);
+      g_free (path);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (download_files); i++)
+    {
+      for (copy = 0; copy < 2; copy++)
+        {
+          /* Warm up, and get the file into the page cache */
+          download_file (root, download_files[i].name, copy);
+
+          total = 0;
+          cpu = thread_cpu_ms ();
+          start = g_get_monotonic_time ();
+
+          for (j = 0; j < opt_downloads; j++)
+            total += download_file (root, download_files[i].name, copy);
+
+          seconds = (g_get_monotonic_time () - start) / 1000000.0;
+          cpu = thread_cpu_ms () - cpu;
+
+          g_print ("file=%s size_kb=%" G_GSIZE_FORMAT " path=%s downloads=%d"
+                   " mb_per_s=%.1f cpu_ms_per_download=%.3f\n",
+                   download_files[i].name, download_files[i].size / 1024,
+                   copy ? "copy" : "sendfile", opt_downloads,
+                   total / (1024.0 * 1024.0) / seconds, cpu / opt_downloads);
+        }
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (download_files); i++)
+    {
+      path = g_build_filename (root, download_files[i].name, NULL);
+      g_unlink (path);
+      g_free (path);
+    }
+  g_rmdir (root);
+  free (root);
+
+  return 0;
+}
+
+typedef struct {
+  const gchar *name;
+  const gchar *accept_encoding;
+  const gchar *suffix;
+  const gchar *tool;
+  const gchar *tool_arg;
+} Encoding;
+
+static const Encoding encodings[] = {
+  { "identity", "identity", "", NULL, NULL },
+  { "identity-from-gzip", "identity", NULL, NULL, NULL },
+  { "gzip", "gzip", ".gz", NULL, NULL },
+  { "br", "br", ".br", "brotli", "--quality=11" },
+  { "zstd", "zstd", ".zst", "zstd", "-19" },
+};
+
+static void
+find_bundles (const gchar *directory,
+              GPtrArray *bundles)
+{
+  const gchar *name;
+  gchar *path;
+  GDir *dir;
+
+  dir = g_dir_open (directory, 0, NULL);
+  if (!dir)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      path = g_build_filename (directory, name, NULL);
+      if (g_file_test (path, G_FILE_TEST_IS_DIR))
+        {
+          find_bundles (path, bundles);
+          g_free (path);
+        }
+      else if (g_str_has_suffix (name, ".js.gz") || g_str_has_suffix (name, ".css.gz"))
+        {
+          g_ptr_array_add (bundles, path);
+        }
+      else
+        {
+          g_free (path);
+        }
+    }
+
+  g_dir_close (dir);
+}
+
+/* Packs @path with an external tool, if it is installed */
+static gboolean
+compress_with_tool (const Encoding *encoding,
+                    const gchar *path)
+{
+  const gchar *argv[] = { encoding->tool, encoding->tool_arg, "-k", "-f", path, NULL };
+  gint status;
+
+  if (!g_spawn_sync (NULL, (gchar **)argv, NULL, G_SPAWN_SEARCH_PATH |
+                     G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                     NULL, NULL, NULL, NULL, &status, NULL))
+    return FALSE;
+
+  return g_spawn_check_exit_status (status, NULL);
+}
+
+static gsize
+serve_encoded (const gchar **roots,
+               const gchar *path,
+               const gchar *accept_encoding)
+{
+  CockpitWebResponse *response;
+  GInputStream *input;
+  GOutputStream *output;
+  GIOStream *io;
+  gsize length;
+
+  input = g_memory_input_stream_new ();
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = g_simple_io_stream_new (input, output);
+
+  response = cockpit_web_response_new (io, path, path, NULL, "GET", "https");
+  cockpit_web_response_file_or_compressed (response, accept_encoding, path, roots);
+
+  while (cockpit_web_response_get_state (response) != COCKPIT_WEB_RESPONSE_SENT)
+    g_main_context_iteration (NULL, TRUE);
+
+  length = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output));
+
+  g_object_unref (response);
+  g_object_unref (io);
+  g_object_unref (input);
+  g_object_unref (output);
+
+  return length;
+}
+
+static gint
+run_encodings (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *directory = NULL;
+  g_autofree gchar *full_root = NULL;
+  g_autofree gchar *gzip_root = NULL;
+  gboolean available[G_N_ELEMENTS (encodings)];
+  gsize sizes[G_N_ELEMENTS (encodings)] = { 0, };
+  const gchar *roots[] = { NULL, NULL };
+  GPtrArray *bundles;
+  GPtrArray *names;
+  gint64 start;
+  gdouble seconds;
+  gsize total;
+  gchar *name;
+  gchar *path;
+  gchar *data;
+  gsize length;
+  guint i, e;
+  gint j;
+
+  bundles = g_ptr_array_new_with_free_func (g_free);
+  find_bundles (opt_dist, bundles);
+  if (bundles->len == 0)
+    {
+      g_printerr ("bench-webresponse: no .js.gz or .css.gz bundles in %s\n", opt_dist);
+      g_ptr_array_free (bundles, TRUE);
+      return 1;
+    }
+
+  directory = g_dir_make_tmp ("bench-cockpit-webresponse.XXXXXX", &error);
+  g_assert_no_error (error);
+  full_root = g_build_filename (directory, "full", NULL);
+  gzip_root = g_build_filename (directory, "gzip", NULL);
+  g_assert_cmpint (g_mkdir (full_root, 0755), ==, 0);
+  g_assert_cmpint (g_mkdir (gzip_root, 0755), ==, 0);
+
+  for (e = 0; e < G_N_ELEMENTS (encodings); e++)
+    available[e] = TRUE;
+
+  /* Every bundle as a flat file name, with all its encodings next to it */
+  names = g_ptr_array_new_with_free_func (g_free);
+  for (i = 0; i < bundles->len; i++)
+    {
+      g_autoptr(GBytes) compressed = NULL;
+      g_autoptr(GBytes) plain = NULL;
+
+      g_file_get_contents (bundles->pdata[i], &data, &length, &error);
+      g_assert_no_error (error);
+      compressed = g_bytes_new_take (data, length);
+      plain = cockpit_web_response_gunzip (compressed, &error);
+      g_assert_no_error (error);
+
+      name = g_strndup ((gchar *)bundles->pdata[i] + strlen (opt_dist) + 1,
+                        strlen (bundles->pdata[i]) - strlen (opt_dist) - 4);
+      g_strdelimit (name, "/", '-');
+      g_ptr_array_add (names, name);
+
+      path = g_build_filename (full_root, name, NULL);
+      g_file_set_contents (path, g_bytes_get_data (plain, NULL), g_bytes_get_size (plain), &error);
+      g_assert_no_error (error);
+      for (e = 0; e < G_N_ELEMENTS (encodings); e++)
+        {
+          if (encodings[e].tool && available[e])
+            available[e] = compress_with_tool (&encodings[e], path);
+        }
+      g_free (path);
+
+      path = g_strconcat (full_root, "/", name, ".gz", NULL);
+      g_file_set_contents (path, g_bytes_get_data (compressed, NULL), length, &error);
+      g_assert_no_error (error);
+      g_free (path);
+
+      path = g_strconcat (gzip_root, "/", name, ".gz", NULL);
+      g_file_set_contents (path, g_bytes_get_data (compressed, NULL), length, &error);
+      g_assert_no_error (error);
+      g_free (path);
+    }
+
+  for (e = 0; e < G_N_ELEMENTS (encodings); e++)
+    {
+      if (!available[e])
+        {
+          g_print ("encoding=%s available=no\n", encodings[e].name);
+          continue;
+        }
+
+      roots[0] = encodings[e].suffix ? full_root : gzip_root;
+
+      /* Decompressing makes the same response as the plain file */
+      if (!encodings[e].suffix)
+        sizes[e] = sizes[0];
+
+      for (i = 0; encodings[e].suffix && i < names->len; i++)
+        {
+          g_autofree gchar *file = g_strconcat (roots[0], "/", names->pdata[i], encodings[e].suffix, NULL);
+          struct stat st;
+
+          g_assert_cmpint (stat (file, &st), ==, 0);
+          sizes[e] += st.st_size;
+        }
+
+      /* Warm up, and get the files into the page cache */
+      for (i = 0; i < names->len; i++)
+        {
+          g_autofree gchar *request = g_strconcat ("/", names->pdata[i], NULL);
+          serve_encoded (roots, request, encodings[e].accept_encoding);
+        }
+
+      total = 0;
+      start = g_get_monotonic_time ();
+      for (j = 0; j < opt_downloads; j++)
+        {
+          for (i = 0; i < names->len; i++)
+            {
+              g_autofree gchar *request = g_strconcat ("/", names->pdata[i], NULL);
+              total += serve_encoded (roots, request, encodings[e].accept_encoding);
+            }
+        }
+      seconds = (g_get_monotonic_time () - start) / 1000000.0;
+
+      g_print ("encoding=%s files=%u size_kb=%" G_GSIZE_FORMAT " ratio=%.3f downloads=%d"
+               " us_per_request=%.1f response_kb=%" G_GSIZE_FORMAT "\n",
+               encodings[e].name, names->len, sizes[e] / 1024,
+               sizes[0] ? (gdouble)sizes[e] / sizes[0] : 0.0, opt_downloads,
+               seconds * 1000000.0 / (opt_downloads * names->len),
+               total / opt_downloads / 1024);
+    }
+
+  for (i = 0; i < names->len; i++)
+    {
+      for (e = 0; e < G_N_ELEMENTS (encodings); e++)
+        {
+          if (!encodings[e].suffix)
+            continue;
+          path = g_strconcat (full_root, "/", names->pdata[i], encodings[e].suffix, NULL);
+          g_unlink (path);
+          g_free (path);
+        }
+      path = g_strconcat (gzip_root, "/", names->pdata[i], ".gz", NULL);
+      g_unlink (path);
+      g_free (path);
+    }
+  g_rmdir (full_root);
+  g_rmdir (gzip_root);
+  g_rmdir (directory);
+
+  g_ptr_array_free (names, TRUE);
+  g_ptr_array_free (bundles, TRUE);
+  return 0;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+
+  context = g_option_context_new ("- measure serving static files");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-webresponse: %s\n", error->message);
+      return 2;
+    }
+  g_option_context_free (context);
+
+  if (opt_requests <= 0 || opt_downloads <= 0)
+    {
+      g_printerr ("bench-webresponse: --requests and --downloads must be positive\n");
+      return 2;
+    }
+
+  if (g_str_equal (opt_benchmark, "syscalls"))
+    return run_syscalls ();
+  else if (g_str_equal (opt_benchmark, "download"))
+    return run_download ();
+  else if (g_str_equal (opt_benchmark, "encodings"))
+    return run_encodings ();
+
+  g_printerr ("bench-webresponse: unknown benchmark: %s\n", opt_benchmark);
+  return 2;
+}
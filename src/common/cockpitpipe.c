@@ -123,6 +123,9 @@ typedef struct {
 /* A megabyte is when we start to consider queue full enough */
 #define QUEUE_PRESSURE 1024UL * 1024UL
 
+/* How many queued blocks to write at once, a transport queues two for each message */
+#define WRITE_BLOCKS 64
+
 static guint cockpit_pipe_sig_read;
 static guint cockpit_pipe_sig_close;
 
@@ -578,7 +581,7 @@ dispatch_output (gint fd,
 {
   CockpitPipe *self = (CockpitPipe *)user_data;
   CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
-  struct iovec iov[4];
+  struct iovec iov[WRITE_BLOCKS];
   gsize partial, size, before;
   GBytes *popped;
   gssize ret;
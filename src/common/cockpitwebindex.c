@@ -0,0 +1,314 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitwebindex.h"
+
+#include <gio/gio.h>
+
+#include <string.h>
+
+/*
+ * An index of which files and directories exist below some document
+ * roots. Serving a static file tries a number of names in each of the
+ * roots, and most of them don't exist. With the index those misses are
+ * answered from memory, and only the file that is there gets opened.
+ *
+ * Each root is scanned when it is added, and a file monitor on each of
+ * its directories marks it stale when anything changes. Lookups in a
+ * stale root fall back to the file system, and once the changes have
+ * settled down the root gets scanned again from the main loop, so that
+ * requests never wait for a scan. A root that is too large or deep, or
+ * can't be read or monitored, isn't indexed at all.
+ */
+
+#define MAX_DEPTH 16
+#define MAX_ENTRIES 100000
+#define REBUILD_DELAY 500 /* ms */
+
+typedef struct {
+  gchar *root;
+  gsize root_len;
+  GHashTable *entries;
+  GPtrArray *monitors;
+  GSource *rebuild;
+  gboolean stale;
+  gboolean valid;
+} IndexedRoot;
+
+static GPtrArray *indexed_roots;
+
+static void indexed_root_build (IndexedRoot *indexed);
+
+static gboolean
+on_rebuild_timeout (gpointer user_data)
+{
+  IndexedRoot *indexed = user_data;
+
+  g_source_unref (indexed->rebuild);
+  indexed->rebuild = NULL;
+
+  indexed_root_build (indexed);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+on_root_changed (GFileMonitor *monitor,
+                 GFile *file,
+                 GFile *other_file,
+                 GFileMonitorEvent event_type,
+                 gpointer user_data)
+{
+  IndexedRoot *indexed = user_data;
+
+  if (!indexed->stale)
+    g_debug ("%s: files changed, indexing again", indexed->root);
+  indexed->stale = TRUE;
+
+  /* Wait until nothing changed for a while, packages come with many files */
+  if (indexed->rebuild)
+    {
+      g_source_destroy (indexed->rebuild);
+      g_source_unref (indexed->rebuild);
+    }
+
+  indexed->rebuild = g_timeout_source_new (REBUILD_DELAY);
+  g_source_set_callback (indexed->rebuild, on_rebuild_timeout, indexed, NULL);
+  g_source_attach (indexed->rebuild, g_main_context_get_thread_default ());
+}
+
+static void
+indexed_root_clear_monitors (IndexedRoot *indexed)
+{
+  GFileMonitor *monitor;
+  guint i;
+
+  for (i = 0; i < indexed->monitors->len; i++)
+    {
+      monitor = indexed->monitors->pdata[i];
+      g_signal_handlers_disconnect_by_data (monitor, indexed);
+      g_file_monitor_cancel (monitor);
+      g_object_unref (monitor);
+    }
+
+  g_ptr_array_set_size (indexed->monitors, 0);
+}
+
+static gboolean
+scan_directory (IndexedRoot *indexed,
+                const gchar *directory,
+                guint depth)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) file = NULL;
+  GFileMonitor *monitor;
+  const gchar *name;
+  gboolean ret = TRUE;
+  GDir *dir;
+
+  if (depth > MAX_DEPTH)
+    {
+      g_debug ("%s: too deep to index", directory);
+      return FALSE;
+    }
+
+  dir = g_dir_open (directory, 0, &error);
+  if (!dir)
+    {
+      g_debug ("couldn't index directory: %s", error->message);
+      return FALSE;
+    }
+
+  file = g_file_new_for_path (directory);
+  monitor = g_file_monitor_directory (file, G_FILE_MONITOR_NONE, NULL, &error);
+  if (!monitor)
+    {
+      g_debug ("%s: couldn't watch directory: %s", directory, error->message);
+      g_dir_close (dir);
+      return FALSE;
+    }
+
+  g_signal_connect (monitor, "changed", G_CALLBACK (on_root_changed), indexed);
+  g_ptr_array_add (indexed->monitors, monitor);
+
+  while (ret && (name = g_dir_read_name (dir)) != NULL)
+    {
+      gchar *path = g_build_filename (directory, name, NULL);
+
+      if (g_hash_table_size (indexed->entries) >= MAX_ENTRIES)
+        {
+          g_debug ("%s: too many files to index", indexed->root);
+          ret = FALSE;
+        }
+      else if (g_file_test (path, G_FILE_TEST_IS_DIR))
+        {
+          g_hash_table_insert (indexed->entries, g_strdup (path),
+                               GINT_TO_POINTER (COCKPIT_WEB_INDEX_DIRECTORY));
+          ret = scan_directory (indexed, path, depth + 1);
+        }
+      else
+        {
+          g_hash_table_insert (indexed->entries, g_strdup (path),
+                               GINT_TO_POINTER (COCKPIT_WEB_INDEX_FILE));
+        }
+
+      g_free (path);
+    }
+
+  g_dir_close (dir);
+  return ret;
+}
+
+static void
+indexed_root_build (IndexedRoot *indexed)
+{
+  g_hash_table_remove_all (indexed->entries);
+  indexed_root_clear_monitors (indexed);
+
+  indexed->stale = FALSE;
+  indexed->valid = scan_directory (indexed, indexed->root, 0);
+
+  if (indexed->valid)
+    {
+      g_debug ("%s: indexed %u files and directories", indexed->root,
+               g_hash_table_size (indexed->entries));
+    }
+  else
+    {
+      g_hash_table_remove_all (indexed->entries);
+      indexed_root_clear_monitors (indexed);
+    }
+}
+
+static void
+indexed_root_free (gpointer data)
+{
+  IndexedRoot *indexed = data;
+
+  if (indexed->rebuild)
+    {
+      g_source_destroy (indexed->rebuild);
+      g_source_unref (indexed->rebuild);
+    }
+
+  indexed_root_clear_monitors (indexed);
+  g_ptr_array_free (indexed->monitors, TRUE);
+  g_hash_table_destroy (indexed->entries);
+  g_free (indexed->root);
+  g_free (indexed);
+}
+
+/**
+ * cockpit_web_index_add_roots:
+ * @roots: resolved document roots, as from cockpit_web_response_resolve_roots()
+ *
+ * Indexes the files in @roots, and keeps the index up to date from then
+ * on. The index is used for serving files from these roots. Call this
+ * from the thread whose main context serves them.
+ */
+void
+cockpit_web_index_add_roots (const gchar **roots)
+{
+  IndexedRoot *indexed;
+  guint i, j;
+
+  if (!indexed_roots)
+    indexed_roots = g_ptr_array_new_with_free_func (indexed_root_free);
+
+  for (i = 0; roots && roots[i]; i++)
+    {
+      for (j = 0; j < indexed_roots->len; j++)
+        {
+          indexed = indexed_roots->pdata[j];
+          if (g_str_equal (indexed->root, roots[i]))
+            break;
+        }
+      if (j < indexed_roots->len)
+        continue;
+
+      indexed = g_new0 (IndexedRoot, 1);
+      indexed->root = g_strdup (roots[i]);
+      indexed->root_len = strlen (roots[i]);
+      indexed->entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      indexed->monitors = g_ptr_array_new ();
+      indexed_root_build (indexed);
+      g_ptr_array_add (indexed_roots, indexed);
+    }
+}
+
+/**
+ * cockpit_web_index_lookup:
+ * @path: an absolute file name
+ *
+ * Looks up whether @path exists, without touching the file system, if it
+ * is below an indexed root.
+ *
+ * Returns: the type of @path, or %COCKPIT_WEB_INDEX_UNKNOWN if the file
+ *          system has to be asked
+ */
+CockpitWebIndexType
+cockpit_web_index_lookup (const gchar *path)
+{
+  IndexedRoot *indexed;
+  gpointer type;
+  guint i;
+
+  g_return_val_if_fail (path != NULL, COCKPIT_WEB_INDEX_UNKNOWN);
+
+  if (!indexed_roots)
+    return COCKPIT_WEB_INDEX_UNKNOWN;
+
+  /* Only plain file names are in the index */
+  if (strstr (path, "/.") || strstr (path, "//") || g_str_has_suffix (path, "/"))
+    return COCKPIT_WEB_INDEX_UNKNOWN;
+
+  for (i = 0; i < indexed_roots->len; i++)
+    {
+      indexed = indexed_roots->pdata[i];
+      if (!g_str_has_prefix (path, indexed->root) ||
+          (path[indexed->root_len] != '/' && path[indexed->root_len] != '\0'))
+        continue;
+
+      if (indexed->stale || !indexed->valid)
+        return COCKPIT_WEB_INDEX_UNKNOWN;
+
+      if (path[indexed->root_len] == '\0')
+        return COCKPIT_WEB_INDEX_DIRECTORY;
+
+      if (g_hash_table_lookup_extended (indexed->entries, path, NULL, &type))
+        return GPOINTER_TO_INT (type);
+      return COCKPIT_WEB_INDEX_MISSING;
+    }
+
+  return COCKPIT_WEB_INDEX_UNKNOWN;
+}
+
+/**
+ * cockpit_web_index_cleanup:
+ *
+ * Forgets all the indexed roots.
+ */
+void
+cockpit_web_index_cleanup (void)
+{
+  if (indexed_roots)
+    g_ptr_array_free (indexed_roots, TRUE);
+  indexed_roots = NULL;
+}
@@ -0,0 +1,42 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_WEB_INDEX_H__
+#define COCKPIT_WEB_INDEX_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  COCKPIT_WEB_INDEX_UNKNOWN,
+  COCKPIT_WEB_INDEX_MISSING,
+  COCKPIT_WEB_INDEX_FILE,
+  COCKPIT_WEB_INDEX_DIRECTORY,
+} CockpitWebIndexType;
+
+void                  cockpit_web_index_add_roots      (const gchar **roots);
+
+CockpitWebIndexType   cockpit_web_index_lookup         (const gchar *path);
+
+void                  cockpit_web_index_cleanup        (void);
+
+G_END_DECLS
+
+#endif /* COCKPIT_WEB_INDEX_H__ */
@@ -33,10 +33,16 @@
 #include "common/cockpitflow.h"
 #include "common/cockpitlocale.h"
 #include "common/cockpittemplate.h"
+#include "common/cockpitwebindex.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /**
  * CockpitWebResponse:
@@ -71,6 +77,12 @@ struct _CockpitWebResponse {
   gsize partial_offset;
   GSource *source;
 
+  /* A file sent with sendfile() when file_block gets to the head of the queue */
+  GBytes *file_block;
+  gint file_fd;
+  off_t file_offset;
+  gsize file_remaining;
+
   /* Status flags */
   guint count;
   gboolean complete;
@@ -80,11 +92,28 @@ struct _CockpitWebResponse {
   gboolean keep_alive;
 
   GList *filters;
+
+  /* Conditional and range request headers */
+  gchar *if_none_match;
+  gchar *if_modified_since;
+  gchar *range;
+  gchar *if_range;
+
+  /* Set when only part of the body, or none of it, goes out */
+  gboolean ranged;
+  gboolean accept_ranges;
+  gsize range_start;
+  gsize range_length;
+  gsize range_total;
+  gsize range_position;
 };
 
 /* A megabyte is when we start to consider queue full enough */
 #define QUEUE_PRESSURE 1024UL * 1024UL
 
+/* Most of a file to send in one go */
+#define SENDFILE_BLOCK (1024 * 1024)
+
 static guint signal__done;
 
 static void      cockpit_web_response_flow_iface_init      (CockpitFlowInterface *iface);
@@ -98,6 +127,16 @@ cockpit_web_response_init (CockpitWebResponse *self)
   self->queue = g_queue_new ();
   self->out_queueable = G_MAXSIZE;
   self->cache_type = COCKPIT_WEB_RESPONSE_CACHE_UNSET;
+  self->file_fd = -1;
+}
+
+static void
+close_file (CockpitWebResponse *self)
+{
+  if (self->file_fd >= 0)
+    close (self->file_fd);
+  self->file_fd = -1;
+  self->file_block = NULL;
 }
 
 static void
@@ -117,6 +156,8 @@ cockpit_web_response_done (CockpitWebResponse *self)
       self->source = NULL;
     }
 
+  close_file (self);
+
   if (self->complete)
     {
       reusable = !self->failed && self->keep_alive;
@@ -160,6 +201,10 @@ cockpit_web_response_finalize (GObject *object)
   g_free (self->url_root);
   g_free (self->method);
   g_free (self->origin);
+  g_free (self->if_none_match);
+  g_free (self->if_modified_since);
+  g_free (self->range);
+  g_free (self->if_range);
   g_assert (self->io == NULL);
   g_assert (self->out == NULL);
   g_queue_free_full (self->queue, (GDestroyNotify)g_bytes_unref);
@@ -257,6 +302,11 @@ cockpit_web_response_new (GIOStream *io,
       if (connection)
         self->keep_alive = g_str_equal (connection, "keep-alive");
       host = g_hash_table_lookup (in_headers, "Host");
+
+      self->if_none_match = g_strdup (g_hash_table_lookup (in_headers, "If-None-Match"));
+      self->if_modified_since = g_strdup (g_hash_table_lookup (in_headers, "If-Modified-Since"));
+      self->range = g_strdup (g_hash_table_lookup (in_headers, "Range"));
+      self->if_range = g_strdup (g_hash_table_lookup (in_headers, "If-Range"));
     }
 
   self->protocol = g_strdup (protocol ?: "http");
@@ -355,6 +405,60 @@ on_output_flushed (GObject *stream,
   g_object_unref (self);
 }
 
+static gboolean
+on_file_output (CockpitWebResponse *self)
+{
+  GSocket *socket;
+  GError *error;
+  gsize before;
+  gssize count;
+  gint errsv;
+
+  before = self->out_queued;
+
+  socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (self->io));
+  count = sendfile (g_socket_get_fd (socket), self->file_fd, &self->file_offset,
+                    MIN (self->file_remaining, SENDFILE_BLOCK));
+  errsv = errno;
+
+  if (count < 0 && (errsv == EAGAIN || errsv == EINTR))
+    return TRUE;
+
+  if (count < 0)
+    {
+      error = g_error_new (G_IO_ERROR, g_io_error_from_errno (errsv), "%s", g_strerror (errsv));
+      if (!cockpit_web_should_suppress_output_error (self->logname, error))
+        g_message ("%s: couldn't send file: %s", self->logname, error->message);
+      g_error_free (error);
+    }
+  else if (count == 0)
+    {
+      g_message ("%s: file got shorter while sending it", self->logname);
+    }
+
+  if (count <= 0)
+    {
+      self->failed = TRUE;
+      cockpit_web_response_done (self);
+      return FALSE;
+    }
+
+  g_debug ("%s: sent %d bytes of file", self->logname, (int)count);
+  self->file_remaining -= count;
+  self->out_queued -= count;
+
+  if (self->file_remaining == 0)
+    {
+      g_bytes_unref (g_queue_pop_head (self->queue));
+      close_file (self);
+    }
+
+  if (before >= QUEUE_PRESSURE && self->out_queued < QUEUE_PRESSURE)
+    cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
+
+  return TRUE;
+}
+
 static gboolean
 on_response_output (GObject *pollable,
                     gpointer user_data)
@@ -367,7 +471,11 @@ on_response_output (GObject *pollable,
   gsize before, size, len;
 
   block = g_queue_peek_head (self->queue);
-  if (block)
+  if (block && block == self->file_block)
+    {
+      return on_file_output (self);
+    }
+  else if (block)
     {
       data = g_bytes_get_data (block, &len);
       g_assert (len == 0 || self->partial_offset < len);
@@ -453,7 +561,10 @@ queue_bytes (CockpitWebResponse *self,
 {
   gsize size, before;
 
-  size = g_bytes_get_size (block);
+  if (block == self->file_block)
+    size = self->file_remaining;
+  else
+    size = g_bytes_get_size (block);
   before = self->out_queued;
   g_return_if_fail (G_MAXSIZE - size > self->out_queued);
   self->out_queued += size;
@@ -518,6 +629,95 @@ queue_block (CockpitWebResponse *self,
     }
 }
 
+/*
+ * Cuts the next @length bytes of the body down to the part of them that
+ * is in the requested range. Returns FALSE if none of them are.
+ */
+static gboolean
+clip_to_range (CockpitWebResponse *self,
+               gsize *offset,
+               gsize *length)
+{
+  gsize position = self->range_position;
+  gsize begin, end;
+
+  self->range_position += *length;
+
+  begin = MAX (position, self->range_start);
+  end = MIN (position + *length, self->range_start + self->range_length);
+  if (begin >= end)
+    return FALSE;
+
+  *offset = begin - position;
+  *length = end - begin;
+  return TRUE;
+}
+
+/*
+ * Sends @length bytes of @fd straight to the socket when the queue gets
+ * to it, without copying them through user space. Takes ownership of @fd.
+ * Only one file can be queued, and the response must not have filters.
+ */
+static void
+queue_file (CockpitWebResponse *self,
+            gint fd,
+            gsize length)
+{
+  GBytes *bytes;
+  gsize offset = 0;
+  gchar *data;
+
+  g_assert (self->file_fd < 0);
+  g_assert (self->filters == NULL);
+  g_assert (G_IS_SOCKET_CONNECTION (self->io));
+
+  if (self->ranged && !clip_to_range (self, &offset, &length))
+    length = 0;
+
+  if (length == 0)
+    {
+      close (fd);
+      return;
+    }
+
+  if (self->out_queueable < length)
+    {
+      g_critical ("Too much data queuing in HTTP response. This is a programmer error.");
+      close (fd);
+      return;
+    }
+
+  self->out_queueable -= length;
+  g_debug ("%s: queued %d bytes of file", self->logname, (int)length);
+
+  self->file_fd = fd;
+  self->file_offset = offset;
+  self->file_remaining = length;
+
+  /* Marks the place of the file in the queue, which holds the reference */
+  self->file_block = g_bytes_new_static ("", 0);
+
+  if (!self->chunked)
+    {
+      queue_bytes (self, self->file_block);
+    }
+  else
+    {
+      data = g_strdup_printf ("%x\r\n", (unsigned int)length);
+      bytes = g_bytes_new_take (data, strlen (data));
+      queue_bytes (self, bytes);
+      g_bytes_unref (bytes);
+
+      queue_bytes (self, self->file_block);
+
+      bytes = g_bytes_new_static ("\r\n", 2);
+      queue_bytes (self, bytes);
+      g_bytes_unref (bytes);
+    }
+
+  g_bytes_unref (self->file_block);
+}
+
 typedef struct {
   CockpitWebResponse *response;
   GList *filters;
@@ -568,6 +768,9 @@ cockpit_web_response_queue (CockpitWebResponse *self,
                             GBytes *block)
 {
   QueueStep qn = { .response = self };
+  g_autoptr(GBytes) part = NULL;
+  gsize offset = 0;
+  gsize length;
 
   g_return_val_if_fail (COCKPIT_IS_WEB_RESPONSE (self), FALSE);
   g_return_val_if_fail (block != NULL, FALSE);
@@ -585,6 +788,16 @@ cockpit_web_response_queue (CockpitWebResponse *self,
       return TRUE;
     }
 
+  /* Only the requested range of the body goes out */
+  if (self->ranged)
+    {
+      length = g_bytes_get_size (block);
+      if (!clip_to_range (self, &offset, &length))
+        return TRUE;
+      if (length < g_bytes_get_size (block))
+        block = part = g_bytes_new_from_bytes (block, offset, length);
+    }
+
   qn.filters = self->filters;
   queue_filter (&qn, block);
   return TRUE;
@@ -719,6 +932,310 @@ enum {
     HEADER_X_FRAME_OPTIONS = 1 << 8,
 };
 
+static const gchar *http_days[] = { "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun" };
+static const gchar *http_months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/* Formats a time as an HTTP date, like "Sun, 06 Nov 1994 08:49:37 GMT" */
+static gchar *
+format_http_date (gint64 when)
+{
+  GDateTime *date;
+  gchar *result;
+
+  date = g_date_time_new_from_unix_utc (when);
+  if (!date)
+    return NULL;
+
+  result = g_strdup_printf ("%s, %02d %s %04d %02d:%02d:%02d GMT",
+                            http_days[g_date_time_get_day_of_week (date) - 1],
+                            g_date_time_get_day_of_month (date),
+                            http_months[g_date_time_get_month (date) - 1],
+                            g_date_time_get_year (date),
+                            g_date_time_get_hour (date),
+                            g_date_time_get_minute (date),
+                            g_date_time_get_second (date));
+
+  g_date_time_unref (date);
+  return result;
+}
+
+/* Only the preferred format of HTTP dates, returns -1 for anything else */
+static gint64
+parse_http_date (const gchar *string)
+{
+  GDateTime *date;
+  gchar day[4], month[4];
+  gint mday, year, hour, minute, second;
+  gint64 result;
+  guint i;
+
+  if (sscanf (string, "%3s, %d %3s %d %d:%d:%d GMT",
+              day, &mday, month, &year, &hour, &minute, &second) != 7)
+    return -1;
+
+  for (i = 0; i < G_N_ELEMENTS (http_months); i++)
+    {
+      if (g_str_equal (month, http_months[i]))
+        break;
+    }
+  if (i == G_N_ELEMENTS (http_months))
+    return -1;
+
+  date = g_date_time_new_utc (year, i + 1, mday, hour, minute, second);
+  if (!date)
+    return -1;
+
+  result = g_date_time_to_unix (date);
+  g_date_time_unref (date);
+  return result;
+}
+
+/* Weak comparison of @etag against a list of them, as in If-None-Match */
+static gboolean
+etag_list_matches (const gchar *list,
+                   const gchar *etag)
+{
+  gboolean matches = FALSE;
+  gchar **tags;
+  gchar *tag;
+  gint i;
+
+  if (g_str_has_prefix (etag, "W/"))
+    etag += 2;
+
+  tags = g_strsplit (list, ",", -1);
+  for (i = 0; !matches && tags[i]; i++)
+    {
+      tag = g_strstrip (tags[i]);
+      if (g_str_has_prefix (tag, "W/"))
+        tag += 2;
+      matches = g_str_equal (tag, "*") || g_str_equal (tag, etag);
+    }
+
+  g_strfreev (tags);
+  return matches;
+}
+
+static gboolean
+is_not_modified (CockpitWebResponse *self,
+                 const gchar *etag,
+                 const gchar *last_modified)
+{
+  gint64 since;
+  gint64 modified;
+
+  /* If-None-Match wins over If-Modified-Since when both are present */
+  if (self->if_none_match)
+    return etag && etag_list_matches (self->if_none_match, etag);
+
+  if (self->if_modified_since && last_modified)
+    {
+      since = parse_http_date (self->if_modified_since);
+      modified = parse_http_date (last_modified);
+      return since >= 0 && modified >= 0 && modified <= since;
+    }
+
+  return FALSE;
+}
+
+/* If-Range needs a strong validator to match exactly */
+static gboolean
+if_range_matches (CockpitWebResponse *self,
+                  const gchar *etag,
+                  const gchar *last_modified)
+{
+  if (!self->if_range)
+    return TRUE;
+  if (self->if_range[0] == '"')
+    return etag && g_str_equal (self->if_range, etag);
+  if (g_str_has_prefix (self->if_range, "W/"))
+    return FALSE;
+  return last_modified && g_str_equal (self->if_range, last_modified);
+}
+
+static gboolean
+parse_number (const gchar **string,
+              guint64 *number)
+{
+  const gchar *p = *string;
+  guint64 value = 0;
+
+  if (!g_ascii_isdigit (*p))
+    return FALSE;
+
+  for (; g_ascii_isdigit (*p); p++)
+    {
+      if (value > (G_MAXUINT64 - 9) / 10)
+        return FALSE;
+      value = value * 10 + (*p - '0');
+    }
+
+  *string = p;
+  *number = value;
+  return TRUE;
+}
+
+typedef enum {
+  RANGE_IGNORED,
+  RANGE_UNSATISFIABLE,
+  RANGE_SATISFIABLE,
+} RangeResult;
+
+/*
+ * A single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range.
+ * Several ranges in one request are ignored, and the whole body is sent.
+ */
+static RangeResult
+parse_range (const gchar *range,
+             gsize total,
+             gsize *start,
+             gsize *length)
+{
+  const gchar *p = range;
+  guint64 first, last;
+
+  if (!g_str_has_prefix (p, "bytes="))
+    return RANGE_IGNORED;
+  p += 6;
+  while (*p == ' ')
+    p++;
+
+  if (*p == '-')
+    {
+      p++;
+      if (!parse_number (&p, &last) || *p != '\0')
+        return RANGE_IGNORED;
+      if (last == 0 || total == 0)
+        return RANGE_UNSATISFIABLE;
+      *start = total - MIN (last, total);
+      *length = total - *start;
+      return RANGE_SATISFIABLE;
+    }
+
+  if (!parse_number (&p, &first) || *p != '-')
+    return RANGE_IGNORED;
+  p++;
+
+  if (*p == '\0')
+    {
+      last = G_MAXUINT64;
+    }
+  else if (!parse_number (&p, &last) || *p != '\0' || last < first)
+    {
+      return RANGE_IGNORED;
+    }
+
+  if (first >= total)
+    return RANGE_UNSATISFIABLE;
+
+  *start = first;
+  *length = MIN (last, total - 1) - first + 1;
+  return RANGE_SATISFIABLE;
+}
+
+/*
+ * Answers If-None-Match, If-Modified-Since and Range for a 200 response
+ * with the validators @etag or @last_modified. This changes @status,
+ * @reason and @length to what is actually sent, and the body queued
+ * afterwards gets cut down to match.
+ */
+static void
+prepare_partial (CockpitWebResponse *self,
+                 guint *status,
+                 const gchar **reason,
+                 gssize *length,
+                 const gchar *etag,
+                 const gchar *last_modified)
+{
+  gsize start = 0;
+  gsize count = 0;
+
+  if (*status != 200 || (!etag && !last_modified))
+    return;
+  if (!g_str_equal (self->method, "GET") && !g_str_equal (self->method, "HEAD"))
+    return;
+
+  if (is_not_modified (self, etag, last_modified))
+    {
+      g_debug ("%s: not modified", self->logname);
+      *status = 304;
+      *reason = "Not Modified";
+      *length = 0;
+      self->ranged = TRUE;
+      return;
+    }
+
+  /* Ranges need to know the whole length, and don't mix with filters */
+  if (*length < 0 || self->filters)
+    return;
+
+  self->accept_ranges = TRUE;
+  if (!self->range || !if_range_matches (self, etag, last_modified))
+    return;
+
+  switch (parse_range (self->range, *length, &start, &count))
+    {
+    case RANGE_IGNORED:
+      return;
+    case RANGE_UNSATISFIABLE:
+      g_debug ("%s: range not satisfiable: %s", self->logname, self->range);
+      *status = 416;
+      *reason = "Range Not Satisfiable";
+      break;
+    case RANGE_SATISFIABLE:
+      g_debug ("%s: sending range %" G_GSIZE_FORMAT "+%" G_GSIZE_FORMAT, self->logname, start, count);
+      *status = 206;
+      *reason = "Partial Content";
+      break;
+    }
+
+  self->ranged = TRUE;
+  self->range_start = start;
+  self->range_length = count;
+  self->range_total = *length;
+  *length = count;
+}
+
+static const gchar *
+lookup_header (GHashTable *headers,
+               const gchar *name)
+{
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+
+  if (headers)
+    {
+      g_hash_table_iter_init (&iter, headers);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          if (g_ascii_strcasecmp (key, name) == 0)
+            return value;
+        }
+    }
+
+  return NULL;
+}
+
+static const gchar *
+lookup_va (va_list va,
+           const gchar *name)
+{
+  const gchar *key;
+  const gchar *value;
+
+  for (;;)
+    {
+      key = va_arg (va, const gchar *);
+      if (!key)
+        return NULL;
+      value = va_arg (va, const gchar *);
+      if (g_ascii_strcasecmp (key, name) == 0)
+        return value;
+    }
+}
+
 static GString *
 begin_headers (CockpitWebResponse *response,
                guint status,
@@ -842,6 +1359,21 @@ finish_headers (CockpitWebResponse *self,
         }
     }
 
+  if (self->ranged && status == 206)
+    {
+      g_string_append_printf (string, "Content-Range: bytes %" G_GSIZE_FORMAT "-%" G_GSIZE_FORMAT
+                              "/%" G_GSIZE_FORMAT "\r\n", self->range_start,
+                              self->range_start + self->range_length - 1, self->range_total);
+    }
+  else if (self->ranged && status == 416)
+    {
+      g_string_append_printf (string, "Content-Range: bytes */%" G_GSIZE_FORMAT "\r\n", self->range_total);
+    }
+  else if (self->accept_ranges && status == 200)
+    {
+      g_string_append (string, "Accept-Ranges: bytes\r\n");
+    }
+
   if ((seen & HEADER_CACHE_CONTROL) == 0 && status >= 200 && status <= 299)
     {
       if (self->cache_type == COCKPIT_WEB_RESPONSE_NO_CACHE)
@@ -918,6 +1450,8 @@ cockpit_web_response_headers (CockpitWebResponse *self,
                               gssize length,
                               ...)
 {
+  const gchar *etag;
+  const gchar *last_modified;
   GString *string;
   GBytes *block;
   va_list va;
@@ -930,6 +1464,14 @@ cockpit_web_response_headers (CockpitWebResponse *self,
       return;
     }
 
+  va_start (va, length);
+  etag = lookup_va (va, "ETag");
+  va_end (va);
+  va_start (va, length);
+  last_modified = lookup_va (va, "Last-Modified");
+  va_end (va);
+  prepare_partial (self, &status, &reason, &length, etag, last_modified);
+
   string = begin_headers (self, status, reason);
 
   va_start (va, length);
@@ -977,6 +1519,10 @@ cockpit_web_response_headers_full  (CockpitWebResponse *self,
       return;
     }
 
+  prepare_partial (self, &status, &reason, &length,
+                   lookup_header (headers, "ETag"),
+                   lookup_header (headers, "Last-Modified"));
+
   string = begin_headers (self, status, reason);
 
   block = finish_headers (self, string, length, status,
@@ -1282,12 +1828,254 @@ cockpit_web_response_resolve_roots (const gchar **input)
   return (gchar **)g_ptr_array_free (roots, FALSE);
 }
 
+/* Doesn't try to open files that the index knows aren't there */
+static gint
+open_indexed_file (const gchar *path,
+                   struct stat *st,
+                   GError **error)
+{
+  gint errsv;
+  gint fd;
+
+  if (cockpit_web_index_lookup (path) == COCKPIT_WEB_INDEX_MISSING)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "%s: Not found in index", path);
+      return -1;
+    }
+
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd >= 0 && fstat (fd, st) < 0)
+    {
+      errsv = errno;
+      close (fd);
+      errno = errsv;
+      fd = -1;
+    }
+  else if (fd >= 0 && S_ISDIR (st->st_mode))
+    {
+      close (fd);
+      errno = EISDIR;
+      fd = -1;
+    }
+
+  if (fd < 0)
+    {
+      errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "%s: %s", path, g_strerror (errsv));
+      return -1;
+    }
+
+  return fd;
+}
+
+/*
+ * Files can go straight from the disk to a plain socket, but not through
+ * TLS or filters.
+ */
+static gboolean
+can_send_file (CockpitWebResponse *self)
+{
+  return self->filters == NULL &&
+         G_IS_SOCKET_CONNECTION (self->io) &&
+         !g_str_equal (self->method, "HEAD");
+}
+
+typedef struct {
+  const gchar *coding;
+  const gchar *suffix;
+} Compression;
+
+/* Our own preference, when the client doesn't have one */
+static const Compression compressions[] = {
+  { "br", ".br" },
+  { "zstd", ".zst" },
+  { "gzip", ".gz" },
+};
+
+#define GZIP_COMPRESSION (&compressions[2])
+
+/*
+ * Fills @accepted with the compressions that @accept_encoding takes, by
+ * q-value, and in our own order of preference where they are equal.
+ * Browsers send all their codings with the same q-value.
+ */
+static guint
+accepted_compressions (const gchar *accept_encoding,
+                       const Compression **accepted)
+{
+  gdouble qvalues[G_N_ELEMENTS (compressions)] = { 0, };
+  gboolean given[G_N_ELEMENTS (compressions)] = { FALSE, };
+  gdouble star = 0;
+  gchar **codings;
+  gchar *coding;
+  gchar *params;
+  guint n_accepted = 0;
+  gdouble qvalue;
+  guint i, j;
+
+  if (!accept_encoding)
+    return 0;
+
+  codings = g_strsplit (accept_encoding, ",", -1);
+  for (i = 0; codings[i]; i++)
+    {
+      coding = codings[i];
+      qvalue = 1;
+
+      params = strchr (coding, ';');
+      if (params)
+        {
+          *params = '\0';
+          params = g_strstrip (params + 1);
+          if (strncmp (params, "q=", 2) == 0)
+            qvalue = MAX (g_ascii_strtod (params + 2, NULL), 0);
+        }
+
+      coding = g_strstrip (coding);
+      if (g_str_equal (coding, "*"))
+        star = qvalue;
+
+      for (j = 0; j < G_N_ELEMENTS (compressions); j++)
+        {
+          if (g_ascii_strcasecmp (coding, compressions[j].coding) == 0 ||
+              (&compressions[j] == GZIP_COMPRESSION && g_ascii_strcasecmp (coding, "x-gzip") == 0))
+            {
+              qvalues[j] = qvalue;
+              given[j] = TRUE;
+            }
+        }
+    }
+  g_strfreev (codings);
+
+  /* Insertion sort, which keeps our order between equal q-values */
+  for (j = 0; j < G_N_ELEMENTS (compressions); j++)
+    {
+      qvalue = given[j] ? qvalues[j] : star;
+      if (qvalue <= 0)
+        continue;
+
+      qvalues[j] = qvalue;
+      for (i = n_accepted; i > 0 && qvalues[accepted[i - 1] - compressions] < qvalue; i--)
+        accepted[i] = accepted[i - 1];
+      accepted[i] = &compressions[j];
+      n_accepted++;
+    }
+
+  return n_accepted;
+}
+
+/*
+ * Decompressed copies of .gz files, for clients that don't take gzip and
+ * for templates, so that they aren't unpacked again for every request.
+ * An entry is used as long as the file on disk is the same one, and the
+ * least recently used entries go when the cache gets too big.
+ */
+
+#define DECOMPRESSED_CACHE_SIZE (8 * 1024 * 1024)
+
+typedef struct {
+  gchar *path;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  GBytes *body;
+  GList link;
+} DecompressedEntry;
+
+static GHashTable *decompressed_entries;
+static GQueue decompressed_lru = G_QUEUE_INIT;
+static gsize decompressed_size;
+
+static void
+decompressed_entry_free (gpointer data)
+{
+  DecompressedEntry *entry = data;
+
+  g_queue_unlink (&decompressed_lru, &entry->link);
+  decompressed_size -= g_bytes_get_size (entry->body);
+  g_bytes_unref (entry->body);
+  g_free (entry->path);
+  g_free (entry);
+}
+
+static gboolean
+decompressed_entry_matches (DecompressedEntry *entry,
+                            const struct stat *st)
+{
+  return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+         entry->size == st->st_size &&
+         entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+         entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static GBytes *
+load_decompressed (const gchar *path,
+                   gint fd,
+                   const struct stat *st,
+                   GError **error)
+{
+  g_autoptr(GMappedFile) file = NULL;
+  g_autoptr(GBytes) compressed = NULL;
+  DecompressedEntry *entry;
+  GBytes *body;
+  GList *last;
+
+  if (!decompressed_entries)
+    decompressed_entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, decompressed_entry_free);
+
+  entry = g_hash_table_lookup (decompressed_entries, path);
+  if (entry && decompressed_entry_matches (entry, st))
+    {
+      g_queue_unlink (&decompressed_lru, &entry->link);
+      g_queue_push_head_link (&decompressed_lru, &entry->link);
+      return g_bytes_ref (entry->body);
+    }
+
+  file = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!file)
+    return NULL;
+
+  compressed = g_mapped_file_get_bytes (file);
+  body = cockpit_web_response_gunzip (compressed, error);
+  if (!body)
+    return NULL;
+
+  g_hash_table_remove (decompressed_entries, path);
+
+  /* Very large files would just push everything else out */
+  if (g_bytes_get_size (body) > DECOMPRESSED_CACHE_SIZE / 4)
+    return body;
+
+  while (decompressed_size + g_bytes_get_size (body) > DECOMPRESSED_CACHE_SIZE)
+    {
+      last = g_queue_peek_tail_link (&decompressed_lru);
+      g_hash_table_remove (decompressed_entries, ((DecompressedEntry *)last->data)->path);
+    }
+
+  entry = g_new0 (DecompressedEntry, 1);
+  entry->path = g_strdup (path);
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->size = st->st_size;
+  entry->mtime = st->st_mtim;
+  entry->body = g_bytes_ref (body);
+  entry->link.data = entry;
+  g_queue_push_head_link (&decompressed_lru, &entry->link);
+  decompressed_size += g_bytes_get_size (body);
+  g_hash_table_insert (decompressed_entries, entry->path, entry);
+
+  g_debug ("%s: keeping %" G_GSIZE_FORMAT " bytes decompressed", path, g_bytes_get_size (body));
+  return body;
+}
+
 static void
 web_response_file (CockpitWebResponse *response,
                    const gchar *escaped,
                    const gchar **roots,
-                   gboolean search_gzip,
-                   gboolean accept_gzip,
+                   gboolean search_compressed,
+                   const gchar *accept_encoding,
                    CockpitTemplateFunc template_func,
                    gpointer user_data)
 {
@@ -1307,14 +2095,29 @@ web_response_file (CockpitWebResponse *response,
       return;
     }
 
-  gboolean is_gzip = FALSE;
-  g_autoptr(GMappedFile) file = NULL;
+  /* Templates need the text, but precompressed files suit anyone else who takes them */
+  const Compression *accepted[G_N_ELEMENTS (compressions)];
+  guint n_accepted = 0;
+  if (search_compressed && !template_func)
+    n_accepted = accepted_compressions (accept_encoding, accepted);
+
+  gboolean accepts_gzip = FALSE;
+  for (guint j = 0; j < n_accepted; j++)
+    accepts_gzip = accepts_gzip || accepted[j] == GZIP_COMPRESSION;
+
+  const Compression *compression = NULL;
+  gboolean decompress = FALSE;
+  g_autofree gchar *found = NULL;
+  struct stat st = { 0, };
+  gint fd = -1;
   for (gint i = 0; roots[i]; i++)
     {
       const gchar *root = roots[i];
       g_autofree gchar *path = g_build_filename (root, unescaped, NULL);
 
-      if (g_file_test (path, G_FILE_TEST_IS_DIR))
+      CockpitWebIndexType type = cockpit_web_index_lookup (path);
+      if (type == COCKPIT_WEB_INDEX_DIRECTORY ||
+          (type == COCKPIT_WEB_INDEX_UNKNOWN && g_file_test (path, G_FILE_TEST_IS_DIR)))
         {
           cockpit_web_response_error (response, 403, NULL, "Directory Listing Denied");
           return;
@@ -1324,21 +2127,41 @@ web_response_file (CockpitWebResponse *response,
       g_assert (path_has_prefix (path, root));
 
       g_autoptr(GError) error = NULL;
-      file = g_mapped_file_new (path, FALSE, &error);
+      for (guint j = 0; fd < 0 && !error && j < n_accepted; j++)
+        {
+          g_autofree gchar *sibling = g_strconcat (path, accepted[j]->suffix, NULL);
+          fd = open_indexed_file (sibling, &st, &error);
+          if (fd >= 0)
+            {
+              compression = accepted[j];
+              g_free (path);
+              path = g_steal_pointer (&sibling);
+            }
+          else if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            {
+              g_clear_error (&error);
+            }
+        }
+
+      if (fd < 0 && !error)
+        fd = open_indexed_file (path, &st, &error);
 
-      if (file == NULL && search_gzip &&
+      if (fd < 0 && search_compressed && !accepts_gzip &&
           g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
         {
           g_debug ("%s: file not found in root: %s, looking for .gz", escaped, root);
           g_clear_error (&error);
           g_autofree gchar *old_path = g_steal_pointer (&path);
           path = g_strconcat (old_path, ".gz", NULL);
-          file = g_mapped_file_new (path, FALSE, &error);
-          is_gzip = file != NULL;
+          fd = open_indexed_file (path, &st, &error);
+          decompress = fd >= 0;
         }
 
-      if (file != NULL)
-        break;
+      if (fd >= 0)
+        {
+          found = g_steal_pointer (&path);
+          break;
+        }
 
       if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT) ||
           g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NAMETOOLONG))
@@ -1360,34 +2183,58 @@ web_response_file (CockpitWebResponse *response,
         }
     }
 
-  if (file == NULL)
+  if (fd < 0)
     {
       cockpit_web_response_error (response, 404, NULL, "Not Found");
       return;
     }
 
-  g_autoptr(GBytes) body = g_mapped_file_get_bytes (file);
+  /* Whether the body is the file exactly as it is on disk */
+  gboolean as_stored = !template_func && !decompress;
+  gboolean send_file = as_stored && can_send_file (response);
+  g_autoptr(GBytes) body = NULL;
 
-  if (is_gzip && (!accept_gzip || template_func))
+  if (decompress)
     {
       /* We have gzipped content, but the client won't accept it, or
        * template expansion was requested.  Decompress.
        */
       g_autoptr(GError) error = NULL;
-      g_autoptr(GBytes) body_gz = g_steal_pointer (&body);
-      body = cockpit_web_response_gunzip (body_gz, &error);
+      body = load_decompressed (found, fd, &st, &error);
+      close (fd);
+      fd = -1;
+
       if (body == NULL)
         {
           g_warning ("%s", error->message);
           cockpit_web_response_error (response, 500, NULL, "Internal server error");
           return;
         }
-      is_gzip = FALSE;
+    }
+  else if (!send_file)
+    {
+      g_autoptr(GError) error = NULL;
+      g_autoptr(GMappedFile) file = g_mapped_file_new_from_fd (fd, FALSE, &error);
+      close (fd);
+      fd = -1;
+
+      if (file == NULL)
+        {
+          g_warning ("%s: %s", unescaped, error->message);
+          cockpit_web_response_error (response, 500, NULL, "Internal server error");
+          return;
+        }
+
+      body = g_mapped_file_get_bytes (file);
     }
 
-  GList *output;
-  gint content_length = -1;
-  if (template_func)
+  GList *output = NULL;
+  gssize content_length = -1;
+  if (send_file)
+    {
+      content_length = st.st_size;
+    }
+  else if (template_func)
     {
       output = cockpit_template_expand (body, "${", "}", template_func, user_data);
     }
@@ -1397,9 +2244,28 @@ web_response_file (CockpitWebResponse *response,
       content_length = g_bytes_get_size (body);
     }
 
-  GString *string = begin_headers (response, 200, "OK");
+  /* Only the stored file can be validated and sent in parts */
+  g_autofree gchar *etag = NULL;
+  g_autofree gchar *last_modified = NULL;
+  if (as_stored)
+    {
+      etag = g_strdup_printf ("\"%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x\"",
+                              (guint64)st.st_ino, (guint64)st.st_size, (guint64)st.st_mtime);
+      last_modified = format_http_date (st.st_mtime);
+    }
+
+  guint status = 200;
+  const gchar *reason = "OK";
+  prepare_partial (response, &status, &reason, &content_length, etag, last_modified);
+
+  GString *string = begin_headers (response, status, reason);
   guint seen = 0;
 
+  if (etag)
+    seen |= append_header (string, "ETag", etag);
+  if (last_modified)
+    seen |= append_header (string, "Last-Modified", last_modified);
+
   if (response->origin)
     seen |= append_header (string, "Access-Control-Allow-Origin", response->origin);
 
@@ -1415,12 +2281,27 @@ web_response_file (CockpitWebResponse *response,
       seen |= append_header (string, "Content-Security-Policy", policy);
     }
 
-  if (is_gzip)
-    seen |= append_header (string, "Content-Encoding", "gzip");
+  if (compression && !decompress)
+    seen |= append_header (string, "Content-Encoding", compression->coding);
 
-  g_autoptr(GBytes) headers_block = finish_headers (response, string, content_length, 200, seen);
+  /* The same URL is a different file depending on what the client takes */
+  if (search_compressed && !template_func)
+    {
+      seen |= append_header (string, "Vary",
+                             response->cache_type == COCKPIT_WEB_RESPONSE_CACHE ?
+                             "Cookie, Accept-Encoding" : "Accept-Encoding");
+    }
+
+  g_autoptr(GBytes) headers_block = finish_headers (response, string, content_length, status, seen);
   queue_bytes (response, headers_block);
 
+  if (send_file)
+    {
+      queue_file (response, fd, st.st_size);
+      cockpit_web_response_complete (response);
+      return;
+    }
+
   GList *l;
   for (l = output; l != NULL; l = g_list_next (l))
     {
@@ -1446,7 +2327,7 @@ cockpit_web_response_file (CockpitWebResponse *response,
                            const gchar *escaped,
                            const gchar **roots)
 {
-  web_response_file (response, escaped, roots, FALSE, FALSE, NULL, NULL);
+  web_response_file (response, escaped, roots, FALSE, NULL, NULL, NULL);
 }
 
 void
@@ -1455,7 +2336,7 @@ cockpit_web_response_template (CockpitWebResponse *response,
                                    const gchar **roots,
                                    GHashTable *values)
 {
-  web_response_file (response, escaped, roots, FALSE, FALSE, substitute_hash_value, values);
+  web_response_file (response, escaped, roots, TRUE, NULL, substitute_hash_value, values);
 }
 
 void
@@ -1464,7 +2345,29 @@ cockpit_web_response_file_or_gz (CockpitWebResponse *response,
                                  const gchar *escaped,
                                  const gchar **roots)
 {
-  web_response_file (response, escaped, roots, TRUE, accepts_gzip, NULL, NULL);
+  web_response_file (response, escaped, roots, TRUE, accepts_gzip ? "gzip" : NULL, NULL, NULL);
+}
+
+/**
+ * cockpit_web_response_file_or_compressed:
+ * @response: the response
+ * @accept_encoding: the Accept-Encoding header of the request, or NULL
+ * @escaped: escaped path, or NULL to get from response
+ * @roots: directories to look for file in
+ *
+ * Serve a file from disk as an HTTP response, like
+ * cockpit_web_response_file(). A .br, .zst or .gz file next to it is
+ * sent instead when @accept_encoding takes that compression, the one
+ * with the highest q-value first. A file that only exists as .gz is
+ * decompressed for clients that don't take gzip.
+ */
+void
+cockpit_web_response_file_or_compressed (CockpitWebResponse *response,
+                                         const gchar *accept_encoding,
+                                         const gchar *escaped,
+                                         const gchar **roots)
+{
+  web_response_file (response, escaped, roots, TRUE, accept_encoding, NULL, NULL);
 }
 
 static gboolean
@@ -1654,7 +2557,8 @@ load_file (const gchar *filename,
  * before the extensions if set.
  *
  * The @existing may be NULL, if non-null it'll be used to check if
- * files exist.
+ * files exist. Otherwise names that cockpit_web_index_lookup() knows
+ * are missing aren't tried.
  */
 GBytes *
 cockpit_web_response_negotiation (const gchar *path,
@@ -1779,6 +2683,10 @@ cockpit_web_response_negotiation (const gchar *path,
               if (!g_hash_table_lookup (existing, name))
                 continue;
             }
+          else if (cockpit_web_index_lookup (name) == COCKPIT_WEB_INDEX_MISSING)
+            {
+              continue;
+            }
 
           bytes = load_file (name, &local_error);
           if (bytes)
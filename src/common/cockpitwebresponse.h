@@ -122,6 +122,11 @@ void                  cockpit_web_response_file_or_gz    (CockpitWebResponse *re
                                                           const gchar *escaped,
                                                           const gchar **roots);
 
+void                  cockpit_web_response_file_or_compressed (CockpitWebResponse *response,
+                                                               const gchar *accept_encoding,
+                                                               const gchar *escaped,
+                                                               const gchar **roots);
+
 GBytes *              cockpit_web_response_gunzip        (GBytes *bytes,
                                                           GError **error);
 
@@ -0,0 +1,203 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitwebindex.h"
+#include "cockpitwebresponse.h"
+
+#include "testlib/cockpittest.h"
+
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+
+#define WAIT_UNTIL(cond) \
+  G_STMT_START \
+    while (!(cond)) g_main_context_iteration (NULL, TRUE); \
+  G_STMT_END
+
+typedef struct {
+  gchar *root;
+} TestCase;
+
+static gchar *
+test_path (TestCase *tc,
+           const gchar *name)
+{
+  return g_build_filename (tc->root, name, NULL);
+}
+
+static void
+write_file (TestCase *tc,
+            const gchar *name,
+            const gchar *contents)
+{
+  g_autofree gchar *path = test_path (tc, name);
+  g_autoptr(GError) error = NULL;
+
+  g_file_set_contents (path, contents, -1, &error);
+  g_assert_no_error (error);
+}
+
+static void
+remove_file (TestCase *tc,
+             const gchar *name)
+{
+  g_autofree gchar *path = test_path (tc, name);
+  g_assert_cmpint (g_remove (path), ==, 0);
+}
+
+static CockpitWebIndexType
+lookup (TestCase *tc,
+        const gchar *name)
+{
+  g_autofree gchar *path = test_path (tc, name);
+  return cockpit_web_index_lookup (path);
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  g_autofree gchar *templ = g_strdup ("/tmp/test-cockpit-webindex.XXXXXX");
+  g_autofree gchar *sub = NULL;
+  const gchar *roots[2] = { NULL, NULL };
+
+  g_assert (g_mkdtemp (templ) == templ);
+  tc->root = realpath (templ, NULL);
+  g_assert (tc->root != NULL);
+
+  sub = test_path (tc, "sub");
+  g_assert_cmpint (g_mkdir (sub, 0755), ==, 0);
+  write_file (tc, "index.html", "<html></html>");
+  write_file (tc, "po.de.js", "de");
+  write_file (tc, "sub/file.js", "file");
+
+  roots[0] = tc->root;
+  cockpit_web_index_add_roots (roots);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  g_autofree gchar *sub = test_path (tc, "sub");
+
+  cockpit_web_index_cleanup ();
+
+  remove_file (tc, "index.html");
+  remove_file (tc, "po.de.js");
+  remove_file (tc, "sub/file.js");
+  g_assert_cmpint (g_rmdir (sub), ==, 0);
+  g_assert_cmpint (g_rmdir (tc->root), ==, 0);
+  free (tc->root);
+}
+
+static void
+test_lookup (TestCase *tc,
+             gconstpointer data)
+{
+  g_assert_cmpint (lookup (tc, "index.html"), ==, COCKPIT_WEB_INDEX_FILE);
+  g_assert_cmpint (lookup (tc, "sub/file.js"), ==, COCKPIT_WEB_INDEX_FILE);
+  g_assert_cmpint (lookup (tc, "sub"), ==, COCKPIT_WEB_INDEX_DIRECTORY);
+  g_assert_cmpint (lookup (tc, "missing.js"), ==, COCKPIT_WEB_INDEX_MISSING);
+  g_assert_cmpint (lookup (tc, "sub/missing.js"), ==, COCKPIT_WEB_INDEX_MISSING);
+  g_assert_cmpint (cockpit_web_index_lookup (tc->root), ==, COCKPIT_WEB_INDEX_DIRECTORY);
+
+  /* Anything that isn't a plain name below the root is left to the file system */
+  g_assert_cmpint (lookup (tc, "sub/../index.html"), ==, COCKPIT_WEB_INDEX_UNKNOWN);
+  g_assert_cmpint (lookup (tc, "sub/"), ==, COCKPIT_WEB_INDEX_UNKNOWN);
+  g_assert_cmpint (cockpit_web_index_lookup ("/nonexistent/index.html"), ==, COCKPIT_WEB_INDEX_UNKNOWN);
+}
+
+static void
+test_changed (TestCase *tc,
+              gconstpointer data)
+{
+  g_assert_cmpint (lookup (tc, "sub/added.js"), ==, COCKPIT_WEB_INDEX_MISSING);
+
+  write_file (tc, "sub/added.js", "added");
+  WAIT_UNTIL (lookup (tc, "sub/added.js") == COCKPIT_WEB_INDEX_FILE);
+
+  remove_file (tc, "sub/added.js");
+  WAIT_UNTIL (lookup (tc, "sub/added.js") == COCKPIT_WEB_INDEX_MISSING);
+}
+
+static void
+test_stale (TestCase *tc,
+            gconstpointer data)
+{
+  g_assert_cmpint (lookup (tc, "index.html"), ==, COCKPIT_WEB_INDEX_FILE);
+
+  /* Until the root is indexed again, lookups go to the file system */
+  write_file (tc, "sub/added.js", "added");
+  WAIT_UNTIL (lookup (tc, "index.html") == COCKPIT_WEB_INDEX_UNKNOWN);
+  WAIT_UNTIL (lookup (tc, "sub/added.js") == COCKPIT_WEB_INDEX_FILE);
+  g_assert_cmpint (lookup (tc, "index.html"), ==, COCKPIT_WEB_INDEX_FILE);
+
+  /* Forgetting the index while a scan is pending */
+  remove_file (tc, "sub/added.js");
+  WAIT_UNTIL (lookup (tc, "index.html") == COCKPIT_WEB_INDEX_UNKNOWN);
+  write_file (tc, "sub/late.js", "late");
+  cockpit_web_index_cleanup ();
+  remove_file (tc, "sub/late.js");
+
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpint (lookup (tc, "index.html"), ==, COCKPIT_WEB_INDEX_UNKNOWN);
+}
+
+static void
+test_negotiation (TestCase *tc,
+                  gconstpointer data)
+{
+  g_autofree gchar *path = test_path (tc, "po.js");
+  g_autoptr(GError) error = NULL;
+  gboolean language_specific = FALSE;
+  GBytes *bytes;
+
+  bytes = cockpit_web_response_negotiation (path, NULL, "de", &language_specific, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (bytes != NULL);
+  g_assert (language_specific);
+  cockpit_assert_bytes_eq (bytes, "de", -1);
+  g_bytes_unref (bytes);
+
+  bytes = cockpit_web_response_negotiation (path, NULL, "fr", NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (bytes == NULL);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/web-index/lookup", TestCase, NULL,
+              setup, test_lookup, teardown);
+  g_test_add ("/web-index/changed", TestCase, NULL,
+              setup, test_changed, teardown);
+  g_test_add ("/web-index/stale", TestCase, NULL,
+              setup, test_stale, teardown);
+  g_test_add ("/web-index/negotiation", TestCase, NULL,
+              setup, test_negotiation, teardown);
+
+  return g_test_run ();
+}
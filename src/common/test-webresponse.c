@@ -29,8 +29,12 @@
 
 #include <glib/gstdio.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 /* headers that are present in every request */
 #define STATIC_HEADERS "X-DNS-Prefetch-Control: off\r\nReferrer-Policy: no-referrer\r\nX-Content-Type-Options: nosniff\r\nCross-Origin-Resource-Policy: same-origin\r\nX-Frame-Options: sameorigin\r\n\r\n"
@@ -326,6 +330,410 @@ test_file_breakout_non_existant (TestCase *tc,
   free (root);
 }
 
+typedef struct {
+  gchar *root;
+  GBytes *content;
+} TestSendFile;
+
+static void
+setup_send_file (TestSendFile *tc,
+                 gconstpointer data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *path = NULL;
+  gsize length = 4 * 1024 * 1024;
+  guchar *content;
+  gsize i;
+
+  tc->root = g_dir_make_tmp ("test-webresponse.XXXXXX", &error);
+  g_assert_no_error (error);
+
+  /* Larger than a socket buffer, so that it goes out in pieces */
+  content = g_malloc (length);
+  for (i = 0; i < length; i++)
+    content[i] = i % 251;
+  tc->content = g_bytes_new_take (content, length);
+
+  path = g_build_filename (tc->root, "large.js.gz", NULL);
+  g_file_set_contents (path, (gchar *)content, length, &error);
+  g_assert_no_error (error);
+}
+
+static void
+teardown_send_file (TestSendFile *tc,
+                    gconstpointer data)
+{
+  g_autofree gchar *path = g_build_filename (tc->root, "large.js.gz", NULL);
+
+  g_assert_cmpint (g_unlink (path), ==, 0);
+  g_assert_cmpint (g_rmdir (tc->root), ==, 0);
+  g_free (tc->root);
+  g_bytes_unref (tc->content);
+}
+
+static void
+read_available (gint fd,
+                GByteArray *received)
+{
+  guint8 buffer[64 * 1024];
+  gssize count;
+
+  while ((count = read (fd, buffer, sizeof (buffer))) > 0)
+    g_byte_array_append (received, buffer, count);
+
+  g_assert (count == 0 || errno == EAGAIN);
+}
+
+/* Serves a file over a real socket, which is where sendfile() is used */
+static GBytes *
+serve_over_socket (const gchar *root,
+                   const gchar *path,
+                   GHashTable *headers,
+                   gboolean or_gz)
+{
+  g_autoptr(GError) error = NULL;
+  GSocketConnection *connection;
+  CockpitWebResponse *response;
+  GByteArray *received;
+  gboolean done = FALSE;
+  GSocket *socket;
+  gint fds[2];
+  const gchar *roots[] = { root, NULL };
+
+  g_assert_cmpint (socketpair (AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+  g_assert_cmpint (fcntl (fds[1], F_SETFL, O_NONBLOCK), ==, 0);
+
+  socket = g_socket_new_from_fd (fds[0], &error);
+  g_assert_no_error (error);
+  connection = g_socket_connection_factory_create_connection (socket);
+  g_object_unref (socket);
+
+  response = cockpit_web_response_new (G_IO_STREAM (connection), path, path, headers, "GET", "http");
+  g_signal_connect (response, "done", G_CALLBACK (on_response_done), &done);
+
+  if (or_gz)
+    cockpit_web_response_file_or_gz (response, TRUE, path, roots);
+  else
+    cockpit_web_response_file (response, path, roots);
+
+  received = g_byte_array_new ();
+  while (!done)
+    {
+      g_main_context_iteration (NULL, FALSE);
+      read_available (fds[1], received);
+    }
+
+  g_object_unref (response);
+  g_object_unref (connection);
+
+  /* Everything that was sent is waiting in the socket now */
+  read_available (fds[1], received);
+  close (fds[1]);
+
+  return g_byte_array_free_to_bytes (received);
+}
+
+static void
+assert_body (GBytes *output,
+             const gchar *separator,
+             GBytes *expected)
+{
+  const gchar *data;
+  const gchar *body;
+  gsize length;
+
+  data = g_bytes_get_data (output, &length);
+  body = g_strstr_len (data, length, separator);
+  g_assert (body != NULL);
+  body += strlen (separator);
+
+  g_assert_cmpuint (length - (body - data), >=, g_bytes_get_size (expected));
+  g_assert (memcmp (body, g_bytes_get_data (expected, NULL), g_bytes_get_size (expected)) == 0);
+}
+
+/* The status line and headers, as a string */
+static gchar *
+response_head (GBytes *output)
+{
+  const gchar *data;
+  const gchar *end;
+  gsize length;
+
+  data = g_bytes_get_data (output, &length);
+  end = g_strstr_len (data, length, "\r\n\r\n");
+  g_assert (end != NULL);
+  return g_strndup (data, end + 4 - data);
+}
+
+static void
+test_file_send_file (TestSendFile *tc,
+                     gconstpointer data)
+{
+  g_autoptr(GBytes) output = NULL;
+  g_autofree gchar *head = NULL;
+
+  output = serve_over_socket (tc->root, "/large.js.gz", NULL, FALSE);
+  head = response_head (output);
+
+  cockpit_assert_strmatch (head, "HTTP/1.1 200 OK\r\n*Content-Length: 4194304\r\n*");
+  g_assert_cmpuint (g_bytes_get_size (output), ==, strlen (head) + 4194304);
+  assert_body (output, "\r\n\r\n", tc->content);
+}
+
+static void
+test_file_send_file_chunked (TestSendFile *tc,
+                             gconstpointer data)
+{
+  g_autoptr(GBytes) output = NULL;
+  g_autofree gchar *head = NULL;
+  const gchar *data;
+  const gchar *end;
+  gsize length;
+
+  /* A gzip file is sent with chunked encoding around it */
+  output = serve_over_socket (tc->root, "/large.js", NULL, TRUE);
+  data = g_bytes_get_data (output, &length);
+  head = response_head (output);
+
+  cockpit_assert_strmatch (head, "HTTP/1.1 200 OK\r\n*Content-Encoding: gzip\r\n*Transfer-Encoding: chunked\r\n*");
+  assert_body (output, "\r\n\r\n400000\r\n", tc->content);
+
+  end = "\r\n0\r\n\r\n";
+  g_assert_cmpuint (length, >, strlen (end));
+  g_assert (memcmp (data + length - strlen (end), end, strlen (end)) == 0);
+}
+
+static void
+test_file_send_file_range (TestSendFile *tc,
+                           gconstpointer data)
+{
+  g_autoptr(GBytes) output = NULL;
+  g_autoptr(GBytes) expected = NULL;
+  g_autofree gchar *head = NULL;
+  GHashTable *headers;
+
+  headers = cockpit_web_server_new_table ();
+  g_hash_table_insert (headers, g_strdup ("Range"), g_strdup ("bytes=1000000-2999999"));
+  output = serve_over_socket (tc->root, "/large.js.gz", headers, FALSE);
+  g_hash_table_unref (headers);
+
+  head = response_head (output);
+  cockpit_assert_strmatch (head, "HTTP/1.1 206 Partial Content\r\n*"
+                           "Content-Length: 2000000\r\n*"
+                           "Content-Range: bytes 1000000-2999999/4194304\r\n*");
+  g_assert_cmpuint (g_bytes_get_size (output), ==, strlen (head) + 2000000);
+
+  expected = g_bytes_new_from_bytes (tc->content, 1000000, 2000000);
+  assert_body (output, "\r\n\r\n", expected);
+}
+
+typedef struct {
+  gchar *root;
+} TestCompressed;
+
+static const gchar *compressed_files[] = {
+  "both.js", "both.js.br", "both.js.zst", "both.js.gz", "gz.js.gz",
+};
+
+static void
+setup_compressed (TestCompressed *tc,
+                  gconstpointer data)
+{
+  g_autoptr(GError) error = NULL;
+  guint i;
+
+  tc->root = g_dir_make_tmp ("test-webresponse.XXXXXX", &error);
+  g_assert_no_error (error);
+
+  /* The contents say which file was sent, they are never decompressed */
+  for (i = 0; i < G_N_ELEMENTS (compressed_files); i++)
+    {
+      g_autofree gchar *path = g_build_filename (tc->root, compressed_files[i], NULL);
+      g_file_set_contents (path, compressed_files[i], -1, &error);
+      g_assert_no_error (error);
+    }
+}
+
+static void
+teardown_compressed (TestCompressed *tc,
+                     gconstpointer data)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (compressed_files); i++)
+    {
+      g_autofree gchar *path = g_build_filename (tc->root, compressed_files[i], NULL);
+      g_assert_cmpint (g_unlink (path), ==, 0);
+    }
+
+  g_assert_cmpint (g_rmdir (tc->root), ==, 0);
+  g_free (tc->root);
+}
+
+typedef struct {
+  const gchar *path;
+  const gchar *accept_encoding;
+  const gchar *content_encoding;
+  const gchar *body;
+} CompressedFixture;
+
+static const CompressedFixture compressed_browser_fixture = {
+  "/both.js", "gzip, deflate, br, zstd", "br", "both.js.br"
+};
+
+static const CompressedFixture compressed_qvalue_fixture = {
+  "/both.js", "br;q=0.5, zstd;q=0.8, gzip;q=0.2", "zstd", "both.js.zst"
+};
+
+static const CompressedFixture compressed_excluded_fixture = {
+  "/both.js", "*, br;q=0", "zstd", "both.js.zst"
+};
+
+static const CompressedFixture compressed_gzip_fixture = {
+  "/both.js", "x-gzip", "gzip", "both.js.gz"
+};
+
+static const CompressedFixture compressed_identity_fixture = {
+  "/both.js", "identity", NULL, "both.js"
+};
+
+static const CompressedFixture compressed_none_fixture = {
+  "/both.js", NULL, NULL, "both.js"
+};
+
+static const CompressedFixture compressed_only_gz_fixture = {
+  "/gz.js", "br, gzip", "gzip", "gz.js.gz"
+};
+
+static void
+test_file_compressed (TestCompressed *tc,
+                      gconstpointer data)
+{
+  const CompressedFixture *fixture = data;
+  const gchar *roots[] = { tc->root, NULL };
+  CockpitWebResponse *response;
+  GOutputStream *output;
+  GInputStream *input;
+  GHashTable *headers;
+  gboolean done = FALSE;
+  const gchar *resp;
+  gsize length;
+  guint status;
+  gssize off;
+  GIOStream *io;
+
+  input = g_memory_input_stream_new ();
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = g_simple_io_stream_new (input, output);
+  g_object_unref (input);
+
+  response = cockpit_web_response_new (io, fixture->path, fixture->path, NULL, "GET", "http");
+  g_object_unref (io);
+
+  g_signal_connect (response, "done", G_CALLBACK (on_response_done), &done);
+  cockpit_web_response_file_or_compressed (response, fixture->accept_encoding, fixture->path, roots);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  resp = g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output));
+  length = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output));
+
+  off = web_socket_util_parse_status_line (resp, length, NULL, &status, NULL);
+  g_assert_cmpuint (off, >, 0);
+  g_assert_cmpuint (status, ==, 200);
+  resp += off;
+  length -= off;
+
+  off = web_socket_util_parse_headers (resp, length, &headers);
+  g_assert_cmpuint (off, >, 0);
+  resp += off;
+  length -= off;
+
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Content-Encoding"), ==, fixture->content_encoding);
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Vary"), ==, "Accept-Encoding");
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Content-Type"), ==, "application/javascript");
+  cockpit_assert_data_eq (resp, length, fixture->body, -1);
+
+  g_hash_table_unref (headers);
+  g_object_unref (response);
+  g_object_unref (output);
+}
+
+static GBytes *
+serve_decompressed (const gchar *path,
+                    const gchar **roots,
+                    GHashTable *values)
+{
+  CockpitWebResponse *response;
+  GOutputStream *output;
+  GInputStream *input;
+  gboolean done = FALSE;
+  GIOStream *io;
+  GBytes *bytes;
+
+  input = g_memory_input_stream_new ();
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = g_simple_io_stream_new (input, output);
+  g_object_unref (input);
+
+  response = cockpit_web_response_new (io, path, path, NULL, "GET", "http");
+  g_object_unref (io);
+
+  g_signal_connect (response, "done", G_CALLBACK (on_response_done), &done);
+  if (values)
+    cockpit_web_response_template (response, path, roots, values);
+  else
+    cockpit_web_response_file_or_compressed (response, "identity", path, roots);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_object_unref (response);
+  g_output_stream_close (output, NULL, NULL);
+  bytes = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+  g_object_unref (output);
+  return bytes;
+}
+
+static void
+test_file_decompressed (void)
+{
+  const gchar *roots[] = { SRCDIR "/src/common/mock-content/", NULL };
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GBytes) compressed = NULL;
+  g_autoptr(GBytes) expected = NULL;
+  g_autoptr(GBytes) first = NULL;
+  g_autoptr(GBytes) second = NULL;
+  g_autoptr(GBytes) templated = NULL;
+  g_autoptr(GHashTable) values = NULL;
+  g_autofree gchar *head = NULL;
+  g_autofree gchar *templated_head = NULL;
+  gchar *contents;
+  gsize length;
+
+  g_file_get_contents (SRCDIR "/src/common/mock-content/large.min.js.gz", &contents, &length, &error);
+  g_assert_no_error (error);
+  compressed = g_bytes_new_take (contents, length);
+  expected = cockpit_web_response_gunzip (compressed, &error);
+  g_assert_no_error (error);
+
+  /* Only there as .gz, so it gets decompressed, the second time from the cache */
+  first = serve_decompressed ("/large.min.js", roots, NULL);
+  head = response_head (first);
+  cockpit_assert_strmatch (head, "HTTP/1.1 200 OK\r\n*");
+  g_assert (!strstr (head, "Content-Encoding"));
+  assert_body (first, "\r\n\r\n", expected);
+
+  second = serve_decompressed ("/large.min.js", roots, NULL);
+  g_assert (g_bytes_equal (first, second));
+
+  /* Templates find the .gz file too */
+  values = g_hash_table_new (g_str_hash, g_str_equal);
+  templated = serve_decompressed ("/large.min.js", roots, values);
+  templated_head = response_head (templated);
+  cockpit_assert_strmatch (templated_head, "HTTP/1.1 200 OK\r\n*Transfer-Encoding: chunked\r\n*");
+  g_assert (!strstr (templated_head, "Content-Encoding"));
+}
+
 static const TestFixture content_type_fixture_html = {
   .path = "/pkg/shell/index.html",
   .expected_content_type = "text/html",
@@ -453,6 +861,195 @@ test_cache (TestCase *tc,
   g_hash_table_unref (headers);
 }
 
+typedef struct {
+  const gchar *range;
+  const gchar *if_range;
+  const gchar *if_none_match;
+  const gchar *if_modified_since;
+  const gchar *method;
+  guint status;
+  const gchar *content_range;
+  const gchar *body;
+} PartialFixture;
+
+static const PartialFixture partial_range_fixture = {
+  .range = "bytes=2-6", .status = 206, .content_range = "bytes 2-6/18", .body = "small"
+};
+
+static const PartialFixture partial_open_fixture = {
+  .range = "bytes=13-", .status = 206, .content_range = "bytes 13-17/18", .body = "file\n"
+};
+
+static const PartialFixture partial_suffix_fixture = {
+  .range = "bytes=-5", .status = 206, .content_range = "bytes 13-17/18", .body = "file\n"
+};
+
+static const PartialFixture partial_clamped_fixture = {
+  .range = "bytes=8-100", .status = 206, .content_range = "bytes 8-17/18", .body = "test file\n"
+};
+
+static const PartialFixture partial_head_fixture = {
+  .range = "bytes=2-6", .method = "HEAD", .status = 206, .content_range = "bytes 2-6/18", .body = ""
+};
+
+static const PartialFixture partial_unsatisfiable_fixture = {
+  .range = "bytes=18-", .status = 416, .content_range = "bytes */18", .body = ""
+};
+
+static const PartialFixture partial_multiple_fixture = {
+  .range = "bytes=0-1,4-5", .status = 200, .body = "A small test file\n"
+};
+
+static const PartialFixture partial_invalid_fixture = {
+  .range = "bytes=6-2", .status = 200, .body = "A small test file\n"
+};
+
+static const PartialFixture partial_if_range_fixture = {
+  .range = "bytes=2-6", .if_range = "\"other\"", .status = 200, .body = "A small test file\n"
+};
+
+static const PartialFixture partial_if_none_match_fixture = {
+  .if_none_match = "\"other\", *", .status = 304, .body = ""
+};
+
+static const PartialFixture partial_if_modified_since_fixture = {
+  .if_modified_since = "Fri, 01 Jan 2100 00:00:00 GMT", .status = 304, .body = ""
+};
+
+static const PartialFixture partial_modified_fixture = {
+  .if_modified_since = "Thu, 01 Jan 1970 00:00:00 GMT", .status = 200, .body = "A small test file\n"
+};
+
+static void
+test_file_partial (gconstpointer data)
+{
+  const PartialFixture *fixture = data;
+  const gchar *roots[] = { SRCDIR "/src/common/mock-content/", NULL };
+  const gchar *path = "/test-file.txt";
+  CockpitWebResponse *response;
+  GOutputStream *output;
+  GInputStream *input;
+  GHashTable *headers;
+  GHashTable *out_headers;
+  gboolean done = FALSE;
+  const gchar *resp;
+  gsize length;
+  guint status;
+  gssize off;
+  GIOStream *io;
+
+  input = g_memory_input_stream_new ();
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = g_simple_io_stream_new (input, output);
+  g_object_unref (input);
+
+  headers = cockpit_web_server_new_table ();
+  if (fixture->range)
+    g_hash_table_insert (headers, g_strdup ("Range"), g_strdup (fixture->range));
+  if (fixture->if_range)
+    g_hash_table_insert (headers, g_strdup ("If-Range"), g_strdup (fixture->if_range));
+  if (fixture->if_none_match)
+    g_hash_table_insert (headers, g_strdup ("If-None-Match"), g_strdup (fixture->if_none_match));
+  if (fixture->if_modified_since)
+    g_hash_table_insert (headers, g_strdup ("If-Modified-Since"), g_strdup (fixture->if_modified_since));
+
+  response = cockpit_web_response_new (io, path, path, headers,
+                                       fixture->method ? fixture->method : "GET", "http");
+  g_hash_table_unref (headers);
+  g_object_unref (io);
+
+  g_signal_connect (response, "done", G_CALLBACK (on_response_done), &done);
+  cockpit_web_response_file (response, path, roots);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  resp = g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output));
+  length = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output));
+
+  off = web_socket_util_parse_status_line (resp, length, NULL, &status, NULL);
+  g_assert_cmpuint (off, >, 0);
+  g_assert_cmpuint (status, ==, fixture->status);
+  resp += off;
+  length -= off;
+
+  off = web_socket_util_parse_headers (resp, length, &out_headers);
+  g_assert_cmpuint (off, >, 0);
+  resp += off;
+  length -= off;
+
+  g_assert (g_hash_table_lookup (out_headers, "ETag") != NULL);
+  g_assert (g_hash_table_lookup (out_headers, "Last-Modified") != NULL);
+  g_assert_cmpstr (g_hash_table_lookup (out_headers, "Content-Range"), ==, fixture->content_range);
+  if (fixture->status == 200)
+    g_assert_cmpstr (g_hash_table_lookup (out_headers, "Accept-Ranges"), ==, "bytes");
+  cockpit_assert_data_eq (resp, length, fixture->body, -1);
+
+  g_hash_table_unref (out_headers);
+  g_object_unref (response);
+  g_object_unref (output);
+}
+
+static void
+test_file_validators (TestCase *tc,
+                      gconstpointer data)
+{
+  const gchar *roots[] = { SRCDIR "/src/common/mock-content/", NULL };
+  GHashTable *values = g_hash_table_new (g_str_hash, g_str_equal);
+  GHashTable *headers;
+  const gchar *resp;
+  gsize length;
+  guint status;
+  gssize off;
+
+  /* Templates change the content, so there is nothing to validate */
+  cockpit_web_response_template (tc->response, "/test-file.txt", roots, values);
+
+  resp = output_as_string (tc);
+  length = strlen (resp);
+
+  off = web_socket_util_parse_status_line (resp, length, NULL, &status, NULL);
+  g_assert_cmpuint (off, >, 0);
+  g_assert_cmpint (status, ==, 200);
+
+  off = web_socket_util_parse_headers (resp + off, length - off, &headers);
+  g_assert_cmpuint (off, >, 0);
+
+  g_assert_null (g_hash_table_lookup (headers, "ETag"));
+  g_assert_null (g_hash_table_lookup (headers, "Last-Modified"));
+  g_assert_null (g_hash_table_lookup (headers, "Accept-Ranges"));
+  g_hash_table_unref (headers);
+  g_hash_table_unref (values);
+}
+
+static void
+test_stream_range (TestCase *tc,
+                   gconstpointer data)
+{
+  const gchar *resp;
+  GBytes *content;
+
+  /* Ranges cut across the queued blocks */
+  cockpit_web_response_headers (tc->response, 200, "OK", 11, "ETag", "\"tag\"", NULL);
+
+  content = g_bytes_new_static ("the ", 4);
+  cockpit_web_response_queue (tc->response, content);
+  g_bytes_unref (content);
+  content = g_bytes_new_static ("content", 7);
+  cockpit_web_response_queue (tc->response, content);
+  g_bytes_unref (content);
+
+  cockpit_web_response_complete (tc->response);
+
+  resp = output_as_string (tc);
+  g_assert_cmpstr (resp, ==, "HTTP/1.1 206 Partial Content\r\nETag: \"tag\"\r\nContent-Length: 5\r\n"
+                   "Content-Range: bytes 2-6/11\r\n" STATIC_HEADERS "e con");
+}
+
+static const TestFixture stream_range_fixture = {
+  .header = "Range",
+  .value = "bytes=2-6",
+};
+
 static void
 test_content_encoding (TestCase *tc,
                        gconstpointer data)
@@ -1500,6 +2097,41 @@ main (int argc,
               setup, test_file_encoding_denied, teardown);
   g_test_add ("/web-response/file/file-slash-denied", TestCase, NULL,
               setup, test_file_slash_denied, teardown);
+  g_test_add ("/web-response/file/send-file", TestSendFile, NULL,
+              setup_send_file, test_file_send_file, teardown_send_file);
+  g_test_add ("/web-response/file/send-file-chunked", TestSendFile, NULL,
+              setup_send_file, test_file_send_file_chunked, teardown_send_file);
+  g_test_add ("/web-response/file/send-file-range", TestSendFile, NULL,
+              setup_send_file, test_file_send_file_range, teardown_send_file);
+  g_test_add_data_func ("/web-response/file/range", &partial_range_fixture, test_file_partial);
+  g_test_add_data_func ("/web-response/file/range-open", &partial_open_fixture, test_file_partial);
+  g_test_add_data_func ("/web-response/file/range-suffix", &partial_suffix_fixture, test_file_partial);
+  g_test_add_data_func ("/web-response/file/range-clamped", &partial_clamped_fixture, test_file_partial);
+  g_test_add_data_func ("/web-response/file/range-head", &partial_head_fixture, test_file_partial);
+  g_test_add_data_func ("/web-response/file/range-unsatisfiable", &partial_unsatisfiable_fixture, test_file_partial);
+  g_test_add_data_func ("/web-response/file/range-multiple", &partial_multiple_fixture, test_file_partial);
+  g_test_add_data_func ("/web-response/file/range-invalid", &partial_invalid_fixture, test_file_partial);
+  g_test_add_data_func ("/web-response/file/if-range", &partial_if_range_fixture, test_file_partial);
+  g_test_add_data_func ("/web-response/file/if-none-match", &partial_if_none_match_fixture, test_file_partial);
+  g_test_add_data_func ("/web-response/file/if-modified-since", &partial_if_modified_since_fixture, test_file_partial);
+  g_test_add_data_func ("/web-response/file/modified", &partial_modified_fixture, test_file_partial);
+  g_test_add ("/web-response/file/validators-template", TestCase, NULL,
+              setup, test_file_validators, teardown);
+  g_test_add ("/web-response/file/compressed-browser", TestCompressed, &compressed_browser_fixture,
+              setup_compressed, test_file_compressed, teardown_compressed);
+  g_test_add ("/web-response/file/compressed-qvalue", TestCompressed, &compressed_qvalue_fixture,
+              setup_compressed, test_file_compressed, teardown_compressed);
+  g_test_add ("/web-response/file/compressed-excluded", TestCompressed, &compressed_excluded_fixture,
+              setup_compressed, test_file_compressed, teardown_compressed);
+  g_test_add ("/web-response/file/compressed-gzip", TestCompressed, &compressed_gzip_fixture,
+              setup_compressed, test_file_compressed, teardown_compressed);
+  g_test_add ("/web-response/file/compressed-identity", TestCompressed, &compressed_identity_fixture,
+              setup_compressed, test_file_compressed, teardown_compressed);
+  g_test_add ("/web-response/file/compressed-none", TestCompressed, &compressed_none_fixture,
+              setup_compressed, test_file_compressed, teardown_compressed);
+  g_test_add ("/web-response/file/compressed-only-gz", TestCompressed, &compressed_only_gz_fixture,
+              setup_compressed, test_file_compressed, teardown_compressed);
+  g_test_add_func ("/web-response/file/decompressed", test_file_decompressed);
   g_test_add ("/web-response/file/breakout-non-existant", TestCase, NULL,
               setup, test_file_breakout_non_existant, teardown);
   g_test_add ("/web-reponse/file/template", TestCase, &template_fixture,
@@ -1514,6 +2146,8 @@ main (int argc,
               setup, test_content_encoding, teardown);
   g_test_add ("/web-response/stream", TestCase, NULL,
               setup, test_stream, teardown);
+  g_test_add ("/web-response/stream-range", TestCase, &stream_range_fixture,
+              setup, test_stream_range, teardown);
   g_test_add ("/web-response/pressure", TestCase, NULL,
               setup, test_pressure, teardown);
   g_test_add ("/web-response/head", TestCase, &fixture_head,
@@ -0,0 +1,1267 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Performance measurements for cockpit-tls.
+ *
+ * This runs the cockpit-tls server and a trivial echoing "ws instance" in
+ * two child processes, and measures them from the outside.  Each
+ * measurement is printed as one line of space separated key=value pairs,
+ * so that the output can be easily compared or fed into other tools.
+ *
+ * This is not run as part of the unit tests.
+ */
+
+#include "config.h"
+
+#include <argp.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gnutls/gnutls.h>
+
+#include <common/cockpitmemory.h>
+
+#include "connection.h"
+#include "server.h"
+#include "socket-io.h"
+#include "utils.h"
+
+/* this has a corresponding mock-server.key */
+#define CERTFILE SRCDIR "/test/data/mock-server.crt"
+#define KEYFILE SRCDIR "/test/data/mock-server.key"
+
+/* how long to wait for any single reply */
+#define REPLY_TIMEOUT_MS 30000
+
+typedef struct {
+  const char *benchmark;
+  bool tls;
+  int workers;
+  unsigned samples;
+  const char *counts;
+  const char *modes;
+  const char *priority;
+  unsigned session_cache;
+  unsigned size;
+  bool splice;
+  unsigned accept_threads;
+  const char *clients;
+} Options;
+
+typedef struct {
+  const Options *options;
+  int workers;
+  char sockdir[64];
+  char runtimedir[64];
+  pid_t backend_pid;
+  pid_t server_pid;
+  struct sockaddr_in addr;
+  gnutls_certificate_credentials_t xcred;
+} Bench;
+
+/* a client connection, optionally with TLS */
+typedef struct {
+  int fd;
+  gnutls_session_t tls;
+} Client;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+raise_fd_limit (rlim_t wanted)
+{
+  struct rlimit rl;
+
+  if (getrlimit (RLIMIT_NOFILE, &rl) != 0)
+    err (EXIT_FAILURE, "getrlimit");
+
+  if (rl.rlim_cur >= wanted)
+    return;
+
+  rl.rlim_cur = wanted;
+  if (rl.rlim_max < wanted)
+    rl.rlim_max = wanted; /* works if we are privileged */
+
+  if (setrlimit (RLIMIT_NOFILE, &rl) != 0)
+    warn ("could not raise RLIMIT_NOFILE to %lu; large connection counts will fail", (unsigned long) wanted);
+}
+
+/**
+ * read_proc_status: Get a numeric field from /proc/pid/status
+ */
+static long
+read_proc_status (pid_t       pid,
+                  const char *field)
+{
+  char path[64];
+  char line[256];
+  size_t field_len = strlen (field);
+  long value = -1;
+
+  snprintf (path, sizeof path, "/proc/%i/status", (int) pid);
+  FILE *f = fopen (path, "r");
+  if (f == NULL)
+    err (EXIT_FAILURE, "open %s", path);
+
+  while (fgets (line, sizeof line, f))
+    {
+      if (strncmp (line, field, field_len) == 0 && line[field_len] == ':')
+        {
+          value = strtol (line + field_len + 1, NULL, 10);
+          break;
+        }
+    }
+
+  fclose (f);
+  return value;
+}
+
+/**
+ * read_proc_cpu_ms: Get the user plus system CPU time of a process
+ */
+static uint64_t
+read_proc_cpu_ms (pid_t pid)
+{
+  char path[64];
+  char line[1024];
+  unsigned long utime = 0, stime = 0;
+
+  snprintf (path, sizeof path, "/proc/%i/stat", (int) pid);
+  FILE *f = fopen (path, "r");
+  if (f == NULL)
+    err (EXIT_FAILURE, "open %s", path);
+
+  /* skip over "pid (comm)", as comm may contain spaces; utime and stime are fields 14 and 15 */
+  if (fgets (line, sizeof line, f))
+    {
+      const char *p = strrchr (line, ')');
+      if (p == NULL || sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        errx (EXIT_FAILURE, "cannot parse %s", path);
+    }
+
+  fclose (f);
+  return (utime + stime) * 1000 / sysconf (_SC_CLK_TCK);
+}
+
+static int
+compare_u64 (const void *a,
+             const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of a sorted array */
+static uint64_t
+percentile (const uint64_t *sorted,
+            unsigned        n,
+            unsigned        pct)
+{
+  unsigned rank = (pct * n + 99) / 100;
+
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/***********************************
+ *
+ * The "ws instance": echoes everything back, except for download requests
+ * "#SIZE\n", which get answered with SIZE bytes of data, and upload requests
+ * "!SIZE\n", which swallow SIZE bytes and then reply with a single byte
+ *
+ ***********************************/
+
+static int
+backend_listen (int         dirfd,
+                const char *name)
+{
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd < 0)
+    err (EXIT_FAILURE, "socket");
+  if (af_unix_bindat (fd, dirfd, name) != 0)
+    err (EXIT_FAILURE, "bind %s", name);
+  if (listen (fd, 4096) != 0)
+    err (EXIT_FAILURE, "listen %s", name);
+
+  return fd;
+}
+
+static void
+backend_main (int dirfd,
+              int ready_fd)
+{
+  int listeners[] = {
+    backend_listen (dirfd, "http.sock"),
+    backend_listen (dirfd, "https@" SHA256_NIL ".sock"),
+  };
+  struct epoll_event events[64];
+  static char buffer[64 << 10];
+
+  int epollfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epollfd < 0)
+    err (EXIT_FAILURE, "epoll_create1");
+
+  for (int i = 0; i < N_ELEMENTS (listeners); i++)
+    {
+      struct epoll_event ev = { .events = EPOLLIN, .data.u64 = ((uint64_t) 1 << 32) | listeners[i] };
+      if (epoll_ctl (epollfd, EPOLL_CTL_ADD, listeners[i], &ev) != 0)
+        err (EXIT_FAILURE, "epoll_ctl");
+    }
+
+  if (write (ready_fd, "", 1) != 1)
+    err (EXIT_FAILURE, "write");
+  close (ready_fd);
+
+  for (;;)
+    {
+      int n = epoll_wait (epollfd, events, N_ELEMENTS (events), -1);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          err (EXIT_FAILURE, "epoll_wait");
+        }
+
+      for (int i = 0; i < n; i++)
+        {
+          int fd = (int) (events[i].data.u64 & 0xffffffff);
+
+          if (events[i].data.u64 >> 32)
+            {
+              int conn = accept4 (fd, NULL, NULL, SOCK_CLOEXEC);
+              if (conn < 0)
+                continue;
+
+              struct epoll_event ev = { .events = EPOLLIN, .data.u64 = conn };
+              if (epoll_ctl (epollfd, EPOLL_CTL_ADD, conn, &ev) != 0)
+                err (EXIT_FAILURE, "epoll_ctl");
+              continue;
+            }
+
+          ssize_t s = read (fd, buffer, sizeof buffer);
+          if (s <= 0)
+            {
+              close (fd);
+              continue;
+            }
+
+          if (buffer[0] == '#')
+            {
+              unsigned long long remaining = strtoull (buffer + 1, NULL, 10);
+
+              memset (buffer, 'x', sizeof buffer);
+              while (remaining > 0)
+                {
+                  ssize_t r = send (fd, buffer, MIN (remaining, sizeof buffer), MSG_NOSIGNAL);
+                  if (r <= 0)
+                    break;
+                  remaining -= r;
+                }
+              continue;
+            }
+
+          if (buffer[0] == '!')
+            {
+              char *data = memchr (buffer, '\n', s);
+              unsigned long long remaining = strtoull (buffer + 1, NULL, 10);
+
+              if (data)
+                remaining -= MIN (remaining, s - (data + 1 - buffer));
+              while (remaining > 0)
+                {
+                  ssize_t r = read (fd, buffer, MIN (remaining, sizeof buffer));
+                  if (r <= 0)
+                    break;
+                  remaining -= r;
+                }
+              if (send (fd, "!", 1, MSG_NOSIGNAL) != 1)
+                close (fd);
+              continue;
+            }
+
+          /* blocking; the clients always read their replies */
+          for (ssize_t sent = 0, r; sent < s; sent += r)
+            {
+              r = send (fd, buffer + sent, s - sent, MSG_NOSIGNAL);
+              if (r <= 0)
+                {
+                  close (fd);
+                  break;
+                }
+            }
+        }
+    }
+}
+
+/***********************************
+ *
+ * cockpit-tls server and client side
+ *
+ ***********************************/
+
+static void
+server_main (Bench *bench,
+             int    ready_fd)
+{
+  server_init (bench->sockdir, bench->runtimedir, 0, 0);
+
+  if (bench->options->tls)
+    {
+      connection_crypto_init (CERTFILE, KEYFILE, true, GNUTLS_CERT_IGNORE);
+      connection_enable_session_cache (bench->options->session_cache);
+    }
+
+  server_set_workers (bench->workers);
+
+  if (bench->options->splice)
+    connection_enable_splice ();
+
+  server_start_accept_threads (bench->options->accept_threads);
+
+  int listener = server_get_listener ();
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof addr;
+  if (getsockname (listener, (struct sockaddr *) &addr, &addrlen) != 0)
+    err (EXIT_FAILURE, "getsockname");
+
+  if (write (ready_fd, &addr, sizeof addr) != sizeof addr)
+    err (EXIT_FAILURE, "write");
+  close (ready_fd);
+
+  server_run ();
+  exit (EXIT_SUCCESS);
+}
+
+static pid_t
+spawn (Bench *bench,
+       void (*func) (Bench *bench, int ready_fd),
+       void  *result,
+       size_t result_size)
+{
+  int fds[2];
+  pid_t pid;
+
+  if (pipe2 (fds, O_CLOEXEC) != 0)
+    err (EXIT_FAILURE, "pipe");
+
+  pid = fork ();
+  if (pid < 0)
+    err (EXIT_FAILURE, "fork");
+
+  if (pid == 0)
+    {
+      close (fds[0]);
+      func (bench, fds[1]);
+      _exit (EXIT_SUCCESS);
+    }
+
+  close (fds[1]);
+  if (read (fds[0], result, result_size) != result_size)
+    errx (EXIT_FAILURE, "child process failed to start");
+  close (fds[0]);
+
+  return pid;
+}
+
+static void
+spawn_backend_main (Bench *bench,
+                    int    ready_fd)
+{
+  int dirfd = open (bench->sockdir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd < 0)
+    err (EXIT_FAILURE, "open %s", bench->sockdir);
+
+  backend_main (dirfd, ready_fd);
+}
+
+static void
+bench_start (Bench         *bench,
+             const Options *options,
+             int            workers)
+{
+  char ready;
+
+  *bench = (Bench) { .options = options, .workers = workers };
+
+  strcpy (bench->sockdir, "/tmp/bench-tls.sock.XXXXXX");
+  strcpy (bench->runtimedir, "/tmp/bench-tls.runtime.XXXXXX");
+  if (!mkdtemp (bench->sockdir) || !mkdtemp (bench->runtimedir))
+    err (EXIT_FAILURE, "mkdtemp");
+
+  bench->backend_pid = spawn (bench, spawn_backend_main, &ready, sizeof ready);
+  bench->server_pid = spawn (bench, server_main, &bench->addr, sizeof bench->addr);
+  bench->addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if (options->tls)
+    {
+      if (gnutls_certificate_allocate_credentials (&bench->xcred) != GNUTLS_E_SUCCESS)
+        errx (EXIT_FAILURE, "gnutls_certificate_allocate_credentials failed");
+    }
+}
+
+static void
+kill_and_wait (pid_t pid)
+{
+  kill (pid, SIGKILL);
+  waitpid (pid, NULL, 0);
+}
+
+static void
+bench_stop (Bench *bench)
+{
+  int dirfd;
+
+  kill_and_wait (bench->server_pid);
+  kill_and_wait (bench->backend_pid);
+
+  if (bench->xcred)
+    gnutls_certificate_free_credentials (bench->xcred);
+
+  dirfd = open (bench->sockdir, O_PATH | O_DIRECTORY);
+  unlinkat (dirfd, "http.sock", 0);
+  unlinkat (dirfd, "https@" SHA256_NIL ".sock", 0);
+  close (dirfd);
+  rmdir (bench->sockdir);
+
+  dirfd = open (bench->runtimedir, O_PATH | O_DIRECTORY);
+  unlinkat (dirfd, "metrics.sock", 0);
+  unlinkat (dirfd, "clients", AT_REMOVEDIR);
+  close (dirfd);
+  rmdir (bench->runtimedir);
+}
+
+/* @session: if not %NULL, try to resume this session */
+static bool
+client_connect (Bench                *bench,
+                Client               *client,
+                const gnutls_datum_t *session)
+{
+  int one = 1;
+  int r;
+
+  *client = (Client) { .fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0) };
+  if (client->fd < 0)
+    return false;
+
+  setsockopt (client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+  if (connect (client->fd, (struct sockaddr *) &bench->addr, sizeof bench->addr) != 0)
+    {
+      close (client->fd);
+      return false;
+    }
+
+  if (!bench->options->tls)
+    return true;
+
+  if (gnutls_init (&client->tls, GNUTLS_CLIENT) != GNUTLS_E_SUCCESS)
+    errx (EXIT_FAILURE, "gnutls_init failed");
+  gnutls_transport_set_int (client->tls, client->fd);
+  if (bench->options->priority)
+    {
+      if (gnutls_priority_set_direct (client->tls, bench->options->priority, NULL) != GNUTLS_E_SUCCESS)
+        errx (EXIT_FAILURE, "invalid priority string: %s", bench->options->priority);
+    }
+  else
+    gnutls_set_default_priority (client->tls);
+  if (session)
+    gnutls_session_set_data (client->tls, session->data, session->size);
+  gnutls_credentials_set (client->tls, GNUTLS_CRD_CERTIFICATE, bench->xcred);
+  gnutls_handshake_set_timeout (client->tls, REPLY_TIMEOUT_MS);
+
+  do
+    r = gnutls_handshake (client->tls);
+  while (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN);
+
+  if (r != GNUTLS_E_SUCCESS)
+    {
+      warnx ("client handshake failed: %s", gnutls_strerror (r));
+      gnutls_deinit (client->tls);
+      close (client->fd);
+      return false;
+    }
+
+  return true;
+}
+
+static void
+client_close (Client *client)
+{
+  if (client->tls)
+    gnutls_deinit (client->tls);
+  close (client->fd);
+}
+
+static bool
+client_send (Client     *client,
+             const char *data,
+             size_t      size)
+{
+  if (client->tls)
+    return gnutls_record_send (client->tls, data, size) == size;
+  else
+    return send (client->fd, data, size, MSG_NOSIGNAL) == size;
+}
+
+static bool
+client_recv_exactly (Client *client,
+                     char   *data,
+                     size_t  size)
+{
+  while (size > 0)
+    {
+      ssize_t s;
+
+      if (!client->tls || !gnutls_record_check_pending (client->tls))
+        {
+          struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+          if (poll (&pfd, 1, REPLY_TIMEOUT_MS) != 1)
+            return false;
+        }
+
+      if (client->tls)
+        {
+          do
+            s = gnutls_record_recv (client->tls, data, size);
+          while (s == GNUTLS_E_INTERRUPTED);
+        }
+      else
+        s = recv (client->fd, data, size, 0);
+
+      /* post-handshake messages such as TLS 1.3 session tickets */
+      if (client->tls && s == GNUTLS_E_AGAIN)
+        continue;
+
+      if (s <= 0)
+        return false;
+
+      data += s;
+      size -= s;
+    }
+
+  return true;
+}
+
+/* send a message and wait for the echo; returns the round trip time in ns, or 0 on failure */
+static uint64_t
+client_roundtrip (Client *client,
+                  size_t  size)
+{
+  char message[4096];
+  char reply[4096];
+  uint64_t start = now_ns ();
+
+  assert (size <= sizeof message);
+  memset (message, 'x', size);
+
+  if (!client_send (client, message, size) || !client_recv_exactly (client, reply, size))
+    return 0;
+
+  return now_ns () - start;
+}
+
+/***********************************
+ *
+ * Benchmarks
+ *
+ ***********************************/
+
+/**
+ * bench_connections: Resource usage and latency vs. number of idle connections
+ *
+ * Opens @n_connections (which all stay open), and then measures round trip
+ * times of small messages on randomly chosen connections, plus the resident
+ * memory and thread count of the server.
+ */
+static void
+bench_connections (const Options *options,
+                   int            workers,
+                   unsigned       n_connections)
+{
+  Client *clients = callocx (n_connections, sizeof (Client));
+  uint64_t *samples = callocx (options->samples, sizeof (uint64_t));
+  unsigned n_open = 0;
+  unsigned n_samples = 0;
+  Bench bench;
+  long rss_base;
+
+  bench_start (&bench, options, workers);
+  rss_base = read_proc_status (bench.server_pid, "VmRSS");
+
+  for (n_open = 0; n_open < n_connections; n_open++)
+    {
+      if (!client_connect (&bench, &clients[n_open], NULL))
+        {
+          warn ("connection %u failed", n_open);
+          break;
+        }
+
+      /* make sure that the whole chain up to the ws instance is set up */
+      if (client_roundtrip (&clients[n_open], 1) == 0)
+        {
+          warnx ("no reply on connection %u", n_open);
+          client_close (&clients[n_open]);
+          break;
+        }
+    }
+
+  if (n_open > 0)
+    {
+      /* deterministic, but spread over all connections */
+      for (unsigned i = 0; i < options->samples; i++)
+        {
+          uint64_t t = client_roundtrip (&clients[(i * 7919u) % n_open], 64);
+          if (t)
+            samples[n_samples++] = t;
+        }
+    }
+
+  qsort (samples, n_samples, sizeof (uint64_t), compare_u64);
+
+  long rss = read_proc_status (bench.server_pid, "VmRSS");
+  long threads = read_proc_status (bench.server_pid, "Threads");
+
+  printf ("benchmark=connections mode=%s workers=%i tls=%s connections=%u open=%u "
+          "rss_kib=%li rss_per_connection_b=%li threads=%li samples=%u p50_us=%.1f p99_us=%.1f\n",
+          workers ? "workers" : "threads", workers, options->tls ? "yes" : "no",
+          n_connections, n_open, rss, n_open ? (rss - rss_base) * 1024 / (long) n_open : 0,
+          threads, n_samples,
+          n_samples ? percentile (samples, n_samples, 50) / 1000.0 : 0,
+          n_samples ? percentile (samples, n_samples, 99) / 1000.0 : 0);
+  fflush (stdout);
+
+  for (unsigned i = 0; i < n_open; i++)
+    client_close (&clients[i]);
+
+  bench_stop (&bench);
+  free (samples);
+  free (clients);
+}
+
+/**
+ * bench_handshakes: TLS handshake rate with and without session resumption
+ *
+ * Sequentially opens @options->samples connections, does a single round
+ * trip on each, and closes it again.  With @resume, each connection tries
+ * to resume the session of the previous one, as a reconnecting browser
+ * would.  Clients which don't use session tickets (such as with a
+ * "%NO_TICKETS" --priority) need the server side --session-cache.
+ */
+static void
+bench_handshakes (const Options *options,
+                  int            workers,
+                  bool           resume)
+{
+  gnutls_datum_t session = { NULL, 0 };
+  unsigned n_ok = 0;
+  unsigned n_resumed = 0;
+  uint64_t start;
+  uint64_t elapsed;
+  Bench bench;
+
+  bench_start (&bench, options, workers);
+
+  start = now_ns ();
+
+  for (unsigned i = 0; i < options->samples; i++)
+    {
+      Client client;
+
+      if (!client_connect (&bench, &client, session.data ? &session : NULL))
+        {
+          warn ("connection %u failed", i);
+          break;
+        }
+
+      /* this also receives TLS 1.3 session tickets, which are sent after the handshake */
+      if (client_roundtrip (&client, 1) == 0)
+        {
+          warnx ("no reply on connection %u", i);
+          client_close (&client);
+          break;
+        }
+
+      n_ok++;
+      if (gnutls_session_is_resumed (client.tls))
+        n_resumed++;
+
+      if (resume)
+        {
+          gnutls_free (session.data);
+          session.data = NULL;
+          if (gnutls_session_get_data2 (client.tls, &session) != GNUTLS_E_SUCCESS)
+            session.data = NULL;
+        }
+
+      client_close (&client);
+    }
+
+  elapsed = now_ns () - start;
+
+  printf ("benchmark=handshakes mode=%s workers=%i resume=%s priority=%s session_cache=%u "
+          "handshakes=%u resumed=%u handshakes_per_s=%.0f mean_us=%.1f\n",
+          workers ? "workers" : "threads", workers, resume ? "yes" : "no",
+          options->priority ?: "default", options->session_cache,
+          n_ok, n_resumed, n_ok ? n_ok * 1e9 / elapsed : 0.0,
+          n_ok ? elapsed / 1000.0 / n_ok : 0.0);
+  fflush (stdout);
+
+  gnutls_free (session.data);
+  bench_stop (&bench);
+}
+
+/**
+ * bench_throughput: Download speed through the proxy
+ *
+ * Downloads @options->size MiB from the ws instance, @options->samples
+ * times on the same connection.  Besides the rate, this reports the
+ * server's CPU time per GiB, which is where kTLS offload shows up even
+ * when the client is the bottleneck.
+ */
+static void
+bench_throughput (const Options *options,
+                  int            workers)
+{
+  static char buffer[64 << 10];
+  unsigned long long size = (unsigned long long) options->size << 20;
+  char request[32];
+  uint64_t elapsed = 0;
+  uint64_t cpu_ms;
+  unsigned n_ok = 0;
+  Client client;
+  Bench bench;
+
+  bench_start (&bench, options, workers);
+
+  if (!client_connect (&bench, &client, NULL))
+    err (EXIT_FAILURE, "connection failed");
+
+  /* connect the ws instance, so that this does not get counted */
+  if (client_roundtrip (&client, 1) == 0)
+    errx (EXIT_FAILURE, "no reply");
+
+  cpu_ms = read_proc_cpu_ms (bench.server_pid);
+
+  for (unsigned i = 0; i < options->samples; i++)
+    {
+      uint64_t start = now_ns ();
+
+      snprintf (request, sizeof request, "#%llu\n", size);
+      if (!client_send (&client, request, strlen (request)))
+        break;
+
+      unsigned long long remaining;
+      for (remaining = size; remaining > 0; remaining -= MIN (remaining, sizeof buffer))
+        {
+          if (!client_recv_exactly (&client, buffer, MIN (remaining, sizeof buffer)))
+            break;
+        }
+
+      if (remaining > 0)
+        {
+          warnx ("download %u failed", i);
+          break;
+        }
+
+      elapsed += now_ns () - start;
+      n_ok++;
+    }
+
+  cpu_ms = read_proc_cpu_ms (bench.server_pid) - cpu_ms;
+
+  double mib = (double) n_ok * options->size;
+  printf ("benchmark=throughput mode=%s workers=%i tls=%s size_mib=%u downloads=%u "
+          "mib_per_s=%.1f server_cpu_ms_per_gib=%.0f\n",
+          workers ? "workers" : "threads", workers, options->tls ? "yes" : "no",
+          options->size, n_ok, elapsed ? mib * 1e9 / elapsed : 0.0,
+          n_ok ? cpu_ms * 1024.0 / mib : 0.0);
+  fflush (stdout);
+
+  client_close (&client);
+  bench_stop (&bench);
+}
+
+/**
+ * bench_relay: iperf style bulk transfer, copying vs. splice()
+ *
+ * Uploads and then downloads @options->size MiB on a single plain HTTP
+ * connection, @options->samples times each, and reports the rate and the
+ * server's CPU time for each direction.
+ */
+static void
+bench_relay (const Options *options,
+             int            workers)
+{
+  static char buffer[64 << 10];
+  unsigned long long size = (unsigned long long) options->size << 20;
+  const char *directions[] = { "upload", "download" };
+  char request[32];
+  Client client;
+  Bench bench;
+
+  bench_start (&bench, options, workers);
+
+  if (!client_connect (&bench, &client, NULL))
+    err (EXIT_FAILURE, "connection failed");
+
+  /* connect the ws instance and send the metadata, so that this does not get counted */
+  if (client_roundtrip (&client, 1) == 0)
+    errx (EXIT_FAILURE, "no reply");
+
+  memset (buffer, 'x', sizeof buffer);
+
+  for (int d = 0; d < N_ELEMENTS (directions); d++)
+    {
+      uint64_t cpu_ms = read_proc_cpu_ms (bench.server_pid);
+      uint64_t elapsed = 0;
+      unsigned n_ok = 0;
+
+      for (unsigned i = 0; i < options->samples; i++)
+        {
+          unsigned long long remaining;
+          uint64_t start = now_ns ();
+          bool upload = d == 0;
+
+          snprintf (request, sizeof request, "%c%llu\n", upload ? '!' : '#', size);
+          if (!client_send (&client, request, strlen (request)))
+            break;
+
+          for (remaining = size; remaining > 0; remaining -= MIN (remaining, sizeof buffer))
+            {
+              if (upload ? !client_send (&client, buffer, MIN (remaining, sizeof buffer))
+                         : !client_recv_exactly (&client, buffer, MIN (remaining, sizeof buffer)))
+                break;
+            }
+
+          if (remaining > 0 || (upload && !client_recv_exactly (&client, buffer, 1)))
+            {
+              warnx ("%s %u failed", directions[d], i);
+              break;
+            }
+
+          elapsed += now_ns () - start;
+          n_ok++;
+        }
+
+      cpu_ms = read_proc_cpu_ms (bench.server_pid) - cpu_ms;
+
+      double mib = (double) n_ok * options->size;
+      printf ("benchmark=relay mode=%s workers=%i relay=%s direction=%s size_mib=%u transfers=%u "
+              "mib_per_s=%.1f server_cpu_ms_per_gib=%.0f\n",
+              workers ? "workers" : "threads", workers, options->splice ? "splice" : "copy",
+              directions[d], options->size, n_ok, elapsed ? mib * 1e9 / elapsed : 0.0,
+              n_ok ? cpu_ms * 1024.0 / mib : 0.0);
+      fflush (stdout);
+    }
+
+  client_close (&client);
+  bench_stop (&bench);
+}
+
+/**
+ * bench_accept: Connection rate and latency with many concurrent clients
+ *
+ * Starts @n_clients client processes, which each open connections in a
+ * loop, do a single round trip on each, and close it again, for a total of
+ * @options->samples connections.  Reports the overall rate of connections
+ * per second, and the latency from connect() to the first reply, which
+ * includes waiting for the server to accept the connection.
+ */
+static void
+bench_accept (const Options *options,
+              int            workers,
+              unsigned       n_clients)
+{
+  unsigned per_client = MAX (options->samples / n_clients, 1);
+  uint64_t *samples = callocx (n_clients * per_client, sizeof (uint64_t));
+  pid_t *pids = callocx (n_clients, sizeof (pid_t));
+  uint64_t first_start = UINT64_MAX;
+  uint64_t last_end = 0;
+  unsigned n_samples = 0;
+  int start_fds[2];
+  int result_fds[2];
+  Bench bench;
+
+  bench_start (&bench, options, workers);
+
+  if (pipe2 (start_fds, O_CLOEXEC) != 0 || pipe2 (result_fds, O_CLOEXEC) != 0)
+    err (EXIT_FAILURE, "pipe");
+
+  for (unsigned c = 0; c < n_clients; c++)
+    {
+      pid_t pid = pids[c] = fork ();
+      if (pid < 0)
+        err (EXIT_FAILURE, "fork");
+      if (pid > 0)
+        continue;
+
+      /* client: reports [start, end, n, latencies...] */
+      uint64_t *result = callocx (per_client + 3, sizeof (uint64_t));
+      const struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+      char go;
+
+      close (start_fds[1]);
+      close (result_fds[0]);
+
+      /* all clients start at the same time */
+      if (read (start_fds[0], &go, 1) != 0)
+        errx (EXIT_FAILURE, "unexpected start signal");
+
+      result[0] = now_ns ();
+      for (unsigned i = 0; i < per_client; i++)
+        {
+          uint64_t start = now_ns ();
+          Client client;
+
+          if (!client_connect (&bench, &client, NULL))
+            continue;
+
+          if (client_roundtrip (&client, 1) != 0)
+            result[3 + result[2]++] = now_ns () - start;
+
+          /* don't run out of local ports due to TIME_WAIT */
+          setsockopt (client.fd, SOL_SOCKET, SO_LINGER, &linger, sizeof linger);
+          client_close (&client);
+        }
+      result[1] = now_ns ();
+
+      size_t size = (result[2] + 3) * sizeof (uint64_t);
+      if (write (result_fds[1], result, size) != size)
+        err (EXIT_FAILURE, "write");
+      _exit (EXIT_SUCCESS);
+    }
+
+  close (start_fds[0]);
+  close (result_fds[1]);
+  close (start_fds[1]);
+
+  for (unsigned c = 0; c < n_clients; c++)
+    {
+      uint64_t header[3];
+
+      if (read (result_fds[0], header, sizeof header) != sizeof header)
+        errx (EXIT_FAILURE, "client %u failed", c);
+
+      first_start = MIN (first_start, header[0]);
+      last_end = MAX (last_end, header[1]);
+
+      size_t size = header[2] * sizeof (uint64_t);
+      if (read (result_fds[0], samples + n_samples, size) != size)
+        errx (EXIT_FAILURE, "short read of client results");
+      n_samples += header[2];
+    }
+
+  close (result_fds[0]);
+  for (unsigned c = 0; c < n_clients; c++)
+    waitpid (pids[c], NULL, 0);
+
+  qsort (samples, n_samples, sizeof (uint64_t), compare_u64);
+
+  printf ("benchmark=accept mode=%s workers=%i accept_threads=%u tls=%s clients=%u connections=%u ok=%u "
+          "connections_per_s=%.0f p50_us=%.1f p99_us=%.1f\n",
+          workers ? "workers" : "threads", workers, options->accept_threads, options->tls ? "yes" : "no",
+          n_clients, n_clients * per_client, n_samples,
+          n_samples ? n_samples * 1e9 / (last_end - first_start) : 0.0,
+          n_samples ? percentile (samples, n_samples, 50) / 1000.0 : 0,
+          n_samples ? percentile (samples, n_samples, 99) / 1000.0 : 0);
+  fflush (stdout);
+
+  bench_stop (&bench);
+  free (samples);
+  free (pids);
+}
+
+static void
+run_relay (const Options *options)
+{
+  Options copy = *options;
+  Options splice = *options;
+
+  copy.tls = splice.tls = false;
+  copy.splice = false;
+  splice.splice = true;
+
+  if (strstr (options->modes, "threads"))
+    {
+      bench_relay (&copy, 0);
+      bench_relay (&splice, 0);
+    }
+  if (strstr (options->modes, "workers"))
+    {
+      bench_relay (&copy, options->workers);
+      bench_relay (&splice, options->workers);
+    }
+}
+
+static void
+run_accept (const Options *options)
+{
+  char *clients = strdupx (options->clients);
+  char *saveptr = NULL;
+  Options main_thread = *options;
+  Options threads = *options;
+
+  /* compare with accepting on the main thread */
+  main_thread.accept_threads = 0;
+  if (threads.accept_threads == 0)
+    threads.accept_threads = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+
+  for (char *count = strtok_r (clients, ",", &saveptr); count; count = strtok_r (NULL, ",", &saveptr))
+    {
+      unsigned n = strtoul (count, NULL, 10);
+
+      if (n < 1)
+        errx (EXIT_FAILURE, "Invalid number of clients: %s", count);
+
+      raise_fd_limit (3 * n + 1024);
+
+      if (strstr (options->modes, "threads"))
+        {
+          bench_accept (&main_thread, 0, n);
+          bench_accept (&threads, 0, n);
+        }
+      if (strstr (options->modes, "workers"))
+        {
+          bench_accept (&main_thread, options->workers, n);
+          bench_accept (&threads, options->workers, n);
+        }
+    }
+
+  free (clients);
+}
+
+static void
+run_throughput (const Options *options)
+{
+  if (strstr (options->modes, "threads"))
+    bench_throughput (options, 0);
+  if (strstr (options->modes, "workers"))
+    bench_throughput (options, options->workers);
+}
+
+static void
+run_handshakes (const Options *options)
+{
+  if (strstr (options->modes, "threads"))
+    {
+      bench_handshakes (options, 0, false);
+      bench_handshakes (options, 0, true);
+    }
+  if (strstr (options->modes, "workers"))
+    {
+      bench_handshakes (options, options->workers, false);
+      bench_handshakes (options, options->workers, true);
+    }
+}
+
+static void
+run_connections (const Options *options)
+{
+  char *counts = strdupx (options->counts);
+  char *saveptr = NULL;
+
+  for (char *count = strtok_r (counts, ",", &saveptr); count; count = strtok_r (NULL, ",", &saveptr))
+    {
+      unsigned n = strtoul (count, NULL, 10);
+
+      /* client, server and ws side of each connection, plus some slack */
+      raise_fd_limit (3 * n + 1024);
+
+      if (strstr (options->modes, "threads"))
+        bench_connections (options, 0, n);
+      if (strstr (options->modes, "workers"))
+        bench_connections (options, options->workers, n);
+    }
+
+  free (counts);
+}
+
+/***********************************
+ *
+ * Command line
+ *
+ ***********************************/
+
+#define OPT_TLS 1000
+#define OPT_WORKERS 1001
+#define OPT_SAMPLES 1002
+#define OPT_COUNTS 1003
+#define OPT_MODES 1004
+#define OPT_PRIORITY 1005
+#define OPT_SESSION_CACHE 1006
+#define OPT_SIZE 1007
+#define OPT_SPLICE 1008
+#define OPT_ACCEPT_THREADS 1009
+#define OPT_CLIENTS 1010
+
+static struct argp_option options[] = {
+  {"tls", OPT_TLS, 0, 0, "Connect with TLS instead of plain HTTP" },
+  {"workers", OPT_WORKERS, "N", 0, "Number of workers for the event-driven mode (default: number of CPUs)" },
+  {"samples", OPT_SAMPLES, "N", 0, "Number of latency samples, handshakes, or downloads (default: 2000)" },
+  {"counts", OPT_COUNTS, "N,...", 0, "Connection counts to measure (default: 100,1000,10000)" },
+  {"modes", OPT_MODES, "MODE,...", 0, "Server modes to measure: threads, workers (default: both)" },
+  {"priority", OPT_PRIORITY, "STRING", 0, "gnutls priority string for the client (default: system default)" },
+  {"session-cache", OPT_SESSION_CACHE, "ENTRIES", 0, "Size of the server's TLS session cache (default: 0, disabled)" },
+  {"size", OPT_SIZE, "MIB", 0, "Size of each transfer in the throughput and relay benchmarks (default: 256)" },
+  {"splice", OPT_SPLICE, 0, 0, "Run the server with --splice" },
+  {"accept-threads", OPT_ACCEPT_THREADS, "N", 0, "Run the server with --accept-threads=N (default: 0; for the accept benchmark: number of CPUs)" },
+  {"clients", OPT_CLIENTS, "N,...", 0, "Numbers of concurrent client processes for the accept benchmark (default: 1,8,32)" },
+  { 0 }
+};
+
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state)
+{
+  Options *opts = state->input;
+
+  switch (key)
+    {
+      case OPT_TLS:
+        opts->tls = true;
+        break;
+      case OPT_WORKERS:
+        opts->workers = atoi (arg);
+        if (opts->workers < 1)
+          argp_error (state, "Invalid number of workers: %s", arg);
+        break;
+      case OPT_SAMPLES:
+        opts->samples = atoi (arg);
+        if (opts->samples < 1)
+          argp_error (state, "Invalid number of samples: %s", arg);
+        break;
+      case OPT_COUNTS:
+        opts->counts = arg;
+        break;
+      case OPT_MODES:
+        opts->modes = arg;
+        break;
+      case OPT_PRIORITY:
+        opts->priority = arg;
+        break;
+      case OPT_SESSION_CACHE:
+        opts->session_cache = atoi (arg);
+        break;
+      case OPT_SPLICE:
+        opts->splice = true;
+        break;
+      case OPT_ACCEPT_THREADS:
+        opts->accept_threads = atoi (arg);
+        if (opts->accept_threads < 1)
+          argp_error (state, "Invalid number of accept threads: %s", arg);
+        break;
+      case OPT_CLIENTS:
+        opts->clients = arg;
+        break;
+      case OPT_SIZE:
+        opts->size = atoi (arg);
+        if (opts->size < 1)
+          argp_error (state, "Invalid download size: %s", arg);
+        break;
+      case ARGP_KEY_ARG:
+        if (state->arg_num > 0)
+          argp_usage (state);
+        if (strcmp (arg, "connections") != 0 && strcmp (arg, "handshakes") != 0 &&
+            strcmp (arg, "throughput") != 0 && strcmp (arg, "relay") != 0 &&
+            strcmp (arg, "accept") != 0)
+          argp_error (state, "Unknown benchmark: %s", arg);
+        opts->benchmark = arg;
+        break;
+      case ARGP_KEY_END:
+        if (state->arg_num < 1)
+          argp_usage (state);
+        break;
+      default:
+        return ARGP_ERR_UNKNOWN;
+    }
+  return 0;
+}
+
+static const struct argp argp = {
+  .options = options,
+  .parser = parse_opt,
+  .args_doc = "BENCHMARK",
+  .doc = "bench-tls -- performance measurements for cockpit-tls\v"
+         "Benchmarks:\n"
+         "  connections   memory, threads and latency with many idle connections\n"
+         "  handshakes    TLS handshake rate, with and without session resumption (implies --tls)\n"
+         "  throughput    download speed and server CPU usage for large responses; use --samples=5 or so\n"
+         "  relay         plain HTTP bulk upload/download, copying vs. splice(); use --samples=5 or so\n"
+         "  accept        connection rate and connect-to-reply latency, with and without accept threads",
+};
+
+int
+main (int argc, char **argv)
+{
+  Options opts = {
+    .workers = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1),
+    .samples = 2000,
+    .counts = "100,1000,10000",
+    .modes = "threads,workers",
+    .size = 256,
+    .clients = "1,8,32",
+  };
+
+  argp_parse (&argp, argc, argv, 0, 0, &opts);
+
+  signal (SIGPIPE, SIG_IGN);
+
+  if (strcmp (opts.benchmark, "handshakes") == 0)
+    {
+      opts.tls = true;
+      run_handshakes (&opts);
+    }
+  else if (strcmp (opts.benchmark, "throughput") == 0)
+    run_throughput (&opts);
+  else if (strcmp (opts.benchmark, "relay") == 0)
+    run_relay (&opts);
+  else if (strcmp (opts.benchmark, "accept") == 0)
+    run_accept (&opts);
+  else
+    run_connections (&opts);
+
+  return 0;
+}
@@ -0,0 +1,299 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Memory for the relay buffers of all connections.
+ *
+ * Buffers only hold on to memory while they contain data, so they come and
+ * go all the time; this keeps a limited number of free slabs of each size
+ * around for reuse, and hands back the rest to malloc.
+ *
+ * The long-lived threads of the worker pool first reuse the slabs which
+ * they freed themselves, without any locking; only what doesn't fit into
+ * their own cache goes to the shared free lists.  A thread's cache goes to
+ * the shared lists when it exits.  All other threads serve a single
+ * connection, and might sit idle for hours, so they don't keep anything
+ * for themselves.
+ */
+
+#include "config.h"
+
+#include "buffer-pool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "common/cockpitmemory.h"
+
+#include "utils.h"
+
+/* 4 KiB … 16 MiB */
+#define N_SIZE_CLASSES 13
+static_assert (BUFFER_POOL_MIN_SIZE << (N_SIZE_CLASSES - 1) == BUFFER_POOL_MAX_SIZE, "size classes");
+
+typedef struct _FreeSlab FreeSlab;
+struct _FreeSlab {
+  FreeSlab *next;
+};
+
+typedef struct {
+  FreeSlab *free[N_SIZE_CLASSES];
+  size_t cached;
+  bool enabled;
+  bool registered;
+} ThreadCache;
+
+static _Thread_local ThreadCache thread_cache;
+
+static struct {
+  pthread_mutex_t mutex;
+  FreeSlab *free[N_SIZE_CLASSES]; /* protected by mutex */
+  size_t shared_cached; /* protected by mutex */
+
+  pthread_once_t key_once;
+  pthread_key_t key;
+
+  /* statistics, including the thread caches */
+  atomic_size_t in_use;
+  atomic_size_t cached;
+  atomic_uint largest;
+} pool = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .key_once = PTHREAD_ONCE_INIT,
+};
+
+static unsigned
+size_class (unsigned size)
+{
+  unsigned class = 0;
+
+  assert (size >= BUFFER_POOL_MIN_SIZE && size <= BUFFER_POOL_MAX_SIZE);
+  assert ((size & (size - 1)) == 0);
+
+  while ((BUFFER_POOL_MIN_SIZE << class) < size)
+    class++;
+
+  return class;
+}
+
+/* keep a free slab in the shared lists, if there is room */
+static void
+shared_put (FreeSlab *slab,
+            unsigned  class)
+{
+  unsigned size = BUFFER_POOL_MIN_SIZE << class;
+
+  pthread_mutex_lock (&pool.mutex);
+
+  if (pool.shared_cached + size <= BUFFER_POOL_MAX_CACHED)
+    {
+      slab->next = pool.free[class];
+      pool.free[class] = slab;
+      pool.shared_cached += size;
+      slab = NULL;
+    }
+
+  pthread_mutex_unlock (&pool.mutex);
+
+  if (slab)
+    {
+      atomic_fetch_sub_explicit (&pool.cached, size, memory_order_relaxed);
+      free (slab);
+    }
+}
+
+static void
+thread_cache_flush (void *data)
+{
+  ThreadCache *cache = data;
+
+  for (unsigned i = 0; i < N_SIZE_CLASSES; i++)
+    {
+      while (cache->free[i])
+        {
+          FreeSlab *slab = cache->free[i];
+          cache->free[i] = slab->next;
+          shared_put (slab, i);
+        }
+    }
+
+  cache->cached = 0;
+  cache->registered = false;
+}
+
+static void
+create_key (void)
+{
+  int r = pthread_key_create (&pool.key, thread_cache_flush);
+  assert (r == 0);
+}
+
+/* make sure that the cache gets flushed when the thread exits */
+static void
+thread_cache_register (ThreadCache *cache)
+{
+  if (cache->registered)
+    return;
+
+  pthread_once (&pool.key_once, create_key);
+  int r = pthread_setspecific (pool.key, cache);
+  assert (r == 0);
+  cache->registered = true;
+}
+
+/**
+ * buffer_pool_enable_thread_cache: Keep freed slabs for the calling thread
+ *
+ * Only for threads which live as long as the process and serve many
+ * connections, like the ones of the worker pool.
+ */
+void
+buffer_pool_enable_thread_cache (void)
+{
+  thread_cache.enabled = true;
+}
+
+/**
+ * buffer_pool_get: Get a slab of memory
+ *
+ * @size: a power of two between BUFFER_POOL_MIN_SIZE and BUFFER_POOL_MAX_SIZE
+ */
+void *
+buffer_pool_get (unsigned size)
+{
+  unsigned class = size_class (size);
+  ThreadCache *cache = &thread_cache;
+  FreeSlab *slab;
+
+  slab = cache->free[class];
+  if (slab)
+    {
+      cache->free[class] = slab->next;
+      cache->cached -= size;
+    }
+  else
+    {
+      pthread_mutex_lock (&pool.mutex);
+
+      slab = pool.free[class];
+      if (slab)
+        {
+          pool.free[class] = slab->next;
+          pool.shared_cached -= size;
+        }
+
+      pthread_mutex_unlock (&pool.mutex);
+    }
+
+  if (slab)
+    atomic_fetch_sub_explicit (&pool.cached, size, memory_order_relaxed);
+  atomic_fetch_add_explicit (&pool.in_use, size, memory_order_relaxed);
+
+  unsigned largest = atomic_load_explicit (&pool.largest, memory_order_relaxed);
+  while (size > largest &&
+         !atomic_compare_exchange_weak_explicit (&pool.largest, &largest, size,
+                                                 memory_order_relaxed, memory_order_relaxed))
+    ;
+
+  if (slab == NULL)
+    {
+      debug (BUFFER, "buffer_pool_get: allocating new slab of %u bytes", size);
+      slab = mallocx (size);
+    }
+
+  return slab;
+}
+
+/**
+ * buffer_pool_put: Return a slab from buffer_pool_get()
+ */
+void
+buffer_pool_put (void     *slab,
+                 unsigned  size)
+{
+  unsigned class = size_class (size);
+  ThreadCache *cache = &thread_cache;
+  FreeSlab *free_slab = slab;
+
+  size_t in_use = atomic_fetch_sub_explicit (&pool.in_use, size, memory_order_relaxed);
+  assert (in_use >= size);
+  atomic_fetch_add_explicit (&pool.cached, size, memory_order_relaxed);
+
+  if (cache->enabled && cache->cached + size <= BUFFER_POOL_THREAD_MAX_CACHED)
+    {
+      thread_cache_register (cache);
+      free_slab->next = cache->free[class];
+      cache->free[class] = free_slab;
+      cache->cached += size;
+    }
+  else
+    {
+      shared_put (free_slab, class);
+    }
+}
+
+/**
+ * buffer_pool_get_stats: Memory usage of the pool
+ *
+ * @in_use: total size of the slabs which are currently in use
+ * @cached: total size of the free slabs kept for reuse, by all threads
+ * @largest: size of the largest slab that was ever handed out
+ */
+void
+buffer_pool_get_stats (size_t   *in_use,
+                       size_t   *cached,
+                       unsigned *largest)
+{
+  *in_use = atomic_load_explicit (&pool.in_use, memory_order_relaxed);
+  *cached = atomic_load_explicit (&pool.cached, memory_order_relaxed);
+  *largest = atomic_load_explicit (&pool.largest, memory_order_relaxed);
+}
+
+/**
+ * buffer_pool_cleanup: Free all cached slabs
+ *
+ * Call this after all other threads which used the pool exited.
+ */
+void
+buffer_pool_cleanup (void)
+{
+  thread_cache_flush (&thread_cache);
+
+  pthread_mutex_lock (&pool.mutex);
+
+  for (unsigned i = 0; i < N_SIZE_CLASSES; i++)
+    {
+      while (pool.free[i])
+        {
+          FreeSlab *slab = pool.free[i];
+          pool.free[i] = slab->next;
+          free (slab);
+        }
+    }
+
+  pool.shared_cached = 0;
+
+  pthread_mutex_unlock (&pool.mutex);
+
+  atomic_store_explicit (&pool.cached, 0, memory_order_relaxed);
+  atomic_store_explicit (&pool.largest, 0, memory_order_relaxed);
+}
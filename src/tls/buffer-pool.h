@@ -0,0 +1,50 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* the smallest slab; all slab sizes are powers of two */
+#define BUFFER_POOL_MIN_SIZE (4u << 10)
+#define BUFFER_POOL_MAX_SIZE (16u << 20)
+
+/* total size of the free slabs which we keep in the shared lists */
+#define BUFFER_POOL_MAX_CACHED (4u << 20)
+
+/* total size of the free slabs which each worker pool thread keeps for itself */
+#define BUFFER_POOL_THREAD_MAX_CACHED (512u << 10)
+
+void
+buffer_pool_enable_thread_cache (void);
+
+void *
+buffer_pool_get (unsigned size);
+
+void
+buffer_pool_put (void     *slab,
+                 unsigned  size);
+
+void
+buffer_pool_get_stats (size_t   *in_use,
+                       size_t   *cached,
+                       unsigned *largest);
+
+void
+buffer_pool_cleanup (void);
@@ -35,6 +35,10 @@
  * required information for authentication, but it's not sufficient:
  * the cgroup of the wsinstance must also match the one found in the
  * client certificate file.
+ *
+ * All concurrent connections with the same client certificate share one
+ * file: the first connection writes it, the others take a reference,
+ * and the last one to close removes it.
  */
 
 #include "config.h"
@@ -49,11 +53,29 @@
 #include <err.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/random.h>
 #include <unistd.h>
 
+/* A client certificate file which is in use by some connections */
+typedef struct _CertFile CertFile;
+struct _CertFile {
+  CertFile *next;
+  unsigned char digest[256 / 8]; /* SHA256 of the DER certificate */
+  char *wsinstance;
+  char *filename;
+  unsigned ref_count;
+};
+
+/* There are rarely more than a handful of different client certificates
+ * connected at the same time, so a list is fine. */
+static struct {
+  pthread_mutex_t mutex;
+  CertFile *files;
+} cert_files = { .mutex = PTHREAD_MUTEX_INITIALIZER };
 
 /**
  * client_certificate_verify: Custom client certificate validation function
@@ -101,33 +123,31 @@ client_certificate_verify (gnutls_session_t session)
 }
 
 /**
- * client_certificate_get_wsinstance:
+ * client_certificate_get_digest:
  * @certificate: the certificate presented by the peer
+ * @digest: return location for the SHA256 of @certificate
  *
- * Determines the correct cockpit-ws instance for handling connections
- * for this @certificate (must be non-%NULL).
+ * The digest identifies the certificate in the file cache, and its hex
+ * form is the cockpit-ws instance for handling connections for this
+ * @certificate (must be non-%NULL).
  *
- * Currently, the full SHA256 fingerprint of the peer certificate is
- * used.  This is a pure design decision that nothing else depends on,
- * and it could be changed to something else.
+ * Using the full SHA256 fingerprint of the peer certificate as instance
+ * is a pure design decision that nothing else depends on, and it could
+ * be changed to something else.
  *
  * This function never fails.  Any internal failure will abort the
  * program.
- *
- * The return value of this function needs to be free()d.
  */
-static char *
-client_certificate_get_wsinstance (const gnutls_datum_t *certificate)
+static void
+client_certificate_get_digest (const gnutls_datum_t *certificate,
+                               unsigned char         digest[256 / 8])
 {
-  unsigned char digest_data[256 / 8];
-  size_t digest_size = sizeof digest_data;
-  int r = gnutls_fingerprint (GNUTLS_DIG_SHA256, certificate, digest_data, &digest_size);
+  size_t digest_size = 256 / 8;
+  int r = gnutls_fingerprint (GNUTLS_DIG_SHA256, certificate, digest, &digest_size);
   if (r != GNUTLS_E_SUCCESS)
     errx (EXIT_FAILURE, "Could not generate fingerprint of peer certificate: %s",
           gnutls_strerror (r));
-  assert (digest_size == sizeof digest_data);
-
-  return cockpit_hex_encode (digest_data, digest_size);
+  assert (digest_size == 256 / 8);
 }
 
 /**
@@ -301,16 +321,18 @@ client_certificate_create_tmpfile (int  dirfd,
  * If a client certificate was presented, the @out_wsinstance will
  * correspond to the SHA256 of the peer certificate.  In this case, a
  * file with a random filename will be written to the directory
- * referenced by @dirfd.  This file will contain the expected cgroup of
- * the cockpit-ws instance in question, plus the client certificate.
- * That data is interpreted by the counterpart to this code, living in
- * src/session/client-certificate.c.
+ * referenced by @dirfd, unless another connection with the same
+ * certificate already did that.  This file will contain the expected
+ * cgroup of the cockpit-ws instance in question, plus the client
+ * certificate.  That data is interpreted by the counterpart to this
+ * code, living in src/session/client-certificate.c.
  *
  * In any case, %true will be returned in case of success, and %false
  * will be returned in case of an error.  In case of success, any values
- * returned in @out_wsinstance or @out_filename need to be free()d.  In
- * case of error, the connection should be terminated: a message will
- * already have been logged.
+ * returned in @out_wsinstance need to be free()d, and @out_filename
+ * must be given to client_certificate_release().  In case of error, the
+ * connection should be terminated: a message will already have been
+ * logged.
  */
 bool
 client_certificate_accept (gnutls_session_t   session,
@@ -328,44 +350,99 @@ client_certificate_accept (gnutls_session_t   session,
       return true;
     }
 
-  char *wsinstance = client_certificate_get_wsinstance (peer_certificate);
+  unsigned char digest[256 / 8];
+  CertFile *file;
 
-  int fd = -1;
-  bool success =
-    client_certificate_create_tmpfile (dirfd, &fd) &&
-    client_certificate_write_cgroup_header (fd, wsinstance) &&
-    client_certificate_write_pem (fd, peer_certificate) &&
-    client_certificate_link_fd_to_random_name (dirfd, fd, out_filename);
+  client_certificate_get_digest (peer_certificate, digest);
 
-  if (fd != -1)
-    close (fd);
+  /* Hold the lock while writing a new file, so that parallel connections
+   * with the same certificate wait for it instead of writing their own. */
+  pthread_mutex_lock (&cert_files.mutex);
 
-  if (success)
-    *out_wsinstance = wsinstance;
-  else
-    free (wsinstance);
+  for (file = cert_files.files; file; file = file->next)
+    if (memcmp (file->digest, digest, sizeof digest) == 0)
+      break;
+
+  if (file == NULL)
+    {
+      char *wsinstance = cockpit_hex_encode (digest, sizeof digest);
+      char *filename = NULL;
+      int fd = -1;
+
+      bool success =
+        client_certificate_create_tmpfile (dirfd, &fd) &&
+        client_certificate_write_cgroup_header (fd, wsinstance) &&
+        client_certificate_write_pem (fd, peer_certificate) &&
+        client_certificate_link_fd_to_random_name (dirfd, fd, &filename);
 
-  if (!success)
-    warnx ("Disconnecting client due to above failure.");
+      if (fd != -1)
+        close (fd);
 
-  return success;
+      if (!success)
+        {
+          pthread_mutex_unlock (&cert_files.mutex);
+          free (wsinstance);
+          warnx ("Disconnecting client due to above failure.");
+          return false;
+        }
+
+      file = callocx (1, sizeof (CertFile));
+      memcpy (file->digest, digest, sizeof digest);
+      file->wsinstance = wsinstance;
+      file->filename = filename;
+      file->next = cert_files.files;
+      cert_files.files = file;
+    }
+
+  file->ref_count++;
+  *out_wsinstance = strdupx (file->wsinstance);
+  *out_filename = strdupx (file->filename);
+
+  pthread_mutex_unlock (&cert_files.mutex);
+
+  return true;
 }
 
 /**
- * client_certificate_unlink_and_free:
+ * client_certificate_release:
  * @dirfd: the directory for session-scoped client certificates
- * @inout_filename: the name of the client certificate file
+ * @filename: the name of the client certificate file
  *
- * Glorified wrapper around unlinkat().
+ * Drops the reference of a connection to the file returned by
+ * client_certificate_accept(), and unlinks the file when this was the
+ * last connection using it.
  *
- * Frees @inout_filename.
+ * Frees @filename.
  *
- * If the operation fails, the program will be aborted.
+ * If unlinking fails, the program will be aborted.
  */
 void
-client_certificate_unlink_and_free (int   dirfd,
-                                    char *filename)
+client_certificate_release (int   dirfd,
+                            char *filename)
 {
+  CertFile **link;
+  CertFile *file;
+
+  pthread_mutex_lock (&cert_files.mutex);
+
+  for (link = &cert_files.files; *link; link = &(*link)->next)
+    if (strcmp ((*link)->filename, filename) == 0)
+      break;
+  file = *link;
+  assert (file != NULL);
+  assert (file->ref_count > 0);
+
+  if (--file->ref_count > 0)
+    {
+      pthread_mutex_unlock (&cert_files.mutex);
+      free (filename);
+      return;
+    }
+
+  *link = file->next;
+
+  /* still under the lock, so that a new connection cannot see the entry
+   * after the file is gone */
   if (unlinkat (dirfd, filename, 0) != 0)
     {
       /* We can't leave stale certificate files hanging around after
@@ -377,5 +454,21 @@ client_certificate_unlink_and_free (int   dirfd,
       err (EXIT_FAILURE, "Failed to unlink client certificate file %s", filename);
     }
 
+  pthread_mutex_unlock (&cert_files.mutex);
+
+  free (file->wsinstance);
+  free (file->filename);
+  free (file);
   free (filename);
 }
+
+/**
+ * client_certificate_cleanup: Check that all certificate files were released
+ *
+ * For unit tests and valgrind.
+ */
+void
+client_certificate_cleanup (void)
+{
+  assert (cert_files.files == NULL);
+}
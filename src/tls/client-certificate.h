@@ -32,5 +32,8 @@ client_certificate_accept (gnutls_session_t   session,
                            char             **out_filename);
 
 void
-client_certificate_unlink_and_free (int   dirfd,
-                                    char *filename);
+client_certificate_release (int   dirfd,
+                            char *filename);
+
+void
+client_certificate_cleanup (void);
@@ -26,10 +26,13 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,21 +43,29 @@
 #include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+#include <gnutls/socket.h>
+#endif
 
 #include <common/cockpitfdpassing.h>
 #include <common/cockpitjsonprint.h>
 #include <common/cockpitmemory.h>
 #include <common/cockpitwebcertificate.h>
 
+#include "buffer-pool.h"
 #include "certificate.h"
 #include "client-certificate.h"
 #include "httpredirect.h"
+#include "metrics.h"
+#include "session-cache.h"
 #include "socket-io.h"
 #include "utils.h"
+#include "wsinstance.h"
 
 /* cockpit-tls TCP server state (singleton) */
 static struct {
@@ -63,27 +74,73 @@ static struct {
   bool require_https;
   int wsinstance_sockdir;
   int cert_session_dir;
+  SessionCache *session_cache;
+  bool splice;
+  unsigned max_buffer_size;
+  unsigned setup_timeout;
 } parameters = {
   .wsinstance_sockdir = -1,
-  .cert_session_dir = -1
+  .cert_session_dir = -1,
+  .max_buffer_size = CONNECTION_DEFAULT_MAX_BUFFER_SIZE,
+  .setup_timeout = CONNECTION_DEFAULT_SETUP_TIMEOUT,
+};
+
+/* Session ticket encryption key; regenerated every SESSION_TICKET_KEY_LIFETIME.
+ * Tickets encrypted with the previous key fall back to a full handshake. */
+#define SESSION_TICKET_KEY_LIFETIME (12 * 60 * 60 * 1000) /* ms */
+
+static struct {
+  pthread_mutex_t mutex;
+  gnutls_datum_t key;
+  uint64_t created;
+} session_ticket = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER
 };
 
+/* full handshakes vs. resumed sessions (tickets or session cache) */
+static atomic_ulong n_handshakes_full;
+static atomic_ulong n_handshakes_resumed;
+
+/* A ring buffer, which starts small, and grows while the reader keeps
+ * filling it up, up to parameters.max_buffer_size.  It only holds on to its
+ * memory while it contains data, so idle connections cost nothing but their
+ * state.  The size is halved for the next allocation if the buffer never got
+ * full, so it adapts back down when the traffic gets lighter. */
 typedef struct
 {
-  char buffer[16u << 10]; /* 16KiB */
+  char *data; /* from buffer_pool_get(), or %NULL if empty */
+  unsigned size; /* power of 2; size of data, or of the next allocation */
+  bool filled; /* got full since data was allocated */
   unsigned start, end;
+  unsigned long transferred; /* written out since the last metrics_relayed() */
   bool eof, shut_rd, shut_wr;
+  /* with splice, the data is kept in this pipe instead of buffer[] */
+  int pipe[2];
+  unsigned pipe_size;
 #ifdef DEBUG
   const char *name;
 #endif
 } Buffer;
 
+typedef enum {
+  CONNECTION_STATE_FIRST_BYTE,
+  CONNECTION_STATE_HANDSHAKE,
+  CONNECTION_STATE_ACTIVATING, /* waiting for connection_activate() */
+  CONNECTION_STATE_RELAY,
+  CONNECTION_STATE_CLOSED,
+} ConnectionState;
+
 /* a single TCP connection between the client (browser) and cockpit-tls */
-typedef struct {
+struct _Connection {
   int client_fd;
   int ws_fd;
 
+  ConnectionState state;
+  uint64_t deadline; /* CLOCK_MONOTONIC milliseconds, during setup */
+  uint64_t handshake_start; /* CLOCK_MONOTONIC microseconds */
+
   gnutls_session_t tls;
+  bool ktls_recv, ktls_send; /* kernel does the record crypto on client_fd */
 
   Buffer client_to_ws_buffer;
   Buffer ws_to_client_buffer;
@@ -91,19 +148,49 @@ typedef struct {
   char *client_cert_filename;
   char *wsinstance;
   int metadata_fd;
-} Connection;
 
-#define BUFFER_SIZE (sizeof ((Buffer *) 0)->buffer)
-#define BUFFER_MASK (BUFFER_SIZE - 1)
+  /* what ws_fd is connected to, for the metrics; -1 if not yet */
+  int ws_kind;
+  WsInstance *ws_instance;
+};
+
+static_assert ((typeof (((Buffer *) 0)->start)) BUFFER_POOL_MAX_SIZE, "buffer is too big");
+
+
+static uint64_t
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
 
-static_assert (!(BUFFER_SIZE & BUFFER_MASK), "buffer size not a power of 2");
-static_assert ((typeof (((Buffer *) 0)->start)) BUFFER_SIZE, "buffer is too big");
+static inline bool
+buffer_spliced (Buffer *self)
+{
+  return self->pipe[0] != -1;
+}
 
+static inline unsigned
+buffer_capacity (Buffer *self)
+{
+  return buffer_spliced (self) ? self->pipe_size : self->size;
+}
 
 static inline bool
 buffer_full (Buffer *self)
 {
-  return self->end - self->start == BUFFER_SIZE;
+  return self->end - self->start == buffer_capacity (self);
 }
 
 static inline bool
@@ -170,7 +257,7 @@ buffer_epipe (Buffer *self)
 static inline bool
 buffer_valid (Buffer *self)
 {
-  return self->end - self->start <= BUFFER_SIZE;
+  return self->end - self->start <= buffer_capacity (self);
 }
 
 static short
@@ -191,20 +278,21 @@ static int
 get_iovecs (struct iovec *iov,
             int           iov_length,
             char         *buffer,
+            unsigned      size,
             unsigned      start,
             unsigned      end)
 {
   int i = 0;
 
-  debug (IOVEC, "  get_iovecs (%p, %i, %p, 0x%x, 0x%x)", iov, iov_length, buffer, start, end);
-  assert (end - start <= BUFFER_SIZE);
+  debug (IOVEC, "  get_iovecs (%p, %i, %p, 0x%x, 0x%x, 0x%x)", iov, iov_length, buffer, size, start, end);
+  assert (end - start <= size);
 
   for (i = 0; i < iov_length && start != end; i++)
     {
-      unsigned start_offset = start & BUFFER_MASK;
+      unsigned start_offset = start & (size - 1);
 
       iov[i].iov_base = &buffer[start_offset];
-      iov[i].iov_len = MIN(BUFFER_SIZE - start_offset, end - start);
+      iov[i].iov_len = MIN(size - start_offset, end - start);
       start += iov[i].iov_len;
 
       debug (IOVEC, "    iov[%i] = { 0x%zx, 0x%zx };  start = 0x%x;", i,
@@ -216,18 +304,73 @@ get_iovecs (struct iovec *iov,
   return i;
 }
 
+/* before reading: make sure that there is memory to read into */
 static void
-buffer_write_to_fd (Buffer *self,
-                    int     fd,
-                    int    *fd_to_send)
+buffer_alloc (Buffer *self)
+{
+  if (self->data == NULL)
+    self->data = buffer_pool_get (self->size);
+}
+
+/* after reading: grow the buffer if the reader filled it up */
+static void
+buffer_grow (Buffer *self)
 {
   struct iovec iov[2];
-  ssize_t s;
+  unsigned len = 0;
 
-  debug (BUFFER, "buffer_write_to_fd (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
+  if (!buffer_full (self))
+    return;
+
+  self->filled = true;
+
+  if (self->size >= parameters.max_buffer_size)
+    return;
+
+  unsigned size = self->size * 2;
+  char *data = buffer_pool_get (size);
+  int iovcnt = get_iovecs (iov, 2, self->data, self->size, self->start, self->end);
+
+  for (int i = 0; i < iovcnt; i++)
+    {
+      memcpy (data + len, iov[i].iov_base, iov[i].iov_len);
+      len += iov[i].iov_len;
+    }
+
+  debug (BUFFER, "buffer_grow (%s): 0x%x -> 0x%x", self->name, self->size, size);
+
+  buffer_pool_put (self->data, self->size);
+  self->data = data;
+  self->size = size;
+  self->start = 0;
+  self->end = len;
+}
+
+/* after reading or writing: give back the memory if the buffer is empty */
+static void
+buffer_release (Buffer *self)
+{
+  if (self->data == NULL || !buffer_empty (self))
+    return;
+
+  buffer_pool_put (self->data, self->size);
+  self->data = NULL;
+
+  if (!self->filled && self->size > BUFFER_POOL_MIN_SIZE)
+    self->size /= 2;
+  self->filled = false;
+}
+
+static void
+buffer_sendmsg (Buffer *self,
+                int     fd,
+                int    *fd_to_send)
+{
+  struct iovec iov[2];
+  ssize_t s;
 
   struct msghdr msg = { .msg_iov = iov };
-  msg.msg_iovlen = get_iovecs (iov, 2, self->buffer, self->start, self->end);
+  msg.msg_iovlen = get_iovecs (iov, 2, self->data, self->size, self->start, self->end);
 
   if (msg.msg_iovlen)
     {
@@ -255,8 +398,21 @@ buffer_write_to_fd (Buffer *self,
             buffer_epipe (self);
         }
       else
-        self->start += s;
+        {
+          self->start += s;
+          self->transferred += s;
+        }
     }
+}
+
+static void
+buffer_write_to_fd (Buffer *self,
+                    int     fd,
+                    int    *fd_to_send)
+{
+  debug (BUFFER, "buffer_write_to_fd (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
+
+  buffer_sendmsg (self, fd, fd_to_send);
 
   if (buffer_needs_shut_wr (self))
     {
@@ -264,6 +420,7 @@ buffer_write_to_fd (Buffer *self,
       buffer_shut_wr (self);
     }
 
+  buffer_release (self);
   assert (buffer_valid (self));
 }
 
@@ -282,7 +439,8 @@ buffer_read_from_fd (Buffer *self,
 
   struct iovec iov[2];
   ssize_t s;
-  int iovcnt = get_iovecs (iov, 2, self->buffer, self->end, self->start + BUFFER_SIZE);
+  buffer_alloc (self);
+  int iovcnt = get_iovecs (iov, 2, self->data, self->size, self->end, self->start + self->size);
   assert (iovcnt > 0);
 
   do
@@ -299,8 +457,12 @@ buffer_read_from_fd (Buffer *self,
   else if (s == 0)
     buffer_eof (self);
   else
-    self->end += s;
+    {
+      self->end += s;
+      buffer_grow (self);
+    }
 
+  buffer_release (self);
   assert (buffer_valid (self));
 }
 
@@ -313,7 +475,7 @@ buffer_write_to_tls (Buffer           *self,
 
   debug (BUFFER, "buffer_write_to_tls (%s/0x%x/0x%x, %p)", self->name, self->start, self->end, tls);
 
-  if (get_iovecs (&iov, 1, self->buffer, self->start, self->end))
+  if (get_iovecs (&iov, 1, self->data, self->size, self->start, self->end))
     {
       do
         s = gnutls_record_send (tls, iov.iov_base, iov.iov_len);
@@ -327,7 +489,10 @@ buffer_write_to_tls (Buffer           *self,
             buffer_epipe (self);
         }
       else
-        self->start += s;
+        {
+          self->start += s;
+          self->transferred += s;
+        }
     }
 
   if (buffer_needs_shut_wr (self))
@@ -336,6 +501,7 @@ buffer_write_to_tls (Buffer           *self,
       buffer_shut_wr (self);
     }
 
+  buffer_release (self);
   assert (buffer_valid (self));
 }
 
@@ -358,7 +524,8 @@ buffer_read_from_tls (Buffer           *self,
       return;
     }
 
-  int iovcnt = get_iovecs (&iov, 1, self->buffer, self->end, self->start + BUFFER_SIZE);
+  buffer_alloc (self);
+  int iovcnt = get_iovecs (&iov, 1, self->data, self->size, self->end, self->start + self->size);
   assert (iovcnt == 1);
 
   do
@@ -373,93 +540,203 @@ buffer_read_from_tls (Buffer           *self,
         buffer_epipe (self);
     }
   else
-    self->end += s;
+    {
+      self->end += s;
+      buffer_grow (self);
+    }
 
+  buffer_release (self);
   assert (buffer_valid (self));
 }
 
-static bool
-request_dynamic_wsinstance (const char *fingerprint)
+/* With kTLS, the kernel encrypts plain writes to the socket; gnutls is only
+ * needed for the close_notify alert. */
+static void
+buffer_write_to_ktls (Buffer           *self,
+                      gnutls_session_t  tls)
 {
-  bool status = false;
-  char reply[20];
-  int fd;
+  debug (BUFFER, "buffer_write_to_ktls (%s/0x%x/0x%x, %p)", self->name, self->start, self->end, tls);
 
-  debug (CONNECTION, "requesting dynamic wsinstance for %s:\n", fingerprint);
+  buffer_sendmsg (self, gnutls_transport_get_int (tls), NULL);
 
-  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-  if (fd == -1)
+  if (buffer_needs_shut_wr (self))
     {
-      warn ("socket() failed");
-      goto out;
+      gnutls_bye (tls, GNUTLS_SHUT_WR);
+      buffer_shut_wr (self);
     }
 
-  debug (CONNECTION, "  -> connecting to https-factory.sock");
-  if (af_unix_connectat (fd, parameters.wsinstance_sockdir, "https-factory.sock") != 0)
+  buffer_release (self);
+  assert (buffer_valid (self));
+}
+
+/* With kTLS, the kernel decrypts application data records for plain reads.
+ * Any other record (alerts, post-handshake messages) makes read() fail with
+ * EIO, and needs to be handled by gnutls instead. */
+static void
+buffer_read_from_ktls (Buffer           *self,
+                       gnutls_session_t  tls)
+{
+  int fd = gnutls_transport_get_int (tls);
+
+  debug (BUFFER, "buffer_read_from_ktls (%s/0x%x/0x%x, %p)", self->name, self->start, self->end, tls);
+
+  if (buffer_needs_shut_rd (self))
     {
-      warn ("connect(https-factory.sock) failed");
-      goto out;
+      shutdown (fd, SHUT_RD);
+      buffer_shut_rd (self);
+      return;
     }
 
-  /* send the fingerprint */
-  debug (CONNECTION, "  -> success; sending fingerprint...");
-  if (!send_all (fd, fingerprint, strlen (fingerprint), 5 * 1000000))
-    goto out;
+  struct iovec iov[2];
+  ssize_t s;
+  buffer_alloc (self);
+  int iovcnt = get_iovecs (iov, 2, self->data, self->size, self->end, self->start + self->size);
+  assert (iovcnt > 0);
+
+  do
+    s = readv (fd, iov, iovcnt);
+  while (s == -1 && errno == EINTR);
+
+  debug (BUFFER, "  readv returns %zi %s", s, (s == -1) ? strerror (errno) : "");
+
+  if (s == -1 && errno == EIO)
+    buffer_read_from_tls (self, tls);
+  else if (s == -1)
+    {
+      if (errno != EAGAIN)
+        buffer_epipe (self);
+    }
+  else if (s == 0)
+    buffer_epipe (self);
+  else
+    {
+      self->end += s;
+      buffer_grow (self);
+    }
 
-  debug (CONNECTION, "  -> success; waiting for reply...");
+  buffer_release (self);
+  assert (buffer_valid (self));
+}
 
-  /* wait for the systemd job status reply */
-  if (!recv_alnum (fd, reply, sizeof reply, 30 * 1000000))
-    goto out;
+/**
+ * buffer_start_splice: Keep the data in a pipe from now on
+ *
+ * The buffer must be empty.  Afterwards, use buffer_splice_in() and
+ * buffer_splice_out() instead of the read/write functions, which moves the
+ * data from one socket to the other without copying it to userspace.
+ *
+ * Returns: %false if the pipe could not be created; the buffer keeps
+ * working as before then.
+ */
+static bool
+buffer_start_splice (Buffer *self)
+{
+  assert (buffer_empty (self));
+  assert (!buffer_spliced (self));
+  assert (self->data == NULL);
 
-  debug (CONNECTION, "  -> got reply '%s'...", reply);
-  status = strcmp (reply, "done") == 0;
+  if (pipe2 (self->pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+      debug (BUFFER, "buffer_start_splice (%s): pipe2 failed: %m; copying instead", self->name);
+      self->pipe[0] = self->pipe[1] = -1;
+      return false;
+    }
 
-out:
-  debug (CONNECTION, "  -> %s.", status ? "success" : "fail");
+  int size = fcntl (self->pipe[1], F_GETPIPE_SZ);
+  self->pipe_size = size > 0 ? size : 4096;
 
-  if (fd != -1)
-    close (fd);
+  debug (BUFFER, "buffer_start_splice (%s): pipe size %u", self->name, self->pipe_size);
 
-  return status;
+  return true;
 }
 
-static bool
-connection_connect_to_dynamic_wsinstance (Connection *self)
+static void
+buffer_splice_in (Buffer *self,
+                  int     fd)
 {
-  char sockname[80];
-  int r;
+  ssize_t s;
 
-  assert (self->tls != NULL);
+  debug (BUFFER, "buffer_splice_in (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
+
+  if (buffer_needs_shut_rd (self))
+    {
+      shutdown (fd, SHUT_RD);
+      buffer_shut_rd (self);
+      return;
+    }
+
+  do
+    s = splice (fd, NULL, self->pipe[1], NULL, buffer_capacity (self) - (self->end - self->start),
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  while (s == -1 && errno == EINTR);
 
-  r = snprintf (sockname, sizeof sockname, "https@%s.sock", self->wsinstance);
-  assert (0 < r && r < sizeof sockname);
+  debug (BUFFER, "  splice returns %zi %s", s, (s == -1) ? strerror (errno) : "");
 
-  debug (CONNECTION, "Connecting to dynamic https instance %s...", sockname);
+  if (s == -1)
+    {
+      if (errno != EAGAIN)
+        buffer_eof (self);
+    }
+  else if (s == 0)
+    buffer_eof (self);
+  else
+    self->end += s;
 
-  /* fast path: the socket already exists, so we can just connect to it */
-  if (af_unix_connectat (self->ws_fd, parameters.wsinstance_sockdir, sockname) == 0)
-    return true;
+  assert (buffer_valid (self));
+}
 
-  if (errno != ENOENT && errno != ECONNREFUSED)
-    warn ("connect(%s) failed on the first attempt", sockname);
+/* @tls: if not %NULL, @fd uses kTLS for sending, and needs a close_notify alert */
+static void
+buffer_splice_out (Buffer           *self,
+                   int               fd,
+                   gnutls_session_t  tls)
+{
+  ssize_t s;
 
-  debug (CONNECTION, "  -> failed (%m).  Requesting activation.");
-  /* otherwise, ask for the instance to be started */
-  if (!request_dynamic_wsinstance (self->wsinstance))
-    return false;
+  debug (BUFFER, "buffer_splice_out (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
 
-  /* ... and try one more time. */
-  debug (CONNECTION, "  -> trying again");
-  if (af_unix_connectat (self->ws_fd, parameters.wsinstance_sockdir, sockname) != 0)
+  if (!buffer_empty (self))
     {
-      warn ("connect(%s) failed on the second attempt", sockname);
-      return false;
+      do
+        s = splice (self->pipe[0], NULL, fd, NULL, self->end - self->start,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      while (s == -1 && errno == EINTR);
+
+      debug (BUFFER, "  splice returns %zi %s", s, (s == -1) ? strerror (errno) : "");
+
+      if (s == -1)
+        {
+          if (errno != EAGAIN)
+            buffer_epipe (self);
+        }
+      else
+        {
+          self->start += s;
+          self->transferred += s;
+        }
     }
 
-  /* otherwise, we're now connected */
-  debug (CONNECTION, "  -> success!");
-  return true;
+  if (buffer_needs_shut_wr (self))
+    {
+      if (tls)
+        gnutls_bye (tls, GNUTLS_SHUT_WR);
+      else
+        shutdown (fd, SHUT_WR);
+      buffer_shut_wr (self);
+    }
+
+  assert (buffer_valid (self));
+}
+
+/* This only connects if the instance is already running, so it doesn't
+ * block; otherwise the connection needs connection_activate(). */
+static bool
+connection_connect_to_dynamic_wsinstance (Connection *self)
+{
+  assert (self->tls != NULL);
+
+  return wsinstance_connect_live (self->ws_fd, parameters.wsinstance_sockdir, self->wsinstance,
+                                  &self->ws_instance);
 }
 
 static bool
@@ -504,7 +781,8 @@ connection_is_to_localhost (Connection *self)
 }
 
 static bool
-connection_connect_to_wsinstance (Connection *self)
+connection_connect_to_wsinstance_kind (Connection    *self,
+                                       MetricsWsKind *kind)
 {
   if (self->tls == NULL && parameters.require_https && !connection_is_to_localhost (self))
     {
@@ -516,6 +794,7 @@ connection_connect_to_wsinstance (Connection *self)
           return false;
         }
 
+      *kind = METRICS_WS_HTTP_REDIRECT;
       return true;
     }
 
@@ -535,308 +814,797 @@ connection_connect_to_wsinstance (Connection *self)
           return false;
         }
 
+      *kind = METRICS_WS_HTTP;
       return true;
     }
-  else
-    return connection_connect_to_dynamic_wsinstance (self);
+
+  *kind = METRICS_WS_HTTPS;
+  return connection_connect_to_dynamic_wsinstance (self);
 }
 
-/**
- * connection_handshake: Handle first event on client fd
- *
- * Check the very first byte of a new connection to tell apart TLS from plain
- * HTTP. Initialize TLS.
- */
-static bool
-connection_handshake (Connection *self)
+static void
+connection_set_ws_kind (Connection    *self,
+                        MetricsWsKind  kind)
 {
-  char b;
-  int ret;
-
-  assert (self->ws_fd == -1);
-
-  /* Wait for up to 30 seconds to receive the first byte before shutting
-   * down the connection.
-   */
-  struct pollfd pfd = { .fd = self->client_fd, .events = POLLIN };
-  do
-    ret = poll (&pfd, 1, 30000); /* timeout is wrong on syscall restart, but it's fine */
-  while (ret == -1 && errno == EINTR);
-
-  if (ret < 0)
-    err (EXIT_FAILURE, "poll() failed on client connection");
-
-  if (ret == 0)
-    {
-      debug (CONNECTION, "client sent no data in 30 seconds, dropping connection.");
-      return false;
-    }
-
-  /* peek the first byte and see if it's a TLS connection (starting with 22).
-     We can assume that there is some data to read, as this is called in response
-     to an epoll event. */
-  ret = recv (self->client_fd, &b, 1, MSG_PEEK);
+  metrics_ws_connections_add (kind, 1);
+  self->ws_kind = kind;
+}
 
-  if (ret < 0)
+static bool
+connection_create_metadata (Connection *self)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrsize = sizeof addr;
+  if (getpeername (self->client_fd, (struct sockaddr *) &addr, &addrsize))
     {
-      debug (CONNECTION, "could not read first byte: %s", strerror (errno));
+      debug (CONNECTION, "getpeername(%i) failed: %m.  Disconnecting.", self->client_fd);
       return false;
     }
 
-  if (ret == 0) /* EOF */
-    {
-      debug (CONNECTION, "client disconnected without sending any data");
-      return false;
-    }
+  /* maximum we're going to see */
+  char ip[INET6_ADDRSTRLEN + 1 + IF_NAMESIZE + 1];
+  in_port_t port;
 
-  if (b == 22)
+  switch (addr.ss_family)
     {
-      debug (CONNECTION, "first byte is %i, initializing TLS", (int) b);
+    case AF_INET:
+      {
+        struct sockaddr_in *in_addr = (struct sockaddr_in *) &addr;
 
-      if (parameters.certificate == NULL)
-        {
-          warnx ("got TLS connection, but our server does not have a certificate/key; refusing");
-          return false;
-        }
+        port = in_addr->sin_port;
+        const char *r = inet_ntop (AF_INET, &in_addr->sin_addr, ip, sizeof ip);
+        assert (r != NULL);
+      }
+      break;
 
-      ret = gnutls_init (&self->tls, GNUTLS_SERVER | GNUTLS_NO_SIGNAL);
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_init failed: %s", gnutls_strerror (ret));
-          return false;
-        }
+    case AF_INET6:
+      {
+        struct sockaddr_in6 *in6_addr = (struct sockaddr_in6 *) &addr;
 
-      ret = gnutls_set_default_priority (self->tls);
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_set_default_priority failed: %s", gnutls_strerror (ret));
-          return false;
-        }
+        port = in6_addr->sin6_port;
+        const char *r = inet_ntop (AF_INET6, &in6_addr->sin6_addr, ip, sizeof ip);
+        assert (r != NULL);
 
-      ret = gnutls_credentials_set (self->tls, GNUTLS_CRD_CERTIFICATE,
-                                    certificate_get_credentials (parameters.certificate));
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_credentials_set failed: %s", gnutls_strerror (ret));
-          return false;
-        }
+        if (in6_addr->sin6_scope_id)
+          {
+            size_t iplen = strlen (ip);
 
-      gnutls_session_set_verify_function (self->tls, client_certificate_verify);
-      gnutls_certificate_server_set_request (self->tls, parameters.request_mode);
-      gnutls_handshake_set_timeout (self->tls, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
-      gnutls_transport_set_int (self->tls, self->client_fd);
+            ip[iplen++] = '%';
 
-      debug (CONNECTION, "TLS is initialised; doing handshake");
+            assert (IF_NAMESIZE < sizeof ip - iplen);
+            if (!if_indextoname (in6_addr->sin6_scope_id, ip + iplen))
+              {
+                /* fallback: just write the index */
+                int r = snprintf (ip + iplen, IF_NAMESIZE, "%u", in6_addr->sin6_scope_id);
+                assert (r < IF_NAMESIZE);
+              }
 
-      do
-        ret = gnutls_handshake (self->tls);
-      while (ret == GNUTLS_E_INTERRUPTED);
+            /* both snprintf() and if_indextoname() will have added a nul. */
+          }
+      }
+      break;
 
-      if (ret != GNUTLS_E_SUCCESS)
+    case AF_UNIX:
+      /* only used in testing */
+      ip[0] = '\0';
+      port = 0;
+      break;
+
+    default:
+      debug (CONNECTION, "Connection fd %i had unknown peer address family %d.  Disconnecting.",
+             self->client_fd, (int) addr.ss_family);
+      return false;
+    }
+
+  debug (CONNECTION, "Connection fd %i is from %s:%d", self->client_fd, ip, port);
+
+  FILE *stream = cockpit_json_print_open_memfd ("cockpit-tls metadata", 1);
+
+  cockpit_json_print_string_property (stream, "origin-ip", ip, -1);
+  cockpit_json_print_integer_property (stream, "origin-port", port);
+
+  if (self->client_cert_filename)
+    cockpit_json_print_string_property (stream, "client-certificate", self->client_cert_filename, -1);
+
+  self->metadata_fd = cockpit_json_print_finish_memfd (&stream);
+
+  return true;
+}
+
+static void
+connection_close (Connection *self)
+{
+  self->state = CONNECTION_STATE_CLOSED;
+}
+
+/**
+ * connection_start_relay: Start relaying once ws_fd is connected
+ */
+static void
+connection_start_relay (Connection *self)
+{
+  self->state = CONNECTION_STATE_RELAY;
+
+  /* With kTLS, the kernel can encrypt spliced data as well; but decrypting
+   * needs gnutls for non-data records, so the other direction always copies. */
+  if (parameters.splice)
+    {
+      /* splice() only honours O_NONBLOCK for some socket types */
+      int flags = fcntl (self->ws_fd, F_GETFL);
+      if (flags == -1 || fcntl (self->ws_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        err (EXIT_FAILURE, "failed to make ws fd %i non-blocking", self->ws_fd);
+
+      if (!self->tls || self->ktls_send)
+        buffer_start_splice (&self->ws_to_client_buffer);
+    }
+}
+
+/**
+ * connection_setup_finish: Set up the connection after the handshake
+ *
+ * Exports the client certificate, prepares the metadata and connects to the
+ * appropriate cockpit-ws instance.  If that is a dynamic instance which
+ * isn't running yet, the connection waits for connection_activate().
+ */
+static void
+connection_setup_finish (Connection *self)
+{
+  if (self->tls && !client_certificate_accept (self->tls, parameters.cert_session_dir,
+                                               &self->wsinstance, &self->client_cert_filename))
+    {
+      connection_close (self);
+      return;
+    }
+
+  if (!connection_create_metadata (self))
+    {
+      connection_close (self);
+      return;
+    }
+
+  MetricsWsKind kind = -1;
+  if (!connection_connect_to_wsinstance_kind (self, &kind))
+    {
+      /* the dynamic instance needs to be started first, which blocks */
+      if (kind == METRICS_WS_HTTPS && self->ws_fd != -1)
         {
-          warnx ("gnutls_handshake failed: %s", gnutls_strerror (ret));
-          return false;
+          debug (CONNECTION, "client fd %i: waiting for wsinstance activation", self->client_fd);
+          self->state = CONNECTION_STATE_ACTIVATING;
         }
+      else
+        connection_close (self);
+      return;
+    }
+
+  connection_set_ws_kind (self, kind);
+  connection_start_relay (self);
+}
+
+/**
+ * connection_handshake_step: Continue the TLS handshake
+ *
+ * The client fd is non-blocking, so this returns as soon as gnutls needs to
+ * wait for the client; connection_get_events() then asks for the direction
+ * that gnutls is waiting for.
+ */
+static void
+connection_handshake_step (Connection *self)
+{
+  int ret;
+
+  do
+    ret = gnutls_handshake (self->tls);
+  while (ret == GNUTLS_E_INTERRUPTED);
+
+  if (ret == GNUTLS_E_AGAIN)
+    {
+      debug (CONNECTION, "TLS handshake on fd %i waiting for %s", self->client_fd,
+             gnutls_record_get_direction (self->tls) ? "write" : "read");
+      return;
+    }
 
-      debug (CONNECTION, "TLS handshake completed");
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_handshake failed: %s", gnutls_strerror (ret));
+      metrics_handshake_finished (now_us () - self->handshake_start, false);
+      connection_close (self);
+      return;
+    }
+
+  metrics_handshake_finished (now_us () - self->handshake_start, true);
 
-      if (!client_certificate_accept (self->tls, parameters.cert_session_dir,
-                                      &self->wsinstance, &self->client_cert_filename))
-        return false;
+  if (gnutls_session_is_resumed (self->tls))
+    atomic_fetch_add (&n_handshakes_resumed, 1);
+  else
+    atomic_fetch_add (&n_handshakes_full, 1);
+
+  debug (CONNECTION, "TLS handshake completed (%s)",
+         gnutls_session_is_resumed (self->tls) ? "resumed" : "full");
+
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+  /* This needs "ktls = true" in the gnutls system configuration, and the
+   * kernel "tls" module.  Otherwise gnutls does the record crypto itself. */
+  gnutls_transport_ktls_enable_flags_t ktls = gnutls_transport_is_ktls_enabled (self->tls);
+  self->ktls_recv = (ktls & GNUTLS_KTLS_RECV) != 0;
+  self->ktls_send = (ktls & GNUTLS_KTLS_SEND) != 0;
+#endif
+
+  debug (CONNECTION, "client fd %i: receiving via %s, sending via %s", self->client_fd,
+         self->ktls_recv ? "kTLS" : "gnutls", self->ktls_send ? "kTLS" : "gnutls");
+
+  connection_setup_finish (self);
+}
+
+/**
+ * connection_enable_session_ticket: Enable session tickets for a new session
+ *
+ * The ticket key is shared by all connections, and replaced once it is
+ * older than SESSION_TICKET_KEY_LIFETIME.  gnutls copies the key, so
+ * existing sessions are unaffected by the rotation.
+ */
+static bool
+connection_enable_session_ticket (Connection *self)
+{
+  uint64_t now = now_ms ();
+  int ret;
+
+  pthread_mutex_lock (&session_ticket.mutex);
+
+  if (session_ticket.key.data == NULL || now - session_ticket.created >= SESSION_TICKET_KEY_LIFETIME)
+    {
+      debug (CONNECTION, "generating new session ticket key");
+
+      gnutls_free (session_ticket.key.data);
+      ret = gnutls_session_ticket_key_generate (&session_ticket.key);
+      if (ret != GNUTLS_E_SUCCESS)
+        errx (EXIT_FAILURE, "gnutls_session_ticket_key_generate failed: %s", gnutls_strerror (ret));
+      session_ticket.created = now;
+    }
+
+  ret = gnutls_session_ticket_enable_server (self->tls, &session_ticket.key);
+
+  pthread_mutex_unlock (&session_ticket.mutex);
+
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_session_ticket_enable_server failed: %s", gnutls_strerror (ret));
+      return false;
     }
 
   return true;
 }
 
-static void
-connection_thread_loop (Connection *self)
+static bool
+connection_tls_init (Connection *self)
 {
-  while (buffer_alive (&self->client_to_ws_buffer) || buffer_alive (&self->ws_to_client_buffer))
+  int ret;
+
+  if (parameters.certificate == NULL)
     {
-      short client_events, ws_events;
-      short client_revents, ws_revents;
-      int n_ready;
+      warnx ("got TLS connection, but our server does not have a certificate/key; refusing");
+      return false;
+    }
 
-      client_events = calculate_events (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
-      ws_events = calculate_events (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
-      client_revents = calculate_revents (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
-      ws_revents = calculate_revents (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
+  ret = gnutls_init (&self->tls, GNUTLS_SERVER | GNUTLS_NO_SIGNAL | GNUTLS_NONBLOCK);
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_init failed: %s", gnutls_strerror (ret));
+      return false;
+    }
 
-      if (self->tls && buffer_can_read (&self->client_to_ws_buffer))
-        client_revents |= POLLIN * gnutls_record_check_pending (self->tls);
+  ret = gnutls_set_default_priority (self->tls);
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_set_default_priority failed: %s", gnutls_strerror (ret));
+      return false;
+    }
 
-      debug (POLL, "poll | client %d/x%x/x%x | ws %d/x%x/x%x |",
-             self->client_fd, client_events, client_revents,
-             self->ws_fd, ws_events, ws_revents);
+  ret = gnutls_credentials_set (self->tls, GNUTLS_CRD_CERTIFICATE,
+                                certificate_get_credentials (parameters.certificate));
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_credentials_set failed: %s", gnutls_strerror (ret));
+      return false;
+    }
 
-      do
-        {
-          /* don't poll for no events, we'd spin in a POLLHUP loop otherwise */
-          struct pollfd fds[] = { { client_events ? self->client_fd : -1, client_events },
-                                  { ws_events ? self->ws_fd : -1, ws_events }};
+  if (!connection_enable_session_ticket (self))
+    return false;
 
-          n_ready = poll (fds, N_ELEMENTS (fds), (client_revents | ws_revents) ? 0 : -1);
+  if (parameters.session_cache)
+    session_cache_attach (parameters.session_cache, self->tls);
 
-          client_revents |= fds[0].revents;
-          ws_revents |= fds[1].revents;
-        }
-      while (n_ready == -1 && errno == EINTR);
+  gnutls_session_set_verify_function (self->tls, client_certificate_verify);
+  gnutls_certificate_server_set_request (self->tls, parameters.request_mode);
+  gnutls_handshake_set_timeout (self->tls, parameters.setup_timeout);
+  gnutls_transport_set_int (self->tls, self->client_fd);
 
-      if (n_ready == -1)
+  return true;
+}
+
+/**
+ * connection_first_byte: Handle first event on client fd
+ *
+ * Check the very first byte of a new connection to tell apart TLS from plain
+ * HTTP. Initialize TLS and start the handshake.
+ */
+static void
+connection_first_byte (Connection *self)
+{
+  char b;
+  int ret;
+
+  assert (self->ws_fd == -1);
+
+  /* peek the first byte and see if it's a TLS connection (starting with 22).
+     We can assume that there is some data to read, as this is called in response
+     to a poll event. */
+  do
+    ret = recv (self->client_fd, &b, 1, MSG_PEEK);
+  while (ret == -1 && errno == EINTR);
+
+  if (ret < 0)
+    {
+      if (errno == EAGAIN)
+        return;
+
+      debug (CONNECTION, "could not read first byte: %s", strerror (errno));
+      connection_close (self);
+      return;
+    }
+
+  if (ret == 0) /* EOF */
+    {
+      debug (CONNECTION, "client disconnected without sending any data");
+      connection_close (self);
+      return;
+    }
+
+  if (b == 22)
+    {
+      debug (CONNECTION, "first byte is %i, initializing TLS", (int) b);
+
+      if (!connection_tls_init (self))
         {
-          if (errno == EINVAL) /* ran out of fds */
-            return;
-          err (EXIT_FAILURE, "poll failed");
+          connection_close (self);
+          return;
         }
 
-      debug (POLL, "poll result %i | client %d/x%x | ws %d/x%x |", n_ready,
-             self->client_fd, client_revents, self->ws_fd, ws_revents);
+      debug (CONNECTION, "TLS is initialised; doing handshake");
+
+      self->state = CONNECTION_STATE_HANDSHAKE;
+      self->deadline = now_ms () + parameters.setup_timeout;
+      self->handshake_start = now_us ();
+      connection_handshake_step (self);
+    }
+  else
+    connection_setup_finish (self);
+}
+
+/**
+ * connection_check_deadline: Drop connections which take too long to set up
+ *
+ * Clients get the setup timeout (30 seconds by default) to send the first
+ * byte, and then the same again to finish the handshake.  Until then, a
+ * connection only costs its (small) state, no thread.
+ */
+static void
+connection_check_deadline (Connection *self)
+{
+  if (self->state >= CONNECTION_STATE_ACTIVATING || now_ms () < self->deadline)
+    return;
+
+  if (self->state == CONNECTION_STATE_FIRST_BYTE)
+    debug (CONNECTION, "client sent no data in %u ms, dropping connection.", parameters.setup_timeout);
+  else
+    {
+      warnx ("TLS handshake timed out, dropping connection");
+      metrics_handshake_finished (now_us () - self->handshake_start, false);
+    }
 
-      if (self->tls)
+  connection_close (self);
+}
+
+/**
+ * connection_get_events: Calculate what a connection is waiting for
+ *
+ * @client_events, @ws_events: the poll() events to wait for on the client
+ *   and ws fds; 0 means that the fd should not be polled at all
+ * @client_revents, @ws_revents: events which can be dispatched right away,
+ *   without waiting for the fds (pending shutdowns and buffered TLS data)
+ *
+ * During setup, this only waits for the client; see
+ * connection_get_timeout() for how long.
+ *
+ * Returns: false if the connection is finished and should be freed.
+ */
+bool
+connection_get_events (Connection *self,
+                       short      *client_events,
+                       short      *ws_events,
+                       short      *client_revents,
+                       short      *ws_revents)
+{
+  connection_check_deadline (self);
+
+  switch (self->state)
+    {
+    case CONNECTION_STATE_FIRST_BYTE:
+    case CONNECTION_STATE_HANDSHAKE:
+      if (self->state == CONNECTION_STATE_HANDSHAKE && gnutls_record_get_direction (self->tls))
+        *client_events = POLLOUT;
+      else
+        *client_events = POLLIN;
+      *ws_events = *client_revents = *ws_revents = 0;
+      return true;
+
+    case CONNECTION_STATE_ACTIVATING:
+      /* nothing to wait for; see connection_needs_activation() */
+      *client_events = *ws_events = *client_revents = *ws_revents = 0;
+      return true;
+
+    case CONNECTION_STATE_RELAY:
+      break;
+
+    case CONNECTION_STATE_CLOSED:
+      return false;
+    }
+
+  if (!buffer_alive (&self->client_to_ws_buffer) && !buffer_alive (&self->ws_to_client_buffer))
+    return false;
+
+  *client_events = calculate_events (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
+  *ws_events = calculate_events (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
+  *client_revents = calculate_revents (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
+  *ws_revents = calculate_revents (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
+
+  /* gnutls_record_check_pending() returns a byte count, not a boolean */
+  if (self->tls && buffer_can_read (&self->client_to_ws_buffer) && gnutls_record_check_pending (self->tls) > 0)
+    *client_revents |= POLLIN;
+
+  return true;
+}
+
+/**
+ * connection_get_timeout: Time until the connection setup times out
+ *
+ * Returns: the number of milliseconds until the deadline of the first byte
+ * or TLS handshake, 0 if it has already passed, or -1 if the connection is
+ * set up (or waiting for the wsinstance activation, which has its own
+ * timeouts).
+ */
+int
+connection_get_timeout (Connection *self)
+{
+  uint64_t now;
+
+  if (self->state >= CONNECTION_STATE_ACTIVATING)
+    return -1;
+
+  now = now_ms ();
+  if (self->deadline <= now)
+    return 0;
+  return self->deadline - now > INT_MAX ? INT_MAX : (int) (self->deadline - now);
+}
+
+/**
+ * connection_dispatch: Advance the connection according to the given poll() results
+ */
+void
+connection_dispatch (Connection *self,
+                     short       client_revents,
+                     short       ws_revents)
+{
+  switch (self->state)
+    {
+    case CONNECTION_STATE_FIRST_BYTE:
+      if (client_revents)
+        connection_first_byte (self);
+      return;
+
+    case CONNECTION_STATE_HANDSHAKE:
+      if (client_revents)
+        connection_handshake_step (self);
+      return;
+
+    case CONNECTION_STATE_ACTIVATING:
+      return;
+
+    case CONNECTION_STATE_RELAY:
+      break;
+
+    case CONNECTION_STATE_CLOSED:
+      return;
+    }
+
+  if (self->tls)
+    {
+      if (client_revents & POLLIN)
         {
-          if (client_revents & POLLIN)
+          if (buffer_spliced (&self->client_to_ws_buffer))
+            buffer_splice_in (&self->client_to_ws_buffer, self->client_fd);
+          else if (self->ktls_recv)
+            buffer_read_from_ktls (&self->client_to_ws_buffer, self->tls);
+          else
             buffer_read_from_tls (&self->client_to_ws_buffer, self->tls);
+        }
 
-          if (client_revents & POLLOUT)
+      if (client_revents & POLLOUT)
+        {
+          if (buffer_spliced (&self->ws_to_client_buffer))
+            buffer_splice_out (&self->ws_to_client_buffer, self->client_fd, self->tls);
+          else if (self->ktls_send)
+            buffer_write_to_ktls (&self->ws_to_client_buffer, self->tls);
+          else
             buffer_write_to_tls (&self->ws_to_client_buffer, self->tls);
         }
-      else
+    }
+  else
+    {
+      if (client_revents & POLLIN)
         {
-          if (client_revents & POLLIN)
+          if (buffer_spliced (&self->client_to_ws_buffer))
+            buffer_splice_in (&self->client_to_ws_buffer, self->client_fd);
+          else
             buffer_read_from_fd (&self->client_to_ws_buffer, self->client_fd);
+        }
 
-          if (client_revents & POLLOUT)
+      if (client_revents & POLLOUT)
+        {
+          if (buffer_spliced (&self->ws_to_client_buffer))
+            buffer_splice_out (&self->ws_to_client_buffer, self->client_fd, NULL);
+          else
             buffer_write_to_fd (&self->ws_to_client_buffer, self->client_fd, NULL);
         }
+    }
 
-      if (ws_revents & POLLIN)
+  if (ws_revents & POLLIN)
+    {
+      if (buffer_spliced (&self->ws_to_client_buffer))
+        buffer_splice_in (&self->ws_to_client_buffer, self->ws_fd);
+      else
         buffer_read_from_fd (&self->ws_to_client_buffer, self->ws_fd);
+    }
 
-      if (ws_revents & POLLOUT)
+  if (ws_revents & POLLOUT)
+    {
+      if (buffer_spliced (&self->client_to_ws_buffer))
+        buffer_splice_out (&self->client_to_ws_buffer, self->ws_fd, NULL);
+      else
         buffer_write_to_fd (&self->client_to_ws_buffer, self->ws_fd, &self->metadata_fd);
     }
+
+  /* The first data towards the ws instance carries the metadata fd, which
+   * needs sendmsg(); switch to splice once that is done. */
+  if (parameters.splice && !self->tls && self->metadata_fd == -1 &&
+      !buffer_spliced (&self->client_to_ws_buffer) && buffer_empty (&self->client_to_ws_buffer))
+    buffer_start_splice (&self->client_to_ws_buffer);
+
+  metrics_relayed (self->client_to_ws_buffer.transferred, self->ws_to_client_buffer.transferred);
+  self->client_to_ws_buffer.transferred = 0;
+  self->ws_to_client_buffer.transferred = 0;
 }
 
-static bool
-connection_create_metadata (Connection *self)
+/**
+ * connection_needs_activation: Check whether the connection waits for its wsinstance
+ *
+ * The dynamic cockpit-ws instance for the client certificate isn't running
+ * yet; connection_activate() needs to start it.  Until then, the connection
+ * has no events to wait for.
+ */
+bool
+connection_needs_activation (Connection *self)
 {
-  struct sockaddr_storage addr;
-  socklen_t addrsize = sizeof addr;
-  if (getpeername (self->client_fd, (struct sockaddr *) &addr, &addrsize))
+  return self->state == CONNECTION_STATE_ACTIVATING;
+}
+
+/**
+ * connection_get_wsinstance: The fingerprint of the dynamic wsinstance
+ *
+ * Only valid once the handshake finished; connections with the same
+ * fingerprint go to the same instance.
+ */
+const char *
+connection_get_wsinstance (Connection *self)
+{
+  return self->wsinstance;
+}
+
+/**
+ * connection_activate: Start the wsinstance and connect to it
+ *
+ * This blocks until the instance is activated, which can take many seconds,
+ * so worker threads hand the connection to a separate thread for it.
+ * Afterwards, the connection carries on with connection_get_events() as
+ * usual, closed if the activation failed.
+ *
+ * Returns: false if the activation failed
+ */
+bool
+connection_activate (Connection *self)
+{
+  assert (self->state == CONNECTION_STATE_ACTIVATING);
+
+  if (!wsinstance_connect (self->ws_fd, parameters.wsinstance_sockdir, self->wsinstance,
+                           &self->ws_instance))
     {
-      debug (CONNECTION, "getpeername(%i) failed: %m.  Disconnecting.", self->client_fd);
+      connection_close (self);
       return false;
     }
 
-  /* maximum we're going to see */
-  char ip[INET6_ADDRSTRLEN + 1 + IF_NAMESIZE + 1];
-  in_port_t port;
+  connection_set_ws_kind (self, METRICS_WS_HTTPS);
+  connection_start_relay (self);
+  return true;
+}
 
-  switch (addr.ss_family)
-    {
-    case AF_INET:
-      {
-        struct sockaddr_in *in_addr = (struct sockaddr_in *) &addr;
+/**
+ * connection_abandon_activation: Close a connection which waits for activation
+ *
+ * For when activating the same wsinstance failed for another connection
+ * while this one was waiting for it, just like connection_activate() would
+ * fail for the waiters of a coalesced activation.
+ */
+void
+connection_abandon_activation (Connection *self)
+{
+  assert (self->state == CONNECTION_STATE_ACTIVATING);
 
-        port = in_addr->sin_port;
-        const char *r = inet_ntop (AF_INET, &in_addr->sin_addr, ip, sizeof ip);
-        assert (r != NULL);
-      }
-      break;
+  debug (CONNECTION, "client fd %i: wsinstance activation failed", self->client_fd);
+  connection_close (self);
+}
 
-    case AF_INET6:
-      {
-        struct sockaddr_in6 *in6_addr = (struct sockaddr_in6 *) &addr;
+static void
+connection_thread_loop (Connection *self)
+{
+  short client_events, ws_events;
+  short client_revents, ws_revents;
 
-        port = in6_addr->sin6_port;
-        const char *r = inet_ntop (AF_INET6, &in6_addr->sin6_addr, ip, sizeof ip);
-        assert (r != NULL);
+  while (connection_get_events (self, &client_events, &ws_events, &client_revents, &ws_revents))
+    {
+      int n_ready;
 
-        if (in6_addr->sin6_scope_id)
-          {
-            size_t iplen = strlen (ip);
+      /* this thread belongs to the connection, so it can just block */
+      if (connection_needs_activation (self))
+        {
+          connection_activate (self);
+          continue;
+        }
 
-            ip[iplen++] = '%';
+      debug (POLL, "poll | client %d/x%x/x%x | ws %d/x%x/x%x |",
+             self->client_fd, client_events, client_revents,
+             self->ws_fd, ws_events, ws_revents);
 
-            assert (IF_NAMESIZE < sizeof ip - iplen);
-            if (!if_indextoname (in6_addr->sin6_scope_id, ip + iplen))
-              {
-                /* fallback: just write the index */
-                int r = snprintf (ip + iplen, IF_NAMESIZE, "%u", in6_addr->sin6_scope_id);
-                assert (r < IF_NAMESIZE);
-              }
+      do
+        {
+          /* don't poll for no events, we'd spin in a POLLHUP loop otherwise */
+          struct pollfd fds[] = { { client_events ? self->client_fd : -1, client_events },
+                                  { ws_events ? self->ws_fd : -1, ws_events }};
 
-            /* both snprintf() and if_indextoname() will have added a nul. */
-          }
-      }
-      break;
+          n_ready = poll (fds, N_ELEMENTS (fds),
+                          (client_revents | ws_revents) ? 0 : connection_get_timeout (self));
 
-    case AF_UNIX:
-      /* only used in testing */
-      ip[0] = '\0';
-      port = 0;
-      break;
+          client_revents |= fds[0].revents;
+          ws_revents |= fds[1].revents;
+        }
+      while (n_ready == -1 && errno == EINTR);
 
-    default:
-      debug (CONNECTION, "Connection fd %i had unknown peer address family %d.  Disconnecting.",
-             self->client_fd, (int) addr.ss_family);
-      return false;
+      if (n_ready == -1)
+        {
+          if (errno == EINVAL) /* ran out of fds */
+            return;
+          err (EXIT_FAILURE, "poll failed");
+        }
+
+      debug (POLL, "poll result %i | client %d/x%x | ws %d/x%x |", n_ready,
+             self->client_fd, client_revents, self->ws_fd, ws_revents);
+
+      connection_dispatch (self, client_revents, ws_revents);
     }
+}
 
-  debug (CONNECTION, "Connection fd %i is from %s:%d", self->client_fd, ip, port);
+/**
+ * connection_new: Create the state for a newly accepted client connection
+ *
+ * @fd: the accepted client fd; the connection takes ownership of it
+ */
+Connection *
+connection_new (int fd)
+{
+  Connection *self = mallocx (sizeof (Connection));
 
-  FILE *stream = cockpit_json_print_open_memfd ("cockpit-tls metadata", 1);
+  *self = (Connection) { .client_fd = fd, .ws_fd = -1, .metadata_fd = -1, .ws_kind = -1,
+                        .state = CONNECTION_STATE_FIRST_BYTE, .deadline = now_ms () + parameters.setup_timeout,
+                        .client_to_ws_buffer = { .size = BUFFER_POOL_MIN_SIZE, .pipe = { -1, -1 } },
+                        .ws_to_client_buffer = { .size = BUFFER_POOL_MIN_SIZE, .pipe = { -1, -1 } } };
 
-  cockpit_json_print_string_property (stream, "origin-ip", ip, -1);
-  cockpit_json_print_integer_property (stream, "origin-port", port);
+  /* everything, including the TLS handshake, is driven by poll events */
+  int flags = fcntl (fd, F_GETFL);
+  if (flags == -1 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    err (EXIT_FAILURE, "failed to make client fd %i non-blocking", fd);
 
-  if (self->client_cert_filename)
-    cockpit_json_print_string_property (stream, "client-certificate", self->client_cert_filename, -1);
+  /* The TLS handshake and the relay do many small writes; don't let Nagle
+   * delay them until the peer's delayed ACK.  This is best-effort. */
+  int one = 1;
+  (void) setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
 
-  self->metadata_fd = cockpit_json_print_finish_memfd (&stream);
+  assert (!buffer_can_write (&self->client_to_ws_buffer));
+  assert (!buffer_can_write (&self->ws_to_client_buffer));
+  assert (!self->tls);
 
-  return true;
+#ifdef DEBUG
+  self->client_to_ws_buffer.name = "client-to-ws";
+  self->ws_to_client_buffer.name = "ws-to-client";
+#endif
+
+  metrics_connection_opened ();
+
+  return self;
+}
+
+int
+connection_get_client_fd (Connection *self)
+{
+  return self->client_fd;
+}
+
+int
+connection_get_ws_fd (Connection *self)
+{
+  return self->ws_fd;
 }
 
 void
-connection_thread_main (int fd)
+connection_free (Connection *self)
 {
-  Connection self = { .client_fd = fd, .ws_fd = -1, .metadata_fd = -1 };
+  if (self->ws_kind != -1)
+    metrics_ws_connections_add (self->ws_kind, -1);
+  wsinstance_disconnected (self->ws_instance);
+  metrics_connection_closed ();
 
-  assert (!buffer_can_write (&self.client_to_ws_buffer));
-  assert (!buffer_can_write (&self.ws_to_client_buffer));
-  assert (!self.tls);
+  free (self->wsinstance);
 
-#ifdef DEBUG
-  self.client_to_ws_buffer.name = "client-to-ws";
-  self.ws_to_client_buffer.name = "ws-to-client";
-#endif
+  if (self->client_cert_filename)
+    client_certificate_release (parameters.cert_session_dir, self->client_cert_filename);
 
-  debug (CONNECTION, "New thread for fd %i", fd);
+  if (self->tls)
+    gnutls_deinit (self->tls);
 
-  if (connection_handshake (&self) &&
-      connection_create_metadata (&self) &&
-      connection_connect_to_wsinstance (&self))
-    connection_thread_loop (&self);
+  if (self->client_fd != -1)
+    close (self->client_fd);
 
-  debug (CONNECTION, "Thread for fd %i is going to exit now", fd);
+  if (self->ws_fd != -1)
+    close (self->ws_fd);
+
+  if (self->metadata_fd != -1)
+    close (self->metadata_fd);
+
+  Buffer *buffers[] = { &self->client_to_ws_buffer, &self->ws_to_client_buffer };
+  for (int i = 0; i < N_ELEMENTS (buffers); i++)
+    {
+      if (buffers[i]->data)
+        buffer_pool_put (buffers[i]->data, buffers[i]->size);
 
-  free (self.wsinstance);
+      if (buffer_spliced (buffers[i]))
+        {
+          close (buffers[i]->pipe[0]);
+          close (buffers[i]->pipe[1]);
+        }
+    }
 
-  if (self.client_cert_filename)
-    client_certificate_unlink_and_free (parameters.cert_session_dir, self.client_cert_filename);
+  free (self);
+}
 
-  if (self.tls)
-    gnutls_deinit (self.tls);
+void
+connection_thread_main (int fd)
+{
+  Connection *self = connection_new (fd);
 
-  if (self.client_fd != -1)
-    close (self.client_fd);
+  debug (CONNECTION, "New thread for fd %i", fd);
 
-  if (self.ws_fd != -1)
-    close (self.ws_fd);
+  connection_thread_loop (self);
 
-  if (self.metadata_fd != -1)
-    close (self.metadata_fd);
+  debug (CONNECTION, "Thread for fd %i is going to exit now", fd);
+
+  connection_free (self);
 }
 
 /**
@@ -864,6 +1632,94 @@ connection_crypto_init (const char *certificate_filename,
   parameters.require_https = !allow_unencrypted;
 }
 
+/**
+ * connection_enable_session_cache: Enable the TLS session resumption cache
+ *
+ * Session tickets are always enabled.  This additionally keeps up to
+ * @n_entries sessions in memory for session ID based resumption, for
+ * clients which don't support tickets.  Call after connection_crypto_init().
+ *
+ * @n_entries: maximum number of cached sessions; 0 disables the cache
+ */
+void
+connection_enable_session_cache (unsigned n_entries)
+{
+  assert (parameters.session_cache == NULL);
+
+  if (n_entries > 0)
+    parameters.session_cache = session_cache_new (n_entries);
+}
+
+/**
+ * connection_enable_splice: Relay data with splice() where possible
+ *
+ * Instead of copying the data through userspace buffers, move it between
+ * the sockets with splice() through a pipe.  This works for unencrypted
+ * connections, and for the sending side of kTLS connections.  It costs two
+ * extra file descriptors per spliced direction.
+ */
+void
+connection_enable_splice (void)
+{
+  parameters.splice = true;
+}
+
+/**
+ * connection_set_max_buffer_size: Limit the growth of the relay buffers
+ *
+ * Each direction of a connection has a buffer, which grows from 4 KiB up to
+ * this size while the data keeps coming in faster than it can be sent.
+ *
+ * @size: in bytes; rounded up to a power of two between 4 KiB and 16 MiB
+ */
+void
+connection_set_max_buffer_size (unsigned size)
+{
+  unsigned rounded = BUFFER_POOL_MIN_SIZE;
+
+  while (rounded < size && rounded < BUFFER_POOL_MAX_SIZE)
+    rounded *= 2;
+
+  parameters.max_buffer_size = rounded;
+}
+
+/**
+ * connection_set_setup_timeout: Limit how long a connection can take to set up
+ *
+ * This applies separately to waiting for the first byte, and to the TLS
+ * handshake.
+ *
+ * @timeout_ms: in milliseconds
+ */
+void
+connection_set_setup_timeout (unsigned timeout_ms)
+{
+  parameters.setup_timeout = timeout_ms;
+}
+
+/**
+ * connection_get_session_counters: Get TLS session resumption statistics
+ *
+ * @full: number of full TLS handshakes
+ * @resumed: number of resumed TLS sessions
+ * @cache_hits, @cache_misses: session cache lookups; always 0 if the cache
+ *   is disabled. Ticket based resumption does not use the cache.
+ */
+void
+connection_get_session_counters (unsigned long *full,
+                                 unsigned long *resumed,
+                                 unsigned long *cache_hits,
+                                 unsigned long *cache_misses)
+{
+  *full = atomic_load (&n_handshakes_full);
+  *resumed = atomic_load (&n_handshakes_resumed);
+
+  if (parameters.session_cache)
+    session_cache_get_counters (parameters.session_cache, cache_hits, cache_misses);
+  else
+    *cache_hits = *cache_misses = 0;
+}
+
 void
 connection_set_directories (const char *wsinstance_sockdir,
                             const char *runtime_directory)
@@ -904,7 +1760,30 @@ connection_cleanup (void)
       parameters.certificate = NULL;
     }
 
+  if (parameters.session_cache)
+    {
+      session_cache_free (parameters.session_cache);
+      parameters.session_cache = NULL;
+    }
+
+  pthread_mutex_lock (&session_ticket.mutex);
+  gnutls_free (session_ticket.key.data);
+  session_ticket.key.data = NULL;
+  session_ticket.key.size = 0;
+  pthread_mutex_unlock (&session_ticket.mutex);
+
+  atomic_store (&n_handshakes_full, 0);
+  atomic_store (&n_handshakes_resumed, 0);
+
   parameters.require_https = false;
+  parameters.splice = false;
+  parameters.max_buffer_size = CONNECTION_DEFAULT_MAX_BUFFER_SIZE;
+  parameters.setup_timeout = CONNECTION_DEFAULT_SETUP_TIMEOUT;
+
+  buffer_pool_cleanup ();
+  wsinstance_cleanup ();
+  client_certificate_cleanup ();
+  metrics_reset ();
 
   close (parameters.cert_session_dir);
   parameters.cert_session_dir = -1;
@@ -24,6 +24,11 @@
 
 #include <gnutls/gnutls.h>
 
+typedef struct _Connection Connection;
+
+#define CONNECTION_DEFAULT_MAX_BUFFER_SIZE (256u << 10)
+#define CONNECTION_DEFAULT_SETUP_TIMEOUT 30000 /* ms */
+
 /* init/teardown */
 void
 connection_set_directories (const char *wsinstance_sockdir,
@@ -35,9 +40,67 @@ connection_crypto_init (const char *certificate_filename,
                         bool allow_unencrypted,
                         gnutls_certificate_request_t request_mode);
 
+void
+connection_enable_session_cache (unsigned n_entries);
+
+void
+connection_enable_splice (void);
+
+void
+connection_set_max_buffer_size (unsigned size);
+
+void
+connection_set_setup_timeout (unsigned timeout_ms);
+
+void
+connection_get_session_counters (unsigned long *full,
+                                 unsigned long *resumed,
+                                 unsigned long *cache_hits,
+                                 unsigned long *cache_misses);
+
 void
 connection_cleanup (void);
 
 /* handle a new connection */
 void
 connection_thread_main (int fd);
+
+/* event-driven operation, see worker.c */
+Connection *
+connection_new (int fd);
+
+int
+connection_get_client_fd (Connection *self);
+
+int
+connection_get_ws_fd (Connection *self);
+
+bool
+connection_get_events (Connection *self,
+                       short      *client_events,
+                       short      *ws_events,
+                       short      *client_revents,
+                       short      *ws_revents);
+
+int
+connection_get_timeout (Connection *self);
+
+bool
+connection_needs_activation (Connection *self);
+
+const char *
+connection_get_wsinstance (Connection *self);
+
+bool
+connection_activate (Connection *self);
+
+void
+connection_abandon_activation (Connection *self);
+
+void
+connection_dispatch (Connection *self,
+                     short       client_revents,
+                     short       ws_revents);
+
+void
+connection_free (Connection *self);
@@ -23,6 +23,7 @@
 #include <err.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <sys/param.h>
 #include <unistd.h>
 
 #include <common/cockpitconf.h>
@@ -36,10 +37,20 @@ struct arguments {
   uint16_t port;
   bool no_tls;
   int idle_timeout;
+  int workers;
+  int session_cache;
+  bool splice;
+  int max_buffer_size;
+  int accept_threads;
 };
 
 #define OPT_NO_TLS 1000
 #define OPT_IDLE_TIMEOUT 1001
+#define OPT_WORKERS 1002
+#define OPT_SESSION_CACHE 1003
+#define OPT_SPLICE 1004
+#define OPT_MAX_BUFFER_SIZE 1005
+#define OPT_ACCEPT_THREADS 1006
 
 static int
 arg_parse_int (char *arg, struct argp_state *state, int min, int max, const char *error_msg)
@@ -69,6 +80,24 @@ parse_opt (int key, char *arg, struct argp_state *state)
       case OPT_IDLE_TIMEOUT:
         arguments->idle_timeout = arg_parse_int (arg, state, 0, INT_MAX, "Invalid idle timeout");
         break;
+      case OPT_WORKERS:
+        if (arg)
+          arguments->workers = arg_parse_int (arg, state, 0, 4096, "Invalid number of workers");
+        else
+          arguments->workers = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+        break;
+      case OPT_SESSION_CACHE:
+        arguments->session_cache = arg_parse_int (arg, state, 0, 1 << 20, "Invalid session cache size");
+        break;
+      case OPT_SPLICE:
+        arguments->splice = true;
+        break;
+      case OPT_MAX_BUFFER_SIZE:
+        arguments->max_buffer_size = arg_parse_int (arg, state, 4, 16 << 10, "Invalid buffer size");
+        break;
+      case OPT_ACCEPT_THREADS:
+        arguments->accept_threads = arg_parse_int (arg, state, 0, 256, "Invalid number of accept threads");
+        break;
       default:
         return ARGP_ERR_UNKNOWN;
     }
@@ -79,6 +108,11 @@ static struct argp_option options[] = {
   {"no-tls", OPT_NO_TLS, 0, 0,  "Don't use TLS" },
   {"port", 'p', "PORT", 0, "Local port to bind to (9090 if unset)" },
   {"idle-timeout", OPT_IDLE_TIMEOUT, "SECONDS", 0, "Time after which to exit if there are no connections; 0 to run forever (default: 90)" },
+  {"workers", OPT_WORKERS, "N", OPTION_ARG_OPTIONAL, "Multiplex connections on N event-driven threads instead of one thread per connection (default N: number of CPUs)" },
+  {"session-cache", OPT_SESSION_CACHE, "ENTRIES", 0, "Keep up to ENTRIES TLS sessions for resumption by clients without session ticket support (default: 0, disabled)" },
+  {"splice", OPT_SPLICE, 0, 0, "Relay unencrypted and kTLS data with splice() instead of copying it through userspace" },
+  {"max-buffer-size", OPT_MAX_BUFFER_SIZE, "KIB", 0, "Maximum size of the relay buffer for each direction of a connection (default: 256)" },
+  {"accept-threads", OPT_ACCEPT_THREADS, "N", 0, "Accept new connections on N dedicated threads (default: 0, on the main thread)" },
   { 0 }
 };
 
@@ -99,6 +133,11 @@ main (int argc, char **argv)
   arguments.no_tls = false;
   arguments.port = 9090;
   arguments.idle_timeout = 90;
+  arguments.workers = 0;
+  arguments.session_cache = 0;
+  arguments.splice = false;
+  arguments.max_buffer_size = CONNECTION_DEFAULT_MAX_BUFFER_SIZE >> 10;
+  arguments.accept_threads = 0;
 
   argp_parse (&argp, argc, argv, 0, 0, &arguments);
 
@@ -107,6 +146,12 @@ main (int argc, char **argv)
     errx (EXIT_FAILURE, "$RUNTIME_DIRECTORY environment variable must be set to a private directory");
 
   server_init ("/run/cockpit/wsinstance", runtimedir, arguments.idle_timeout, arguments.port);
+  server_set_workers (arguments.workers);
+
+  if (arguments.splice)
+    connection_enable_splice ();
+
+  connection_set_max_buffer_size (arguments.max_buffer_size << 10);
 
   if (!arguments.no_tls)
     {
@@ -123,6 +168,7 @@ main (int argc, char **argv)
       connection_crypto_init ("/run/cockpit/tls/server/cert",
                               "/run/cockpit/tls/server/key",
                               allow_unencrypted, client_cert_mode);
+      connection_enable_session_cache (arguments.session_cache);
 
       /* There's absolutely no need to keep these around */
       if (unlink ("/run/cockpit/tls/server/cert") != 0)
@@ -132,6 +178,8 @@ main (int argc, char **argv)
         err (EXIT_FAILURE, "unlink: /run/cockpit/tls/server/key");
     }
 
+  server_start_accept_threads (arguments.accept_threads);
+
   server_run ();
   server_cleanup ();
 
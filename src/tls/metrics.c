@@ -0,0 +1,286 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Statistics about the running cockpit-tls, in the Prometheus text format.
+ *
+ * The counters in here get updated from the connection threads with
+ * relaxed atomic operations, without any locks; a reader may see them
+ * slightly out of sync with each other, which is fine for monitoring.
+ * Other modules keep their own counters (e.g. handshakes, instance
+ * activations), which metrics_print() collects when asked.
+ *
+ * The output is available on metrics.sock in the runtime directory, and
+ * gets written to stderr on SIGUSR1 (see server.c).
+ */
+
+#include "config.h"
+
+#include "metrics.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer-pool.h"
+#include "connection.h"
+#include "wsinstance.h"
+
+/* upper bounds are powers of two, starting at 128µs; the last one is +Inf */
+#define HISTOGRAM_BUCKETS 17
+#define HISTOGRAM_FIRST_BUCKET_US 128
+
+typedef struct
+{
+  atomic_ulong buckets[HISTOGRAM_BUCKETS];
+  atomic_ulong sum_us;
+} Histogram;
+
+static struct
+{
+  atomic_ulong connections_accepted;
+  atomic_long connections_active;
+  atomic_long ws_connections_active[METRICS_WS_N_KINDS];
+  atomic_ulong handshakes_failed;
+  Histogram handshake_duration;
+  Histogram activation_duration;
+  atomic_ulong relayed_client_to_ws;
+  atomic_ulong relayed_ws_to_client;
+} metrics;
+
+static const char * const ws_kind_names[METRICS_WS_N_KINDS] = {
+  [METRICS_WS_HTTP] = "http",
+  [METRICS_WS_HTTP_REDIRECT] = "http-redirect",
+  [METRICS_WS_HTTPS] = "https",
+};
+
+static inline void
+counter_add (atomic_ulong *counter,
+             unsigned long value)
+{
+  atomic_fetch_add_explicit (counter, value, memory_order_relaxed);
+}
+
+static inline unsigned long
+counter_get (atomic_ulong *counter)
+{
+  return atomic_load_explicit (counter, memory_order_relaxed);
+}
+
+static void
+histogram_observe (Histogram *self,
+                   uint64_t   value_us)
+{
+  unsigned bucket = 0;
+
+  while (bucket < HISTOGRAM_BUCKETS - 1 && value_us > (uint64_t) HISTOGRAM_FIRST_BUCKET_US << bucket)
+    bucket++;
+
+  counter_add (&self->buckets[bucket], 1);
+  counter_add (&self->sum_us, value_us);
+}
+
+static void
+histogram_print (Histogram  *self,
+                 FILE       *stream,
+                 const char *name)
+{
+  unsigned long cumulative = 0;
+
+  fprintf (stream, "# TYPE %s histogram\n", name);
+
+  for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+      cumulative += counter_get (&self->buckets[i]);
+
+      if (i < HISTOGRAM_BUCKETS - 1)
+        fprintf (stream, "%s_bucket{le=\"%g\"} %lu\n", name,
+                 (double) ((uint64_t) HISTOGRAM_FIRST_BUCKET_US << i) / 1e6, cumulative);
+      else
+        fprintf (stream, "%s_bucket{le=\"+Inf\"} %lu\n", name, cumulative);
+    }
+
+  fprintf (stream, "%s_sum %g\n", name, counter_get (&self->sum_us) / 1e6);
+  fprintf (stream, "%s_count %lu\n", name, cumulative);
+}
+
+static long
+read_thread_count (void)
+{
+  char line[256];
+  long threads = -1;
+  FILE *status;
+
+  status = fopen ("/proc/self/status", "re");
+  if (status == NULL)
+    return -1;
+
+  while (fgets (line, sizeof line, status))
+    if (strncmp (line, "Threads:", 8) == 0)
+      {
+        threads = strtol (line + 8, NULL, 10);
+        break;
+      }
+
+  fclose (status);
+  return threads;
+}
+
+static void
+print_instance_connections (const char *fingerprint,
+                            unsigned    n_connections,
+                            void       *data)
+{
+  FILE *stream = data;
+
+  fprintf (stream, "cockpit_tls_ws_connections_active{instance=\"https@%s\"} %u\n",
+           fingerprint, n_connections);
+}
+
+void
+metrics_connection_opened (void)
+{
+  counter_add (&metrics.connections_accepted, 1);
+  atomic_fetch_add_explicit (&metrics.connections_active, 1, memory_order_relaxed);
+}
+
+void
+metrics_connection_closed (void)
+{
+  atomic_fetch_sub_explicit (&metrics.connections_active, 1, memory_order_relaxed);
+}
+
+/**
+ * metrics_ws_connections_add: Count connections to a type of ws instance
+ *
+ * The https instances are also counted per certificate, in wsinstance.c.
+ */
+void
+metrics_ws_connections_add (MetricsWsKind kind,
+                            int           delta)
+{
+  assert (kind < METRICS_WS_N_KINDS);
+  atomic_fetch_add_explicit (&metrics.ws_connections_active[kind], delta, memory_order_relaxed);
+}
+
+/**
+ * metrics_handshake_finished: Record the outcome of a TLS handshake
+ *
+ * @duration_us: time from the first byte to the end of the handshake
+ */
+void
+metrics_handshake_finished (uint64_t duration_us,
+                            bool     success)
+{
+  if (success)
+    histogram_observe (&metrics.handshake_duration, duration_us);
+  else
+    counter_add (&metrics.handshakes_failed, 1);
+}
+
+void
+metrics_activation_finished (uint64_t duration_us)
+{
+  histogram_observe (&metrics.activation_duration, duration_us);
+}
+
+void
+metrics_relayed (unsigned long client_to_ws,
+                 unsigned long ws_to_client)
+{
+  if (client_to_ws)
+    counter_add (&metrics.relayed_client_to_ws, client_to_ws);
+  if (ws_to_client)
+    counter_add (&metrics.relayed_ws_to_client, ws_to_client);
+}
+
+/**
+ * metrics_print: Write all metrics to @stream
+ */
+void
+metrics_print (FILE *stream)
+{
+  unsigned long handshakes_full, handshakes_resumed, cache_hits, cache_misses;
+  WsInstanceCounters activations;
+  size_t pool_in_use, pool_cached;
+  unsigned pool_largest;
+
+  connection_get_session_counters (&handshakes_full, &handshakes_resumed, &cache_hits, &cache_misses);
+  wsinstance_get_counters (&activations);
+  buffer_pool_get_stats (&pool_in_use, &pool_cached, &pool_largest);
+
+  fprintf (stream, "# TYPE cockpit_tls_connections_accepted_total counter\n");
+  fprintf (stream, "cockpit_tls_connections_accepted_total %lu\n",
+           counter_get (&metrics.connections_accepted));
+  fprintf (stream, "# TYPE cockpit_tls_connections_active gauge\n");
+  fprintf (stream, "cockpit_tls_connections_active %li\n",
+           atomic_load_explicit (&metrics.connections_active, memory_order_relaxed));
+
+  fprintf (stream, "# TYPE cockpit_tls_ws_connections_active gauge\n");
+  for (int i = 0; i < METRICS_WS_N_KINDS; i++)
+    fprintf (stream, "cockpit_tls_ws_connections_active{instance=\"%s\"} %li\n", ws_kind_names[i],
+             atomic_load_explicit (&metrics.ws_connections_active[i], memory_order_relaxed));
+  wsinstance_foreach (print_instance_connections, stream);
+
+  fprintf (stream, "# TYPE cockpit_tls_handshakes_total counter\n");
+  fprintf (stream, "cockpit_tls_handshakes_total{result=\"full\"} %lu\n", handshakes_full);
+  fprintf (stream, "cockpit_tls_handshakes_total{result=\"resumed\"} %lu\n", handshakes_resumed);
+  fprintf (stream, "cockpit_tls_handshakes_total{result=\"failed\"} %lu\n",
+           counter_get (&metrics.handshakes_failed));
+  histogram_print (&metrics.handshake_duration, stream, "cockpit_tls_handshake_duration_seconds");
+
+  fprintf (stream, "# TYPE cockpit_tls_session_cache_lookups_total counter\n");
+  fprintf (stream, "cockpit_tls_session_cache_lookups_total{result=\"hit\"} %lu\n", cache_hits);
+  fprintf (stream, "cockpit_tls_session_cache_lookups_total{result=\"miss\"} %lu\n", cache_misses);
+
+  fprintf (stream, "# TYPE cockpit_tls_relayed_bytes_total counter\n");
+  fprintf (stream, "cockpit_tls_relayed_bytes_total{direction=\"client-to-ws\"} %lu\n",
+           counter_get (&metrics.relayed_client_to_ws));
+  fprintf (stream, "cockpit_tls_relayed_bytes_total{direction=\"ws-to-client\"} %lu\n",
+           counter_get (&metrics.relayed_ws_to_client));
+
+  fprintf (stream, "# TYPE cockpit_tls_wsinstance_activations_total counter\n");
+  fprintf (stream, "cockpit_tls_wsinstance_activations_total{result=\"success\"} %lu\n",
+           activations.activations - activations.activation_failures);
+  fprintf (stream, "cockpit_tls_wsinstance_activations_total{result=\"failed\"} %lu\n",
+           activations.activation_failures);
+  fprintf (stream, "# TYPE cockpit_tls_wsinstance_activation_waits_total counter\n");
+  fprintf (stream, "cockpit_tls_wsinstance_activation_waits_total %lu\n", activations.coalesced_waits);
+  histogram_print (&metrics.activation_duration, stream, "cockpit_tls_wsinstance_activation_duration_seconds");
+
+  fprintf (stream, "# TYPE cockpit_tls_buffer_bytes gauge\n");
+  fprintf (stream, "cockpit_tls_buffer_bytes{state=\"in-use\"} %zu\n", pool_in_use);
+  fprintf (stream, "cockpit_tls_buffer_bytes{state=\"cached\"} %zu\n", pool_cached);
+
+  fprintf (stream, "# TYPE cockpit_tls_threads gauge\n");
+  fprintf (stream, "cockpit_tls_threads %li\n", read_thread_count ());
+}
+
+/**
+ * metrics_reset: Reset all counters
+ *
+ * Only for cleaning up between unit tests; there must not be any
+ * connections.
+ */
+void
+metrics_reset (void)
+{
+  memset (&metrics, 0, sizeof metrics);
+}
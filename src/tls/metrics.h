@@ -0,0 +1,59 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum
+{
+  METRICS_WS_HTTP,
+  METRICS_WS_HTTP_REDIRECT,
+  METRICS_WS_HTTPS,
+  METRICS_WS_N_KINDS,
+} MetricsWsKind;
+
+void
+metrics_connection_opened (void);
+
+void
+metrics_connection_closed (void);
+
+void
+metrics_ws_connections_add (MetricsWsKind kind,
+                            int           delta);
+
+void
+metrics_handshake_finished (uint64_t duration_us,
+                            bool     success);
+
+void
+metrics_activation_finished (uint64_t duration_us);
+
+void
+metrics_relayed (unsigned long client_to_ws,
+                 unsigned long ws_to_client);
+
+void
+metrics_print (FILE *stream);
+
+void
+metrics_reset (void);
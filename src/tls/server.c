@@ -24,20 +24,37 @@
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/param.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "common/cockpitmemory.h"
+
 #include "connection.h"
+#include "metrics.h"
 #include "utils.h"
+#include "worker.h"
+
+/* maximum number of connections to accept per listener wakeup */
+#define ACCEPT_BATCH 32
+
+typedef struct {
+  pthread_t thread;
+  int epollfd;
+} AcceptThread;
 
 /* cockpit-tls TCP server state (singleton) */
 static struct {
@@ -46,6 +63,16 @@ static struct {
   int first_listener;
   int last_listener;
   int epollfd;
+  unsigned n_workers;
+  AcceptThread *accept_threads;
+  unsigned n_accept_threads;
+  bool accept_threads_running;
+  int accept_quit_fd;
+  int metrics_fd;
+  char *metrics_path;
+  pid_t metrics_pid;
+  int sigusr1_fd;
+  sigset_t orig_sigmask;
 
   /* rw, protected by mutex */
   pthread_mutex_t connection_mutex;
@@ -84,56 +111,42 @@ check_sd_listen_pid (void)
   return true;
 }
 
-static void *
-server_connection_thread_start_routine (void *data)
+static void
+server_connection_closed (void)
 {
-  int fd = (uintptr_t) data;
+  pthread_mutex_lock (&server.connection_mutex);
 
-  connection_thread_main (fd);
+  server.connection_count--;
 
-  /* teardown */
-  {
-    pthread_mutex_lock (&server.connection_mutex);
+  debug (CONNECTION, "Server.connection_count decreased to %i", server.connection_count);
 
-    server.connection_count--;
+  if (server.connection_count == 0 && server.idle_timerfd != -1)
+    {
+      debug (CONNECTION, "  -> setting idle timeout");
+      timerfd_settime (server.idle_timerfd, 0, &server.idle_timeout, NULL);
+    }
 
-    debug (CONNECTION, "Server.connection_count decreased to %i", server.connection_count);
+  pthread_mutex_unlock (&server.connection_mutex);
+}
 
-    if (server.connection_count == 0 && server.idle_timerfd != -1)
-      {
-        debug (CONNECTION, "  -> setting idle timeout");
-        timerfd_settime (server.idle_timerfd, 0, &server.idle_timeout, NULL);
-      }
+static void *
+server_connection_thread_start_routine (void *data)
+{
+  int fd = (uintptr_t) data;
 
-    pthread_mutex_unlock (&server.connection_mutex);
-  }
+  connection_thread_main (fd);
+
+  server_connection_closed ();
 
   return NULL;
 }
 
-/**
- * handle_accept: Handle event on listening fd
- *
- * I. e. accepting new connections
- */
 static void
-handle_accept (int listen_fd)
+server_add_connection (int fd)
 {
-  int fd;
   pthread_attr_t attr;
   pthread_t thread;
 
-  debug (CONNECTION, "epoll_wait event on server listen fd %i", listen_fd);
-
-  /* accept and create new connection */
-  fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
-  if (fd < 0)
-    {
-      if (errno != EINTR)
-        warn ("failed to accept connection");
-      return;
-    }
-
   debug (CONNECTION, "New connection accepted, fd %i", fd);
 
   {
@@ -153,6 +166,13 @@ handle_accept (int listen_fd)
     pthread_mutex_unlock (&server.connection_mutex);
   }
 
+  if (server.n_workers > 0)
+    {
+      /* the whole connection, including the handshake, is event-driven */
+      worker_pool_add (connection_new (fd));
+      return;
+    }
+
   pthread_attr_init (&attr);
   pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
 
@@ -165,17 +185,200 @@ handle_accept (int listen_fd)
       errno = r;
       warn ("pthread_create() failed.  dropping connection");
       close (fd);
+      server_connection_closed ();
     }
 
   pthread_attr_destroy (&attr);
 }
 
+/**
+ * handle_accept: Handle event on listening fd
+ *
+ * I. e. accepting new connections.  The listening fds are non-blocking,
+ * so that we can take all pending connections (up to a limit, so that
+ * other listeners get their turn) without going back to epoll for each.
+ */
+static void
+handle_accept (int listen_fd)
+{
+  debug (CONNECTION, "epoll_wait event on server listen fd %i", listen_fd);
+
+  for (unsigned i = 0; i < ACCEPT_BATCH; i++)
+    {
+      int fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0)
+        {
+          if (errno == ECONNABORTED)
+            continue;
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            warn ("failed to accept connection");
+          return;
+        }
+
+      server_add_connection (fd);
+    }
+}
+
+static void *
+server_accept_thread_main (void *data)
+{
+  AcceptThread *self = data;
+  struct epoll_event events[8];
+  bool quit = false;
+
+  while (!quit)
+    {
+      int n = epoll_wait (self->epollfd, events, N_ELEMENTS (events), -1);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          err (EXIT_FAILURE, "Failed to epoll_wait");
+        }
+
+      /* still accept what's already there when asked to quit */
+      for (int i = 0; i < n; i++)
+        {
+          if (events[i].data.fd == server.accept_quit_fd)
+            quit = true;
+          else
+            handle_accept (events[i].data.fd);
+        }
+    }
+
+  return NULL;
+}
+
 /***********************************
  *
  * Public API
  *
  ***********************************/
 
+/**
+ * server_init_metrics: Set up the metrics.sock listener and SIGUSR1 handler
+ *
+ * Failing to bind the socket is not fatal, the metrics are just a
+ * diagnostic aid.
+ */
+static void
+server_init_metrics (const char *runtime_directory)
+{
+  struct sockaddr_un sa = { .sun_family = AF_UNIX };
+  struct epoll_event ev = { .events = EPOLLIN };
+  sigset_t mask;
+
+  /* block before any other thread gets spawned, so that they inherit the mask */
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGUSR1);
+  if (pthread_sigmask (SIG_BLOCK, &mask, &server.orig_sigmask) != 0)
+    errx (EXIT_FAILURE, "Failed to block SIGUSR1");
+
+  server.sigusr1_fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (server.sigusr1_fd < 0)
+    err (EXIT_FAILURE, "Failed to create signalfd");
+  ev.data.fd = server.sigusr1_fd;
+  if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, server.sigusr1_fd, &ev) < 0)
+    err (EXIT_FAILURE, "Failed to epoll signalfd");
+
+  if (asprintf (&server.metrics_path, "%s/metrics.sock", runtime_directory) < 0)
+    errx (EXIT_FAILURE, "out of memory");
+  if (strlen (server.metrics_path) >= sizeof sa.sun_path)
+    {
+      warnx ("Runtime directory path too long, not providing %s", server.metrics_path);
+      goto fail;
+    }
+  strcpy (sa.sun_path, server.metrics_path);
+
+  server.metrics_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (server.metrics_fd < 0)
+    err (EXIT_FAILURE, "Failed to create metrics socket");
+
+  /* a stale socket from a previous instance */
+  unlink (server.metrics_path);
+
+  if (bind (server.metrics_fd, (struct sockaddr *) &sa, sizeof sa) < 0 ||
+      listen (server.metrics_fd, 16) < 0)
+    {
+      warn ("Failed to listen on %s", server.metrics_path);
+      close (server.metrics_fd);
+      server.metrics_fd = -1;
+      goto fail;
+    }
+
+  server.metrics_pid = getpid ();
+  ev.data.fd = server.metrics_fd;
+  if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, server.metrics_fd, &ev) < 0)
+    err (EXIT_FAILURE, "Failed to epoll metrics socket");
+
+  debug (SERVER, "Providing metrics on %s, fd %i", server.metrics_path, server.metrics_fd);
+  return;
+
+fail:
+  free (server.metrics_path);
+  server.metrics_path = NULL;
+}
+
+/**
+ * server_send_metrics: Answer a client of metrics.sock
+ *
+ * The client gets a snapshot of the current metrics in the Prometheus
+ * text format, and then EOF.  This runs in the main thread, so it must
+ * never block.
+ */
+static void
+server_send_metrics (void)
+{
+  char *text = NULL;
+  size_t len = 0;
+  size_t done = 0;
+  FILE *stream;
+  int fd;
+
+  fd = accept4 (server.metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0)
+    {
+      if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+        warn ("accept(metrics.sock) failed");
+      return;
+    }
+
+  stream = open_memstream (&text, &len);
+  if (stream == NULL)
+    errx (EXIT_FAILURE, "out of memory");
+  metrics_print (stream);
+  fclose (stream);
+
+  /* the output is small enough to fit into the socket buffer */
+  while (done < len)
+    {
+      ssize_t s = send (fd, text + done, len - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (s < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          debug (SERVER, "sending metrics failed: %m");
+          break;
+        }
+      done += s;
+    }
+
+  free (text);
+  close (fd);
+}
+
+static void
+server_dump_metrics (void)
+{
+  struct signalfd_siginfo info;
+
+  while (read (server.sigusr1_fd, &info, sizeof info) == sizeof info)
+    ;
+
+  metrics_print (stderr);
+  fflush (stderr);
+}
+
 /**
  * server_init: Initialize cockpit TLS proxy server
  *
@@ -183,7 +386,8 @@ handle_accept (int listen_fd)
  * is an error.
  *
  * @wsinstance_sockdir: Path to cockpit-wsinstance sockets directory
- * @cert_session_dir: Path to store session certificates
+ * @cert_session_dir: Runtime directory; session certificates are stored in
+ *                    its clients/ subdirectory, and metrics.sock is bound here
  * @idle_timeout: When positive, stop server after given number of seconds with
  *                no connections
  * @port: Port to listen to; ignored when the listening socket is handed over
@@ -201,6 +405,8 @@ server_init (const char *wsinstance_sockdir,
   assert (!server.initialized);
   server.initialized = true;
   server.idle_timerfd = -1;
+  server.accept_quit_fd = -1;
+  server.metrics_fd = -1;
 
   connection_set_directories (wsinstance_sockdir, cert_session_dir);
 
@@ -250,6 +456,9 @@ server_init (const char *wsinstance_sockdir,
     err (EXIT_FAILURE, "Failed to create epoll fd");
   for (int fd = server.first_listener; fd <= server.last_listener; fd++)
     {
+      if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) < 0)
+        err (EXIT_FAILURE, "Failed to make server listening fd non-blocking");
+
       ev.data.fd = fd;
       if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, fd, &ev) < 0)
         err (EXIT_FAILURE, "Failed to epoll server listening fd");
@@ -270,6 +479,126 @@ server_init (const char *wsinstance_sockdir,
       if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, server.idle_timerfd, &ev) < 0)
         err (EXIT_FAILURE, "Failed to epoll idle timerfd");
     }
+
+  server_init_metrics (cert_session_dir);
+}
+
+/**
+ * server_set_workers: Use a fixed pool of event-driven worker threads
+ *
+ * This should be called after server_init() and before accepting any
+ * connection.  By default, every connection gets its own thread; with
+ * workers, each thread multiplexes many established connections.
+ *
+ * @n_workers: number of worker threads; 0 keeps the thread-per-connection mode
+ */
+void
+server_set_workers (unsigned n_workers)
+{
+  assert (server.initialized);
+  assert (server.n_workers == 0);
+  assert (server.n_accept_threads == 0);
+  assert (server.connection_count == 0);
+
+  if (n_workers == 0)
+    return;
+
+  worker_pool_init (n_workers, server_connection_closed);
+  server.n_workers = n_workers;
+}
+
+static void
+server_spawn_accept_threads (void)
+{
+  for (unsigned i = 0; i < server.n_accept_threads; i++)
+    {
+      int r = pthread_create (&server.accept_threads[i].thread, NULL,
+                              server_accept_thread_main, &server.accept_threads[i]);
+      if (r != 0)
+        {
+          errno = r;
+          err (EXIT_FAILURE, "Failed to create accept thread");
+        }
+    }
+
+  server.accept_threads_running = true;
+}
+
+static void
+server_join_accept_threads (void)
+{
+  uint64_t value = 1;
+
+  if (write (server.accept_quit_fd, &value, sizeof value) != sizeof value)
+    err (EXIT_FAILURE, "Failed to stop accept threads");
+
+  for (unsigned i = 0; i < server.n_accept_threads; i++)
+    pthread_join (server.accept_threads[i].thread, NULL);
+
+  /* reset it for the next server_spawn_accept_threads() */
+  if (read (server.accept_quit_fd, &value, sizeof value) != sizeof value)
+    err (EXIT_FAILURE, "Failed to reset accept thread eventfd");
+
+  server.accept_threads_running = false;
+}
+
+/**
+ * server_start_accept_threads: Accept connections on dedicated threads
+ *
+ * By default, the thread which calls server_run() or server_poll_event()
+ * accepts all connections.  With this, @n_threads threads each wait for
+ * new connections on all listening fds (with EPOLLEXCLUSIVE, so that a
+ * single connection only wakes up one of them), and accept them in
+ * parallel.  server_poll_event() then only handles the idle timeout.
+ *
+ * Connections get accepted right away, so this must be called after all
+ * other configuration, including server_set_workers().
+ *
+ * @n_threads: number of accept threads; 0 keeps accepting on the main thread
+ */
+void
+server_start_accept_threads (unsigned n_threads)
+{
+  assert (server.initialized);
+  assert (server.n_accept_threads == 0);
+
+  if (n_threads == 0)
+    return;
+
+  /* stays readable until it's reset, so it wakes up every thread */
+  server.accept_quit_fd = eventfd (0, EFD_CLOEXEC);
+  if (server.accept_quit_fd < 0)
+    err (EXIT_FAILURE, "Failed to create eventfd");
+
+  server.accept_threads = callocx (n_threads, sizeof (AcceptThread));
+  server.n_accept_threads = n_threads;
+
+  for (unsigned i = 0; i < n_threads; i++)
+    {
+      AcceptThread *thread = &server.accept_threads[i];
+      struct epoll_event ev = { .events = EPOLLIN, .data.fd = server.accept_quit_fd };
+
+      thread->epollfd = epoll_create1 (EPOLL_CLOEXEC);
+      if (thread->epollfd < 0)
+        err (EXIT_FAILURE, "Failed to create epoll fd");
+
+      if (epoll_ctl (thread->epollfd, EPOLL_CTL_ADD, server.accept_quit_fd, &ev) < 0)
+        err (EXIT_FAILURE, "Failed to epoll eventfd");
+
+      for (int fd = server.first_listener; fd <= server.last_listener; fd++)
+        {
+          ev = (struct epoll_event) { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.fd = fd };
+          if (epoll_ctl (thread->epollfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            err (EXIT_FAILURE, "Failed to epoll server listening fd");
+        }
+    }
+
+  /* the main loop no longer accepts */
+  for (int fd = server.first_listener; fd <= server.last_listener; fd++)
+    if (epoll_ctl (server.epollfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+      err (EXIT_FAILURE, "Failed to remove server listening fd from epoll");
+
+  server_spawn_accept_threads ();
 }
 
 int
@@ -289,16 +618,39 @@ void
 server_cleanup (void)
 {
   assert (server.initialized);
+
+  if (server.accept_threads_running)
+    server_join_accept_threads ();
+
   assert (server.connection_count == 0);
 
   if (server.idle_timerfd != -1)
     close (server.idle_timerfd);
 
+  if (server.metrics_fd != -1)
+    {
+      /* forked children (e.g. in tests) must not remove the parent's socket */
+      if (server.metrics_pid == getpid ())
+        unlink (server.metrics_path);
+      close (server.metrics_fd);
+    }
+  free (server.metrics_path);
+  close (server.sigusr1_fd);
+  pthread_sigmask (SIG_SETMASK, &server.orig_sigmask, NULL);
+
   for (int fd = server.first_listener; fd <= server.last_listener; fd++)
     close (fd);
 
   close (server.epollfd);
 
+  for (unsigned i = 0; i < server.n_accept_threads; i++)
+    close (server.accept_threads[i].epollfd);
+  free (server.accept_threads);
+  if (server.accept_quit_fd != -1)
+    close (server.accept_quit_fd);
+
+  worker_pool_cleanup ();
+
   pthread_mutex_destroy (&server.connection_mutex);
 
   connection_cleanup ();
@@ -312,8 +664,9 @@ server_cleanup (void)
  * @timeout: number of milliseconds to wait for an event to happen; after that,
  * the function will return false. -1 will to block until an event occurs.
  *
- * This can be an event on a listening socket, or the idle timeout if no
- * clients are connected.
+ * This can be an event on a listening socket (unless there are accept
+ * threads), a metrics request, or the idle timeout if no clients are
+ * connected.
  *
  * Returns: false on timeout, true if some (other) event was handled.
  */
@@ -325,6 +678,10 @@ server_poll_event (int timeout)
 
   assert (server.initialized);
 
+  /* after an idle timeout */
+  if (server.n_accept_threads > 0 && !server.accept_threads_running)
+    server_spawn_accept_threads ();
+
   ret = epoll_wait (server.epollfd, &ev, 1, timeout);
   if (ret == 0)
     return false; /* hit timeout */
@@ -337,9 +694,40 @@ server_poll_event (int timeout)
         {
           /* hit the idle timeout */
           debug (SERVER, "server_poll_event(): idle timer elapsed, returning immediately");
+
+          /* make sure that no connection gets accepted after we said we're idle */
+          if (server.accept_threads_running)
+            {
+              bool busy;
+
+              server_join_accept_threads ();
+
+              pthread_mutex_lock (&server.connection_mutex);
+              busy = server.connection_count > 0;
+              pthread_mutex_unlock (&server.connection_mutex);
+
+              if (busy)
+                {
+                  debug (SERVER, "  -> a connection came in meanwhile; continuing");
+                  return true;
+                }
+            }
+
           return false;
         }
 
+      if (fd == server.metrics_fd)
+        {
+          server_send_metrics ();
+          return true;
+        }
+
+      if (fd == server.sigusr1_fd)
+        {
+          server_dump_metrics ();
+          return true;
+        }
+
       assert (server.first_listener <= fd && fd <= server.last_listener);
 
       handle_accept (fd);
@@ -30,6 +30,12 @@ server_init (const char *wsinstance_sockdir,
              int idle_timeout,
              uint16_t port);
 
+void
+server_set_workers (unsigned n_workers);
+
+void
+server_start_accept_threads (unsigned n_threads);
+
 void
 server_run (void);
 
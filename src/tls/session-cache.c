@@ -0,0 +1,228 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * An in-process TLS session resumption cache, shared between all
+ * connections.  This backs the gnutls "db" functions, which are used for
+ * session ID based resumption of clients which don't use session tickets.
+ *
+ * It is a direct-mapped table: each session ID hashes to exactly one slot,
+ * and storing a session overwrites whatever was there before.  This bounds
+ * the memory use without any LRU bookkeeping; the session IDs are random,
+ * so they spread out evenly.
+ */
+
+#include "config.h"
+
+#include "session-cache.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cockpitmemory.h"
+
+#include "utils.h"
+
+typedef struct {
+  gnutls_datum_t key;
+  gnutls_datum_t data;
+} SessionCacheEntry;
+
+struct _SessionCache {
+  pthread_mutex_t mutex;
+  SessionCacheEntry *entries;
+  unsigned n_entries;
+
+  atomic_ulong hits;
+  atomic_ulong misses;
+};
+
+static void
+datum_set (gnutls_datum_t       *dest,
+           const gnutls_datum_t *src)
+{
+  free (dest->data);
+  dest->data = mallocx (src->size);
+  memcpy (dest->data, src->data, src->size);
+  dest->size = src->size;
+}
+
+static void
+datum_clear (gnutls_datum_t *datum)
+{
+  free (datum->data);
+  datum->data = NULL;
+  datum->size = 0;
+}
+
+static bool
+datum_equal (const gnutls_datum_t *a,
+             const gnutls_datum_t *b)
+{
+  return a->size == b->size && a->data && memcmp (a->data, b->data, a->size) == 0;
+}
+
+/* FNV-1a */
+static SessionCacheEntry *
+session_cache_lookup (SessionCache         *self,
+                      const gnutls_datum_t *key)
+{
+  uint32_t hash = 2166136261u;
+
+  for (unsigned i = 0; i < key->size; i++)
+    hash = (hash ^ key->data[i]) * 16777619u;
+
+  return &self->entries[hash % self->n_entries];
+}
+
+static int
+session_cache_store (void           *data,
+                     gnutls_datum_t  key,
+                     gnutls_datum_t  value)
+{
+  SessionCache *self = data;
+
+  pthread_mutex_lock (&self->mutex);
+
+  SessionCacheEntry *entry = session_cache_lookup (self, &key);
+  datum_set (&entry->key, &key);
+  datum_set (&entry->data, &value);
+
+  pthread_mutex_unlock (&self->mutex);
+
+  return 0;
+}
+
+static gnutls_datum_t
+session_cache_retrieve (void           *data,
+                        gnutls_datum_t  key)
+{
+  SessionCache *self = data;
+  gnutls_datum_t result = { NULL, 0 };
+
+  pthread_mutex_lock (&self->mutex);
+
+  SessionCacheEntry *entry = session_cache_lookup (self, &key);
+  if (datum_equal (&entry->key, &key))
+    {
+      /* gnutls checks the expiry time which is stored in the data itself */
+      result.data = gnutls_malloc (entry->data.size);
+      if (result.data)
+        {
+          memcpy (result.data, entry->data.data, entry->data.size);
+          result.size = entry->data.size;
+        }
+    }
+
+  pthread_mutex_unlock (&self->mutex);
+
+  if (result.data)
+    atomic_fetch_add (&self->hits, 1);
+  else
+    atomic_fetch_add (&self->misses, 1);
+
+  debug (CONNECTION, "session cache %s", result.data ? "hit" : "miss");
+
+  return result;
+}
+
+static int
+session_cache_remove (void           *data,
+                      gnutls_datum_t  key)
+{
+  SessionCache *self = data;
+  int ret = -1;
+
+  pthread_mutex_lock (&self->mutex);
+
+  SessionCacheEntry *entry = session_cache_lookup (self, &key);
+  if (datum_equal (&entry->key, &key))
+    {
+      datum_clear (&entry->key);
+      datum_clear (&entry->data);
+      ret = 0;
+    }
+
+  pthread_mutex_unlock (&self->mutex);
+
+  return ret;
+}
+
+/**
+ * session_cache_new: Create a session cache
+ *
+ * @n_entries: maximum number of cached sessions; must be positive
+ */
+SessionCache *
+session_cache_new (unsigned n_entries)
+{
+  SessionCache *self = callocx (1, sizeof (SessionCache));
+
+  assert (n_entries > 0);
+
+  pthread_mutex_init (&self->mutex, NULL);
+  self->entries = callocx (n_entries, sizeof (SessionCacheEntry));
+  self->n_entries = n_entries;
+
+  return self;
+}
+
+void
+session_cache_free (SessionCache *self)
+{
+  for (unsigned i = 0; i < self->n_entries; i++)
+    {
+      datum_clear (&self->entries[i].key);
+      datum_clear (&self->entries[i].data);
+    }
+
+  pthread_mutex_destroy (&self->mutex);
+  free (self->entries);
+  free (self);
+}
+
+/**
+ * session_cache_attach: Use the cache for a (server) session
+ */
+void
+session_cache_attach (SessionCache     *self,
+                      gnutls_session_t  session)
+{
+  gnutls_db_set_ptr (session, self);
+  gnutls_db_set_store_function (session, session_cache_store);
+  gnutls_db_set_retrieve_function (session, session_cache_retrieve);
+  gnutls_db_set_remove_function (session, session_cache_remove);
+}
+
+/**
+ * session_cache_get_counters: Get the number of successful and failed lookups
+ */
+void
+session_cache_get_counters (SessionCache  *self,
+                            unsigned long *hits,
+                            unsigned long *misses)
+{
+  *hits = atomic_load (&self->hits);
+  *misses = atomic_load (&self->misses);
+}
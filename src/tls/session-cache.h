@@ -0,0 +1,39 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gnutls/gnutls.h>
+
+typedef struct _SessionCache SessionCache;
+
+SessionCache *
+session_cache_new (unsigned n_entries);
+
+void
+session_cache_free (SessionCache *self);
+
+void
+session_cache_attach (SessionCache     *self,
+                      gnutls_session_t  session);
+
+void
+session_cache_get_counters (SessionCache  *self,
+                            unsigned long *hits,
+                            unsigned long *misses);
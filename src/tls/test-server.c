@@ -26,17 +26,23 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <sys/poll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gnutls/x509.h>
 
+#include "buffer-pool.h"
 #include "connection.h"
 #include "testing.h"
 #include "server.h"
+#include "socket-io.h"
 #include "utils.h"
+#include "worker.h"
+#include "wsinstance.h"
 #include "testlib/cockpittest.h"
 #include "common/cockpithacks-glib.h"
 
@@ -69,6 +75,11 @@ typedef struct {
   const char *client_crt;
   const char *client_key;
   const char *client_fingerprint;
+  unsigned workers;
+  unsigned session_cache;
+  const char *client_priority;
+  bool splice;
+  unsigned accept_threads;
 } TestFixture;
 
 static const TestFixture fixture_separate_crt_key = {
@@ -107,6 +118,77 @@ static const TestFixture fixture_run_idle = {
   .idle_timeout = 1,
 };
 
+static const TestFixture fixture_workers = {
+  .workers = 2,
+};
+
+static const TestFixture fixture_workers_separate_crt_key = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .workers = 2,
+};
+
+static const TestFixture fixture_one_worker_separate_crt_key = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .workers = 1,
+};
+
+static const TestFixture fixture_workers_client_cert = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .cert_request_mode = GNUTLS_CERT_REQUEST,
+  .client_crt = CLIENT_CERTFILE,
+  .client_key = CLIENT_KEYFILE,
+  .client_fingerprint = CLIENT_CERT_FINGERPRINT,
+  .workers = 2,
+};
+
+/* TLS 1.2 without tickets needs the server side session cache */
+static const TestFixture fixture_session_cache = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .session_cache = 16,
+  .client_priority = "NORMAL:-VERS-TLS1.3:%NO_TICKETS",
+};
+
+static const TestFixture fixture_workers_session_cache = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .session_cache = 16,
+  .client_priority = "NORMAL:-VERS-TLS1.3:%NO_TICKETS",
+  .workers = 2,
+};
+
+static const TestFixture fixture_splice = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .splice = true,
+};
+
+static const TestFixture fixture_workers_splice = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .splice = true,
+  .workers = 2,
+};
+
+static const TestFixture fixture_accept_threads = {
+  .accept_threads = 2,
+};
+
+static const TestFixture fixture_accept_threads_run_idle = {
+  .idle_timeout = 1,
+  .accept_threads = 2,
+};
+
+static const TestFixture fixture_workers_accept_threads = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .workers = 2,
+  .accept_threads = 2,
+};
+
 /* for forking test cases, where server's SIGCHLD handling gets in the way */
 static void
 block_sigchld (void)
@@ -395,7 +477,17 @@ setup (TestCase *tc, gconstpointer data)
   server_init (tc->ws_socket_dir, tc->runtime_dir, fixture ? fixture->idle_timeout : 0, 0);
 
   if (fixture && fixture->certfile)
-    connection_crypto_init (fixture->certfile, fixture->keyfile, false, fixture->cert_request_mode);
+    {
+      connection_crypto_init (fixture->certfile, fixture->keyfile, false, fixture->cert_request_mode);
+      connection_enable_session_cache (fixture->session_cache);
+    }
+
+  server_set_workers (fixture ? fixture->workers : 0);
+
+  if (fixture && fixture->splice)
+    connection_enable_splice ();
+
+  server_start_accept_threads (fixture ? fixture->accept_threads : 0);
 
   /* Figure out the socket address we ought to connect to */
   socklen_t addrlen = sizeof tc->server_addr;
@@ -510,6 +602,359 @@ test_tls_blocked_handshake (TestCase *tc, gconstpointer data)
     }
 }
 
+static void
+test_tls_stalled_handshake (TestCase *tc, gconstpointer data)
+{
+  struct pollfd pfd = { .events = POLLIN };
+  char buf[100];
+
+  connection_set_setup_timeout (500);
+
+  pfd.fd = do_connect (tc);
+  send_request (pfd.fd, "\x16"); /* start the TLS handshake, and never finish it */
+
+  /* the server must give up on the handshake and drop the connection */
+  for (int retries = 0; retries < 100 && poll (&pfd, 1, 0) == 0; ++retries) /* 5s */
+    server_poll_event (50);
+  g_assert_cmpint (poll (&pfd, 1, 0), ==, 1);
+  g_assert_cmpint (recv (pfd.fd, buf, sizeof buf, 0), <=, 0);
+  close (pfd.fd);
+
+  for (int retries = 0; retries < 10 && server_num_connections () > 0; ++retries)
+    server_poll_event (100);
+  g_assert_cmpuint (server_num_connections (), ==, 0);
+}
+
+static void
+test_tls_many_blocked_handshakes (TestCase *tc, gconstpointer data)
+{
+  const unsigned n_blocked = 5000;
+  struct rlimit rl;
+  int ready_pipe[2];
+  int hold_pipe[2];
+
+  /* both the clients and the server side live in this process */
+  g_assert_cmpint (getrlimit (RLIMIT_NOFILE, &rl), ==, 0);
+  if (rl.rlim_max < 2 * n_blocked + 256)
+    {
+      g_test_skip ("RLIMIT_NOFILE is too small");
+      return;
+    }
+  rl.rlim_cur = rl.rlim_max;
+  g_assert_cmpint (setrlimit (RLIMIT_NOFILE, &rl), ==, 0);
+
+  block_sigchld ();
+  g_assert_cmpint (pipe (ready_pipe), ==, 0);
+  g_assert_cmpint (pipe (hold_pipe), ==, 0);
+
+  pid_t pid = fork ();
+  if (pid == -1)
+    g_error ("fork failed: %m");
+
+  if (pid == 0)
+    {
+      /* child: start lots of TLS handshakes, and never finish them */
+      char b;
+
+      close (ready_pipe[0]);
+      close (hold_pipe[1]);
+
+      for (unsigned i = 0; i < n_blocked; i++)
+        {
+          int fd = do_connect (tc);
+          g_assert_cmpint (fd, >, 0);
+          send_request (fd, "\x16");
+        }
+
+      g_assert_cmpint (write (ready_pipe[1], "x", 1), ==, 1);
+
+      /* keep the connections open until the parent is done */
+      g_assert_cmpint (read (hold_pipe[0], &b, 1), ==, 0);
+      exit (0);
+    }
+
+  close (ready_pipe[1]);
+  close (hold_pipe[0]);
+
+  /* accept all of them */
+  struct pollfd pfd = { .fd = ready_pipe[0], .events = POLLIN };
+  while (poll (&pfd, 1, 0) == 0)
+    server_poll_event (10);
+  while (server_poll_event (0))
+    ;
+  close (ready_pipe[0]);
+
+  g_assert_cmpuint (server_num_connections (), >=, n_blocked);
+
+  /* a legitimate client still gets through in a reasonable time */
+  gint64 start = g_get_monotonic_time ();
+  assert_https (tc, data, 1);
+  g_assert_cmpint (g_get_monotonic_time () - start, <, 5 * G_USEC_PER_SEC);
+
+  /* release the blocked connections */
+  close (hold_pipe[1]);
+  int status;
+  g_assert_cmpint (waitpid (pid, &status, 0), ==, pid);
+  g_assert_cmpint (status, ==, 0);
+}
+
+static void
+wait_buffers_released (void)
+{
+  size_t in_use, cached;
+  unsigned largest;
+
+  for (int retry = 0; retry < 100; retry++)
+    {
+      buffer_pool_get_stats (&in_use, &cached, &largest);
+      if (in_use == 0)
+        break;
+      server_poll_event (50);
+    }
+
+  g_assert_cmpuint (in_use, ==, 0);
+}
+
+/* replace http.sock with a trivial echo server, for @n_clients connections */
+static pid_t
+spawn_echo_wsinstance (TestCase *tc,
+                       unsigned  n_clients)
+{
+  int ready[2];
+  char c;
+
+  g_assert_no_errno (pipe (ready));
+
+  pid_t pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      int dirfd = open (tc->ws_socket_dir, O_PATH | O_DIRECTORY);
+      int listener = socket (AF_UNIX, SOCK_STREAM, 0);
+      int status;
+
+      g_assert_no_errno (unlinkat (dirfd, "http.sock", 0));
+      g_assert_no_errno (af_unix_bindat (listener, dirfd, "http.sock"));
+      g_assert_no_errno (listen (listener, n_clients));
+      g_assert_cmpint (write (ready[1], "x", 1), ==, 1);
+
+      for (unsigned i = 0; i < n_clients; i++)
+        {
+          int fd = accept (listener, NULL, NULL);
+          g_assert_cmpint (fd, >=, 0);
+
+          pid_t child = fork ();
+          g_assert_cmpint (child, >=, 0);
+          if (child == 0)
+            {
+              static char buffer[64 << 10];
+              ssize_t len;
+
+              close (listener);
+              while ((len = read (fd, buffer, sizeof buffer)) > 0)
+                g_assert_cmpint (write (fd, buffer, len), ==, len);
+              exit (0);
+            }
+
+          close (fd);
+        }
+
+      close (listener);
+      for (unsigned i = 0; i < n_clients; i++)
+        {
+          g_assert_cmpint (wait (&status), >, 0);
+          g_assert_cmpint (status, ==, 0);
+        }
+      exit (0);
+    }
+
+  close (ready[1]);
+  g_assert_cmpint (read (ready[0], &c, 1), ==, 1);
+  close (ready[0]);
+
+  return pid;
+}
+
+/* stream data through the proxy and the echo server, and check what comes back */
+static void
+echo_bulk (int    fd,
+           size_t size)
+{
+  static char out[64 << 10];
+  static char in[64 << 10];
+  size_t sent = 0;
+  size_t received = 0;
+  int flags = fcntl (fd, F_GETFL);
+
+  g_assert_no_errno (fcntl (fd, F_SETFL, flags | O_NONBLOCK));
+
+  while (received < size)
+    {
+      struct pollfd pfd = { .fd = fd, .events = POLLIN | (sent < size ? POLLOUT : 0) };
+      g_assert_cmpint (poll (&pfd, 1, 10000), ==, 1);
+
+      if (pfd.revents & POLLOUT)
+        {
+          size_t len = MIN (sizeof out, size - sent);
+          for (size_t i = 0; i < len; i++)
+            out[i] = (sent + i) * 7 + (sent + i) / 4096;
+          ssize_t r = write (fd, out, len);
+          g_assert (r > 0 || errno == EAGAIN);
+          if (r > 0)
+            sent += r;
+        }
+
+      if (pfd.revents & POLLIN)
+        {
+          ssize_t r = read (fd, in, sizeof in);
+          g_assert (r > 0 || (r < 0 && errno == EAGAIN));
+          for (ssize_t i = 0; i < r; i++, received++)
+            g_assert_cmpint ((char) (received * 7 + received / 4096), ==, in[i]);
+        }
+    }
+
+  g_assert_no_errno (fcntl (fd, F_SETFL, flags));
+}
+
+static void
+test_idle_memory (TestCase *tc, gconstpointer data)
+{
+  const TestFixture *fixture = data;
+  const int n_connections = 50;
+  size_t in_use, cached;
+  unsigned largest;
+  int ready[2];
+  int done[2];
+  pid_t echo_pid;
+  pid_t pid;
+  int status = -1;
+
+  block_sigchld ();
+  echo_pid = spawn_echo_wsinstance (tc, n_connections);
+  g_assert_no_errno (pipe (ready));
+  g_assert_no_errno (pipe (done));
+
+  /* open a bunch of connections which each move some data, and then sit idle */
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      int fds[n_connections];
+      char c;
+
+      close (ready[0]);
+      close (done[1]);
+
+      for (int i = 0; i < n_connections; i++)
+        {
+          fds[i] = do_connect (tc);
+          g_assert_cmpint (fds[i], >, 0);
+          echo_bulk (fds[i], 2 << 20);
+        }
+
+      g_assert_cmpint (write (ready[1], "x", 1), ==, 1);
+      g_assert_cmpint (read (done[0], &c, 1), ==, 0);
+
+      for (int i = 0; i < n_connections; i++)
+        close (fds[i]);
+      exit (0);
+    }
+
+  close (ready[1]);
+  close (done[0]);
+
+  struct pollfd pfd = { .fd = ready[0], .events = POLLIN };
+  while (poll (&pfd, 1, 0) == 0)
+    server_poll_event (100);
+  g_assert_cmpint (server_num_connections (), ==, n_connections);
+
+  /* idle connections don't hold any buffer memory, and the memory which they
+   * used during the transfer didn't stay with their threads */
+  wait_buffers_released ();
+  buffer_pool_get_stats (&in_use, &cached, &largest);
+  g_test_message ("buffer memory per idle connection: %zu bytes, %zu bytes cached in the pool",
+                  in_use / n_connections, cached);
+  g_assert_cmpuint (largest, >, BUFFER_POOL_MIN_SIZE);
+  g_assert_cmpuint (cached, <=, BUFFER_POOL_MAX_CACHED +
+                    (fixture ? fixture->workers : 0) * BUFFER_POOL_THREAD_MAX_CACHED);
+
+  close (done[1]);
+  close (ready[0]);
+  for (int retry = 0; retry < 100 && waitpid (pid, &status, WNOHANG) <= 0; ++retry)
+    server_poll_event (100);
+  g_assert_cmpint (status, ==, 0);
+  for (int retry = 0; retry < 100 && waitpid (echo_pid, &status, WNOHANG) <= 0; ++retry)
+    server_poll_event (100);
+  g_assert_cmpint (status, ==, 0);
+}
+
+static void
+test_bulk_throughput (TestCase *tc, gconstpointer data)
+{
+  const size_t size = 32 << 20;
+  size_t in_use, cached;
+  unsigned largest;
+  pid_t echo_pid;
+  pid_t pid;
+  int status = -1;
+
+  block_sigchld ();
+  echo_pid = spawn_echo_wsinstance (tc, 1);
+
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      int fd = do_connect (tc);
+      gint64 start = g_get_monotonic_time ();
+
+      g_assert_cmpint (fd, >, 0);
+      echo_bulk (fd, size);
+
+      g_test_message ("relayed %zu MiB in both directions at %.0f MiB/s", size >> 20,
+                      (double) (size >> 20) * G_USEC_PER_SEC / (g_get_monotonic_time () - start));
+
+      close (fd);
+      exit (0);
+    }
+
+  for (int retry = 0; retry < 600 && waitpid (pid, &status, WNOHANG) <= 0; ++retry)
+    server_poll_event (100);
+  g_assert_cmpint (status, ==, 0);
+  g_assert_cmpint (waitpid (echo_pid, &status, 0), ==, echo_pid);
+  g_assert_cmpint (status, ==, 0);
+
+  /* the buffers grew under load, and give back their memory afterwards */
+  wait_buffers_released ();
+  buffer_pool_get_stats (&in_use, &cached, &largest);
+  g_assert_cmpuint (largest, >, BUFFER_POOL_MIN_SIZE);
+  g_assert_cmpuint (largest, <=, CONNECTION_DEFAULT_MAX_BUFFER_SIZE);
+}
+
+static void
+test_accept_burst (TestCase *tc, gconstpointer data)
+{
+  const unsigned n_connections = 100;
+  int fds[n_connections];
+
+  for (unsigned i = 0; i < n_connections; i++)
+    {
+      fds[i] = do_connect (tc);
+      g_assert_cmpint (fds[i], >, 0);
+    }
+
+  /* the accept threads take them all, without any help from the main loop */
+  for (int retry = 0; retry < 500 && server_num_connections () < n_connections; retry++)
+    g_usleep (10000);
+  g_assert_cmpuint (server_num_connections (), ==, n_connections);
+
+  for (unsigned i = 0; i < n_connections; i++)
+    close (fds[i]);
+}
+
 static void
 test_no_tls_many_parallel (TestCase *tc, gconstpointer data)
 {
@@ -767,6 +1212,495 @@ test_tls_client_cert_parallel (TestCase *tc, gconstpointer data)
   g_assert_cmpint (status, ==, 0);
 }
 
+static unsigned
+count_certfiles (TestCase *tc)
+{
+  g_autoptr(GDir) dir = g_dir_open (tc->clients_dir, 0, NULL);
+  unsigned count = 0;
+
+  g_assert (dir != NULL);
+  while (g_dir_read_name (dir))
+    count++;
+
+  return count;
+}
+
+typedef struct {
+  TestCase *tc;
+  gnutls_certificate_credentials_t xcred;
+  int fd;
+  gnutls_session_t session;
+} SharedCertClient;
+
+static gpointer
+shared_cert_client_thread (gpointer data)
+{
+  SharedCertClient *client = data;
+  char buffer[6];
+  ssize_t s;
+
+  client->fd = do_connect (client->tc);
+  g_assert_cmpint (client->fd, >, 0);
+
+  g_assert_cmpint (gnutls_init (&client->session, GNUTLS_CLIENT), ==, GNUTLS_E_SUCCESS);
+  gnutls_transport_set_int (client->session, client->fd);
+  g_assert_cmpint (gnutls_set_default_priority (client->session), ==, GNUTLS_E_SUCCESS);
+  g_assert_cmpint (gnutls_credentials_set (client->session, GNUTLS_CRD_CERTIFICATE, client->xcred), ==, GNUTLS_E_SUCCESS);
+  gnutls_handshake_set_timeout (client->session, 10000);
+  g_assert_cmpint (gnutls_handshake (client->session), ==, GNUTLS_E_SUCCESS);
+
+  /* the instance greets us once cockpit-tls connected us to it, which is after writing the file */
+  do
+    s = gnutls_record_recv (client->session, buffer, sizeof buffer);
+  while (s == GNUTLS_E_INTERRUPTED || s == GNUTLS_E_AGAIN);
+  g_assert_cmpint (s, ==, 5);
+  g_assert (memcmp (buffer, "hello", 5) == 0);
+
+  return NULL;
+}
+
+static void
+test_tls_client_cert_shared_file (TestCase *tc, gconstpointer data)
+{
+  const TestFixture *fixture = data;
+  pid_t pid, r = 0;
+  int status = -1;
+
+  if (cockpit_test_skip_slow ())
+    return;
+
+  block_sigchld ();
+
+  /* do the connections in a subprocess, as gnutls_handshake is synchronous */
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      gnutls_certificate_credentials_t xcred;
+      const unsigned n_connections = 50;
+      SharedCertClient clients[n_connections];
+      GThread *threads[n_connections];
+
+      g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
+      g_assert_cmpint (gnutls_certificate_set_x509_system_trust (xcred), >=, 0);
+      g_assert_cmpint (gnutls_certificate_set_x509_key_file (xcred,
+                                                             fixture->client_crt,
+                                                             fixture->client_key,
+                                                             GNUTLS_X509_FMT_PEM),
+                       ==, GNUTLS_E_SUCCESS);
+
+      g_assert_cmpuint (count_certfiles (tc), ==, 0);
+
+      /* handshake in parallel, so that the connections race for writing the file */
+      for (unsigned i = 0; i < n_connections; ++i)
+        {
+          clients[i] = (SharedCertClient) { .tc = tc, .xcred = xcred };
+          threads[i] = g_thread_new ("client", shared_cert_client_thread, &clients[i]);
+        }
+      for (unsigned i = 0; i < n_connections; ++i)
+        g_thread_join (threads[i]);
+
+      /* all of them share a single file */
+      g_assert_cmpuint (count_certfiles (tc), ==, 1);
+      g_assert (check_for_certfile (tc, NULL));
+
+      /* it stays as long as any connection uses it */
+      for (unsigned i = 0; i < n_connections - 1; ++i)
+        {
+          g_assert_cmpint (gnutls_bye (clients[i].session, GNUTLS_SHUT_RDWR), ==, GNUTLS_E_SUCCESS);
+          close (clients[i].fd);
+          gnutls_deinit (clients[i].session);
+        }
+      g_usleep (100000);
+      g_assert_cmpuint (count_certfiles (tc), ==, 1);
+
+      g_assert_cmpint (gnutls_bye (clients[n_connections - 1].session, GNUTLS_SHUT_RDWR), ==, GNUTLS_E_SUCCESS);
+      close (clients[n_connections - 1].fd);
+      for (int retry = 0; retry < 100 && count_certfiles (tc) > 0; ++retry)
+        g_usleep (10000);
+      g_assert_cmpuint (count_certfiles (tc), ==, 0);
+      exit (0);
+    }
+
+  for (int retry = 0; retry < 300 && (r = waitpid (pid, &status, WNOHANG)) == 0; ++retry)
+    server_poll_event (100);
+  g_assert_cmpint (r, ==, pid);
+  g_assert_cmpint (status, ==, 0);
+}
+
+/* Replace the factory and the SHA256_NIL instance with a factory which
+ * takes its time to "start" the instance.  Exits with the number of
+ * activation requests it got, once @n_connections were made to the instance.
+ */
+static pid_t
+spawn_slow_wsinstance_factory (TestCase *tc,
+                               unsigned n_connections)
+{
+  int ready[2];
+  char c;
+
+  g_assert_no_errno (pipe (ready));
+
+  pid_t pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      int dirfd = open (tc->ws_socket_dir, O_PATH | O_DIRECTORY);
+      int factory = socket (AF_UNIX, SOCK_STREAM, 0);
+      int instance = socket (AF_UNIX, SOCK_STREAM, 0);
+      unsigned n_requests = 0;
+      unsigned n_accepted = 0;
+
+      g_assert_no_errno (unlinkat (dirfd, "https-factory.sock", 0));
+      g_assert_no_errno (unlinkat (dirfd, "https@" SHA256_NIL ".sock", 0));
+      g_assert_no_errno (af_unix_bindat (factory, dirfd, "https-factory.sock"));
+      g_assert_no_errno (listen (factory, 64));
+      g_assert_cmpint (write (ready[1], "x", 1), ==, 1);
+
+      while (n_accepted < n_connections)
+        {
+          struct pollfd pfds[] = {
+            { .fd = factory, .events = POLLIN },
+            { .fd = n_requests ? instance : -1, .events = POLLIN },
+          };
+
+          g_assert_cmpint (poll (pfds, G_N_ELEMENTS (pfds), 10000), >, 0);
+
+          if (pfds[0].revents & POLLIN)
+            {
+              char fingerprint[WSINSTANCE_MAX];
+              int fd = accept (factory, NULL, NULL);
+
+              g_assert_cmpint (fd, >=, 0);
+              g_assert (recv_alnum (fd, fingerprint, sizeof fingerprint, 1000000));
+              g_assert_cmpstr (fingerprint, ==, SHA256_NIL);
+
+              if (n_requests++ == 0)
+                {
+                  /* give the other connections time to pile up */
+                  g_usleep (200000);
+                  g_assert_no_errno (af_unix_bindat (instance, dirfd, "https@" SHA256_NIL ".sock"));
+                  g_assert_no_errno (listen (instance, 64));
+                }
+
+              g_assert (send_all (fd, "done", 4, 1000000));
+              close (fd);
+            }
+
+          if (pfds[1].revents & POLLIN)
+            {
+              int fd = accept (instance, NULL, NULL);
+
+              g_assert_cmpint (fd, >=, 0);
+              g_assert_cmpint (write (fd, "hello", 5), ==, 5);
+              n_accepted++;
+            }
+        }
+
+      exit (n_requests);
+    }
+
+  close (ready[1]);
+  g_assert_cmpint (read (ready[0], &c, 1), ==, 1);
+  close (ready[0]);
+
+  return pid;
+}
+
+static void
+test_tls_coalesced_activation (TestCase *tc, gconstpointer data)
+{
+  const TestFixture *fixture = data;
+  const unsigned n_connections = 20;
+  WsInstanceCounters counters;
+  pid_t factory_pid;
+  pid_t pid;
+  int status = -1;
+
+  if (cockpit_test_skip_slow ())
+    return;
+
+  block_sigchld ();
+  factory_pid = spawn_slow_wsinstance_factory (tc, n_connections);
+
+  /* open all connections while the instance is still being started */
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      gnutls_certificate_credentials_t xcred;
+      gnutls_session_t sessions[n_connections];
+      int fds[n_connections];
+
+      g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
+
+      for (unsigned i = 0; i < n_connections; ++i)
+        {
+          fds[i] = do_connect (tc);
+          g_assert_cmpint (fds[i], >, 0);
+
+          g_assert_cmpint (gnutls_init (&sessions[i], GNUTLS_CLIENT), ==, GNUTLS_E_SUCCESS);
+          gnutls_transport_set_int (sessions[i], fds[i]);
+          g_assert_cmpint (gnutls_set_default_priority (sessions[i]), ==, GNUTLS_E_SUCCESS);
+          g_assert_cmpint (gnutls_credentials_set (sessions[i], GNUTLS_CRD_CERTIFICATE, xcred), ==, GNUTLS_E_SUCCESS);
+          gnutls_handshake_set_timeout (sessions[i], 5000);
+          g_assert_cmpint (gnutls_handshake (sessions[i]), ==, GNUTLS_E_SUCCESS);
+        }
+
+      /* every one of them makes it to the instance */
+      for (unsigned i = 0; i < n_connections; ++i)
+        {
+          char buffer[6];
+          ssize_t s;
+
+          do
+            s = gnutls_record_recv (sessions[i], buffer, sizeof buffer);
+          while (s == GNUTLS_E_INTERRUPTED || s == GNUTLS_E_AGAIN);
+          g_assert_cmpint (s, ==, 5);
+          g_assert (memcmp (buffer, "hello", 5) == 0);
+
+          gnutls_deinit (sessions[i]);
+          close (fds[i]);
+        }
+
+      gnutls_certificate_free_credentials (xcred);
+      exit (0);
+    }
+
+  for (int retry = 0; retry < 200 && waitpid (pid, &status, WNOHANG) <= 0; ++retry)
+    server_poll_event (100);
+  g_assert_cmpint (status, ==, 0);
+
+  /* only the first connection asked the factory; the others waited for it */
+  g_assert_cmpint (waitpid (factory_pid, &status, 0), ==, factory_pid);
+  g_assert (WIFEXITED (status));
+  g_assert_cmpint (WEXITSTATUS (status), ==, 1);
+
+  wsinstance_get_counters (&counters);
+  g_assert_cmpuint (counters.activations, ==, 1);
+  g_assert_cmpuint (counters.activation_failures, ==, 0);
+  g_assert_cmpuint (counters.activation_time_max_ms, >=, 200);
+
+  if (fixture->workers)
+    {
+      /* the worker pool queued them up behind a single activation thread */
+      g_assert_cmpuint (worker_pool_get_max_activation_threads (), ==, 1);
+      g_assert_cmpuint (counters.coalesced_waits, ==, 0);
+    }
+  else
+    {
+      g_assert_cmpuint (counters.coalesced_waits, >, 0);
+      g_assert_cmpuint (counters.coalesced_waits, <, n_connections);
+    }
+}
+
+static void
+test_tls_activation_nonblocking (TestCase *tc, gconstpointer data)
+{
+  int got_request[2], release[2];
+  pid_t factory_pid, pid;
+  int status = -1;
+  char c;
+
+  block_sigchld ();
+  g_assert_no_errno (pipe (got_request));
+  g_assert_no_errno (pipe (release));
+
+  /* a factory which only answers once we tell it to */
+  factory_pid = fork ();
+  if (factory_pid < 0)
+    g_error ("failed to fork: %m");
+  if (factory_pid == 0)
+    {
+      char fingerprint[WSINSTANCE_MAX];
+      int dirfd = open (tc->ws_socket_dir, O_PATH | O_DIRECTORY);
+      int factory = socket (AF_UNIX, SOCK_STREAM, 0);
+      int instance = socket (AF_UNIX, SOCK_STREAM, 0);
+
+      close (got_request[0]);
+      close (release[1]);
+      g_assert_no_errno (unlinkat (dirfd, "https-factory.sock", 0));
+      g_assert_no_errno (unlinkat (dirfd, "https@" SHA256_NIL ".sock", 0));
+      g_assert_no_errno (af_unix_bindat (factory, dirfd, "https-factory.sock"));
+      g_assert_no_errno (listen (factory, 64));
+      g_assert_cmpint (write (got_request[1], "x", 1), ==, 1);
+
+      int fd = accept (factory, NULL, NULL);
+      g_assert_cmpint (fd, >=, 0);
+      g_assert (recv_alnum (fd, fingerprint, sizeof fingerprint, 10000000));
+      g_assert_cmpstr (fingerprint, ==, SHA256_NIL);
+      g_assert_cmpint (write (got_request[1], "x", 1), ==, 1);
+
+      g_assert_cmpint (read (release[0], &c, 1), ==, 0);
+      g_assert (send_all (fd, "fail", 4, 1000000));
+      close (fd);
+
+      /* teardown expects the instance socket */
+      g_assert_no_errno (af_unix_bindat (instance, dirfd, "https@" SHA256_NIL ".sock"));
+      exit (0);
+    }
+
+  close (got_request[1]);
+  close (release[0]);
+  g_assert_cmpint (read (got_request[0], &c, 1), ==, 1);
+
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      gnutls_certificate_credentials_t xcred;
+      gnutls_session_t session;
+      char buffer[6];
+      ssize_t s;
+      int fd;
+
+      /* only the parent may release the factory */
+      close (release[1]);
+      close (got_request[0]);
+
+      fd = do_connect (tc);
+      g_assert_cmpint (fd, >, 0);
+      g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
+      g_assert_cmpint (gnutls_init (&session, GNUTLS_CLIENT), ==, GNUTLS_E_SUCCESS);
+      gnutls_transport_set_int (session, fd);
+      g_assert_cmpint (gnutls_set_default_priority (session), ==, GNUTLS_E_SUCCESS);
+      g_assert_cmpint (gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred), ==, GNUTLS_E_SUCCESS);
+      gnutls_handshake_set_timeout (session, 5000);
+      g_assert_cmpint (gnutls_handshake (session), ==, GNUTLS_E_SUCCESS);
+
+      /* the activation fails, so the server hangs up */
+      do
+        s = gnutls_record_recv (session, buffer, sizeof buffer);
+      while (s == GNUTLS_E_INTERRUPTED || s == GNUTLS_E_AGAIN);
+      g_assert_cmpint (s, <=, 0);
+
+      gnutls_deinit (session);
+      gnutls_certificate_free_credentials (xcred);
+      close (fd);
+      exit (0);
+    }
+
+  /* wait until the factory got the request... */
+  struct pollfd pfd = { .fd = got_request[0], .events = POLLIN };
+  for (int retry = 0; retry < 100 && poll (&pfd, 1, 0) == 0; ++retry)
+    server_poll_event (100);
+  g_assert_cmpint (read (got_request[0], &c, 1), ==, 1);
+
+  /* ... which must not hold up the only worker */
+  assert_http (tc);
+
+  close (release[1]);
+  for (int retry = 0; retry < 100 && waitpid (pid, &status, WNOHANG) == 0; ++retry)
+    server_poll_event (100);
+  g_assert_cmpint (status, ==, 0);
+
+  g_assert_cmpint (waitpid (factory_pid, &status, 0), ==, factory_pid);
+  g_assert_cmpint (status, ==, 0);
+  close (got_request[0]);
+}
+
+/* do a request on a new TLS connection, resuming @session if given; returns whether it was resumed */
+static bool
+https_request_resume (TestCase *tc,
+                      const TestFixture *fixture,
+                      gnutls_certificate_credentials_t xcred,
+                      gnutls_datum_t *session_data)
+{
+  const char request[] = "GET / HTTP/1.0\r\nHost: localhost\r\n\r\n";
+  char buf[4096];
+  gnutls_session_t session;
+  bool resumed;
+  ssize_t len;
+  int fd = do_connect (tc);
+
+  g_assert_cmpint (fd, >, 0);
+
+  g_assert_cmpint (gnutls_init (&session, GNUTLS_CLIENT), ==, GNUTLS_E_SUCCESS);
+  gnutls_transport_set_int (session, fd);
+  if (fixture->client_priority)
+    g_assert_cmpint (gnutls_priority_set_direct (session, fixture->client_priority, NULL), ==, GNUTLS_E_SUCCESS);
+  else
+    g_assert_cmpint (gnutls_set_default_priority (session), ==, GNUTLS_E_SUCCESS);
+  gnutls_handshake_set_timeout (session, 5000);
+  g_assert_cmpint (gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred), ==, GNUTLS_E_SUCCESS);
+  if (session_data->data)
+    g_assert_cmpint (gnutls_session_set_data (session, session_data->data, session_data->size), ==, GNUTLS_E_SUCCESS);
+
+  g_assert_cmpint (gnutls_handshake (session), ==, GNUTLS_E_SUCCESS);
+  resumed = gnutls_session_is_resumed (session);
+
+  g_assert_cmpint (gnutls_record_send (session, request, sizeof (request)), ==, sizeof (request));
+
+  /* TLS 1.3 session tickets arrive after the handshake, and make this return EAGAIN */
+  do
+    len = gnutls_record_recv (session, buf, sizeof (buf) - 1);
+  while (len == GNUTLS_E_AGAIN || len == GNUTLS_E_INTERRUPTED);
+  g_assert_cmpint (len, >=, 100);
+  buf[len] = '\0';
+  cockpit_assert_strmatch (buf, "HTTP/1.1 *");
+
+  gnutls_free (session_data->data);
+  g_assert_cmpint (gnutls_session_get_data2 (session, session_data), ==, GNUTLS_E_SUCCESS);
+
+  g_assert_cmpint (gnutls_bye (session, GNUTLS_SHUT_RDWR), ==, GNUTLS_E_SUCCESS);
+  gnutls_deinit (session);
+  close (fd);
+
+  return resumed;
+}
+
+static void
+test_tls_resumption (TestCase *tc, gconstpointer data)
+{
+  const TestFixture *fixture = data;
+  unsigned long full, resumed, hits, misses;
+  pid_t pid;
+  int status = -1;
+
+  block_sigchld ();
+
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      gnutls_certificate_credentials_t xcred;
+      gnutls_datum_t session_data = { NULL, 0 };
+
+      g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
+      if (fixture->client_crt)
+        g_assert_cmpint (gnutls_certificate_set_x509_key_file (xcred, fixture->client_crt, fixture->client_key,
+                                                               GNUTLS_X509_FMT_PEM), ==, GNUTLS_E_SUCCESS);
+
+      g_assert_false (https_request_resume (tc, fixture, xcred, &session_data));
+      g_assert_true (https_request_resume (tc, fixture, xcred, &session_data));
+      g_assert_true (https_request_resume (tc, fixture, xcred, &session_data));
+
+      gnutls_free (session_data.data);
+      gnutls_certificate_free_credentials (xcred);
+      exit (0);
+    }
+
+  for (int retry = 0; retry < 100 && waitpid (pid, &status, WNOHANG) <= 0; ++retry)
+    server_poll_event (200);
+  g_assert_cmpint (status, ==, 0);
+
+  /* client certificates of resumed sessions get cleaned up as well */
+  g_assert (!check_for_certfile (tc, NULL));
+
+  connection_get_session_counters (&full, &resumed, &hits, &misses);
+  g_assert_cmpuint (full, ==, 1);
+  g_assert_cmpuint (resumed, ==, 2);
+  if (fixture->session_cache)
+    g_assert_cmpuint (hits, ==, 2);
+  else
+    g_assert_cmpuint (hits + misses, ==, 0);
+}
+
 static void
 test_mixed_protocols (TestCase *tc, gconstpointer data)
 {
@@ -776,6 +1710,62 @@ test_mixed_protocols (TestCase *tc, gconstpointer data)
   assert_http (tc);
 }
 
+static unsigned long
+metrics_value (const char *metrics, const char *name)
+{
+  g_autofree gchar *line = g_strconcat ("\n", name, " ", NULL);
+  const char *pos = strstr (metrics, line);
+
+  g_assert (pos != NULL);
+  return strtoul (pos + strlen (line), NULL, 10);
+}
+
+static void
+test_metrics (TestCase *tc, gconstpointer data)
+{
+  struct sockaddr_un sa = { .sun_family = AF_UNIX };
+  g_autofree gchar *path = g_build_filename (tc->runtime_dir, "metrics.sock", NULL);
+  g_autoptr(GString) metrics = g_string_new ("");
+  char buf[1024];
+  int fd;
+
+  assert_http (tc);
+  assert_https (tc, data, 1);
+
+  /* the counters are final when the connections are gone */
+  for (int retries = 0; retries < 20 && server_num_connections () > 0; ++retries)
+    server_poll_event (100);
+  g_assert_cmpuint (server_num_connections (), ==, 0);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpuint (strlen (path), <, sizeof sa.sun_path);
+  strcpy (sa.sun_path, path);
+  g_assert_cmpint (connect (fd, (struct sockaddr *) &sa, sizeof sa), ==, 0);
+
+  /* the main loop answers it */
+  g_assert (server_poll_event (1000));
+
+  for (;;)
+    {
+      ssize_t len = recv (fd, buf, sizeof buf, 0);
+      g_assert_cmpint (len, >=, 0);
+      if (len == 0)
+        break;
+      g_string_append_len (metrics, buf, len);
+    }
+  close (fd);
+
+  g_assert_cmpuint (metrics_value (metrics->str, "cockpit_tls_connections_accepted_total"), ==, 2);
+  g_assert_cmpuint (metrics_value (metrics->str, "cockpit_tls_connections_active"), ==, 0);
+  g_assert_cmpuint (metrics_value (metrics->str, "cockpit_tls_handshakes_total{result=\"full\"}"), ==, 1);
+  g_assert_cmpuint (metrics_value (metrics->str, "cockpit_tls_handshakes_total{result=\"failed\"}"), ==, 0);
+  g_assert_cmpuint (metrics_value (metrics->str, "cockpit_tls_handshake_duration_seconds_count"), ==, 1);
+  g_assert_cmpuint (metrics_value (metrics->str, "cockpit_tls_ws_connections_active{instance=\"http\"}"), ==, 0);
+  g_assert_cmpuint (metrics_value (metrics->str, "cockpit_tls_relayed_bytes_total{direction=\"client-to-ws\"}"), >, 0);
+  g_assert_cmpuint (metrics_value (metrics->str, "cockpit_tls_relayed_bytes_total{direction=\"ws-to-client\"}"), >, 0);
+}
+
 static void
 test_run_idle (TestCase *tc, gconstpointer data)
 {
@@ -812,16 +1802,74 @@ main (int argc, char *argv[])
               setup, test_tls_client_cert_parallel, teardown);
   g_test_add ("/server/tls/client-cert-parallel/alternate", TestCase, &fixture_alternate_client_cert,
               setup, test_tls_client_cert_parallel, teardown);
+  g_test_add ("/server/tls/client-cert-shared-file", TestCase, &fixture_alternate_client_cert,
+              setup, test_tls_client_cert_shared_file, teardown);
+  g_test_add ("/server/tls/coalesced-activation", TestCase, &fixture_separate_crt_key,
+              setup, test_tls_coalesced_activation, teardown);
+  g_test_add ("/server/workers/tls/coalesced-activation", TestCase, &fixture_workers_separate_crt_key,
+              setup, test_tls_coalesced_activation, teardown);
+  g_test_add ("/server/workers/tls/activation-nonblocking", TestCase, &fixture_one_worker_separate_crt_key,
+              setup, test_tls_activation_nonblocking, teardown);
   g_test_add ("/server/tls/no-server-cert", TestCase, NULL,
               setup, test_tls_no_server_cert, teardown);
   g_test_add ("/server/tls/redirect", TestCase, &fixture_separate_crt_key,
               setup, test_tls_redirect, teardown);
   g_test_add ("/server/tls/blocked-handshake", TestCase, &fixture_separate_crt_key,
               setup, test_tls_blocked_handshake, teardown);
+  g_test_add ("/server/tls/stalled-handshake", TestCase, &fixture_separate_crt_key,
+              setup, test_tls_stalled_handshake, teardown);
+  g_test_add ("/server/tls/resumption/tickets", TestCase, &fixture_separate_crt_key_client_cert,
+              setup, test_tls_resumption, teardown);
+  g_test_add ("/server/tls/resumption/session-cache", TestCase, &fixture_session_cache,
+              setup, test_tls_resumption, teardown);
+  g_test_add ("/server/metrics", TestCase, &fixture_separate_crt_key,
+              setup, test_metrics, teardown);
   g_test_add ("/server/mixed-protocols", TestCase, &fixture_separate_crt_key,
               setup, test_mixed_protocols, teardown);
+  g_test_add ("/server/no-tls/idle-memory", TestCase, NULL,
+              setup, test_idle_memory, teardown);
+  g_test_add ("/server/no-tls/bulk-throughput", TestCase, NULL,
+              setup, test_bulk_throughput, teardown);
+  g_test_add ("/server/splice/no-tls/many-serial", TestCase, &fixture_splice,
+              setup, test_no_tls_many_serial, teardown);
+  g_test_add ("/server/splice/mixed-protocols", TestCase, &fixture_splice,
+              setup, test_mixed_protocols, teardown);
   g_test_add ("/server/run-idle", TestCase, &fixture_run_idle,
               setup, test_run_idle, teardown);
+  g_test_add ("/server/accept-threads/no-tls/many-serial", TestCase, &fixture_accept_threads,
+              setup, test_no_tls_many_serial, teardown);
+  g_test_add ("/server/accept-threads/burst", TestCase, &fixture_accept_threads,
+              setup, test_accept_burst, teardown);
+  g_test_add ("/server/accept-threads/run-idle", TestCase, &fixture_accept_threads_run_idle,
+              setup, test_run_idle, teardown);
+  g_test_add ("/server/workers/no-tls/single-request", TestCase, &fixture_workers,
+              setup, test_no_tls_single, teardown);
+  g_test_add ("/server/workers/no-tls/many-serial", TestCase, &fixture_workers,
+              setup, test_no_tls_many_serial, teardown);
+  g_test_add ("/server/workers/tls/client-cert", TestCase, &fixture_workers_client_cert,
+              setup, test_tls_client_cert, teardown);
+  g_test_add ("/server/workers/tls/client-cert-parallel", TestCase, &fixture_workers_client_cert,
+              setup, test_tls_client_cert_parallel, teardown);
+  g_test_add ("/server/workers/mixed-protocols", TestCase, &fixture_workers_separate_crt_key,
+              setup, test_mixed_protocols, teardown);
+  g_test_add ("/server/workers/tls/resumption/session-cache", TestCase, &fixture_workers_session_cache,
+              setup, test_tls_resumption, teardown);
+  g_test_add ("/server/workers/no-tls/idle-memory", TestCase, &fixture_workers,
+              setup, test_idle_memory, teardown);
+  g_test_add ("/server/workers/no-tls/bulk-throughput", TestCase, &fixture_workers,
+              setup, test_bulk_throughput, teardown);
+  g_test_add ("/server/workers/splice/mixed-protocols", TestCase, &fixture_workers_splice,
+              setup, test_mixed_protocols, teardown);
+  g_test_add ("/server/workers/tls/blocked-handshake", TestCase, &fixture_workers_separate_crt_key,
+              setup, test_tls_blocked_handshake, teardown);
+  g_test_add ("/server/workers/tls/stalled-handshake", TestCase, &fixture_workers_separate_crt_key,
+              setup, test_tls_stalled_handshake, teardown);
+  g_test_add ("/server/workers/tls/many-blocked-handshakes", TestCase, &fixture_workers_separate_crt_key,
+              setup, test_tls_many_blocked_handshakes, teardown);
+  g_test_add ("/server/workers/accept-threads/burst", TestCase, &fixture_workers_accept_threads,
+              setup, test_accept_burst, teardown);
+  g_test_add ("/server/workers/accept-threads/mixed-protocols", TestCase, &fixture_workers_accept_threads,
+              setup, test_mixed_protocols, teardown);
 
   return g_test_run ();
 }
@@ -32,6 +32,7 @@
 #define DEBUG_SERVER 1
 #define DEBUG_FACTORY 1
 #define DEBUG_SOCKET_IO 1
+#define DEBUG_WSINSTANCE 1
 
 /* socket-activation-helper.c */
 #define DEBUG_HELPER 1
@@ -0,0 +1,701 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A fixed pool of threads, each of which multiplexes many connections
+ * with epoll.  This is an alternative to the default thread-per-connection
+ * mode of connection_thread_main(), and drives the very same buffer state
+ * machine through connection_get_events() and connection_dispatch().
+ *
+ * Connections are handed over through a per-worker queue and an eventfd,
+ * so that the worker thread is the only one who ever touches them.  This
+ * includes the TLS handshake: connections which are still being set up are
+ * kept on a separate list, which gets checked for timeouts once per second.
+ *
+ * The one thing which can't be done without blocking is starting a dynamic
+ * cockpit-ws instance.  Connections which need that leave their worker for
+ * an activation thread, which hands them back to the pool once connected.
+ * There is one such thread per instance which is being activated; more
+ * connections for the same instance queue up behind the first one, so that
+ * a burst of them doesn't start a burst of threads.
+ */
+
+#include "config.h"
+
+#include "worker.h"
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <common/cockpitmemory.h>
+
+#include "buffer-pool.h"
+#include "utils.h"
+
+enum { SIDE_CLIENT, SIDE_WS };
+
+/* how often to check connections in setup for their timeout */
+#define SWEEP_INTERVAL_MS 1000
+
+typedef struct _Worker Worker;
+typedef struct _WorkerItem WorkerItem;
+typedef struct _Activation Activation;
+
+struct _WorkerItem {
+  Connection *connection;
+  short registered[2];      /* events currently in the epoll set, per side */
+  bool dead;
+  bool activate;            /* dead, but goes to worker_activate_connection() */
+  WorkerItem *next;         /* in the handover queue, the dead list, or an Activation */
+
+  /* in the list of connections which are still being set up */
+  bool in_setup;
+  WorkerItem *setup_prev;
+  WorkerItem *setup_next;
+};
+
+struct _Worker {
+  pthread_t thread;
+  int epollfd;
+  int wakeup_fd;
+
+  /* protected by queue_mutex */
+  pthread_mutex_t queue_mutex;
+  WorkerItem *queue;
+  bool quit;
+
+  atomic_uint n_connections;
+
+  /* only used from the worker thread */
+  WorkerItem *setup_list;
+  uint64_t last_sweep;
+};
+
+/* the connections which wait for a wsinstance to be activated */
+struct _Activation {
+  char *fingerprint;
+  WorkerItem *waiting;
+  WorkerItem **waiting_tail;
+  Activation *next;
+};
+
+static struct {
+  Worker *workers;
+  unsigned n_workers;
+  void (*connection_closed) (void);
+} pool;
+
+static struct {
+  pthread_mutex_t mutex;
+  Activation *list;         /* protected by mutex */
+  unsigned n_threads;       /* protected by mutex */
+  unsigned max_threads;     /* protected by mutex */
+} activations = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint32_t
+poll_to_epoll (short events)
+{
+  return ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+}
+
+static short
+epoll_to_poll (uint32_t events)
+{
+  short result = 0;
+
+  /* errors and hangups need to be picked up by whichever direction we are
+   * interested in; the following read or write will then fail */
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+    result |= POLLIN;
+  if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+    result |= POLLOUT;
+
+  return result;
+}
+
+static uint64_t
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static void
+worker_item_set_in_setup (Worker     *self,
+                          WorkerItem *item,
+                          bool        in_setup)
+{
+  if (item->in_setup == in_setup)
+    return;
+
+  if (in_setup)
+    {
+      item->setup_prev = NULL;
+      item->setup_next = self->setup_list;
+      if (self->setup_list)
+        self->setup_list->setup_prev = item;
+      self->setup_list = item;
+    }
+  else
+    {
+      if (item->setup_prev)
+        item->setup_prev->setup_next = item->setup_next;
+      else
+        self->setup_list = item->setup_next;
+      if (item->setup_next)
+        item->setup_next->setup_prev = item->setup_prev;
+      item->setup_prev = item->setup_next = NULL;
+    }
+
+  item->in_setup = in_setup;
+}
+
+static void
+worker_item_watch (Worker     *self,
+                   WorkerItem *item,
+                   int         side,
+                   int         fd,
+                   short       events)
+{
+  struct epoll_event ev = { .events = poll_to_epoll (events),
+                            .data.u64 = (uintptr_t) item | side };
+  int op;
+
+  if (events == item->registered[side])
+    return;
+
+  /* epoll always reports EPOLLHUP/EPOLLERR, so we need to remove fds with no
+   * events completely; otherwise we'd spin */
+  if (events == 0)
+    op = EPOLL_CTL_DEL;
+  else if (item->registered[side] == 0)
+    op = EPOLL_CTL_ADD;
+  else
+    op = EPOLL_CTL_MOD;
+
+  if (epoll_ctl (self->epollfd, op, fd, &ev) != 0)
+    err (EXIT_FAILURE, "epoll_ctl failed for connection fd %i", fd);
+
+  item->registered[side] = events;
+}
+
+/**
+ * worker_item_process: Run a connection until it needs to wait for its fds
+ *
+ * @client_revents, @ws_revents: events reported by epoll_wait()
+ *
+ * Returns: false if the connection finished, or needs activation.
+ */
+static bool
+worker_item_process (Worker     *self,
+                     WorkerItem *item,
+                     short       client_revents,
+                     short       ws_revents)
+{
+  Connection *connection = item->connection;
+  short client_events, ws_events;
+  short client_pending, ws_pending;
+
+  while (connection_get_events (connection, &client_events, &ws_events, &client_pending, &ws_pending))
+    {
+      if (connection_needs_activation (connection))
+        {
+          worker_item_watch (self, item, SIDE_CLIENT, connection_get_client_fd (connection), 0);
+          worker_item_watch (self, item, SIDE_WS, connection_get_ws_fd (connection), 0);
+          item->activate = true;
+          break;
+        }
+
+      /* the events might be stale if the state changed since epoll_wait() */
+      client_revents = (client_revents & client_events) | client_pending;
+      ws_revents = (ws_revents & ws_events) | ws_pending;
+
+      if (!client_revents && !ws_revents)
+        {
+          worker_item_watch (self, item, SIDE_CLIENT, connection_get_client_fd (connection), client_events);
+          worker_item_watch (self, item, SIDE_WS, connection_get_ws_fd (connection), ws_events);
+          worker_item_set_in_setup (self, item, connection_get_timeout (connection) >= 0);
+          return true;
+        }
+
+      connection_dispatch (connection, client_revents, ws_revents);
+      client_revents = ws_revents = 0;
+    }
+
+  worker_item_set_in_setup (self, item, false);
+  return false;
+}
+
+static void
+worker_item_finish (WorkerItem  *item,
+                    WorkerItem **dead)
+{
+  item->dead = true;
+  item->next = *dead;
+  *dead = item;
+}
+
+/**
+ * worker_sweep: Drop connections whose setup timed out
+ *
+ * Returns: the epoll_wait() timeout until the next sweep
+ */
+static int
+worker_sweep (Worker      *self,
+              WorkerItem **dead)
+{
+  uint64_t now = now_ms ();
+
+  if (self->setup_list == NULL)
+    return -1;
+
+  if (now - self->last_sweep >= SWEEP_INTERVAL_MS)
+    {
+      WorkerItem *next;
+
+      for (WorkerItem *item = self->setup_list; item; item = next)
+        {
+          next = item->setup_next;
+
+          if (connection_get_timeout (item->connection) == 0 &&
+              !worker_item_process (self, item, 0, 0))
+            worker_item_finish (item, dead);
+        }
+
+      self->last_sweep = now;
+    }
+
+  return self->setup_list ? SWEEP_INTERVAL_MS - (now - self->last_sweep) : -1;
+}
+
+static WorkerItem *
+activation_pop (Activation *activation)
+{
+  WorkerItem *item = activation->waiting;
+
+  if (item)
+    {
+      activation->waiting = item->next;
+      if (activation->waiting == NULL)
+        activation->waiting_tail = &activation->waiting;
+      item->next = NULL;
+    }
+
+  return item;
+}
+
+static void
+activation_push (Activation *activation,
+                 WorkerItem *item)
+{
+  item->next = NULL;
+  *activation->waiting_tail = item;
+  activation->waiting_tail = &item->next;
+}
+
+static void
+activation_free (Activation *activation)
+{
+  Activation **link;
+
+  for (link = &activations.list; *link != activation; link = &(*link)->next)
+    assert (*link != NULL);
+  *link = activation->next;
+
+  activations.n_threads--;
+  free (activation->fingerprint);
+  free (activation);
+}
+
+/* hand a connection back to the pool, after it got connected or closed */
+static void
+activation_finish (WorkerItem *item)
+{
+  Connection *connection = item->connection;
+
+  free (item);
+  worker_pool_add (connection);
+}
+
+static void *
+activation_thread_main (void *data)
+{
+  Activation *activation = data;
+  WorkerItem *item;
+  WorkerItem *failed;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&activations.mutex);
+      item = activation_pop (activation);
+      if (item == NULL)
+        {
+          activation_free (activation);
+          pthread_mutex_unlock (&activations.mutex);
+          return NULL;
+        }
+      pthread_mutex_unlock (&activations.mutex);
+
+      /* only the first one blocks; afterwards the instance is running */
+      if (connection_activate (item->connection))
+        {
+          activation_finish (item);
+          continue;
+        }
+
+      activation_finish (item);
+
+      /* the ones which waited for this attempt share its result */
+      pthread_mutex_lock (&activations.mutex);
+      failed = activation->waiting;
+      activation->waiting = NULL;
+      activation->waiting_tail = &activation->waiting;
+      pthread_mutex_unlock (&activations.mutex);
+
+      while ((item = failed))
+        {
+          failed = item->next;
+          connection_abandon_activation (item->connection);
+          activation_finish (item);
+        }
+    }
+}
+
+/**
+ * worker_activate_connection: Activate the wsinstance of a connection
+ *
+ * This blocks, so it happens in the activation thread for the instance,
+ * which then hands the connection back to the pool.  The thread gets
+ * started if there is none for this instance yet.
+ */
+static void
+worker_activate_connection (WorkerItem *item)
+{
+  const char *fingerprint = connection_get_wsinstance (item->connection);
+  Activation *activation;
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  pthread_mutex_lock (&activations.mutex);
+
+  for (activation = activations.list; activation; activation = activation->next)
+    {
+      if (strcmp (activation->fingerprint, fingerprint) == 0)
+        {
+          debug (CONNECTION, "connection for fd %i waits for the running activation of %s",
+                 connection_get_client_fd (item->connection), fingerprint);
+          activation_push (activation, item);
+          pthread_mutex_unlock (&activations.mutex);
+          return;
+        }
+    }
+
+  activation = callocx (1, sizeof (Activation));
+  activation->fingerprint = strdupx (fingerprint);
+  activation->waiting_tail = &activation->waiting;
+  activation_push (activation, item);
+  activation->next = activations.list;
+  activations.list = activation;
+
+  activations.n_threads++;
+  if (activations.n_threads > activations.max_threads)
+    activations.max_threads = activations.n_threads;
+
+  pthread_mutex_unlock (&activations.mutex);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+  int r = pthread_create (&thread, &attr, activation_thread_main, activation);
+  if (r != 0)
+    {
+      errno = r;
+      warn ("pthread_create() failed.  activating wsinstance in the worker");
+      activation_thread_main (activation);
+    }
+
+  pthread_attr_destroy (&attr);
+}
+
+static void *
+worker_thread_main (void *data)
+{
+  Worker *self = data;
+  struct epoll_event events[64];
+  int timeout = -1;
+
+  buffer_pool_enable_thread_cache ();
+
+  for (;;)
+    {
+      WorkerItem *dead = NULL;
+      int n_ready;
+
+      n_ready = epoll_wait (self->epollfd, events, N_ELEMENTS (events), timeout);
+      if (n_ready == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          err (EXIT_FAILURE, "worker epoll_wait failed");
+        }
+
+      debug (POLL, "worker %p: %i events", self, n_ready);
+
+      for (int i = 0; i < n_ready; i++)
+        {
+          WorkerItem *item;
+          int side;
+
+          if (events[i].data.u64 == 0)
+            {
+              WorkerItem *queue;
+              uint64_t value;
+              bool quit;
+
+              /* new connections were handed over to us */
+              if (read (self->wakeup_fd, &value, sizeof value) < 0 && errno != EAGAIN)
+                err (EXIT_FAILURE, "failed to read worker wakeup fd");
+
+              pthread_mutex_lock (&self->queue_mutex);
+              queue = self->queue;
+              self->queue = NULL;
+              quit = self->quit;
+              pthread_mutex_unlock (&self->queue_mutex);
+
+              if (quit)
+                {
+                  assert (queue == NULL);
+                  return NULL;
+                }
+
+              while ((item = queue))
+                {
+                  queue = item->next;
+                  item->next = NULL;
+
+                  if (!worker_item_process (self, item, 0, 0))
+                    worker_item_finish (item, &dead);
+                }
+
+              continue;
+            }
+
+          item = (WorkerItem *) (uintptr_t) (events[i].data.u64 & ~(uint64_t) 1);
+          side = events[i].data.u64 & 1;
+
+          /* finished earlier in this batch */
+          if (item->dead)
+            continue;
+
+          short revents = epoll_to_poll (events[i].events);
+          if (!worker_item_process (self, item,
+                                    side == SIDE_CLIENT ? revents : 0,
+                                    side == SIDE_WS ? revents : 0))
+            worker_item_finish (item, &dead);
+        }
+
+      timeout = worker_sweep (self, &dead);
+
+      /* only free connections after the batch, as they might still be
+       * referenced by later events */
+      while (dead)
+        {
+          WorkerItem *item = dead;
+          dead = item->next;
+
+          atomic_fetch_sub (&self->n_connections, 1);
+
+          if (item->activate)
+            {
+              debug (CONNECTION, "worker %p: connection for fd %i needs activation",
+                     self, connection_get_client_fd (item->connection));
+              item->dead = item->activate = false;
+              worker_activate_connection (item);
+              continue;
+            }
+
+          debug (CONNECTION, "worker %p: connection for fd %i finished",
+                 self, connection_get_client_fd (item->connection));
+
+          /* closing the fds removes them from the epoll set */
+          connection_free (item->connection);
+          free (item);
+
+          pool.connection_closed ();
+        }
+    }
+}
+
+static void
+worker_wakeup (Worker *self)
+{
+  uint64_t one = 1;
+
+  if (write (self->wakeup_fd, &one, sizeof one) != sizeof one)
+    err (EXIT_FAILURE, "failed to write worker wakeup fd");
+}
+
+/**
+ * worker_pool_init: Start the event-driven worker threads
+ *
+ * @n_workers: number of threads; must be positive
+ * @connection_closed: called from a worker thread whenever a connection
+ *   which was passed to worker_pool_add() finished
+ */
+void
+worker_pool_init (unsigned n_workers,
+                  void (*connection_closed) (void))
+{
+  assert (pool.workers == NULL);
+  assert (n_workers > 0);
+
+  pool.workers = callocx (n_workers, sizeof (Worker));
+  pool.n_workers = n_workers;
+  pool.connection_closed = connection_closed;
+
+  for (unsigned i = 0; i < n_workers; i++)
+    {
+      Worker *worker = &pool.workers[i];
+      struct epoll_event ev = { .events = EPOLLIN, .data.u64 = 0 };
+
+      worker->epollfd = epoll_create1 (EPOLL_CLOEXEC);
+      if (worker->epollfd < 0)
+        err (EXIT_FAILURE, "Failed to create worker epoll fd");
+
+      worker->wakeup_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (worker->wakeup_fd < 0)
+        err (EXIT_FAILURE, "Failed to create worker eventfd");
+
+      if (epoll_ctl (worker->epollfd, EPOLL_CTL_ADD, worker->wakeup_fd, &ev) < 0)
+        err (EXIT_FAILURE, "Failed to epoll worker eventfd");
+
+      pthread_mutex_init (&worker->queue_mutex, NULL);
+
+      int r = pthread_create (&worker->thread, NULL, worker_thread_main, worker);
+      if (r != 0)
+        {
+          errno = r;
+          err (EXIT_FAILURE, "Failed to create worker thread");
+        }
+    }
+
+  debug (SERVER, "Started %u worker threads", n_workers);
+}
+
+/**
+ * worker_pool_cleanup: Stop and join all worker threads
+ *
+ * All connections must have finished already.
+ */
+void
+worker_pool_cleanup (void)
+{
+  if (pool.workers == NULL)
+    return;
+
+  for (unsigned i = 0; i < pool.n_workers; i++)
+    {
+      Worker *worker = &pool.workers[i];
+
+      assert (atomic_load (&worker->n_connections) == 0);
+
+      pthread_mutex_lock (&worker->queue_mutex);
+      worker->quit = true;
+      pthread_mutex_unlock (&worker->queue_mutex);
+      worker_wakeup (worker);
+
+      pthread_join (worker->thread, NULL);
+      pthread_mutex_destroy (&worker->queue_mutex);
+      close (worker->wakeup_fd);
+      close (worker->epollfd);
+    }
+
+  free (pool.workers);
+  memset (&pool, 0, sizeof pool);
+
+  /* the activation threads might still be on their way out */
+  pthread_mutex_lock (&activations.mutex);
+  activations.max_threads = 0;
+  pthread_mutex_unlock (&activations.mutex);
+}
+
+/**
+ * worker_pool_get_max_activation_threads: Most activation threads at a time
+ *
+ * Since worker_pool_init(); there is at most one per wsinstance.
+ */
+unsigned
+worker_pool_get_max_activation_threads (void)
+{
+  pthread_mutex_lock (&activations.mutex);
+  unsigned result = activations.max_threads;
+  pthread_mutex_unlock (&activations.mutex);
+
+  return result;
+}
+
+/**
+ * worker_pool_add: Hand over a freshly accepted connection to a worker thread
+ *
+ * The connection goes to the worker with the fewest connections, which then
+ * owns it: it waits for the first byte, does the TLS handshake if needed, and
+ * relays the data.  This can be called from any thread.
+ */
+void
+worker_pool_add (Connection *connection)
+{
+  Worker *worker = &pool.workers[0];
+  WorkerItem *item;
+
+  assert (pool.workers != NULL);
+
+  for (unsigned i = 1; i < pool.n_workers; i++)
+    if (atomic_load (&pool.workers[i].n_connections) < atomic_load (&worker->n_connections))
+      worker = &pool.workers[i];
+
+  item = callocx (1, sizeof (WorkerItem));
+  item->connection = connection;
+
+  atomic_fetch_add (&worker->n_connections, 1);
+
+  debug (CONNECTION, "Handing connection fd %i over to worker %p",
+         connection_get_client_fd (connection), worker);
+
+  pthread_mutex_lock (&worker->queue_mutex);
+  item->next = worker->queue;
+  worker->queue = item;
+  pthread_mutex_unlock (&worker->queue_mutex);
+
+  worker_wakeup (worker);
+}
@@ -0,0 +1,467 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Connecting to dynamic (per client certificate) cockpit-ws instances.
+ *
+ * The instances are started on demand by asking https-factory.sock to
+ * activate the instance for a given certificate fingerprint.  A browser
+ * opens many connections at once when loading the page, and without any
+ * coordination each of them would notice the missing socket and send its
+ * own activation request, each of which would go through the factory and
+ * systemd for nothing.
+ *
+ * We therefore keep a small table of the instances we know about.  Only
+ * the first connection to find an instance missing talks to the factory;
+ * the others wait for it and share its result.  Once an instance is known
+ * to be live, connections go straight to its socket.  If it has since gone
+ * away (as idle instances do), that connect fails and we activate again.
+ */
+
+#include "config.h"
+
+#include "wsinstance.h"
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common/cockpitmemory.h"
+
+#include "metrics.h"
+#include "socket-io.h"
+#include "utils.h"
+
+/* Fingerprints come from client-provided certificates, so the table must
+ * not grow without bounds.  Beyond this, we still activate instances, but
+ * no longer coalesce requests for new fingerprints.
+ */
+#define WSINSTANCE_TABLE_MAX 1024
+#define WSINSTANCE_BUCKETS 64
+
+typedef enum
+{
+  WSINSTANCE_UNKNOWN,
+  WSINSTANCE_ACTIVATING,
+  WSINSTANCE_LIVE,
+} WsInstanceState;
+
+struct _WsInstance
+{
+  WsInstance *next;
+  char fingerprint[WSINSTANCE_MAX];
+  WsInstanceState state;
+
+  /* bumped each time an activation finishes; waiters watch for it */
+  unsigned generation;
+  bool last_result;
+
+  /* open connections to this instance; changes without the lock */
+  atomic_uint n_connections;
+};
+
+static struct
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t activated;
+  WsInstance *buckets[WSINSTANCE_BUCKETS];
+  unsigned n_instances;
+  WsInstanceCounters counters;
+} table = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .activated = PTHREAD_COND_INITIALIZER,
+};
+
+static unsigned
+fingerprint_hash (const char *fingerprint)
+{
+  uint32_t hash = 2166136261u;
+
+  for (const char *c = fingerprint; *c; c++)
+    hash = (hash ^ (unsigned char) *c) * 16777619u;
+
+  return hash % WSINSTANCE_BUCKETS;
+}
+
+/* Must be called with the table locked.  Returns NULL if the table is full. */
+static WsInstance *
+wsinstance_lookup (const char *fingerprint)
+{
+  WsInstance **bucket = &table.buckets[fingerprint_hash (fingerprint)];
+  WsInstance *instance;
+
+  for (instance = *bucket; instance != NULL; instance = instance->next)
+    if (strcmp (instance->fingerprint, fingerprint) == 0)
+      return instance;
+
+  if (table.n_instances == WSINSTANCE_TABLE_MAX)
+    return NULL;
+
+  instance = callocx (1, sizeof (WsInstance));
+  assert (strlen (fingerprint) < sizeof instance->fingerprint);
+  strcpy (instance->fingerprint, fingerprint);
+  instance->state = WSINSTANCE_UNKNOWN;
+  instance->next = *bucket;
+  *bucket = instance;
+  table.n_instances++;
+
+  return instance;
+}
+
+static bool
+request_dynamic_wsinstance (int sockdir,
+                            const char *fingerprint)
+{
+  bool status = false;
+  char reply[20];
+  int fd;
+
+  debug (WSINSTANCE, "requesting dynamic wsinstance for %s:\n", fingerprint);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    {
+      warn ("socket() failed");
+      goto out;
+    }
+
+  debug (WSINSTANCE, "  -> connecting to https-factory.sock");
+  if (af_unix_connectat (fd, sockdir, "https-factory.sock") != 0)
+    {
+      warn ("connect(https-factory.sock) failed");
+      goto out;
+    }
+
+  /* send the fingerprint */
+  debug (WSINSTANCE, "  -> success; sending fingerprint...");
+  if (!send_all (fd, fingerprint, strlen (fingerprint), 5 * 1000000))
+    goto out;
+
+  debug (WSINSTANCE, "  -> success; waiting for reply...");
+
+  /* wait for the systemd job status reply */
+  if (!recv_alnum (fd, reply, sizeof reply, 30 * 1000000))
+    goto out;
+
+  debug (WSINSTANCE, "  -> got reply '%s'...", reply);
+  status = strcmp (reply, "done") == 0;
+
+out:
+  debug (WSINSTANCE, "  -> %s.", status ? "success" : "fail");
+
+  if (fd != -1)
+    close (fd);
+
+  return status;
+}
+
+static uint64_t
+elapsed_us (const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) * 1000000ull + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * wsinstance_activate: make sure the instance for @fingerprint is running
+ *
+ * If another thread is already activating this instance, wait for it to
+ * finish and return its result instead of sending a request of our own.
+ * @instance may be NULL if the table is full, in which case we always
+ * send the request.
+ */
+static bool
+wsinstance_activate (WsInstance *instance,
+                     int sockdir,
+                     const char *fingerprint)
+{
+  struct timespec start;
+  unsigned long ms;
+  uint64_t us;
+  bool result;
+
+  pthread_mutex_lock (&table.mutex);
+
+  if (instance && instance->state == WSINSTANCE_ACTIVATING)
+    {
+      unsigned generation = instance->generation;
+
+      debug (WSINSTANCE, "  -> activation already in progress; waiting for it");
+      table.counters.coalesced_waits++;
+
+      while (instance->generation == generation)
+        pthread_cond_wait (&table.activated, &table.mutex);
+
+      result = instance->last_result;
+      pthread_mutex_unlock (&table.mutex);
+
+      return result;
+    }
+
+  if (instance)
+    instance->state = WSINSTANCE_ACTIVATING;
+
+  pthread_mutex_unlock (&table.mutex);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  result = request_dynamic_wsinstance (sockdir, fingerprint);
+  us = elapsed_us (&start);
+  ms = us / 1000;
+
+  metrics_activation_finished (us);
+
+  pthread_mutex_lock (&table.mutex);
+
+  table.counters.activations++;
+  if (!result)
+    table.counters.activation_failures++;
+  table.counters.activation_time_ms += ms;
+  if (ms > table.counters.activation_time_max_ms)
+    table.counters.activation_time_max_ms = ms;
+
+  if (instance)
+    {
+      instance->state = result ? WSINSTANCE_LIVE : WSINSTANCE_UNKNOWN;
+      instance->last_result = result;
+      instance->generation++;
+      pthread_cond_broadcast (&table.activated);
+    }
+
+  pthread_mutex_unlock (&table.mutex);
+
+  debug (WSINSTANCE, "  -> activation took %lu ms", ms);
+
+  return result;
+}
+
+static void
+wsinstance_sockname (char       *sockname,
+                     size_t      size,
+                     const char *fingerprint)
+{
+  int r = snprintf (sockname, size, "https@%s.sock", fingerprint);
+  assert (0 < r && r < size);
+}
+
+/* Connect to the instance socket, unless we know that it isn't there.
+ * Sets @instance to the table entry, which may be %NULL.
+ */
+static bool
+wsinstance_connect_existing (int          fd,
+                             int          sockdir,
+                             const char  *fingerprint,
+                             const char  *sockname,
+                             WsInstance **instance)
+{
+  bool activating;
+
+  pthread_mutex_lock (&table.mutex);
+  *instance = wsinstance_lookup (fingerprint);
+  activating = *instance && (*instance)->state == WSINSTANCE_ACTIVATING;
+  pthread_mutex_unlock (&table.mutex);
+
+  /* If someone is busy activating it, it can't be there yet: don't bother. */
+  if (activating)
+    return false;
+
+  if (af_unix_connectat (fd, sockdir, sockname) != 0)
+    {
+      if (errno != ENOENT && errno != ECONNREFUSED)
+        warn ("connect(%s) failed on the first attempt", sockname);
+
+      debug (WSINSTANCE, "  -> failed (%m).  Needs activation.");
+      return false;
+    }
+
+  pthread_mutex_lock (&table.mutex);
+  if (*instance && (*instance)->state == WSINSTANCE_UNKNOWN)
+    (*instance)->state = WSINSTANCE_LIVE;
+  pthread_mutex_unlock (&table.mutex);
+
+  return true;
+}
+
+static void
+wsinstance_connected (WsInstance  *instance,
+                      WsInstance **instance_out)
+{
+  if (instance)
+    atomic_fetch_add_explicit (&instance->n_connections, 1, memory_order_relaxed);
+  *instance_out = instance;
+}
+
+/**
+ * wsinstance_connect_live: connect @fd to the instance for @fingerprint, if it runs
+ *
+ * This is the fast path of wsinstance_connect(): it never activates the
+ * instance or waits for someone else's activation, so it does not block.
+ * If it fails, wsinstance_connect() on the same @fd does the rest.
+ *
+ * Returns: %true if @fd is now connected
+ */
+bool
+wsinstance_connect_live (int          fd,
+                         int          sockdir,
+                         const char  *fingerprint,
+                         WsInstance **instance_out)
+{
+  WsInstance *instance;
+  char sockname[80];
+
+  wsinstance_sockname (sockname, sizeof sockname, fingerprint);
+  debug (WSINSTANCE, "Connecting to dynamic https instance %s...", sockname);
+
+  if (!wsinstance_connect_existing (fd, sockdir, fingerprint, sockname, &instance))
+    return false;
+
+  wsinstance_connected (instance, instance_out);
+  return true;
+}
+
+/**
+ * wsinstance_connect: connect @fd to the dynamic instance for @fingerprint
+ *
+ * The instance socket lives in @sockdir.  If it doesn't exist yet, the
+ * instance gets activated first.  Concurrent calls for the same
+ * fingerprint share a single activation request.  This blocks for as long
+ * as the activation takes, so it must not be called from a worker thread.
+ *
+ * On success, @instance_out is set to the instance, which counts the
+ * connection until wsinstance_disconnected().  This may be %NULL if the
+ * instance is not tracked, which is fine to pass to that as well.
+ *
+ * Returns: %true if @fd is now connected
+ */
+bool
+wsinstance_connect (int fd,
+                    int sockdir,
+                    const char *fingerprint,
+                    WsInstance **instance_out)
+{
+  WsInstance *instance;
+  char sockname[80];
+
+  wsinstance_sockname (sockname, sizeof sockname, fingerprint);
+  debug (WSINSTANCE, "Connecting to dynamic https instance %s...", sockname);
+
+  /* fast path: the socket already exists, so we can just connect to it. */
+  if (wsinstance_connect_existing (fd, sockdir, fingerprint, sockname, &instance))
+    goto connected;
+
+  /* otherwise, ask for the instance to be started */
+  if (!wsinstance_activate (instance, sockdir, fingerprint))
+    return false;
+
+  /* ... and try one more time. */
+  debug (WSINSTANCE, "  -> trying again");
+  if (af_unix_connectat (fd, sockdir, sockname) != 0)
+    {
+      warn ("connect(%s) failed on the second attempt", sockname);
+      return false;
+    }
+
+  /* otherwise, we're now connected */
+  debug (WSINSTANCE, "  -> success!");
+
+connected:
+  wsinstance_connected (instance, instance_out);
+  return true;
+}
+
+/**
+ * wsinstance_disconnected: a connection from wsinstance_connect() closed
+ *
+ * @instance: the instance from wsinstance_connect(), or %NULL
+ */
+void
+wsinstance_disconnected (WsInstance *instance)
+{
+  if (instance)
+    atomic_fetch_sub_explicit (&instance->n_connections, 1, memory_order_relaxed);
+}
+
+/**
+ * wsinstance_foreach: Call @func for each known instance
+ *
+ * This holds the table lock, so @func must not call back into here.
+ */
+void
+wsinstance_foreach (void (*func) (const char *fingerprint, unsigned n_connections, void *data),
+                    void *data)
+{
+  pthread_mutex_lock (&table.mutex);
+
+  for (unsigned i = 0; i < WSINSTANCE_BUCKETS; i++)
+    for (WsInstance *instance = table.buckets[i]; instance != NULL; instance = instance->next)
+      func (instance->fingerprint,
+            atomic_load_explicit (&instance->n_connections, memory_order_relaxed), data);
+
+  pthread_mutex_unlock (&table.mutex);
+}
+
+/**
+ * wsinstance_get_counters: report activation statistics
+ */
+void
+wsinstance_get_counters (WsInstanceCounters *counters)
+{
+  pthread_mutex_lock (&table.mutex);
+  *counters = table.counters;
+  pthread_mutex_unlock (&table.mutex);
+}
+
+/**
+ * wsinstance_cleanup: forget all known instances and reset the counters
+ *
+ * Must not be called while connections are still being set up.
+ */
+void
+wsinstance_cleanup (void)
+{
+  pthread_mutex_lock (&table.mutex);
+
+  for (unsigned i = 0; i < WSINSTANCE_BUCKETS; i++)
+    {
+      while (table.buckets[i])
+        {
+          WsInstance *instance = table.buckets[i];
+          assert (instance->state != WSINSTANCE_ACTIVATING);
+          assert (instance->n_connections == 0);
+          table.buckets[i] = instance->next;
+          free (instance);
+        }
+    }
+
+  table.n_instances = 0;
+  memset (&table.counters, 0, sizeof table.counters);
+
+  pthread_mutex_unlock (&table.mutex);
+}
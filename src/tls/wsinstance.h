@@ -0,0 +1,58 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+typedef struct _WsInstance WsInstance;
+
+typedef struct
+{
+  unsigned long activations;
+  unsigned long activation_failures;
+  unsigned long coalesced_waits;
+  unsigned long activation_time_ms;
+  unsigned long activation_time_max_ms;
+} WsInstanceCounters;
+
+bool
+wsinstance_connect_live (int          fd,
+                         int          sockdir,
+                         const char  *fingerprint,
+                         WsInstance **instance);
+
+bool
+wsinstance_connect (int          fd,
+                    int          sockdir,
+                    const char  *fingerprint,
+                    WsInstance **instance);
+
+void
+wsinstance_disconnected (WsInstance *instance);
+
+void
+wsinstance_foreach (void (*func) (const char *fingerprint, unsigned n_connections, void *data),
+                    void *data);
+
+void
+wsinstance_get_counters (WsInstanceCounters *counters);
+
+void
+wsinstance_cleanup (void);
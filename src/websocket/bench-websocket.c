@@ -0,0 +1,1598 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Performance measurements for WebSocketConnection.
+ *
+ * The "compression" benchmark measures what permessage-deflate costs and
+ * saves. The messages of a session are sent through a server side WebSocket,
+ * and the bytes that come out of it are counted. Those bytes are then
+ * fed into another server side WebSocket, which decodes them again. CPU
+ * time is measured for both directions.
+ *
+ * A session is a recording of what cockpit-bridge sent to cockpit-ws, in
+ * the usual cockpit frame format (for example captured with strace or by
+ * putting tee in front of the bridge). Without one, a synthetic session
+ * of D-Bus, journal and metrics messages is used.
+ *
+ * The "throughput" benchmark sends many messages with a channel prefix,
+ * the way cockpit-ws forwards them from the bridge, and reports messages
+ * per second and how many bytes of them were copied on the way.
+ *
+ * The "latency" benchmark downloads a lot of data (1 GiB by default) in
+ * 64 KiB messages on one flow of a WebSocket, while a terminal echoes a
+ * keystroke every 10 milliseconds on another. It reports how long the
+ * echoes take to come out of the socket, once with both sharing one flow
+ * as before and once on separate flows.
+ *
+ * The "frames" benchmark hands 10000 tiny frames from a client to a server
+ * side WebSocket in one buffer, as if they had all arrived in one read, and
+ * measures how fast they are parsed.
+ *
+ * The "mask" benchmark unmasks and validates text frames of 1 KiB, 64 KiB
+ * and 1 MiB the way frames from a client are handled, with a plain byte
+ * loop followed by g_utf8_validate() and with each of the unmasking
+ * implementations available on this CPU.
+ *
+ * The "batch" benchmark writes a burst of small D-Bus calls from a browser
+ * into a WebSocket, and forwards them to a session transport the way
+ * cockpit-ws does, once per WebSocketConnection::message and once with
+ * WebSocketConnection::messages. It counts the write system calls of the
+ * process, as reported in /proc/self/io, for each message forwarded.
+ *
+ * The "sweep" benchmark connects WebSocketClient and WebSocketServer pairs
+ * over socket pairs, plain or with TLS in between. Each client sends
+ * --messages text messages in total, split into a number of fragments, and
+ * the server echoes each one back. It runs for every combination of the
+ * --transports, --sizes, --fragments and --connections lists, and reports
+ * echoed messages and megabytes per second, allocations per message and
+ * the resident memory afterwards. With --rounds it repeats the whole sweep,
+ * to soak the code and show whether memory keeps growing.
+ *
+ * Each measurement is printed as one line of space separated key=value
+ * pairs. This is not run as part of the unit tests.
+ */
+
+#include "config.h"
+
+#include "websocket.h"
+#include "websocketprivate.h"
+
+#include "common/cockpitframe.h"
+#include "common/cockpitpipetransport.h"
+#include "common/cockpitsocket.h"
+
+#include <glib-unix.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* The receiving side rejects larger frames */
+#define MAX_MESSAGE (128 * 1024)
+
+static gchar *opt_benchmark = "compression";
+static gchar *opt_session;
+static gchar *opt_window_bits = "9,12,15";
+static gint opt_messages = 20000;
+static gint opt_size = 4096;
+static gint opt_download = 1024;
+static gchar *opt_transports = "plain,tls";
+static gchar *opt_sizes = "64,4096,65536";
+static gchar *opt_fragments = "1,4";
+static gchar *opt_connections = "1,16";
+static gint opt_rounds = 1;
+
+static GOptionEntry entries[] = {
+  { "benchmark", 0, 0, G_OPTION_ARG_STRING, &opt_benchmark, "Which benchmark to run: compression, throughput, latency, frames, mask, batch or sweep", "NAME" },
+  { "session", 0, 0, G_OPTION_ARG_FILENAME, &opt_session, "Recorded session in cockpit frame format", "FILE" },
+  { "window-bits", 0, 0, G_OPTION_ARG_STRING, &opt_window_bits, "Comma separated compression window sizes", "BITS" },
+  { "messages", 0, 0, G_OPTION_ARG_INT, &opt_messages, "Number of synthetic messages", "COUNT" },
+  { "size", 0, 0, G_OPTION_ARG_INT, &opt_size, "Message size for the throughput benchmark", "BYTES" },
+  { "download", 0, 0, G_OPTION_ARG_INT, &opt_download, "Size of the download for the latency benchmark", "MIB" },
+  { "transports", 0, 0, G_OPTION_ARG_STRING, &opt_transports, "Comma separated transports to sweep: plain, tls", "LIST" },
+  { "sizes", 0, 0, G_OPTION_ARG_STRING, &opt_sizes, "Comma separated message sizes to sweep", "BYTES" },
+  { "fragments", 0, 0, G_OPTION_ARG_STRING, &opt_fragments, "Comma separated numbers of frames per message to sweep", "COUNT" },
+  { "connections", 0, 0, G_OPTION_ARG_STRING, &opt_connections, "Comma separated numbers of concurrent connections to sweep", "COUNT" },
+  { "rounds", 0, 0, G_OPTION_ARG_INT, &opt_rounds, "How often to repeat the sweep", "COUNT" },
+  { NULL }
+};
+
+/* Sanitizers interpose the allocator themselves, and memory from
+ * __libc_malloc() would confuse them.
+ */
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define HAVE_SANITIZER 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || __has_feature(memory_sanitizer)
+#define HAVE_SANITIZER 1
+#endif
+#endif
+
+#if defined(__GLIBC__) && !defined(HAVE_SANITIZER)
+
+/*
+ * Count allocations by wrapping the allocator of the C library, which GLib
+ * uses as well. Aligned allocations aren't counted, they are rare.
+ */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static gboolean counting_allocations = TRUE;
+static volatile gsize allocations;
+
+void *
+malloc (size_t size)
+{
+  __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb,
+        size_t size)
+{
+  __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr,
+         size_t size)
+{
+  __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc (ptr, size);
+}
+
+#else
+
+static gboolean counting_allocations = FALSE;
+static volatile gsize allocations;
+
+#endif /* __GLIBC__ && !HAVE_SANITIZER */
+
+typedef struct {
+  GPtrArray *messages;
+  gsize payload;
+
+  /* Sending side */
+  GByteArray *wire;
+  gsize wire_offset;
+  gboolean headers_done;
+  gboolean discard;
+  guint frames;
+
+  /* Receiving side */
+  gsize written;
+  guint received;
+} Bench;
+
+static double
+cpu_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static GPtrArray *
+load_session (const gchar *filename)
+{
+  GError *error = NULL;
+  GPtrArray *messages;
+  gchar *contents;
+  gsize length;
+  gsize offset;
+  gsize consumed;
+  gssize size;
+  guint skipped = 0;
+
+  if (!g_file_get_contents (filename, &contents, &length, &error))
+    g_error ("couldn't read session: %s", error->message);
+
+  messages = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  for (offset = 0; offset < length; offset += consumed + size)
+    {
+      size = cockpit_frame_parse ((guchar *)contents + offset, length - offset, &consumed);
+      if (size <= 0 || consumed + size > length - offset)
+        {
+          g_warning ("ignoring invalid or truncated frame at offset %" G_GSIZE_FORMAT, offset);
+          break;
+        }
+      if (size > MAX_MESSAGE)
+        skipped++;
+      else
+        g_ptr_array_add (messages, g_bytes_new (contents + offset + consumed, size));
+    }
+
+  if (skipped)
+    g_message ("skipped %u messages larger than %d bytes", skipped, MAX_MESSAGE);
+
+  g_free (contents);
+  return messages;
+}
+
+/* Roughly what the overview and logs pages of a busy machine look like */
+static GPtrArray *
+synthesize_session (gint count)
+{
+  GPtrArray *messages;
+  gchar *message;
+  gint i;
+
+  messages = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  for (i = 0; i < count; i++)
+    {
+      switch (i % 4)
+        {
+        case 0:
+          message = g_strdup_printf ("1:2!1\n{\"notify\":{\"/org/freedesktop/systemd1/unit/session_2d%d_2escope\":"
+                                     "{\"org.freedesktop.systemd1.Unit\":{\"ActiveState\":\"active\",\"SubState\":\"running\","
+                                     "\"ActiveEnterTimestamp\":%d000000,\"InvocationID\":[%d,%d,%d,%d]}}}}",
+                                     i % 97, 1700000000 + i, i & 0xff, (i >> 3) & 0xff, (i * 7) & 0xff, (i * 13) & 0xff);
+          break;
+        case 1:
+          message = g_strdup_printf ("1:3!2\n{\"__CURSOR\":\"s=8c1f;i=%x;b=5d2e;m=%x;t=%x\",\"__REALTIME_TIMESTAMP\":\"%d\","
+                                     "\"PRIORITY\":\"%d\",\"SYSLOG_IDENTIFIER\":\"%s\",\"_PID\":\"%d\","
+                                     "\"MESSAGE\":\"Started session %d of user admin.\"}",
+                                     i, i * 31, i * 1000, 1700000000 + i, i % 7,
+                                     (i % 3) ? "systemd" : "sshd", 1000 + i % 500, i % 97);
+          break;
+        case 2:
+          message = g_strdup_printf ("1:4!3\n[{\"timestamp\":%d000,\"now\":%d000,\"interval\":1000},"
+                                     "[[%d,%d,%d,%d],[%d],[%d,%d]]]",
+                                     1700000000 + i, 1700000000 + i,
+                                     i % 100, (i * 3) % 100, (i * 7) % 100, (i * 11) % 100,
+                                     i * 4096, i % 1500, (i * 5) % 1500);
+          break;
+        default:
+          message = g_strdup_printf ("\n{\"command\":\"ping\",\"channel\":\"1:%d!%d\"}", i % 5, i);
+          break;
+        }
+      g_ptr_array_add (messages, g_bytes_new_take (message, strlen (message)));
+    }
+
+  return messages;
+}
+
+static GHashTable *
+handshake_headers (gboolean deflate)
+{
+  GHashTable *headers = web_socket_util_new_headers ();
+
+  g_hash_table_insert (headers, g_strdup ("Host"), g_strdup ("localhost"));
+  g_hash_table_insert (headers, g_strdup ("Upgrade"), g_strdup ("websocket"));
+  g_hash_table_insert (headers, g_strdup ("Connection"), g_strdup ("Upgrade"));
+  g_hash_table_insert (headers, g_strdup ("Sec-WebSocket-Key"), g_strdup ("dGhlIHNhbXBsZSBub25jZQ=="));
+  g_hash_table_insert (headers, g_strdup ("Sec-WebSocket-Version"), g_strdup ("13"));
+  if (deflate)
+    {
+      /* What web browsers offer */
+      g_hash_table_insert (headers, g_strdup ("Sec-WebSocket-Extensions"),
+                           g_strdup ("permessage-deflate; client_max_window_bits"));
+    }
+
+  return headers;
+}
+
+static WebSocketConnection *
+bench_server (GIOStream *io,
+              GHashTable *headers,
+              GByteArray *input,
+              guint window_bits)
+{
+  WebSocketConnection *ws;
+
+  ws = web_socket_server_new_for_stream ("ws://localhost/bench", NULL, NULL, io, headers, input);
+  if (window_bits)
+    g_object_set (ws, "permessage-deflate", TRUE, "deflate-window-bits", window_bits, NULL);
+
+  return ws;
+}
+
+static void
+count_frames (Bench *bench)
+{
+  const guint8 *data;
+  gsize avail;
+  gsize header;
+  guint64 len;
+  gint i;
+
+  for (;;)
+    {
+      data = bench->wire->data + bench->wire_offset;
+      avail = bench->wire->len - bench->wire_offset;
+      if (avail < 2)
+        return;
+
+      len = data[1] & 0x7f;
+      header = len == 127 ? 10 : len == 126 ? 4 : 2;
+      if (avail < header)
+        return;
+      if (len >= 126)
+        {
+          len = 0;
+          for (i = 2; i < header; i++)
+            len = (len << 8) | data[i];
+        }
+      if (avail < header + len)
+        return;
+
+      bench->wire_offset += header + len;
+      bench->frames++;
+    }
+}
+
+static gboolean
+on_wire_readable (GObject *stream,
+                  gpointer user_data)
+{
+  Bench *bench = user_data;
+  GError *error = NULL;
+  gsize at = bench->wire->len;
+  gssize ret;
+  gchar *end;
+
+  g_byte_array_set_size (bench->wire, at + 64 * 1024);
+  ret = g_pollable_input_stream_read_nonblocking (G_POLLABLE_INPUT_STREAM (stream),
+                                                  bench->wire->data + at, 64 * 1024, NULL, &error);
+  g_byte_array_set_size (bench->wire, at + MAX (ret, 0));
+
+  if (ret < 0)
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+        {
+          g_error_free (error);
+          return TRUE;
+        }
+      g_error ("couldn't read from WebSocket: %s", error->message);
+    }
+  else if (ret == 0)
+    {
+      g_error ("WebSocket closed unexpectedly");
+    }
+
+  /* Drop the handshake response, only count the frames */
+  if (!bench->headers_done)
+    {
+      end = g_strstr_len ((gchar *)bench->wire->data, bench->wire->len, "\r\n\r\n");
+      if (!end)
+        return TRUE;
+      g_byte_array_remove_range (bench->wire, 0, end + 4 - (gchar *)bench->wire->data);
+      bench->headers_done = TRUE;
+    }
+
+  count_frames (bench);
+
+  /* Only the number of frames matters */
+  if (bench->discard)
+    {
+      g_byte_array_remove_range (bench->wire, 0, bench->wire_offset);
+      bench->wire_offset = 0;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+on_wire_writable (GObject *stream,
+                  gpointer user_data)
+{
+  Bench *bench = user_data;
+  GError *error = NULL;
+  gssize ret;
+
+  ret = g_pollable_output_stream_write_nonblocking (G_POLLABLE_OUTPUT_STREAM (stream),
+                                                    bench->wire->data + bench->written,
+                                                    MIN (bench->wire->len - bench->written, 64 * 1024),
+                                                    NULL, &error);
+  if (ret < 0)
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+        {
+          g_error_free (error);
+          return TRUE;
+        }
+      g_error ("couldn't write to WebSocket: %s", error->message);
+    }
+
+  bench->written += ret;
+  return bench->written < bench->wire->len;
+}
+
+static void
+on_open_send (WebSocketConnection *ws,
+              gpointer user_data)
+{
+  Bench *bench = user_data;
+  WebSocketDataType type;
+  GBytes *message;
+  gsize length;
+  guint i;
+
+  for (i = 0; i < bench->messages->len; i++)
+    {
+      message = bench->messages->pdata[i];
+      type = g_utf8_validate (g_bytes_get_data (message, &length), length, NULL) ?
+               WEB_SOCKET_DATA_TEXT : WEB_SOCKET_DATA_BINARY;
+      web_socket_connection_send (ws, type, NULL, message);
+    }
+}
+
+static void
+on_open_send_prefixed (WebSocketConnection *ws,
+                       gpointer user_data)
+{
+  Bench *bench = user_data;
+  GBytes *prefix;
+  guint i;
+
+  prefix = g_bytes_new_static ("1:2!1\n", 6);
+  for (i = 0; i < bench->messages->len; i++)
+    web_socket_connection_send (ws, WEB_SOCKET_DATA_BINARY, prefix, bench->messages->pdata[i]);
+  g_bytes_unref (prefix);
+}
+
+static void
+on_message_count (WebSocketConnection *ws,
+                  WebSocketDataType type,
+                  GBytes *message,
+                  gpointer user_data)
+{
+  Bench *bench = user_data;
+  bench->received++;
+}
+
+static void
+run_compression (Bench *bench,
+                 guint window_bits)
+{
+  WebSocketConnection *ws;
+  GHashTable *headers;
+  GIOStream *ours;
+  GIOStream *theirs;
+  GSource *source;
+  double send_ms;
+  double receive_ms;
+  double start;
+
+  bench->wire = g_byte_array_new ();
+  bench->wire_offset = 0;
+  bench->headers_done = FALSE;
+  bench->discard = FALSE;
+  bench->frames = 0;
+  bench->written = 0;
+  bench->received = 0;
+
+  /* Sending: messages go in, frames come out */
+  cockpit_socket_streampair (&ours, &theirs);
+  headers = handshake_headers (window_bits != 0);
+  ws = bench_server (theirs, headers, NULL, window_bits);
+  g_signal_connect (ws, "open", G_CALLBACK (on_open_send), bench);
+
+  source = g_pollable_input_stream_create_source (G_POLLABLE_INPUT_STREAM (g_io_stream_get_input_stream (ours)), NULL);
+  g_source_set_callback (source, (GSourceFunc)on_wire_readable, bench, NULL);
+  g_source_attach (source, NULL);
+
+  start = cpu_ms ();
+  while (bench->frames < bench->messages->len)
+    g_main_context_iteration (NULL, TRUE);
+  send_ms = cpu_ms () - start;
+
+  g_source_destroy (source);
+  g_source_unref (source);
+  g_object_unref (ws);
+  g_object_unref (ours);
+  g_object_unref (theirs);
+
+  /* Receiving: those frames go in, messages come out */
+  cockpit_socket_streampair (&ours, &theirs);
+  start = cpu_ms ();
+  ws = bench_server (theirs, headers, NULL, window_bits);
+  g_signal_connect (ws, "message", G_CALLBACK (on_message_count), bench);
+
+  source = g_pollable_output_stream_create_source (G_POLLABLE_OUTPUT_STREAM (g_io_stream_get_output_stream (ours)), NULL);
+  g_source_set_callback (source, (GSourceFunc)on_wire_writable, bench, NULL);
+  g_source_attach (source, NULL);
+
+  while (bench->received < bench->messages->len)
+    g_main_context_iteration (NULL, TRUE);
+  receive_ms = cpu_ms () - start;
+
+  g_source_destroy (source);
+  g_source_unref (source);
+  g_object_unref (ws);
+  g_object_unref (ours);
+  g_object_unref (theirs);
+  g_hash_table_unref (headers);
+
+  g_print ("mode=%s window_bits=%u messages=%u payload=%" G_GSIZE_FORMAT " wire=%u ratio=%.3f send_cpu_ms=%.1f receive_cpu_ms=%.1f\n",
+           window_bits ? "deflate" : "plain", window_bits, bench->messages->len, bench->payload,
+           bench->wire->len, (double)bench->wire->len / bench->payload, send_ms, receive_ms);
+
+  g_byte_array_unref (bench->wire);
+  bench->wire = NULL;
+}
+
+static void
+run_throughput (Bench *bench)
+{
+  WebSocketConnection *ws;
+  GHashTable *headers;
+  GIOStream *ours;
+  GIOStream *theirs;
+  GSource *source;
+  gint64 start;
+  double seconds;
+
+  bench->wire = g_byte_array_new ();
+  bench->wire_offset = 0;
+  bench->headers_done = FALSE;
+  bench->discard = TRUE;
+  bench->frames = 0;
+
+  cockpit_socket_streampair (&ours, &theirs);
+  headers = handshake_headers (FALSE);
+  ws = bench_server (theirs, headers, NULL, 0);
+  g_signal_connect (ws, "open", G_CALLBACK (on_open_send_prefixed), bench);
+
+  source = g_pollable_input_stream_create_source (G_POLLABLE_INPUT_STREAM (g_io_stream_get_input_stream (ours)), NULL);
+  g_source_set_callback (source, (GSourceFunc)on_wire_readable, bench, NULL);
+  g_source_attach (source, NULL);
+
+  start = g_get_monotonic_time ();
+  while (bench->frames < bench->messages->len)
+    g_main_context_iteration (NULL, TRUE);
+  seconds = (g_get_monotonic_time () - start) / 1000000.0;
+
+  g_print ("messages=%u size=%d messages_per_sec=%.0f mb_per_sec=%.1f copied_per_message=%.1f\n",
+           bench->messages->len, opt_size, bench->messages->len / seconds,
+           bench->payload / seconds / (1024 * 1024),
+           (double)_web_socket_connection_get_output_copied (ws) / bench->messages->len);
+
+  g_source_destroy (source);
+  g_source_unref (source);
+  g_object_unref (ws);
+  g_object_unref (ours);
+  g_object_unref (theirs);
+  g_hash_table_unref (headers);
+  g_byte_array_unref (bench->wire);
+  bench->wire = NULL;
+}
+
+typedef struct {
+  WebSocketConnection *ws;
+  gboolean flows;
+  GBytes *block;
+  guint64 queued;
+  guint64 total;
+
+  /* What came out of the socket */
+  GByteArray *wire;
+  gboolean headers_done;
+  guint64 downloaded;
+  GArray *latencies;
+} Latency;
+
+static gboolean
+on_latency_download (gpointer user_data)
+{
+  Latency *latency = user_data;
+  GBytes *prefix;
+
+  /* Like cockpit-ws, which stops reading from the bridge when a WebSocket is full */
+  prefix = g_bytes_new_static ("1\n", 2);
+  while (latency->queued < latency->total &&
+         web_socket_connection_get_buffered_amount (latency->ws) < 1024 * 1024)
+    {
+      web_socket_connection_send_full (latency->ws, WEB_SOCKET_DATA_BINARY, prefix, latency->block,
+                                       latency->flows ? "1" : NULL);
+      latency->queued += g_bytes_get_size (latency->block);
+    }
+  g_bytes_unref (prefix);
+
+  return latency->queued < latency->total;
+}
+
+static gboolean
+on_latency_keystroke (gpointer user_data)
+{
+  Latency *latency = user_data;
+  GBytes *message;
+  gchar *text;
+
+  text = g_strdup_printf ("2\n%" G_GINT64_FORMAT, g_get_monotonic_time ());
+  message = g_bytes_new_take (text, strlen (text));
+  web_socket_connection_send_full (latency->ws, WEB_SOCKET_DATA_TEXT, NULL, message,
+                                   latency->flows ? "2" : NULL);
+  g_bytes_unref (message);
+
+  return TRUE;
+}
+
+static gboolean
+on_latency_readable (GObject *stream,
+                     gpointer user_data)
+{
+  Latency *latency = user_data;
+  GError *error = NULL;
+  const guint8 *data;
+  gsize at = latency->wire->len;
+  gsize offset = 0;
+  gsize header;
+  guint64 len;
+  gchar *sent;
+  gdouble ms;
+  gssize ret;
+  gchar *end;
+  gint i;
+
+  g_byte_array_set_size (latency->wire, at + 256 * 1024);
+  ret = g_pollable_input_stream_read_nonblocking (G_POLLABLE_INPUT_STREAM (stream),
+                                                  latency->wire->data + at, 256 * 1024, NULL, &error);
+  g_byte_array_set_size (latency->wire, at + MAX (ret, 0));
+
+  if (ret < 0)
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+        {
+          g_error_free (error);
+          return TRUE;
+        }
+      g_error ("couldn't read from WebSocket: %s", error->message);
+    }
+  else if (ret == 0)
+    {
+      g_error ("WebSocket closed unexpectedly");
+    }
+
+  if (!latency->headers_done)
+    {
+      end = g_strstr_len ((gchar *)latency->wire->data, latency->wire->len, "\r\n\r\n");
+      if (!end)
+        return TRUE;
+      g_byte_array_remove_range (latency->wire, 0, end + 4 - (gchar *)latency->wire->data);
+      latency->headers_done = TRUE;
+    }
+
+  for (;;)
+    {
+      data = latency->wire->data + offset;
+      if (latency->wire->len - offset < 2)
+        break;
+
+      len = data[1] & 0x7f;
+      header = len == 127 ? 10 : len == 126 ? 4 : 2;
+      if (latency->wire->len - offset < header)
+        break;
+      if (len >= 126)
+        {
+          len = 0;
+          for (i = 2; i < header; i++)
+            len = (len << 8) | data[i];
+        }
+      if (latency->wire->len - offset < header + len)
+        break;
+
+      /* A keystroke being echoed, with the time it was sent */
+      if (len > 2 && data[header] == '2')
+        {
+          sent = g_strndup ((gchar *)data + header + 2, len - 2);
+          ms = (g_get_monotonic_time () - g_ascii_strtoll (sent, NULL, 10)) / 1000.0;
+          g_array_append_val (latency->latencies, ms);
+          g_free (sent);
+        }
+      else
+        {
+          latency->downloaded += len - 2;
+        }
+
+      offset += header + len;
+    }
+
+  g_byte_array_remove_range (latency->wire, 0, offset);
+  return TRUE;
+}
+
+static gint
+compare_doubles (gconstpointer a,
+                 gconstpointer b)
+{
+  gdouble x = *(const gdouble *)a;
+  gdouble y = *(const gdouble *)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void
+run_latency (gboolean flows)
+{
+  Latency latency = { NULL };
+  GHashTable *headers;
+  GIOStream *ours;
+  GIOStream *theirs;
+  GSource *source;
+  guint download;
+  guint keystroke;
+  gdouble *sorted;
+  guint count;
+
+  latency.flows = flows;
+  latency.block = g_bytes_new_take (g_malloc0 (64 * 1024), 64 * 1024);
+  latency.total = (guint64)opt_download * 1024 * 1024;
+  latency.wire = g_byte_array_new ();
+  latency.latencies = g_array_new (FALSE, FALSE, sizeof (gdouble));
+
+  cockpit_socket_streampair (&ours, &theirs);
+  headers = handshake_headers (FALSE);
+  latency.ws = bench_server (theirs, headers, NULL, 0);
+  while (web_socket_connection_get_ready_state (latency.ws) == WEB_SOCKET_STATE_CONNECTING)
+    g_main_context_iteration (NULL, TRUE);
+
+  source = g_pollable_input_stream_create_source (G_POLLABLE_INPUT_STREAM (g_io_stream_get_input_stream (ours)), NULL);
+  g_source_set_callback (source, (GSourceFunc)on_latency_readable, &latency, NULL);
+  g_source_attach (source, NULL);
+
+  download = g_idle_add (on_latency_download, &latency);
+  keystroke = g_timeout_add (10, on_latency_keystroke, &latency);
+
+  while (latency.downloaded < latency.total)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_source_remove (keystroke);
+  if (latency.queued < latency.total)
+    g_source_remove (download);
+
+  sorted = (gdouble *)latency.latencies->data;
+  count = latency.latencies->len;
+  g_array_sort (latency.latencies, compare_doubles);
+  if (count == 0)
+    g_error ("no keystrokes were echoed");
+
+  g_print ("mode=%s download_mb=%d echoes=%u p50_ms=%.2f p99_ms=%.2f max_ms=%.2f\n",
+           flows ? "flows" : "single", opt_download, count,
+           sorted[count / 2], sorted[(count * 99) / 100], sorted[count - 1]);
+
+  g_source_destroy (source);
+  g_source_unref (source);
+  g_object_unref (latency.ws);
+  g_object_unref (ours);
+  g_object_unref (theirs);
+  g_hash_table_unref (headers);
+  g_byte_array_unref (latency.wire);
+  g_array_unref (latency.latencies);
+  g_bytes_unref (latency.block);
+}
+
+static void
+run_frames (Bench *bench,
+            guint count)
+{
+  const guint8 mask[] = { 0x37, 0x5a, 0x21, 0x3d };
+  WebSocketConnection *ws;
+  GHashTable *headers;
+  GByteArray *input;
+  GIOStream *ours;
+  GIOStream *theirs;
+  guint8 frame[7];
+  double start;
+  double total = 0;
+  guint rounds = 50;
+  guint i, j;
+
+  headers = handshake_headers (FALSE);
+
+  for (i = 0; i < rounds; i++)
+    {
+      /* Frames from clients are always masked */
+      input = g_byte_array_new ();
+      for (j = 0; j < count; j++)
+        {
+          frame[0] = 0x81; /* fin | text */
+          frame[1] = 0x80 | 1; /* masked | length */
+          memcpy (frame + 2, mask, 4);
+          frame[6] = 'x' ^ mask[0];
+          g_byte_array_append (input, frame, sizeof (frame));
+        }
+
+      bench->received = 0;
+      cockpit_socket_streampair (&ours, &theirs);
+
+      start = cpu_ms ();
+      ws = bench_server (theirs, headers, input, 0);
+      g_signal_connect (ws, "message", G_CALLBACK (on_message_count), bench);
+      while (bench->received < count)
+        g_main_context_iteration (NULL, TRUE);
+      total += cpu_ms () - start;
+
+      g_object_unref (ws);
+      g_object_unref (ours);
+      g_object_unref (theirs);
+      g_byte_array_unref (input);
+    }
+
+  g_print ("frames=%u frame_size=%u rounds=%u cpu_ms_per_round=%.2f frames_per_sec=%.0f\n",
+           count, (guint)sizeof (frame), rounds, total / rounds,
+           count * rounds / (total / 1000));
+
+  g_hash_table_unref (headers);
+}
+
+static gsize
+unmask_bytes (const guint8 *mask,
+              guint8 *data,
+              gsize len)
+{
+  gsize n;
+
+  for (n = 0; n < len; n++)
+    data[n] ^= mask[n & 3];
+
+  /* Nothing known about ASCII */
+  return 0;
+}
+
+static void
+run_mask (void)
+{
+  const gchar *names[] = { "bytes", "avx2", "sse2", "words" };
+  const gsize sizes[] = { 1024, 64 * 1024, 1024 * 1024 };
+  /* Without high bits, so the data stays ASCII whether masked or not */
+  const guint8 mask[] = { 0x37, 0x5a, 0x21, 0x3d };
+  gsize (* unmask) (const guint8 *, guint8 *, gsize);
+  gboolean valid;
+  guint8 *data;
+  gsize ascii;
+  gsize total;
+  gsize len;
+  gsize n;
+  gint64 start;
+  double seconds;
+  guint i, j;
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      len = sizes[i];
+      data = g_malloc (len);
+      for (n = 0; n < len; n++)
+        data[n] = "{\"command\": \"ready\"}\n"[n % 20];
+
+      for (j = 0; j < G_N_ELEMENTS (names); j++)
+        {
+          if (g_str_equal (names[j], "bytes"))
+            {
+              unmask = unmask_bytes;
+            }
+          else if (_web_socket_mask_set_implementation (names[j]))
+            {
+              unmask = _web_socket_unmask_rfc6455;
+            }
+          else
+            {
+              continue;
+            }
+
+          valid = TRUE;
+          start = g_get_monotonic_time ();
+          for (total = 0; total < 1024 * 1024 * 1024; total += len)
+            {
+              ascii = unmask (mask, data, len);
+              if (unmask == unmask_bytes)
+                valid &= g_utf8_validate ((const gchar *)data, len, NULL);
+              else
+                valid &= _web_socket_validate_utf8 (data, len, ascii);
+            }
+          seconds = (g_get_monotonic_time () - start) / 1000000.0;
+          g_assert (valid);
+
+          g_print ("impl=%s size=%" G_GSIZE_FORMAT " mb_per_sec=%.0f\n",
+                   names[j], len, total / seconds / (1024 * 1024));
+        }
+
+      g_free (data);
+    }
+}
+
+typedef struct _Sweep Sweep;
+
+/* One client and the server it talks to */
+typedef struct {
+  Sweep *sweep;
+  WebSocketConnection *client;
+  WebSocketConnection *server;
+  guint count;
+  guint sent;
+  guint echoed;
+} SweepPair;
+
+struct _Sweep {
+  GBytes *message;
+
+  /* The message as masked fragments, when it is split */
+  guint fragments;
+  GByteArray *wire;
+
+  /* How many messages each client has on the way at once */
+  guint window;
+
+  SweepPair *pairs;
+  guint n_pairs;
+  guint opened;
+  guint echoed;
+};
+
+static void
+append_frame_header (GByteArray *wire,
+                     guint8 first,
+                     gsize len)
+{
+  guint8 header[14];
+  gsize n = 0;
+  gint i;
+
+  header[n++] = first;
+  if (len < 126)
+    {
+      header[n++] = 0x80 | len;
+    }
+  else if (len < 65536)
+    {
+      header[n++] = 0x80 | 126;
+      header[n++] = (len >> 8) & 0xff;
+      header[n++] = len & 0xff;
+    }
+  else
+    {
+      header[n++] = 0x80 | 127;
+      for (i = 7; i >= 0; i--)
+        header[n++] = ((guint64)len >> (i * 8)) & 0xff;
+    }
+
+  g_byte_array_append (wire, header, n);
+}
+
+/* What a browser sends for the message when it splits it up */
+static GByteArray *
+build_fragments (GBytes *message,
+                 guint fragments)
+{
+  /* Without high bits, so the text stays ASCII */
+  const guint8 mask[] = { 0x37, 0x5a, 0x21, 0x3d };
+  const guint8 *data;
+  GByteArray *wire;
+  gsize length;
+  gsize offset;
+  gsize chunk;
+  gsize at;
+  guint i;
+  gsize n;
+
+  data = g_bytes_get_data (message, &length);
+  wire = g_byte_array_new ();
+
+  for (i = 0, offset = 0; i < fragments; i++, offset += chunk)
+    {
+      chunk = (i == fragments - 1) ? length - offset : length / fragments;
+      append_frame_header (wire, (i == fragments - 1 ? 0x80 : 0x00) | (i == 0 ? 0x01 : 0x00), chunk);
+      g_byte_array_append (wire, mask, sizeof (mask));
+      at = wire->len;
+      g_byte_array_append (wire, data + offset, chunk);
+      for (n = 0; n < chunk; n++)
+        wire->data[at + n] ^= mask[n & 3];
+    }
+
+  return wire;
+}
+
+static void
+sweep_send (SweepPair *pair)
+{
+  Sweep *sweep = pair->sweep;
+  gpointer copy;
+
+  while (pair->sent < pair->count && pair->sent - pair->echoed < sweep->window)
+    {
+      if (sweep->wire)
+        {
+          /* The raw frames must be copied, since the connection takes them over */
+          copy = g_malloc (sweep->wire->len);
+          memcpy (copy, sweep->wire->data, sweep->wire->len);
+          _web_socket_connection_queue (pair->client, WEB_SOCKET_QUEUE_NORMAL, copy,
+                                        sweep->wire->len, g_bytes_get_size (sweep->message));
+        }
+      else
+        {
+          web_socket_connection_send (pair->client, WEB_SOCKET_DATA_TEXT, NULL, sweep->message);
+        }
+      pair->sent++;
+    }
+}
+
+static void
+on_sweep_open (WebSocketConnection *ws,
+               gpointer user_data)
+{
+  SweepPair *pair = user_data;
+  pair->sweep->opened++;
+}
+
+static void
+on_sweep_echo (WebSocketConnection *ws,
+               WebSocketDataType type,
+               GBytes *message,
+               gpointer user_data)
+{
+  web_socket_connection_send (ws, type, NULL, message);
+}
+
+static void
+on_sweep_echoed (WebSocketConnection *ws,
+                 WebSocketDataType type,
+                 GBytes *message,
+                 gpointer user_data)
+{
+  SweepPair *pair = user_data;
+
+  g_assert (g_bytes_get_size (message) == g_bytes_get_size (pair->sweep->message));
+  pair->echoed++;
+  pair->sweep->echoed++;
+  sweep_send (pair);
+}
+
+static gboolean
+on_sweep_error (WebSocketConnection *ws,
+                GError *error,
+                gpointer user_data)
+{
+  g_error ("WebSocket failed: %s", error->message);
+  return TRUE;
+}
+
+static gboolean
+on_accept_certificate (GTlsConnection *conn,
+                       GTlsCertificate *peer_cert,
+                       GTlsCertificateFlags errors,
+                       gpointer user_data)
+{
+  return TRUE;
+}
+
+static void
+on_tls_handshake (GObject *object,
+                  GAsyncResult *result,
+                  gpointer user_data)
+{
+  guint *pending = user_data;
+  GError *error = NULL;
+
+  if (!g_tls_connection_handshake_finish (G_TLS_CONNECTION (object), result, &error))
+    g_error ("TLS handshake failed: %s", error->message);
+  (*pending)--;
+}
+
+static void
+tls_streampair (GTlsCertificate *certificate,
+                GIOStream **client,
+                GIOStream **server)
+{
+  GError *error = NULL;
+  GIOStream *ioc;
+  GIOStream *ios;
+  guint pending = 2;
+
+  cockpit_socket_streampair (&ioc, &ios);
+
+  *server = g_tls_server_connection_new (ios, certificate, &error);
+  if (*server == NULL)
+    g_error ("couldn't create TLS server: %s", error->message);
+  *client = g_tls_client_connection_new (ioc, NULL, &error);
+  if (*client == NULL)
+    g_error ("couldn't create TLS client: %s", error->message);
+  g_signal_connect (*client, "accept-certificate", G_CALLBACK (on_accept_certificate), NULL);
+
+  g_tls_connection_handshake_async (G_TLS_CONNECTION (*server), G_PRIORITY_DEFAULT, NULL, on_tls_handshake, &pending);
+  g_tls_connection_handshake_async (G_TLS_CONNECTION (*client), G_PRIORITY_DEFAULT, NULL, on_tls_handshake, &pending);
+  while (pending > 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_object_unref (ioc);
+  g_object_unref (ios);
+}
+
+static void
+memory_usage (guint64 *rss_kb,
+              guint64 *peak_kb)
+{
+  gchar *contents;
+  gchar *line;
+
+  *rss_kb = *peak_kb = 0;
+  if (!g_file_get_contents ("/proc/self/status", &contents, NULL, NULL))
+    return;
+
+  line = strstr (contents, "\nVmRSS:");
+  if (line)
+    *rss_kb = g_ascii_strtoull (line + 7, NULL, 10);
+  line = strstr (contents, "\nVmHWM:");
+  if (line)
+    *peak_kb = g_ascii_strtoull (line + 7, NULL, 10);
+
+  g_free (contents);
+}
+
+static void
+run_sweep (GTlsCertificate *certificate,
+           guint round,
+           gsize size,
+           guint fragments,
+           guint connections)
+{
+  Sweep sweep = { NULL };
+  SweepPair *pair;
+  GIOStream *ioc;
+  GIOStream *ios;
+  gsize allocated;
+  gchar *per_message;
+  guint64 rss_kb;
+  guint64 peak_kb;
+  gint64 start;
+  double cpu_start;
+  double seconds;
+  double cpu;
+  guint total;
+  guint i;
+
+  sweep.message = g_bytes_new_take (g_strnfill (size, 'x'), size);
+  sweep.fragments = fragments;
+  if (fragments > 1)
+    sweep.wire = build_fragments (sweep.message, fragments);
+  sweep.window = CLAMP ((1024 * 1024) / size, 1, 64);
+
+  sweep.n_pairs = connections;
+  sweep.pairs = g_new0 (SweepPair, connections);
+  total = 0;
+  for (i = 0; i < connections; i++)
+    {
+      pair = sweep.pairs + i;
+      pair->sweep = &sweep;
+      pair->count = opt_messages / connections + (i < opt_messages % connections ? 1 : 0);
+      total += pair->count;
+
+      if (certificate)
+        tls_streampair (certificate, &ioc, &ios);
+      else
+        cockpit_socket_streampair (&ioc, &ios);
+
+      pair->server = web_socket_server_new_for_stream ("ws://localhost/bench", NULL, NULL, ios, NULL, NULL);
+      pair->client = web_socket_client_new_for_stream ("ws://localhost/bench", NULL, NULL, ioc);
+      g_signal_connect (pair->server, "message", G_CALLBACK (on_sweep_echo), pair);
+      g_signal_connect (pair->client, "message", G_CALLBACK (on_sweep_echoed), pair);
+      g_signal_connect (pair->client, "open", G_CALLBACK (on_sweep_open), pair);
+      g_signal_connect (pair->server, "error", G_CALLBACK (on_sweep_error), pair);
+      g_signal_connect (pair->client, "error", G_CALLBACK (on_sweep_error), pair);
+
+      g_object_unref (ioc);
+      g_object_unref (ios);
+    }
+
+  /* Connecting isn't what is measured */
+  while (sweep.opened < connections)
+    g_main_context_iteration (NULL, TRUE);
+
+  allocated = allocations;
+  cpu_start = cpu_ms ();
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < connections; i++)
+    sweep_send (sweep.pairs + i);
+  while (sweep.echoed < total)
+    g_main_context_iteration (NULL, TRUE);
+
+  seconds = (g_get_monotonic_time () - start) / 1000000.0;
+  cpu = cpu_ms () - cpu_start;
+  allocated = allocations - allocated;
+
+  for (i = 0; i < connections; i++)
+    web_socket_connection_close (sweep.pairs[i].client, WEB_SOCKET_CLOSE_NORMAL, NULL);
+  for (i = 0; i < connections; i++)
+    {
+      pair = sweep.pairs + i;
+      while (web_socket_connection_get_ready_state (pair->client) != WEB_SOCKET_STATE_CLOSED ||
+             web_socket_connection_get_ready_state (pair->server) != WEB_SOCKET_STATE_CLOSED)
+        g_main_context_iteration (NULL, TRUE);
+      g_object_unref (pair->client);
+      g_object_unref (pair->server);
+    }
+
+  memory_usage (&rss_kb, &peak_kb);
+  if (counting_allocations)
+    per_message = g_strdup_printf ("%.1f", (double)allocated / total);
+  else
+    per_message = g_strdup ("-");
+
+  g_print ("round=%u transport=%s connections=%u size=%" G_GSIZE_FORMAT " fragments=%u messages=%u "
+           "msgs_per_sec=%.0f mb_per_sec=%.1f cpu_ms=%.1f allocs_per_message=%s rss_kb=%" G_GUINT64_FORMAT
+           " peak_rss_kb=%" G_GUINT64_FORMAT "\n",
+           round, certificate ? "tls" : "plain", connections, size, fragments, total,
+           total / seconds, (double)total * size / seconds / (1024 * 1024), cpu,
+           per_message, rss_kb, peak_kb);
+
+  g_free (per_message);
+  g_free (sweep.pairs);
+  if (sweep.wire)
+    g_byte_array_unref (sweep.wire);
+  g_bytes_unref (sweep.message);
+}
+
+typedef struct {
+  CockpitTransport *transport;
+  gsize expected;
+  gsize forwarded;
+} Forward;
+
+static void
+forward_message (Forward *forward,
+                 GBytes *message)
+{
+  GBytes *payload;
+  gchar *channel = NULL;
+
+  payload = cockpit_transport_parse_frame (message, &channel);
+  g_assert (payload != NULL && channel != NULL);
+  cockpit_transport_send (forward->transport, channel, payload);
+  g_bytes_unref (payload);
+  g_free (channel);
+}
+
+static void
+on_message_forward (WebSocketConnection *ws,
+                    WebSocketDataType type,
+                    GBytes *message,
+                    gpointer user_data)
+{
+  forward_message (user_data, message);
+}
+
+static void
+on_messages_forward (WebSocketConnection *ws,
+                     const WebSocketMessage *messages,
+                     guint n_messages,
+                     gpointer user_data)
+{
+  guint i;
+
+  for (i = 0; i < n_messages; i++)
+    forward_message (user_data, messages[i].payload);
+}
+
+static gboolean
+on_session_readable (gint fd,
+                     GIOCondition cond,
+                     gpointer user_data)
+{
+  Forward *forward = user_data;
+  gchar buffer[64 * 1024];
+  gssize ret;
+
+  ret = read (fd, buffer, sizeof (buffer));
+  if (ret <= 0)
+    g_error ("couldn't read from session: %s", ret < 0 ? g_strerror (errno) : "closed");
+  forward->forwarded += ret;
+
+  return TRUE;
+}
+
+static guint64
+write_syscalls (void)
+{
+  gchar *contents;
+  gchar *line;
+  guint64 count = 0;
+
+  if (!g_file_get_contents ("/proc/self/io", &contents, NULL, NULL))
+    g_error ("couldn't read /proc/self/io");
+
+  line = strstr (contents, "syscw:");
+  if (line)
+    count = g_ascii_strtoull (line + 6, NULL, 10);
+
+  g_free (contents);
+  return count;
+}
+
+static void
+run_batch (gboolean batched)
+{
+  const guint8 mask[] = { 0x37, 0x5a, 0x21, 0x3d };
+  Forward forward = { NULL };
+  Bench bench = { NULL };
+  WebSocketConnection *ws;
+  GHashTable *headers;
+  GIOStream *ours;
+  GIOStream *theirs;
+  GSource *source;
+  guint64 before;
+  guint64 writes;
+  gchar *message;
+  gsize length;
+  gsize at;
+  guint watch;
+  gint fds[2];
+  guint i;
+  gsize n;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    g_error ("couldn't create socket pair: %s", g_strerror (errno));
+  forward.transport = cockpit_pipe_transport_new_fds ("session", fds[0], dup (fds[0]));
+  watch = g_unix_fd_add (fds[1], G_IO_IN, on_session_readable, &forward);
+
+  /* What a browser sends when a page starts up and asks for many properties */
+  bench.wire = g_byte_array_new ();
+  for (i = 0; i < opt_messages; i++)
+    {
+      message = g_strdup_printf ("4\n{\"call\":[\"/org/freedesktop/systemd1/unit/unit_%u_2eservice\","
+                                 "\"org.freedesktop.DBus.Properties\",\"GetAll\",[\"org.freedesktop.systemd1.Unit\"]],"
+                                 "\"id\":\"%u\"}", i, i);
+      length = strlen (message);
+      /* The transport frames it as the length, a newline and the message */
+      forward.expected += g_snprintf (NULL, 0, "%" G_GSIZE_FORMAT, length) + 1 + length;
+
+      append_frame_header (bench.wire, 0x81, length);
+      g_byte_array_append (bench.wire, mask, sizeof (mask));
+      at = bench.wire->len;
+      g_byte_array_append (bench.wire, (guint8 *)message, length);
+      for (n = 0; n < length; n++)
+        bench.wire->data[at + n] ^= mask[n & 3];
+      g_free (message);
+    }
+
+  cockpit_socket_streampair (&ours, &theirs);
+  headers = handshake_headers (FALSE);
+  ws = bench_server (theirs, headers, NULL, 0);
+  if (batched)
+    {
+      g_object_set (ws, "batch-messages", TRUE, NULL);
+      g_signal_connect (ws, "messages", G_CALLBACK (on_messages_forward), &forward);
+    }
+  else
+    {
+      g_signal_connect (ws, "message", G_CALLBACK (on_message_forward), &forward);
+    }
+
+  while (web_socket_connection_get_ready_state (ws) == WEB_SOCKET_STATE_CONNECTING)
+    g_main_context_iteration (NULL, TRUE);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  /* The WebSocket itself sends and receives, only the transport writes */
+  before = write_syscalls ();
+
+  source = g_pollable_output_stream_create_source (G_POLLABLE_OUTPUT_STREAM (g_io_stream_get_output_stream (ours)), NULL);
+  g_source_set_callback (source, (GSourceFunc)on_wire_writable, &bench, NULL);
+  g_source_attach (source, NULL);
+
+  while (forward.forwarded < forward.expected)
+    g_main_context_iteration (NULL, TRUE);
+  writes = write_syscalls () - before;
+
+  g_print ("mode=%s messages=%d writes=%" G_GUINT64_FORMAT " writes_per_message=%.3f\n",
+           batched ? "batch" : "message", opt_messages, writes, (double)writes / opt_messages);
+
+  g_source_destroy (source);
+  g_source_unref (source);
+  g_source_remove (watch);
+  close (fds[1]);
+  g_object_unref (ws);
+  g_object_unref (forward.transport);
+  g_object_unref (ours);
+  g_object_unref (theirs);
+  g_hash_table_unref (headers);
+  g_byte_array_unref (bench.wire);
+}
+
+static GArray *
+parse_list (const gchar *option,
+            const gchar *value,
+            guint64 min,
+            guint64 max)
+{
+  GError *error = NULL;
+  GArray *values;
+  gchar **parts;
+  guint64 number;
+  guint item;
+  guint i;
+
+  values = g_array_new (FALSE, FALSE, sizeof (guint));
+  parts = g_strsplit (value, ",", -1);
+  for (i = 0; parts[i] != NULL; i++)
+    {
+      if (!g_ascii_string_to_unsigned (parts[i], 10, min, max, &number, &error))
+        {
+          g_printerr ("bench-websocket: invalid %s: %s\n", option, error->message);
+          exit (2);
+        }
+      item = number;
+      g_array_append_val (values, item);
+    }
+  g_strfreev (parts);
+
+  return values;
+}
+
+static void
+run_sweeps (void)
+{
+  GTlsCertificate *certificate;
+  GError *error = NULL;
+  gchar **transports;
+  GArray *sizes;
+  GArray *fragments;
+  GArray *connections;
+  guint round;
+  guint t, s, f, c;
+
+  sizes = parse_list ("size", opt_sizes, 1, MAX_MESSAGE);
+  fragments = parse_list ("fragments", opt_fragments, 1, 1024);
+  connections = parse_list ("connections", opt_connections, 1, 1024);
+  transports = g_strsplit (opt_transports, ",", -1);
+
+  for (round = 1; round <= opt_rounds; round++)
+    {
+      for (t = 0; transports[t] != NULL; t++)
+        {
+          if (g_str_equal (transports[t], "tls"))
+            {
+              certificate = g_tls_certificate_new_from_files (SRCDIR "/test/data/mock-server.crt",
+                                                              SRCDIR "/test/data/mock-server.key", &error);
+              if (certificate == NULL)
+                g_error ("couldn't load certificate: %s", error->message);
+            }
+          else if (g_str_equal (transports[t], "plain"))
+            {
+              certificate = NULL;
+            }
+          else
+            {
+              g_printerr ("bench-websocket: unknown transport: %s\n", transports[t]);
+              exit (2);
+            }
+
+          for (s = 0; s < sizes->len; s++)
+            {
+              for (f = 0; f < fragments->len; f++)
+                {
+                  /* Every fragment carries at least a byte */
+                  if (g_array_index (fragments, guint, f) > g_array_index (sizes, guint, s))
+                    continue;
+                  for (c = 0; c < connections->len; c++)
+                    run_sweep (certificate, round, g_array_index (sizes, guint, s),
+                               g_array_index (fragments, guint, f), g_array_index (connections, guint, c));
+                }
+            }
+
+          g_clear_object (&certificate);
+        }
+    }
+
+  g_strfreev (transports);
+  g_array_unref (sizes);
+  g_array_unref (fragments);
+  g_array_unref (connections);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  Bench bench = { NULL };
+  gchar **window_bits;
+  guint64 bits;
+  guint i;
+
+  context = g_option_context_new ("- measure WebSocket performance");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-websocket: %s\n", error->message);
+      return 2;
+    }
+  g_option_context_free (context);
+
+  if (g_str_equal (opt_benchmark, "throughput"))
+    {
+      GBytes *payload = g_bytes_new_take (g_strnfill (opt_size, 'x'), opt_size);
+      bench.messages = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+      for (i = 0; i < opt_messages; i++)
+        g_ptr_array_add (bench.messages, g_bytes_ref (payload));
+      bench.payload = (gsize)opt_size * opt_messages;
+      g_bytes_unref (payload);
+
+      run_throughput (&bench);
+      g_ptr_array_unref (bench.messages);
+      return 0;
+    }
+  else if (g_str_equal (opt_benchmark, "latency"))
+    {
+      run_latency (FALSE);
+      run_latency (TRUE);
+      return 0;
+    }
+  else if (g_str_equal (opt_benchmark, "frames"))
+    {
+      run_frames (&bench, 10000);
+      return 0;
+    }
+  else if (g_str_equal (opt_benchmark, "mask"))
+    {
+      run_mask ();
+      return 0;
+    }
+  else if (g_str_equal (opt_benchmark, "batch"))
+    {
+      run_batch (FALSE);
+      run_batch (TRUE);
+      return 0;
+    }
+  else if (g_str_equal (opt_benchmark, "sweep"))
+    {
+      run_sweeps ();
+      return 0;
+    }
+  else if (!g_str_equal (opt_benchmark, "compression"))
+    {
+      g_printerr ("bench-websocket: unknown benchmark: %s\n", opt_benchmark);
+      return 2;
+    }
+
+  if (opt_session)
+    bench.messages = load_session (opt_session);
+  else
+    bench.messages = synthesize_session (opt_messages);
+  for (i = 0; i < bench.messages->len; i++)
+    bench.payload += g_bytes_get_size (bench.messages->pdata[i]);
+  if (bench.payload == 0)
+    {
+      g_printerr ("bench-websocket: no messages in session\n");
+      return 1;
+    }
+
+  run_compression (&bench, 0);
+
+  window_bits = g_strsplit (opt_window_bits, ",", -1);
+  for (i = 0; window_bits[i] != NULL; i++)
+    {
+      if (!g_ascii_string_to_unsigned (window_bits[i], 10, 9, 15, &bits, &error))
+        {
+          g_printerr ("bench-websocket: invalid window bits: %s\n", error->message);
+          return 2;
+        }
+      run_compression (&bench, bits);
+    }
+  g_strfreev (window_bits);
+
+  g_ptr_array_unref (bench.messages);
+  return 0;
+}
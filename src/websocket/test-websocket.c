@@ -447,6 +447,68 @@ test_header_empty (void)
   g_hash_table_unref (headers);
 }
 
+static void
+test_unmask (void)
+{
+  const gchar *names[] = { "avx2", "sse2", "words" };
+  const guint8 mask[] = { 0x37, 0xfa, 0x21, 0x3d };
+  guint8 input[200];
+  guint8 expected[200];
+  guint8 data[200];
+  gsize expected_ascii;
+  gsize offset;
+  gsize len;
+  gsize n;
+  guint i;
+
+  for (n = 0; n < sizeof (input); n++)
+    input[n] = (n * 7) & 0x7f;
+
+  for (i = 0; i < G_N_ELEMENTS (names); i++)
+    {
+      if (!_web_socket_mask_set_implementation (names[i]))
+        continue;
+
+      for (offset = 0; offset < 8; offset++)
+        {
+          for (len = 0; len + offset <= sizeof (input); len += 3)
+            {
+              /* Put a non-ASCII byte at various places */
+              memcpy (data, input, sizeof (data));
+              if (len > 0)
+                data[offset + len * 2 / 3] = 0x80 ^ mask[(len * 2 / 3) & 3];
+              memcpy (expected, data, sizeof (expected));
+              expected_ascii = len;
+              for (n = 0; n < len; n++)
+                {
+                  expected[offset + n] ^= mask[n & 3];
+                  if (expected_ascii == len && (expected[offset + n] & 0x80))
+                    expected_ascii = n;
+                }
+
+              g_assert_cmpuint (_web_socket_unmask_rfc6455 (mask, data + offset, len), ==, expected_ascii);
+              g_assert (memcmp (data, expected, sizeof (data)) == 0);
+            }
+        }
+
+      g_assert (_web_socket_validate_utf8 ((const guint8 *)"", 0, 0));
+      g_assert (_web_socket_validate_utf8 (input, sizeof (input), 0));
+      g_assert (_web_socket_validate_utf8 (input, sizeof (input), 100));
+      memcpy (data, input, sizeof (data));
+      memcpy (data + 150, "\xc3\xa9\xe2\x82\xac", 5);
+      g_assert (_web_socket_validate_utf8 (data, sizeof (data), 0));
+      g_assert (_web_socket_validate_utf8 (data, sizeof (data), 150));
+      data[152] = 0xff;
+      g_assert (!_web_socket_validate_utf8 (data, sizeof (data), 0));
+      g_assert (!_web_socket_validate_utf8 (data, sizeof (data), 150));
+      data[152] = 0xe2;
+      g_assert (!_web_socket_validate_utf8 (data, 153, 0));
+    }
+
+  /* Back to the best one for the other tests */
+  for (i = 0; !_web_socket_mask_set_implementation (names[i]); i++);
+}
+
 static gboolean
 on_error_not_reached (WebSocketConnection *ws,
                       GError *error,
@@ -771,6 +833,168 @@ test_pressure_throttle (Test *test,
   g_object_unref (pressure);
 }
 
+typedef struct {
+  GIOStream *io;
+  gulong delay;
+} SlowReader;
+
+static gpointer
+slow_reader_thread (gpointer user_data)
+{
+  SlowReader *reader = user_data;
+  const gchar request[] = "GET /unix HTTP/1.1\r\n"
+                          "Host: localhost\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                          "Sec-WebSocket-Version: 13\r\n"
+                          "\r\n";
+  const gchar close[] = "\x88\x02\x03\xe8";
+  const gchar reply[] = "\x88\x82\x00\x00\x00\x00\x03\xe8";
+  gchar buffer[16 * 1024];
+  gchar tail[4] = { 0, };
+  gssize count;
+  gsize written;
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (reader->io),
+                                  request, sizeof (request) - 1, &written, NULL, NULL))
+    g_assert_not_reached ();
+
+  /* Read a bit at a time until the server closes the connection */
+  while (memcmp (tail, close, sizeof (tail)) != 0)
+    {
+      g_usleep (reader->delay);
+      count = g_input_stream_read (g_io_stream_get_input_stream (reader->io),
+                                   buffer, sizeof (buffer), NULL, NULL);
+      g_assert_cmpint (count, >, 0);
+      if ((gsize)count >= sizeof (tail))
+        {
+          memcpy (tail, buffer + count - sizeof (tail), sizeof (tail));
+        }
+      else
+        {
+          memmove (tail, tail + count, sizeof (tail) - count);
+          memcpy (tail + sizeof (tail) - count, buffer, count);
+        }
+    }
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (reader->io),
+                                  reply, sizeof (reply) - 1, &written, NULL, NULL))
+    g_assert_not_reached ();
+
+  return NULL;
+}
+
+typedef struct {
+  WebSocketConnection *ws;
+  gboolean pressure;
+  guint applied;
+  gsize applied_at;
+  gsize relieved_at;
+} SlowWriter;
+
+static void
+on_pressure_record (WebSocketConnection *ws,
+                    gboolean pressure,
+                    gpointer user_data)
+{
+  SlowWriter *writer = user_data;
+
+  g_assert (pressure != writer->pressure);
+  writer->pressure = pressure;
+  if (pressure)
+    {
+      writer->applied++;
+      writer->applied_at = web_socket_connection_get_buffered_amount (ws);
+    }
+  else
+    {
+      writer->relieved_at = web_socket_connection_get_buffered_amount (ws);
+    }
+}
+
+static void
+write_to_slow_reader (gboolean adaptive,
+                      gulong delay,
+                      gsize total,
+                      SlowWriter *writer)
+{
+  SlowReader reader = { NULL, delay };
+  GIOStream *io;
+  GThread *thread;
+  GBytes *sent;
+  gint64 start;
+  gsize i;
+
+  cockpit_socket_streampair (&reader.io, &io);
+  thread = g_thread_new ("slow-reader", slow_reader_thread, &reader);
+
+  writer->ws = web_socket_server_new_for_stream ("ws://localhost/unix", NULL, NULL, io, NULL, NULL);
+  g_signal_connect (writer->ws, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (writer->ws, "pressure", G_CALLBACK (on_pressure_record), writer);
+  g_object_set (writer->ws,
+                "pressure-high", adaptive ? 1024 * 1024 : 256 * 1024,
+                "pressure-low", 64 * 1024,
+                "adaptive-pressure", adaptive,
+                NULL);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (writer->ws) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (writer->ws), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* Only queue more while there's no back pressure, like a channel would */
+  start = g_get_monotonic_time ();
+  sent = g_bytes_new_take (g_strnfill (16 * 1024, '!'), 16 * 1024);
+  for (i = 0; i < total; i += g_bytes_get_size (sent))
+    {
+      WAIT_UNTIL (!writer->pressure);
+      web_socket_connection_send (writer->ws, WEB_SOCKET_DATA_TEXT, NULL, sent);
+    }
+  g_bytes_unref (sent);
+
+  WAIT_UNTIL (web_socket_connection_get_buffered_amount (writer->ws) == 0);
+  g_assert (!writer->pressure);
+
+  g_assert_cmpuint (web_socket_connection_get_pressure_count (writer->ws), ==, writer->applied);
+  g_assert_cmpint (web_socket_connection_get_pressure_time (writer->ws), >, 0);
+  g_assert_cmpint (web_socket_connection_get_pressure_time (writer->ws), <, g_get_monotonic_time () - start);
+
+  web_socket_connection_close (writer->ws, WEB_SOCKET_CLOSE_NORMAL, NULL);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (writer->ws) == WEB_SOCKET_STATE_CLOSED);
+  g_thread_join (thread);
+
+  g_object_unref (writer->ws);
+  g_object_unref (reader.io);
+  g_object_unref (io);
+}
+
+static void
+test_pressure_slow_reader (void)
+{
+  SlowWriter writer = { NULL, };
+
+  /* About 3 MB/s */
+  write_to_slow_reader (FALSE, 5 * 1000, 2 * 1024 * 1024, &writer);
+
+  /* Each pressure lets the queue drain to the low mark, not just below the high one */
+  g_assert_cmpuint (writer.applied, >=, 2);
+  g_assert_cmpuint (writer.applied, <=, (2 * 1024 * 1024) / (192 * 1024) + 1);
+  g_assert_cmpuint (writer.applied_at, >=, 255 * 1024);
+  g_assert_cmpuint (writer.applied_at, <, 256 * 1024 + 32 * 1024);
+  g_assert_cmpuint (writer.relieved_at, <=, 64 * 1024 + 16 * 1024);
+}
+
+static void
+test_pressure_adaptive (void)
+{
+  SlowWriter writer = { NULL, };
+
+  /* About 800 KB/s, so a quarter of a second is much less than the high mark */
+  write_to_slow_reader (TRUE, 20 * 1000, 2 * 1024 * 1024, &writer);
+
+  g_assert_cmpuint (writer.applied, >=, 2);
+  g_assert_cmpuint (writer.applied_at, <, 512 * 1024);
+}
+
 static void
 test_send_prefixed (Test *test,
                     gconstpointer data)
@@ -796,6 +1020,64 @@ test_send_prefixed (Test *test,
   g_bytes_unref (received);
 }
 
+static void
+on_message_check_sequence (WebSocketConnection *ws,
+                           WebSocketDataType type,
+                           GBytes *message,
+                           gpointer user_data)
+{
+  guint *received = user_data;
+  gchar *expected;
+
+  expected = g_strdup_printf ("prefix %u\n", *received);
+  g_assert_cmpuint (g_bytes_get_size (message), ==, 1000 + strlen (expected));
+  g_assert (strncmp (g_bytes_get_data (message, NULL), expected, strlen (expected)) == 0);
+  g_free (expected);
+
+  (*received)++;
+}
+
+static void
+test_send_many_queued (Test *test,
+                       gconstpointer data)
+{
+  WebSocketConnection *senders[] = { test->server, test->client };
+  WebSocketConnection *receivers[] = { test->client, test->server };
+  guint received;
+  GBytes *payload;
+  GBytes *prefix;
+  gchar *string;
+  guint i, j;
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+
+  payload = g_bytes_new_take (g_strnfill (1000, '*'), 1000);
+
+  /* Queue much more than a socket buffer, so frames get written partially */
+  for (j = 0; j < G_N_ELEMENTS (senders); j++)
+    {
+      received = 0;
+      g_signal_connect (receivers[j], "message", G_CALLBACK (on_message_check_sequence), &received);
+
+      for (i = 0; i < 2000; i++)
+        {
+          string = g_strdup_printf ("prefix %u\n", i);
+          prefix = g_bytes_new_take (string, strlen (string));
+          web_socket_connection_send (senders[j], WEB_SOCKET_DATA_TEXT, prefix, payload);
+          g_bytes_unref (prefix);
+        }
+
+      g_assert_cmpuint (web_socket_connection_get_buffered_amount (senders[j]), >, 2000 * 1000);
+      WAIT_UNTIL (received == 2000);
+      g_assert_cmpuint (web_socket_connection_get_buffered_amount (senders[j]), ==, 0);
+
+      g_signal_handlers_disconnect_by_func (receivers[j], on_message_check_sequence, &received);
+    }
+
+  g_bytes_unref (payload);
+}
+
 static void
 test_send_bad_data (Test *test,
                     gconstpointer unused)
@@ -922,6 +1204,570 @@ test_protocol_client_any (Test *test,
   g_clear_error (&error);
 }
 
+static void
+test_deflate_negotiate (Test *test,
+                        gconstpointer unused)
+{
+  g_object_set (test->server, "permessage-deflate", TRUE, NULL);
+  g_object_set (test->client, "permessage-deflate", TRUE, NULL);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->client), ==, "permessage-deflate");
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->server), ==, "permessage-deflate");
+}
+
+static void
+test_deflate_declined (Test *test,
+                       gconstpointer unused)
+{
+  GBytes *sent = NULL;
+  GBytes *received = NULL;
+
+  /* Only the client wants it */
+  g_object_set (test->client, "permessage-deflate", TRUE, NULL);
+  g_signal_connect (test->server, "message", G_CALLBACK (on_text_message), &received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->client), ==, NULL);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->server), ==, NULL);
+
+  sent = g_bytes_new_take (g_strnfill (1000, 'x'), 1000);
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (sent, received));
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+}
+
+static void
+test_deflate_window_bits (Test *test,
+                          gconstpointer unused)
+{
+  /* The client can't afford a full window from the server ... */
+  g_object_set (test->client,
+                "permessage-deflate", TRUE,
+                "deflate-memory-limit", 40 * 1000,
+                NULL);
+
+  /* ... and the server wants to use less anyway */
+  g_object_set (test->server,
+                "permessage-deflate", TRUE,
+                "deflate-window-bits", 10,
+                NULL);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->client), ==, "permessage-deflate; server_max_window_bits=10");
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->server), ==, "permessage-deflate; server_max_window_bits=10");
+}
+
+static GBytes *
+build_json_message (gint count)
+{
+  GString *string = g_string_new ("");
+  gint i;
+
+  for (i = 0; i < count; i++)
+    g_string_append_printf (string, "{\"channel\": \"4:%d\", \"command\": \"ready\", \"data\": %d}\n", i, i * 7);
+
+  return g_string_free_to_bytes (string);
+}
+
+static void
+test_deflate_send (Test *test,
+                   gconstpointer unused)
+{
+  GBytes *prefix;
+  GBytes *sent;
+  GBytes *small;
+  GBytes *received = NULL;
+  gint i;
+
+  g_object_set (test->server, "permessage-deflate", TRUE, NULL);
+  g_object_set (test->client, "permessage-deflate", TRUE, NULL);
+
+  g_signal_connect (test->server, "message", G_CALLBACK (on_text_message), &received);
+  g_signal_connect (test->client, "message", G_CALLBACK (on_text_message), &received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->client), ==, "permessage-deflate");
+
+  sent = build_json_message (2000);
+  g_assert_cmpuint (g_bytes_get_size (sent), >, 64 * 1024);
+  small = g_bytes_new_static ("tiny", 4);
+  prefix = g_bytes_new_static ("prefix\n", 7);
+
+  /* Several times in each direction, so that the compression context is reused */
+  for (i = 0; i < 3; i++)
+    {
+      web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+      WAIT_UNTIL (received != NULL);
+      g_assert (g_bytes_equal (sent, received));
+      g_bytes_unref (received);
+      received = NULL;
+
+      web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, NULL, sent);
+      WAIT_UNTIL (received != NULL);
+      g_assert (g_bytes_equal (sent, received));
+      g_bytes_unref (received);
+      received = NULL;
+
+      /* Small messages aren't compressed, and that mixes fine */
+      web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, NULL, small);
+      WAIT_UNTIL (received != NULL);
+      g_assert (g_bytes_equal (small, received));
+      g_bytes_unref (received);
+      received = NULL;
+    }
+
+  web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, prefix, sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert_cmpuint (g_bytes_get_size (received), ==, g_bytes_get_size (sent) + 7);
+  g_assert (strncmp (g_bytes_get_data (received, NULL), "prefix\n{", 9) == 0);
+  g_bytes_unref (received);
+
+  g_bytes_unref (prefix);
+  g_bytes_unref (small);
+  g_bytes_unref (sent);
+}
+
+static void
+test_deflate_unexpected (Test *test,
+                         gconstpointer unused)
+{
+  GError *error = NULL;
+  GIOStream *io;
+  gsize written;
+  const gchar *frame;
+  guint logid;
+
+  g_signal_handlers_disconnect_by_func (test->server, on_error_not_reached, NULL);
+  g_signal_connect (test->server, "error", G_CALLBACK (on_error_copy), &error);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->server), ==, NULL);
+
+  io = web_socket_connection_get_io_stream (test->client);
+
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  /* A frame marked as compressed without negotiating it */
+  frame = "\xC1\x04abcd";
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (io),
+                                  frame, 6, &written, NULL, NULL))
+    g_assert_not_reached ();
+  g_assert_cmpuint (written, ==, 6);
+
+  WAIT_UNTIL (error != NULL);
+  g_assert_error (error, WEB_SOCKET_ERROR, WEB_SOCKET_CLOSE_PROTOCOL);
+  g_error_free (error);
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+}
+
+/* Hard to compress, so that the compressed messages still fill the queue */
+static GBytes *
+build_flow_message (gchar flow,
+                    guint number)
+{
+  GString *string = g_string_new ("");
+  GRand *rand;
+
+  rand = g_rand_new_with_seed (number * 2 + (flow == 'b'));
+  g_string_append_printf (string, "%c %u\n", flow, number);
+  while (string->len < 16 * 1024)
+    g_string_append_printf (string, "%08x", g_rand_int (rand));
+  g_rand_free (rand);
+
+  return g_string_free_to_bytes (string);
+}
+
+typedef struct {
+  guint a;
+  guint b;
+} DeflateFlows;
+
+static void
+on_message_deflate_flows (WebSocketConnection *ws,
+                          WebSocketDataType type,
+                          GBytes *message,
+                          gpointer user_data)
+{
+  DeflateFlows *counts = user_data;
+  const gchar *data;
+  GBytes *expected;
+
+  data = g_bytes_get_data (message, NULL);
+  if (data[0] == 'a')
+    expected = build_flow_message ('a', counts->a++);
+  else
+    expected = build_flow_message ('b', counts->b++);
+
+  /* Each message arrives intact, and in order with its flow */
+  g_assert (g_bytes_equal (message, expected));
+  g_bytes_unref (expected);
+}
+
+static void
+test_deflate_flows (Test *test,
+                    gconstpointer unused)
+{
+  DeflateFlows counts = { 0, 0 };
+  GBytes *message;
+  guint i;
+
+  g_object_set (test->server, "permessage-deflate", TRUE, NULL);
+  g_object_set (test->client, "permessage-deflate", TRUE, NULL);
+
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_deflate_flows), &counts);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->server), ==, "permessage-deflate");
+
+  /* The flows take turns, so the messages go out in a different order than
+   * they were sent in. They still share the compression context. */
+  web_socket_connection_set_flow_weight (test->server, "a", 1);
+  web_socket_connection_set_flow_weight (test->server, "b", 8);
+  for (i = 0; i < 20; i++)
+    {
+      message = build_flow_message ('a', i);
+      web_socket_connection_send_full (test->server, WEB_SOCKET_DATA_TEXT, NULL, message, "a");
+      g_bytes_unref (message);
+
+      message = build_flow_message ('b', i);
+      web_socket_connection_send_full (test->server, WEB_SOCKET_DATA_TEXT, NULL, message, "b");
+      g_bytes_unref (message);
+    }
+
+  WAIT_UNTIL (counts.a == 20 && counts.b == 20);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), ==, 0);
+}
+
+typedef struct {
+  guint bulk;
+  gint interactive_after;
+} FlowOrder;
+
+static void
+on_message_flow_order (WebSocketConnection *ws,
+                       WebSocketDataType type,
+                       GBytes *message,
+                       gpointer user_data)
+{
+  FlowOrder *order = user_data;
+  const guint8 *data;
+  gsize length;
+
+  data = g_bytes_get_data (message, &length);
+  if (length == 4)
+    {
+      g_assert (memcmp (data, "tiny", 4) == 0);
+      g_assert_cmpint (order->interactive_after, <, 0);
+      order->interactive_after = order->bulk;
+    }
+  else
+    {
+      /* Messages on the same flow stay in order */
+      g_assert_cmpuint (data[0], ==, order->bulk);
+      order->bulk++;
+    }
+}
+
+static void
+test_flow_interleave (Test *test,
+                      gconstpointer unused)
+{
+  FlowOrder order = { 0, -1 };
+  GByteArray *data;
+  GBytes *bytes;
+  guint i;
+
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_flow_order), &order);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+
+  web_socket_connection_set_flow_weight (test->server, "bulk", 1);
+
+  /* Much more than goes out at once */
+  data = g_byte_array_new ();
+  g_byte_array_set_size (data, 64 * 1024);
+  for (i = 0; i < 32; i++)
+    {
+      memset (data->data, i, data->len);
+      bytes = g_bytes_new (data->data, data->len);
+      web_socket_connection_send_full (test->server, WEB_SOCKET_DATA_BINARY, NULL, bytes, "bulk");
+      g_bytes_unref (bytes);
+    }
+  g_byte_array_unref (data);
+
+  /* Doesn't wait for all of the above */
+  bytes = g_bytes_new_static ("tiny", 4);
+  web_socket_connection_send_full (test->server, WEB_SOCKET_DATA_TEXT, NULL, bytes, "interactive");
+  g_bytes_unref (bytes);
+
+  WAIT_UNTIL (order.bulk == 32);
+  g_assert_cmpint (order.interactive_after, >=, 0);
+  g_assert_cmpint (order.interactive_after, <, 4);
+
+  /* Nothing left over */
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), ==, 0);
+}
+
+static void
+test_flow_default (Test *test,
+                   gconstpointer unused)
+{
+  FlowOrder order = { 0, -1 };
+  GByteArray *data;
+  GBytes *bytes;
+  gchar *frame;
+  guint i;
+
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_flow_order), &order);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+
+  web_socket_connection_set_flow_weight (test->server, "bulk", 1);
+
+  data = g_byte_array_new ();
+  g_byte_array_set_size (data, 64 * 1024);
+  for (i = 0; i < 32; i++)
+    {
+      memset (data->data, i, data->len);
+      bytes = g_bytes_new (data->data, data->len);
+      web_socket_connection_send_full (test->server, WEB_SOCKET_DATA_BINARY, NULL, bytes, "bulk");
+      g_bytes_unref (bytes);
+    }
+  g_byte_array_unref (data);
+
+  /* A raw frame without a flow takes turns on the default flow */
+  frame = g_malloc (6);
+  memcpy (frame, "\x81\x04tiny", 6);
+  _web_socket_connection_queue (test->server, WEB_SOCKET_QUEUE_NORMAL, frame, 6, 4);
+
+  WAIT_UNTIL (order.bulk == 32);
+  g_assert_cmpint (order.interactive_after, >=, 0);
+  g_assert_cmpint (order.interactive_after, <, 4);
+}
+
+typedef struct {
+  gint type;
+  GByteArray *data;
+  guint fragments;
+  gboolean done;
+} Streamed;
+
+static void
+on_message_not_reached (WebSocketConnection *ws,
+                        WebSocketDataType type,
+                        GBytes *message,
+                        gpointer user_data)
+{
+  g_assert_not_reached ();
+}
+
+static void
+on_stream_begin (WebSocketConnection *ws,
+                 WebSocketDataType type,
+                 gpointer user_data)
+{
+  Streamed *streamed = user_data;
+  g_assert (streamed->data == NULL);
+  streamed->type = type;
+  streamed->data = g_byte_array_new ();
+  streamed->fragments = 0;
+  streamed->done = FALSE;
+}
+
+static void
+on_stream_fragment (WebSocketConnection *ws,
+                    GBytes *fragment,
+                    gpointer user_data)
+{
+  Streamed *streamed = user_data;
+  gconstpointer data;
+  gsize length;
+
+  g_assert (streamed->data != NULL);
+  g_assert (!streamed->done);
+
+  /* Text is never split within a character */
+  data = g_bytes_get_data (fragment, &length);
+  if (streamed->type == WEB_SOCKET_DATA_TEXT)
+    g_assert (g_utf8_validate (data, length, NULL));
+
+  g_byte_array_append (streamed->data, data, length);
+  streamed->fragments++;
+}
+
+static void
+on_stream_end (WebSocketConnection *ws,
+               gpointer user_data)
+{
+  Streamed *streamed = user_data;
+  g_assert (streamed->data != NULL);
+  g_assert (!streamed->done);
+  streamed->done = TRUE;
+}
+
+static void
+connect_streamed (WebSocketConnection *ws,
+                  Streamed *streamed)
+{
+  g_object_set (ws, "streaming", TRUE, NULL);
+  g_signal_connect (ws, "message", G_CALLBACK (on_message_not_reached), NULL);
+  g_signal_connect (ws, "message-begin", G_CALLBACK (on_stream_begin), streamed);
+  g_signal_connect (ws, "message-fragment", G_CALLBACK (on_stream_fragment), streamed);
+  g_signal_connect (ws, "message-end", G_CALLBACK (on_stream_end), streamed);
+}
+
+static GBytes *
+build_text_message (gsize size)
+{
+  GString *string = g_string_sized_new (size);
+
+  /* Characters of one, two and three bytes */
+  while (string->len < size)
+    g_string_append (string, "price: 3\xe2\x82\xac or \xc2\xa3 2\n");
+
+  return g_string_free_to_bytes (string);
+}
+
+static void
+check_streamed (Streamed *streamed,
+                WebSocketDataType type,
+                GBytes *sent)
+{
+  GBytes *received;
+
+  WAIT_UNTIL (streamed->done);
+  g_assert_cmpint (streamed->type, ==, type);
+  received = g_byte_array_free_to_bytes (streamed->data);
+  g_assert (g_bytes_equal (sent, received));
+  g_bytes_unref (received);
+  streamed->data = NULL;
+  streamed->done = FALSE;
+}
+
+static void
+test_stream_large (Test *test,
+                   gconstpointer unused)
+{
+  Streamed streamed = { 0, };
+  GBytes *sent;
+
+  connect_streamed (test->server, &streamed);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+
+  /* Far more than fits in a single message without streaming */
+  sent = build_text_message (4 * 1024 * 1024);
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  check_streamed (&streamed, WEB_SOCKET_DATA_TEXT, sent);
+  g_bytes_unref (sent);
+
+  /* Arrives in pieces, without waiting for the whole message */
+  g_assert_cmpuint (streamed.fragments, >, 1);
+
+  sent = g_bytes_new_static ("", 0);
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_BINARY, NULL, sent);
+  check_streamed (&streamed, WEB_SOCKET_DATA_BINARY, sent);
+  g_assert_cmpuint (streamed.fragments, ==, 0);
+  g_bytes_unref (sent);
+}
+
+static void
+test_stream_deflate (Test *test,
+                     gconstpointer unused)
+{
+  Streamed streamed = { 0, };
+  GBytes *sent;
+  gint i;
+
+  g_object_set (test->server, "permessage-deflate", TRUE, NULL);
+  g_object_set (test->client, "permessage-deflate", TRUE, NULL);
+  connect_streamed (test->server, &streamed);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->server), ==, "permessage-deflate");
+
+  /* Inflates to much more than a single message may be */
+  sent = build_text_message (1024 * 1024);
+  for (i = 0; i < 2; i++)
+    {
+      web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+      check_streamed (&streamed, WEB_SOCKET_DATA_TEXT, sent);
+    }
+  g_bytes_unref (sent);
+}
+
+static gpointer
+send_streamed_server_thread (gpointer user_data)
+{
+  GIOStream *io = user_data;
+  guint8 pong[10];
+  gsize count;
+  guint i;
+
+  /* Control frames between the fragments, and a character split between them */
+  const gchar frames[] = "\x01\x05""one \xe2"              /* !fin | text */
+                         "\x89\x04""ping"                   /* ping */
+                         "\x00\x07""\x82\xac two "          /* !fin | no opcode */
+                         "\x8A\x00"                         /* pong */
+                         "\x80\x05""three";                 /* fin | no opcode */
+
+  mock_perform_handshake (io);
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (io),
+                                  frames, sizeof (frames) - 1, &count, NULL, NULL))
+    g_assert_not_reached ();
+  g_assert_cmpuint (count, ==, sizeof (frames) - 1);
+
+  /* The ping was answered in the middle of the message */
+  if (!g_input_stream_read_all (g_io_stream_get_input_stream (io),
+                                pong, sizeof (pong), &count, NULL, NULL))
+    g_assert_not_reached ();
+  g_assert_cmpuint (count, ==, sizeof (pong));
+  g_assert_cmpint (pong[0], ==, 0x8A);
+  g_assert_cmpint (pong[1], ==, 0x80 | 4);
+  for (i = 0; i < 4; i++)
+    pong[6 + i] ^= pong[2 + i];
+  g_assert (memcmp (pong + 6, "ping", 4) == 0);
+
+  return NULL;
+}
+
+static void
+test_stream_interleaved (void)
+{
+  WebSocketConnection *client;
+  Streamed streamed = { 0, };
+  GIOStream *io_a;
+  GIOStream *io_b;
+  GThread *thread;
+  GBytes *expect;
+
+  /* Note that no server is around in this test, so no close happens */
+  cockpit_socket_streampair (&io_a, &io_b);
+  thread = g_thread_new ("streamed-thread", send_streamed_server_thread, io_a);
+
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  connect_streamed (client, &streamed);
+
+  expect = g_bytes_new_static ("one \xe2\x82\xac two three", 17);
+  check_streamed (&streamed, WEB_SOCKET_DATA_TEXT, expect);
+  g_bytes_unref (expect);
+
+  /* The split character is delivered on its own, once complete */
+  g_assert_cmpuint (streamed.fragments, ==, 4);
+
+  g_thread_join (thread);
+  g_object_unref (client);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
 static void
 test_close_clean_client (Test *test,
                          gconstpointer data)
@@ -1206,6 +2052,151 @@ client_thread (gpointer data)
   return NULL;
 }
 
+static gpointer
+send_many_frames_server_thread (gpointer user_data)
+{
+  GIOStream *io = user_data;
+  GOutputStream *output;
+  GByteArray *frames;
+  gsize written;
+  guint8 frame[3];
+  guint i;
+
+  /* Lots of tiny frames, all in one go */
+  frames = g_byte_array_new ();
+  for (i = 0; i < 10000; i++)
+    {
+      frame[0] = 0x81; /* fin | text */
+      frame[1] = 1;
+      frame[2] = '0' + (i % 10);
+      g_byte_array_append (frames, frame, sizeof (frame));
+    }
+
+  mock_perform_handshake (io);
+
+  /* The last frame arrives in two pieces */
+  output = g_io_stream_get_output_stream (io);
+  if (!g_output_stream_write_all (output, frames->data, frames->len - 2, &written, NULL, NULL))
+    g_assert_not_reached ();
+  g_usleep (G_USEC_PER_SEC / 20);
+  if (!g_output_stream_write_all (output, frames->data + frames->len - 2, 2, &written, NULL, NULL))
+    g_assert_not_reached ();
+
+  g_byte_array_unref (frames);
+  return NULL;
+}
+
+static void
+test_receive_many_frames (void)
+{
+  WebSocketConnection *client;
+  GByteArray *received;
+  GIOStream *io_a;
+  GIOStream *io_b;
+  GThread *thread;
+  guint i;
+
+  cockpit_socket_streampair (&io_a, &io_b);
+  thread = g_thread_new ("many-frames-thread", send_many_frames_server_thread, io_a);
+
+  received = g_byte_array_new ();
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (client, "message", G_CALLBACK (on_message_append), received);
+
+  WAIT_UNTIL (received->len == 10000);
+  for (i = 0; i < received->len; i++)
+    g_assert_cmpint (received->data[i], ==, '0' + (i % 10));
+
+  g_thread_join (thread);
+  g_byte_array_unref (received);
+  g_object_unref (client);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
+static gpointer
+send_batch_server_thread (gpointer user_data)
+{
+  GIOStream *io = user_data;
+  gsize written;
+
+  const gchar frames[] = "\x81\x03""one"         /* fin | text */
+                         "\x82\x03""two"         /* fin | binary */
+                         "\x01\x02""th"          /* !fin | text */
+                         "\x89\x00"              /* ping */
+                         "\x80\x03""ree"         /* fin | no opcode */
+                         "\x88\x02\x03\xe8";     /* close */
+
+  mock_perform_handshake (io);
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (io),
+                                  frames, sizeof (frames) - 1, &written, NULL, NULL))
+    g_assert_not_reached ();
+  g_assert_cmpuint (written, ==, sizeof (frames) - 1);
+
+  return NULL;
+}
+
+static void
+on_messages_collect (WebSocketConnection *ws,
+                     const WebSocketMessage *messages,
+                     guint n_messages,
+                     gpointer user_data)
+{
+  GPtrArray *received = user_data;
+  guint i;
+
+  g_assert_cmpuint (n_messages, >, 0);
+
+  /* Delivered before the close is handled */
+  g_assert_cmpint (web_socket_connection_get_ready_state (ws), ==, WEB_SOCKET_STATE_OPEN);
+
+  for (i = 0; i < n_messages; i++)
+    {
+      g_assert_cmpint (messages[i].type, ==, received->len == 1 ? WEB_SOCKET_DATA_BINARY : WEB_SOCKET_DATA_TEXT);
+      g_ptr_array_add (received, g_bytes_ref (messages[i].payload));
+    }
+}
+
+static void
+test_receive_batch (void)
+{
+  const gchar *expected[] = { "one", "two", "three" };
+  WebSocketConnection *client;
+  GPtrArray *received;
+  GIOStream *io_a;
+  GIOStream *io_b;
+  GThread *thread;
+  guint i;
+
+  /* Note that no server is around in this test, so no close happens */
+  cockpit_socket_streampair (&io_a, &io_b);
+  thread = g_thread_new ("batch-thread", send_batch_server_thread, io_a);
+
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  g_object_set (client, "batch-messages", TRUE, NULL);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (client, "message", G_CALLBACK (on_message_not_reached), NULL);
+  g_signal_connect (client, "messages", G_CALLBACK (on_messages_collect), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (client) == WEB_SOCKET_STATE_CLOSING);
+
+  g_assert_cmpuint (received->len, ==, G_N_ELEMENTS (expected));
+  for (i = 0; i < received->len; i++)
+    {
+      g_assert_cmpuint (g_bytes_get_size (received->pdata[i]), ==, strlen (expected[i]));
+      g_assert (memcmp (g_bytes_get_data (received->pdata[i], NULL), expected[i], strlen (expected[i])) == 0);
+    }
+
+  g_thread_join (thread);
+  g_ptr_array_unref (received);
+  g_object_unref (client);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
 static void
 test_handshake_with_buffer_and_headers (void)
 {
@@ -1272,6 +2263,7 @@ main (int argc,
       { test_send_server_to_client, "send-server-to-client" },
       { test_send_big_packets, "send-big-packets" },
       { test_send_prefixed, "send-prefixed" },
+      { test_send_many_queued, "send-many-queued" },
       { test_send_bad_data, "send-bad-data" },
       { test_pressure_queue, "pressure-queue" },
       { test_pressure_throttle, "pressure-throttle" },
@@ -1279,6 +2271,16 @@ main (int argc,
       { test_protocol_mismatch, "protocol-mismatch" },
       { test_protocol_server_any, "protocol-server-any" },
       { test_protocol_client_any, "protocol-client-any" },
+      { test_deflate_negotiate, "deflate-negotiate" },
+      { test_deflate_declined, "deflate-declined" },
+      { test_deflate_window_bits, "deflate-window-bits" },
+      { test_deflate_send, "deflate-send" },
+      { test_deflate_unexpected, "deflate-unexpected" },
+      { test_deflate_flows, "deflate-flows" },
+      { test_flow_interleave, "flow-interleave" },
+      { test_flow_default, "flow-default" },
+      { test_stream_large, "stream-large" },
+      { test_stream_deflate, "stream-deflate" },
       { test_close_clean_client, "close-clean-client" },
       { test_close_clean_server, "close-clean-server" },
   };
@@ -1314,6 +2316,7 @@ main (int argc,
   g_test_add_func ("/web-socket/header-equals", test_header_equals);
   g_test_add_func ("/web-socket/header-contains", test_header_contains);
   g_test_add_func ("/web-socket/header-empty", test_header_empty);
+  g_test_add_func ("/web-socket/unmask", test_unmask);
 
   for (j = 0; j < G_N_ELEMENTS (tests_with_client_server_pair); j++)
     {
@@ -1326,6 +2329,11 @@ main (int argc,
   if (g_test_slow ())
     g_test_add_func ("/web-socket/close-after-timeout", test_close_after_timeout);
   g_test_add_func ("/web-socket/receive-fragmented", test_receive_fragmented);
+  g_test_add_func ("/web-socket/receive-many-frames", test_receive_many_frames);
+  g_test_add_func ("/web-socket/receive-batch", test_receive_batch);
+  g_test_add_func ("/web-socket/stream-interleaved", test_stream_interleaved);
+  g_test_add_func ("/web-socket/pressure-slow-reader", test_pressure_slow_reader);
+  g_test_add_func ("/web-socket/pressure-adaptive", test_pressure_adaptive);
   g_test_add_func ("/web-socket/handshake-with-buffer-headers", test_handshake_with_buffer_and_headers);
 
   g_test_add ("/web-socket/message-after-closing", Test, NULL, setup_pair, test_message_after_closing, teardown);
@@ -24,7 +24,13 @@
 
 #include "common/cockpitflow.h"
 
+#include <errno.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <zlib.h>
 
 /*
  * SECTION:websocketconnection
@@ -56,6 +62,14 @@
  * by returning %FALSE from the signal handler. You should in that case
  * call the web_socket_connection_close() function at a later time to complete
  * the close.
+ *
+ * Messages can be compressed with the permessage-deflate extension from
+ * RFC 7692. Set the #WebSocketConnection:permessage-deflate property before
+ * the handshake to offer (client) or accept (server) it.
+ *
+ * Large messages don't need to be held in memory: with the
+ * #WebSocketConnection:streaming property set, messages are delivered in
+ * pieces as they arrive, and there is no limit on their size.
  */
 
 /**
@@ -71,6 +85,9 @@
  * @handshake: used by derived classes to handle received HTTP handshake
  * @open: default handler for the #WebSocketConnection::open signal
  * @message: default handler for the #WebSocketConnection::message signal
+ * @message_begin: default handler for the #WebSocketConnection::message-begin signal
+ * @message_fragment: default handler for the #WebSocketConnection::message-fragment signal
+ * @message_end: default handler for the #WebSocketConnection::message-end signal
  * @error: default handler for the #WebSocketConnection::error signal
  * @closing: the default handler for the #WebSocketConnection:closing signal
  * @close: default handler for the #WebSocketConnection::close signal
@@ -85,11 +102,23 @@ enum {
   PROP_READY_STATE,
   PROP_BUFFERED_AMOUNT,
   PROP_IO_STREAM,
+  PROP_PERMESSAGE_DEFLATE,
+  PROP_DEFLATE_WINDOW_BITS,
+  PROP_DEFLATE_MEMORY_LIMIT,
+  PROP_STREAMING,
+  PROP_PRESSURE_HIGH,
+  PROP_PRESSURE_LOW,
+  PROP_ADAPTIVE_PRESSURE,
+  PROP_BATCH_MESSAGES,
 };
 
 enum {
   OPEN,
   MESSAGE,
+  MESSAGE_BEGIN,
+  MESSAGE_FRAGMENT,
+  MESSAGE_END,
+  MESSAGES,
   ERROR,
   CLOSING,
   CLOSE,
@@ -98,13 +127,53 @@ enum {
 
 static guint signals[NUM_SIGNALS] = { 0, };
 
+/*
+ * An outgoing frame is sent as its header followed by the caller's
+ * prefix and payload, without copying them together.
+ *
+ * All compressed messages share one deflate context, so the peer must
+ * see them in the order in which they were compressed. That's why
+ * they're only compressed once they are committed to the order in
+ * which frames go out; until then @length is the uncompressed size.
+ */
 typedef struct {
-  GBytes *data;
+  guint8 header[14];
+  gsize header_len;
+  GBytes *prefix;
+  GBytes *payload;
+  gsize length;
   gboolean last;
+  gboolean compress;
   gsize sent;
   gsize amount;
 } Frame;
 
+/* How many pieces of queued frames to write at once */
+#define MAX_OUTPUT_VECTORS 64
+
+/*
+ * Data messages are queued per flow, and the flows take turns with
+ * deficit round robin: on each turn a flow may send QUANTUM bytes times
+ * its weight. Only SCHEDULE_AHEAD bytes are committed to the order in
+ * which frames go out, so that a message on a quiet flow doesn't wait
+ * behind everything a busy flow has queued. Messages without a flow take
+ * their turns on the default flow; only the close message waits until
+ * all flows are done.
+ */
+typedef struct {
+  gchar *name;
+  GQueue frames;
+  gsize deficit;
+  gboolean visited;
+} Flow;
+
+#define FLOW_QUANTUM         (4 * 1024)
+#define FLOW_DEFAULT_WEIGHT  4
+#define SCHEDULE_AHEAD       (64 * 1024)
+
+/* How much to read at once when the stream can't tell what's available */
+#define INPUT_CHUNK (64 * 1024)
+
 typedef struct
 {
   /* FALSE if client, TRUE if server */
@@ -116,6 +185,7 @@ typedef struct
    */
   gchar *url;
   gchar *chosen_protocol;
+  gchar *chosen_extensions;
 
   GSource *start_idle;
   gboolean handshake_done;
@@ -136,16 +206,67 @@ typedef struct
   GPollableInputStream *input;
   GSource *input_source;
   GByteArray *incoming;
+  gsize incoming_offset;
 
   GPollableOutputStream *output;
+  gint socket_fd;
   GSource *output_source;
   gsize output_queued;
+  gsize output_copied;
   GQueue outgoing;
+  gsize outgoing_length;
+  GHashTable *flows;
+  GQueue active_flows;
+  GHashTable *flow_weights;
+  GQueue after_flows;
+
+  /* Back pressure applied to whoever queues output, see WebSocketConnection:pressure-high */
+  gsize queue_high;
+  gsize queue_low;
+  gboolean queue_adaptive;
+  gboolean queue_pressure;
+  gint64 pressure_since;
+  GTimeSpan pressure_time;
+  guint pressure_count;
+
+  /* How fast the peer reads our output, for adaptive pressure */
+  gint64 drain_start;
+  gsize drain_bytes;
+  gdouble drain_rate;
 
   /* Current message being assembled */
   guint8 message_opcode;
+  gboolean message_compressed;
   GByteArray *message_data;
 
+  /* Current frame when messages are streamed, see WebSocketConnection:streaming */
+  gboolean streaming;
+  guint64 frame_remaining;
+  gboolean frame_fin;
+  gboolean frame_masked;
+  gboolean frame_discard;
+  guint8 frame_mask[4];
+  guint frame_mask_offset;
+
+  /* A character split between streamed fragments of a text message */
+  guint8 utf8_partial[4];
+  gsize utf8_partial_len;
+
+  /* Messages received from one read, see WebSocketConnection:batch-messages */
+  gboolean batching;
+  GArray *batch;
+
+  /* permessage-deflate configuration */
+  gboolean deflate_enabled;
+  guint deflate_window_bits;
+  guint deflate_memory_limit;
+
+  /* permessage-deflate state, only set when negotiated */
+  z_stream *deflater;
+  z_stream *inflater;
+  gboolean deflate_no_context_takeover;
+  gboolean inflate_no_context_takeover;
+
   /* Pressure which throttles input on this web socket */
   CockpitFlow *pressure;
   gulong pressure_sig;
@@ -153,8 +274,29 @@ typedef struct
 
 #define MAX_PAYLOAD   128 * 1024
 
-/* The queue size above which we consider applying back pressure */
-#define QUEUE_PRESSURE       1UL * 1024UL * 1024UL /* 1 megabyte */
+/* Don't bother compressing messages smaller than this */
+#define DEFLATE_MIN_SIZE     128
+
+/*
+ * The zlib state for the default 15 window bits in both directions:
+ * the compressor needs 2^(bits + 3) bytes (with a memory level of
+ * bits - 7), the decompressor 2^bits, and both some more for themselves.
+ */
+#define DEFLATE_OVERHEAD     (16 * 1024)
+#define DEFLATE_MEMORY_LIMIT (320 * 1024)
+
+/* The queue sizes at which back pressure is applied, and relieved again */
+#define PRESSURE_HIGH        (1024 * 1024)
+#define PRESSURE_LOW         (256 * 1024)
+
+/*
+ * With adaptive pressure, queue no more than the peer reads in
+ * PRESSURE_DELAY. The rate is measured over PRESSURE_INTERVAL while
+ * output is pending.
+ */
+#define PRESSURE_DELAY       (250 * G_TIME_SPAN_MILLISECOND)
+#define PRESSURE_INTERVAL    (100 * G_TIME_SPAN_MILLISECOND)
+#define PRESSURE_MIN_HIGH    (64 * 1024)
 
 static void    web_socket_connection_flow_iface_init        (CockpitFlowInterface *iface);
 
@@ -170,17 +312,106 @@ frame_free (gpointer data)
   Frame *frame = data;
   if (frame)
     {
-      g_bytes_unref (frame->data);
+      if (frame->prefix)
+        g_bytes_unref (frame->prefix);
+      if (frame->payload)
+        g_bytes_unref (frame->payload);
       g_slice_free (Frame, frame);
     }
 }
 
+/* Raw frames from _web_socket_connection_queue() have no header */
+static gboolean
+frame_is_close (Frame *frame)
+{
+  return frame->header_len > 0 && (frame->header[0] & 0x0F) == 0x08;
+}
+
+static void
+frames_clear (GQueue *frames)
+{
+  while (!g_queue_is_empty (frames))
+    frame_free (g_queue_pop_head (frames));
+}
+
+static void
+flow_free (gpointer data)
+{
+  Flow *flow = data;
+  frames_clear (&flow->frames);
+  g_free (flow->name);
+  g_slice_free (Flow, flow);
+}
+
+static gsize
+frames_amount (GQueue *frames)
+{
+  gsize amount = 0;
+  Frame *frame;
+  GList *l;
+
+  for (l = frames->head; l != NULL; l = g_list_next (l))
+    {
+      frame = l->data;
+      amount += frame->amount;
+    }
+
+  return amount;
+}
+
+/*
+ * Fill in @vectors with the parts of @frame that haven't been sent yet,
+ * and return how many were used.
+ */
+static guint
+frame_vectors (Frame *frame,
+               struct iovec *vectors,
+               guint max)
+{
+  const guint8 *parts[3] = { frame->header, NULL, NULL };
+  gsize lengths[3] = { frame->header_len, 0, 0 };
+  gsize skip = frame->sent;
+  guint count = 0;
+  guint i;
+
+  if (frame->prefix)
+    parts[1] = g_bytes_get_data (frame->prefix, &lengths[1]);
+  if (frame->payload)
+    parts[2] = g_bytes_get_data (frame->payload, &lengths[2]);
+
+  for (i = 0; i < G_N_ELEMENTS (parts) && count < max; i++)
+    {
+      if (skip >= lengths[i])
+        {
+          skip -= lengths[i];
+          continue;
+        }
+
+      vectors[count].iov_base = (gpointer)(parts[i] + skip);
+      vectors[count].iov_len = lengths[i] - skip;
+      skip = 0;
+      count++;
+    }
+
+  return count;
+}
+
 static void
 web_socket_connection_init (WebSocketConnection *self)
 {
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
 
+  pv->socket_fd = -1;
+  pv->deflate_window_bits = 15;
+  pv->deflate_memory_limit = DEFLATE_MEMORY_LIMIT;
+  pv->queue_high = PRESSURE_HIGH;
+  pv->queue_low = PRESSURE_LOW;
+
   g_queue_init (&pv->outgoing);
+  g_queue_init (&pv->active_flows);
+  g_queue_init (&pv->after_flows);
+  pv->flows = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, flow_free);
+  pv->flow_weights = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   pv->main_context = g_main_context_ref_thread_default ();
 }
 
@@ -344,72 +575,226 @@ close_io_after_timeout (WebSocketConnection *self)
   g_source_attach (pv->close_timeout, pv->main_context);
 }
 
+static gsize
+deflate_memory_usage (guint own_bits,
+                      guint peer_bits)
+{
+  return ((gsize)1 << (own_bits + 3)) + ((gsize)1 << peer_bits) + DEFLATE_OVERHEAD;
+}
+
+/*
+ * Shrink the window sizes until the compression state fits into the
+ * memory limit: first our own, and then the peer's if @peer_adjustable.
+ */
+static gboolean
+deflate_fit_memory_limit (WebSocketConnection *self,
+                          guint *own_bits,
+                          guint *peer_bits,
+                          gboolean peer_adjustable)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+
+  while (deflate_memory_usage (*own_bits, *peer_bits) > pv->deflate_memory_limit)
+    {
+      if (*own_bits > 9)
+        (*own_bits)--;
+      else if (peer_adjustable && *peer_bits > 9)
+        (*peer_bits)--;
+      else
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static void
-xor_with_mask_rfc6455 (const guint8 *mask,
-                       guint8 *data,
-                       gsize len)
+deflate_start (WebSocketConnection *self,
+               guint own_bits,
+               guint peer_bits)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  int ret;
+
+  g_assert (pv->deflater == NULL && pv->inflater == NULL);
+  g_assert (own_bits >= 9 && own_bits <= 15);
+  g_assert (peer_bits >= 9 && peer_bits <= 15);
+
+  /* Negative window bits select a raw deflate stream without zlib header */
+  pv->deflater = g_new0 (z_stream, 1);
+  ret = deflateInit2 (pv->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                      -(int)own_bits, own_bits - 7, Z_DEFAULT_STRATEGY);
+  if (ret != Z_OK)
+    g_error ("couldn't initialize deflate: %d", ret);
+
+  pv->inflater = g_new0 (z_stream, 1);
+  ret = inflateInit2 (pv->inflater, -(int)peer_bits);
+  if (ret != Z_OK)
+    g_error ("couldn't initialize inflate: %d", ret);
+
+  g_debug ("using permessage-deflate with window bits %u/%u%s%s", own_bits, peer_bits,
+           pv->deflate_no_context_takeover ? ", no own context takeover" : "",
+           pv->inflate_no_context_takeover ? ", no peer context takeover" : "");
+}
+
+static void
+deflate_stop (WebSocketConnection *self)
 {
-  g_assert (mask != NULL);
-  g_assert (data != NULL);
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
 
-  /* Do the masking */
-  for (gsize n = 0; n < len; n++)
-    data[n] ^= mask[n & 3];
+  if (pv->deflater)
+    {
+      deflateEnd (pv->deflater);
+      g_free (pv->deflater);
+      pv->deflater = NULL;
+    }
+  if (pv->inflater)
+    {
+      inflateEnd (pv->inflater);
+      g_free (pv->inflater);
+      pv->inflater = NULL;
+    }
 }
 
 static void
-send_prefixed_message_rfc6455 (WebSocketConnection *self,
-                               WebSocketQueueFlags flags,
-                               guint8 opcode,
-                               const guint8 *prefix,
-                               gsize prefix_len,
-                               const guint8 *payload,
-                               gsize payload_len)
+deflate_append (z_stream *zs,
+                GByteArray *output,
+                const guint8 *data,
+                gsize len,
+                int flush)
 {
-  gsize amount;
-  GByteArray *bytes;
-  gsize frame_len;
-  guint8 *outer;
-  guint8 *mask = 0;
-  guint8 *at;
-  gsize len;
-  guint64 size;
+  int ret;
 
-  len = payload_len + prefix_len;
-  amount = len;
+  zs->next_in = (Bytef *)data;
+  zs->avail_in = len;
+
+  do
+    {
+      gsize at = output->len;
+      gsize chunk = MAX (len / 2, 1024);
 
-  bytes = g_byte_array_sized_new (14 + len);
-  outer = bytes->data;
-  outer[0] = 0x80 | opcode;
+      g_byte_array_set_size (output, at + chunk);
+      zs->next_out = output->data + at;
+      zs->avail_out = chunk;
 
-  /* If control message, truncate payload */
-  if (opcode & 0x08)
+      ret = deflate (zs, flush);
+      g_assert (ret != Z_STREAM_ERROR);
+
+      g_byte_array_set_size (output, at + chunk - zs->avail_out);
+    }
+  while (zs->avail_out == 0 || zs->avail_in > 0);
+}
+
+/*
+ * Compress a message as described in RFC 7692 section 7.2.1: deflate
+ * everything, flush, and drop the trailing empty stored block.
+ */
+static GByteArray *
+deflate_message (WebSocketConnection *self,
+                 const guint8 *prefix,
+                 gsize prefix_len,
+                 const guint8 *payload,
+                 gsize payload_len)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GByteArray *output;
+
+  output = g_byte_array_sized_new ((prefix_len + payload_len) / 2);
+
+  if (prefix_len > 0)
+    deflate_append (pv->deflater, output, prefix, prefix_len, Z_NO_FLUSH);
+  deflate_append (pv->deflater, output, payload, payload_len, Z_SYNC_FLUSH);
+
+  g_assert (output->len >= 4);
+  g_assert (memcmp (output->data + output->len - 4, "\x00\x00\xff\xff", 4) == 0);
+  g_byte_array_set_size (output, output->len - 4);
+
+  if (pv->deflate_no_context_takeover)
+    deflateReset (pv->deflater);
+
+  return output;
+}
+
+typedef enum {
+  INFLATE_OK,
+  INFLATE_BAD_DATA,
+  INFLATE_TOO_BIG,
+} InflateResult;
+
+static InflateResult
+inflate_append (z_stream *zs,
+                GByteArray *output,
+                const guint8 *data,
+                gsize len,
+                gsize limit)
+{
+  gsize start = output->len;
+  int ret;
+
+  zs->next_in = (Bytef *)data;
+  zs->avail_in = len;
+
+  for (;;)
     {
-      if (len > 125)
-        {
-          g_warning ("Truncating WebSocket control message payload");
-          if (prefix_len > 125)
-              prefix_len = 125;
-          payload_len = 125 - prefix_len;
-          len = 125;
-        }
+      gsize at = output->len;
+      gsize chunk = MAX (len * 4, 4096);
 
-      /* Buffered amount of bytes is zero for control messages */
-      amount = 0;
+      g_byte_array_set_size (output, at + chunk);
+      zs->next_out = output->data + at;
+      zs->avail_out = chunk;
+
+      ret = inflate (zs, Z_SYNC_FLUSH);
+
+      g_byte_array_set_size (output, at + chunk - zs->avail_out);
+
+      /* The peer finished its deflate stream; it starts a new one for the next message */
+      if (ret == Z_STREAM_END)
+        inflateReset (zs);
+      else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        return INFLATE_BAD_DATA;
+
+      if (output->len - start > limit)
+        return INFLATE_TOO_BIG;
+
+      if (zs->avail_in == 0 && zs->avail_out > 0)
+        return INFLATE_OK;
     }
+}
+
+static void
+queue_frame (WebSocketConnection *self,
+             WebSocketQueueFlags flags,
+             const gchar *flow,
+             Frame *frame);
+
+/* Fill in the length and mask of the header, once the payload is final */
+static void
+frame_encode (WebSocketConnection *self,
+              Frame *frame)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GByteArray *masked;
+  guint8 *outer;
+  guint8 *mask = 0;
+  gsize len;
+  guint64 size;
+
+  len = g_bytes_get_size (frame->payload);
+  if (frame->prefix)
+    len += g_bytes_get_size (frame->prefix);
 
+  outer = frame->header;
   size = len;
   if (size < 126)
     {
       outer[1] = (0xFF & size); /* mask | 7-bit-len */
-      bytes->len = 2;
+      frame->header_len = 2;
     }
   else if (size < 65536)
     {
       outer[1] = 126; /* mask | 16-bit-len */
       outer[2] = (size >> 8) & 0xFF;
       outer[3] = (size >> 0) & 0xFF;
-      bytes->len = 4;
+      frame->header_len = 4;
     }
   else
     {
@@ -422,34 +807,133 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
       outer[7] = (size >> 16) & 0xFF;
       outer[8] = (size >> 8) & 0xFF;
       outer[9] = (size >> 0) & 0xFF;
-      bytes->len = 10;
+      frame->header_len = 10;
     }
 
   /*
    * The server side doesn't need to mask, so we don't. There's
    * probably a client somewhere that's not expecting it.
+   *
+   * Clients have to copy the data in order to mask it.
    */
-  const gboolean is_client_side = !GET_PRIV(self)->server_side;
+  const gboolean is_client_side = !pv->server_side;
   if (is_client_side)
     {
       guint32 rand = g_random_int ();
       outer[1] |= 0x80;
-      mask = outer + bytes->len;
+      mask = outer + frame->header_len;
       memcpy (mask, &rand, sizeof (guint32));
-      bytes->len += 4;
+      frame->header_len += 4;
+
+      masked = g_byte_array_sized_new (len);
+      if (frame->prefix)
+        g_byte_array_append (masked, g_bytes_get_data (frame->prefix, NULL), g_bytes_get_size (frame->prefix));
+      g_byte_array_append (masked, g_bytes_get_data (frame->payload, NULL), g_bytes_get_size (frame->payload));
+      g_assert (masked->len == len);
+      _web_socket_unmask_rfc6455 (mask, masked->data, len);
+
+      g_clear_pointer (&frame->prefix, g_bytes_unref);
+      g_bytes_unref (frame->payload);
+      frame->payload = g_byte_array_free_to_bytes (masked);
+      pv->output_copied += len;
     }
 
-  at = bytes->data + bytes->len;
-  g_byte_array_append (bytes, prefix, prefix_len);
-  g_byte_array_append (bytes, payload, payload_len);
+  frame->length = frame->header_len + len;
+}
 
-  if (is_client_side)
-    xor_with_mask_rfc6455 (mask, at, len);
+/* Data messages are compressed as a whole, and then sent as usual */
+static void
+frame_compress (WebSocketConnection *self,
+                Frame *frame)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GByteArray *compressed;
+  const guint8 *pref = NULL;
+  const guint8 *data;
+  gsize prefix_len = 0;
+  gsize payload_len;
+
+  g_assert (frame->compress);
+  g_assert (pv->deflater != NULL);
+
+  if (frame->prefix)
+    pref = g_bytes_get_data (frame->prefix, &prefix_len);
+  data = g_bytes_get_data (frame->payload, &payload_len);
+
+  compressed = deflate_message (self, pref, prefix_len, data, payload_len);
+  g_clear_pointer (&frame->prefix, g_bytes_unref);
+  g_bytes_unref (frame->payload);
+  frame->payload = g_byte_array_free_to_bytes (compressed);
+  frame->header[0] |= 0x40; /* RSV1: per-message compressed */
+  frame->compress = FALSE;
+
+  frame_encode (self, frame);
+}
+
+static void
+send_prefixed_message_rfc6455 (WebSocketConnection *self,
+                               WebSocketQueueFlags flags,
+                               const gchar *flow,
+                               guint8 opcode,
+                               GBytes *prefix,
+                               GBytes *payload)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  gsize prefix_len = 0;
+  gsize payload_len;
+  Frame *frame;
+  gsize amount;
+  gsize len;
+
+  if (prefix)
+    prefix_len = g_bytes_get_size (prefix);
+  payload_len = g_bytes_get_size (payload);
+
+  frame = g_slice_new0 (Frame);
+  frame->prefix = prefix ? g_bytes_ref (prefix) : NULL;
+  frame->payload = g_bytes_ref (payload);
+
+  len = payload_len + prefix_len;
+  amount = len;
+
+  frame->header[0] = 0x80 | opcode;
+
+  /* Compressed when it goes out, see Frame */
+  if (pv->deflater && !(opcode & 0x08) && len >= DEFLATE_MIN_SIZE)
+    {
+      frame->compress = TRUE;
+      frame->length = len;
+      frame->amount = amount;
+      queue_frame (self, flags, flow, frame);
+      g_debug ("queued rfc6455 %d frame of len %u for compression", (gint)opcode, (guint)len);
+      return;
+    }
+
+  /* If control message, truncate payload */
+  if (opcode & 0x08)
+    {
+      if (len > 125)
+        {
+          g_warning ("Truncating WebSocket control message payload");
+          if (prefix_len > 125)
+            {
+              g_bytes_unref (frame->prefix);
+              frame->prefix = g_bytes_new_from_bytes (prefix, 0, 125);
+              prefix_len = 125;
+            }
+          g_bytes_unref (frame->payload);
+          frame->payload = g_bytes_new_from_bytes (payload, 0, 125 - prefix_len);
+          len = 125;
+        }
+
+      /* Buffered amount of bytes is zero for control messages */
+      amount = 0;
+    }
 
-  frame_len = bytes->len;
-  _web_socket_connection_queue (self, flags, g_byte_array_free (bytes, FALSE),
-                                frame_len, amount);
-  g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame_len);
+  frame_encode (self, frame);
+  frame->amount = amount;
+  queue_frame (self, flags, flow, frame);
+  g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame->length);
 }
 
 static void
@@ -459,7 +943,9 @@ send_message_rfc6455 (WebSocketConnection *self,
                       const guint8 *payload,
                       gsize payload_len)
 {
-  return send_prefixed_message_rfc6455 (self, flags, opcode, NULL, 0, payload, payload_len);
+  GBytes *bytes = g_bytes_new (payload, payload_len);
+  send_prefixed_message_rfc6455 (self, flags, NULL, opcode, NULL, bytes);
+  g_bytes_unref (bytes);
 }
 
 static void
@@ -652,7 +1138,7 @@ receive_close_rfc6455 (WebSocketConnection *self,
     {
       data += 2;
       len -= 2;
-      if (g_utf8_validate ((gchar *)data, len, NULL))
+      if (_web_socket_validate_utf8 (data, len, 0))
         pv->peer_close_data = g_strndup ((gchar *)data, len);
       else
         g_message ("received non-UTF8 close data: %d '%.*s' %d", (int)len, (int)len, (gchar *)data, (int)data[0]);
@@ -684,124 +1170,251 @@ receive_ping_rfc6455 (WebSocketConnection *self,
 }
 
 static void
-process_contents_rfc6455 (WebSocketConnection *self,
-                          gboolean control,
+discard_message (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+
+  g_byte_array_unref (pv->message_data);
+  pv->message_data = NULL;
+  pv->message_opcode = 0;
+  pv->message_compressed = FALSE;
+}
+
+/*
+ * Decompress a frame of a compressed message into the message data.
+ * Returns FALSE if the message was invalid and the connection is closing.
+ */
+static gboolean
+inflate_contents_rfc6455 (WebSocketConnection *self,
                           gboolean fin,
-                          guint8 opcode,
                           gconstpointer payload,
                           gsize payload_len)
 {
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
-  GBytes *message;
+  static const guint8 trailer[] = { 0x00, 0x00, 0xff, 0xff };
+  gsize before = pv->message_data->len;
+  gsize size;
+  InflateResult res;
 
-  if (control)
-    {
-      /* Control frames must never be fragmented */
-      if (!fin)
-        {
-          g_message ("received fragmented control frame");
-          protocol_error_and_close (self);
-          return;
-        }
+  res = inflate_append (pv->inflater, pv->message_data, payload, payload_len, MAX_PAYLOAD);
 
-      g_debug ("received control frame %d with %d payload", (int)opcode, (int)payload_len);
+  /* Put back the empty block that the peer removed from the end of the message */
+  if (res == INFLATE_OK && fin)
+    res = inflate_append (pv->inflater, pv->message_data, trailer, sizeof trailer,
+                          MAX_PAYLOAD - (pv->message_data->len - before));
 
-      switch (opcode)
-        {
-        case 0x08:
-          receive_close_rfc6455 (self, payload, payload_len);
-          break;
-        case 0x09:
-          receive_ping_rfc6455 (self, payload, payload_len);
-          break;
-        case 0x0A:
-          break;
-        default:
-          g_message ("received unsupported control frame: %d", (gint)opcode);
-          break;
-        }
+  if (res == INFLATE_OK && fin && pv->message_opcode == 0x01 &&
+      !_web_socket_validate_utf8 (pv->message_data->data, pv->message_data->len, 0))
+    {
+      g_message ("received invalid non-UTF8 text data");
+      res = INFLATE_BAD_DATA;
     }
 
-  else if (pv->close_received)
+  if (res == INFLATE_OK)
     {
-      g_message ("received message after close was received");
+      if (fin && pv->inflate_no_context_takeover)
+        inflateReset (pv->inflater);
+      return TRUE;
     }
 
-  /* A message frame */
+  size = pv->message_data->len - before;
+  discard_message (self);
+
+  if (res == INFLATE_TOO_BIG)
+    {
+      too_big_error_and_close (self, size);
+    }
   else
     {
-      /* Initial fragment of a message */
-      if (!fin && opcode)
-        {
-          if (pv->message_data)
-            {
-              g_message ("received out of order initial message fragment");
-              protocol_error_and_close (self);
-              return;
-            }
-          g_debug ("received initial fragment frame %d with %d payload", (int)opcode, (int)payload_len);
-        }
-
-      /* Middle fragment of a message */
-      else if (!fin && !opcode)
-        {
-          if (!pv->message_data)
-            {
-              g_message ("received out of order middle message fragment");
-              protocol_error_and_close (self);
-              return;
-            }
-          g_debug ("received middle fragment frame with %d payload", (int)payload_len);
-        }
+      g_message ("received invalid compressed data");
+      bad_data_error_and_close (self);
+    }
 
-      /* Last fragment of a message */
-      else if (fin && !opcode)
+  return FALSE;
+}
+
+static gboolean
+check_message_frame (WebSocketConnection *self,
+                     gboolean fin,
+                     guint8 opcode,
+                     guint64 payload_len)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+
+  /* Initial fragment of a message */
+  if (!fin && opcode)
+    {
+      if (pv->message_opcode)
         {
-          if (!pv->message_data)
-            {
-              g_message ("received out of order ending message fragment");
-              protocol_error_and_close (self);
-              return;
-            }
-          g_debug ("received last fragment frame with %d payload", (int)payload_len);
+          g_message ("received out of order initial message fragment");
+          protocol_error_and_close (self);
+          return FALSE;
         }
+      g_debug ("received initial fragment frame %d with %d payload", (int)opcode, (int)payload_len);
+    }
 
-      /* An unfragmented message */
-      else
+  /* Middle fragment of a message */
+  else if (!fin && !opcode)
+    {
+      if (!pv->message_opcode)
         {
-          g_assert (opcode != 0);
-          if (pv->message_data)
-            {
-              g_message ("received unfragmented message when fragment was expected");
-              protocol_error_and_close (self);
-              return;
-            }
-          g_debug ("received frame %d with %d payload", (int)opcode, (int)payload_len);
+          g_message ("received out of order middle message fragment");
+          protocol_error_and_close (self);
+          return FALSE;
         }
+      g_debug ("received middle fragment frame with %d payload", (int)payload_len);
+    }
+
+  /* Last fragment of a message */
+  else if (fin && !opcode)
+    {
+      if (!pv->message_opcode)
+        {
+          g_message ("received out of order ending message fragment");
+          protocol_error_and_close (self);
+          return FALSE;
+        }
+      g_debug ("received last fragment frame with %d payload", (int)payload_len);
+    }
+
+  /* An unfragmented message */
+  else
+    {
+      g_assert (opcode != 0);
+      if (pv->message_opcode)
+        {
+          g_message ("received unfragmented message when fragment was expected");
+          protocol_error_and_close (self);
+          return FALSE;
+        }
+      g_debug ("received frame %d with %d payload", (int)opcode, (int)payload_len);
+    }
+
+  return TRUE;
+}
+
+static void
+clear_batch (GArray *batch)
+{
+  guint i;
+
+  for (i = 0; i < batch->len; i++)
+    g_bytes_unref (g_array_index (batch, WebSocketMessage, i).payload);
+  g_array_set_size (batch, 0);
+}
+
+static void
+deliver_batch (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+
+  if (!pv->batch || pv->batch->len == 0)
+    return;
+
+  g_debug ("message: delivering batch of %u", pv->batch->len);
+  g_signal_emit (self, signals[MESSAGES], 0, pv->batch->data, pv->batch->len);
+  clear_batch (pv->batch);
+}
+
+static void
+process_contents_rfc6455 (WebSocketConnection *self,
+                          gboolean control,
+                          gboolean fin,
+                          gboolean compressed,
+                          guint8 opcode,
+                          gconstpointer payload,
+                          gsize payload_len,
+                          gsize ascii)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  WebSocketMessage batched;
+  GBytes *message;
+
+  /* Only the first frame of a data message can be marked as compressed */
+  if (compressed && (!pv->inflater || control || !opcode))
+    {
+      g_message ("received unexpected compressed frame");
+      protocol_error_and_close (self);
+      return;
+    }
+
+  if (control)
+    {
+      /* Control frames must never be fragmented */
+      if (!fin)
+        {
+          g_message ("received fragmented control frame");
+          protocol_error_and_close (self);
+          return;
+        }
+
+      g_debug ("received control frame %d with %d payload", (int)opcode, (int)payload_len);
+
+      switch (opcode)
+        {
+        case 0x08:
+          /* Whatever came before the close goes first */
+          deliver_batch (self);
+          receive_close_rfc6455 (self, payload, payload_len);
+          break;
+        case 0x09:
+          receive_ping_rfc6455 (self, payload, payload_len);
+          break;
+        case 0x0A:
+          break;
+        default:
+          g_message ("received unsupported control frame: %d", (gint)opcode);
+          break;
+        }
+    }
+
+  else if (pv->close_received)
+    {
+      g_message ("received message after close was received");
+    }
+
+  /* A message frame */
+  else
+    {
+      if (!check_message_frame (self, fin, opcode, payload_len))
+        return;
 
       if (opcode)
         {
           pv->message_opcode = opcode;
+          pv->message_compressed = compressed;
           pv->message_data = g_byte_array_sized_new (payload_len);
         }
 
       switch (pv->message_opcode)
         {
         case 0x01:
-          if (!g_utf8_validate ((gchar *)payload, payload_len, NULL))
+          /* Compressed text is validated once it is complete */
+          if (pv->message_compressed)
+            {
+              if (!inflate_contents_rfc6455 (self, fin, payload, payload_len))
+                return;
+              break;
+            }
+          if (!_web_socket_validate_utf8 (payload, payload_len, ascii))
             {
               g_message ("received invalid non-UTF8 text data");
 
               /* Discard the entire message */
-              g_byte_array_unref (pv->message_data);
-              pv->message_data = NULL;
-              pv->message_opcode = 0;
+              discard_message (self);
 
               bad_data_error_and_close (self);
               return;
             }
-          /* fall through */
+          g_byte_array_append (pv->message_data, payload, payload_len);
+          break;
         case 0x02:
+          if (pv->message_compressed)
+            {
+              if (!inflate_contents_rfc6455 (self, fin, payload, payload_len))
+                return;
+              break;
+            }
           g_byte_array_append (pv->message_data, payload, payload_len);
           break;
         default:
@@ -822,34 +1435,347 @@ process_contents_rfc6455 (WebSocketConnection *self,
           message = g_byte_array_free_to_bytes (pv->message_data);
           pv->message_data = NULL;
           pv->message_opcode = 0;
-          g_debug ("message: delivering %d with %d length",
-                   (int)opcode, (int)g_bytes_get_size (message));
-          g_signal_emit (self, signals[MESSAGE], 0, (int)opcode, message);
-          g_bytes_unref (message);
+          pv->message_compressed = FALSE;
+          if (pv->batching)
+            {
+              g_debug ("message: batching %d with %d length",
+                       (int)opcode, (int)g_bytes_get_size (message));
+              if (!pv->batch)
+                pv->batch = g_array_new (FALSE, FALSE, sizeof (WebSocketMessage));
+              batched.type = opcode;
+              batched.payload = message;
+              g_array_append_val (pv->batch, batched);
+            }
+          else
+            {
+              g_debug ("message: delivering %d with %d length",
+                       (int)opcode, (int)g_bytes_get_size (message));
+              g_signal_emit (self, signals[MESSAGE], 0, (int)opcode, message);
+              g_bytes_unref (message);
+            }
         }
     }
 }
 
+static gsize
+utf8_sequence_length (guint8 lead)
+{
+  if (lead >= 0xf0)
+    return 4;
+  else if (lead >= 0xe0)
+    return 3;
+  else if (lead >= 0xc0)
+    return 2;
+  return 1;
+}
+
+/* The number of bytes at the end of @data that start a character but don't complete it */
+static gsize
+utf8_incomplete_tail (const guint8 *data,
+                      gsize len)
+{
+  gsize i;
+
+  for (i = 1; i <= MIN (len, 3); i++)
+    {
+      if ((data[len - i] & 0xc0) == 0x80)
+        continue;
+      if (data[len - i] >= 0xc2 && data[len - i] <= 0xf4 &&
+          utf8_sequence_length (data[len - i]) > i)
+        return i;
+      break;
+    }
+
+  return 0;
+}
+
+static void
+abandon_streamed_message (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+
+  pv->frame_discard = TRUE;
+  pv->message_opcode = 0;
+  pv->message_compressed = FALSE;
+  pv->utf8_partial_len = 0;
+}
+
+static void
+emit_fragment (WebSocketConnection *self,
+               const guint8 *data,
+               gsize len)
+{
+  GBytes *fragment;
+
+  if (len == 0)
+    return;
+
+  fragment = g_bytes_new (data, len);
+  g_signal_emit (self, signals[MESSAGE_FRAGMENT], 0, fragment);
+  g_bytes_unref (fragment);
+}
+
+/*
+ * Deliver part of a streamed message. Text is only handed out in whole
+ * characters, a character split between two parts is held back until
+ * the rest of it arrives.
+ */
+static gboolean
+stream_fragment (WebSocketConnection *self,
+                 const guint8 *data,
+                 gsize len,
+                 gsize ascii)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  gsize need;
+  gsize hold;
+  gsize n;
+
+  if (pv->message_opcode != 0x01)
+    {
+      emit_fragment (self, data, len);
+      return TRUE;
+    }
+
+  if (pv->utf8_partial_len > 0)
+    {
+      need = utf8_sequence_length (pv->utf8_partial[0]);
+      n = MIN (need - pv->utf8_partial_len, len);
+      memcpy (pv->utf8_partial + pv->utf8_partial_len, data, n);
+      pv->utf8_partial_len += n;
+      data += n;
+      len -= n;
+      ascii = ascii > n ? ascii - n : 0;
+
+      if (pv->utf8_partial_len < need)
+        return TRUE;
+      if (!g_utf8_validate ((gchar *)pv->utf8_partial, need, NULL))
+        goto invalid;
+
+      pv->utf8_partial_len = 0;
+      emit_fragment (self, pv->utf8_partial, need);
+    }
+
+  hold = utf8_incomplete_tail (data, len);
+  if (!_web_socket_validate_utf8 (data, len - hold, MIN (ascii, len - hold)))
+    goto invalid;
+
+  memcpy (pv->utf8_partial, data + len - hold, hold);
+  pv->utf8_partial_len = hold;
+  emit_fragment (self, data, len - hold);
+  return TRUE;
+
+invalid:
+  g_message ("received invalid non-UTF8 text data");
+  abandon_streamed_message (self);
+  bad_data_error_and_close (self);
+  return FALSE;
+}
+
+static gboolean
+stream_inflate (WebSocketConnection *self,
+                const guint8 *data,
+                gsize len)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  z_stream *zs = pv->inflater;
+  guint8 buffer[16 * 1024];
+  int ret;
+
+  zs->next_in = (Bytef *)data;
+  zs->avail_in = len;
+
+  /* The output is delivered as it comes, so no need to limit how much there is */
+  for (;;)
+    {
+      zs->next_out = buffer;
+      zs->avail_out = sizeof (buffer);
+
+      ret = inflate (zs, Z_SYNC_FLUSH);
+
+      if (ret == Z_STREAM_END)
+        {
+          inflateReset (zs);
+        }
+      else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+          g_message ("received invalid compressed data");
+          abandon_streamed_message (self);
+          bad_data_error_and_close (self);
+          return FALSE;
+        }
+
+      if (!stream_fragment (self, buffer, sizeof (buffer) - zs->avail_out, 0))
+        return FALSE;
+
+      if (zs->avail_in == 0 && zs->avail_out > 0)
+        return TRUE;
+    }
+}
+
+static void
+finish_streamed_frame (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  static const guint8 trailer[] = { 0x00, 0x00, 0xff, 0xff };
+
+  if (pv->frame_discard)
+    {
+      pv->frame_discard = FALSE;
+      return;
+    }
+
+  if (!pv->frame_fin)
+    return;
+
+  if (pv->message_compressed)
+    {
+      /* Put back the empty block that the peer removed from the end of the message */
+      if (!stream_inflate (self, trailer, sizeof (trailer)))
+        {
+          pv->frame_discard = FALSE;
+          return;
+        }
+      if (pv->inflate_no_context_takeover)
+        inflateReset (pv->inflater);
+    }
+
+  if (pv->utf8_partial_len > 0)
+    {
+      g_message ("received invalid non-UTF8 text data");
+      abandon_streamed_message (self);
+      pv->frame_discard = FALSE;
+      bad_data_error_and_close (self);
+      return;
+    }
+
+  g_debug ("message: finished streaming %d", (int)pv->message_opcode);
+  pv->message_opcode = 0;
+  pv->message_compressed = FALSE;
+  g_signal_emit (self, signals[MESSAGE_END], 0);
+}
+
+/*
+ * Handle the payload of a streamed frame that has arrived so far. It is
+ * unmasked in place, and the position in the mask is remembered for the
+ * next part.
+ */
+static gboolean
+process_frame_part (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  guint8 mask[4];
+  guint8 *data;
+  gsize ascii = 0;
+  gsize len;
+  guint i;
+
+  len = MIN (pv->incoming->len - pv->incoming_offset, pv->frame_remaining);
+  if (len == 0)
+    return FALSE; /* need more data */
+
+  data = pv->incoming->data + pv->incoming_offset;
+  if (pv->frame_masked)
+    {
+      for (i = 0; i < 4; i++)
+        mask[i] = pv->frame_mask[(pv->frame_mask_offset + i) & 3];
+      ascii = _web_socket_unmask_rfc6455 (mask, data, len);
+      pv->frame_mask_offset = (pv->frame_mask_offset + len) & 3;
+    }
+
+  pv->incoming_offset += len;
+  pv->frame_remaining -= len;
+
+  if (!pv->frame_discard)
+    {
+      if (pv->message_compressed)
+        stream_inflate (self, data, len);
+      else
+        stream_fragment (self, data, len, ascii);
+    }
+
+  if (pv->frame_remaining == 0)
+    finish_streamed_frame (self);
+
+  return TRUE;
+}
+
+static gboolean
+begin_streamed_frame (WebSocketConnection *self,
+                      gboolean fin,
+                      gboolean compressed,
+                      guint8 opcode,
+                      const guint8 *mask,
+                      guint64 payload_len)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+
+  pv->frame_fin = fin;
+  pv->frame_masked = (mask != NULL);
+  if (mask)
+    memcpy (pv->frame_mask, mask, 4);
+  pv->frame_mask_offset = 0;
+  pv->frame_remaining = payload_len;
+  pv->frame_discard = FALSE;
+
+  /* Only the first frame of a message can be marked as compressed */
+  if (compressed && (!pv->inflater || !opcode))
+    {
+      g_message ("received unexpected compressed frame");
+      pv->frame_discard = TRUE;
+      protocol_error_and_close (self);
+    }
+  else if (pv->close_received)
+    {
+      g_message ("received message after close was received");
+      pv->frame_discard = TRUE;
+    }
+  else if (!check_message_frame (self, fin, opcode, payload_len))
+    {
+      pv->frame_discard = TRUE;
+    }
+  else if (opcode)
+    {
+      pv->message_opcode = opcode;
+      pv->message_compressed = compressed;
+      pv->utf8_partial_len = 0;
+      g_signal_emit (self, signals[MESSAGE_BEGIN], 0, (int)opcode);
+    }
+
+  if (pv->frame_remaining == 0)
+    finish_streamed_frame (self);
+
+  return TRUE;
+}
+
 static gboolean
 process_frame_rfc6455 (WebSocketConnection *self)
 {
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
   guint8 *header;
   guint8 *payload;
   guint64 payload_len;
   guint8 *mask;
   gboolean fin;
   gboolean control;
+  gboolean compressed;
   gboolean masked;
   guint8 opcode;
+  gsize ascii = 0;
   gsize len;
   gsize at;
 
-  len = GET_PRIV(self)->incoming->len;
+  /* The rest of a frame that is being streamed */
+  if (pv->frame_remaining > 0)
+    return process_frame_part (self);
+
+  len = pv->incoming->len - pv->incoming_offset;
   if (len < 2)
     return FALSE; /* need more data */
 
-  header = GET_PRIV(self)->incoming->data;
+  header = pv->incoming->data + pv->incoming_offset;
   fin = ((header[0] & 0x80) != 0);
+  compressed = ((header[0] & 0x40) != 0);
   control = header[0] & 0x08;
   opcode = header[0] & 0x0f;
   masked = ((header[1] & 0x80) != 0);
@@ -882,6 +1808,25 @@ process_frame_rfc6455 (WebSocketConnection *self)
       break;
     }
 
+  /* Data frames are handed out as they arrive when streaming, however large they are */
+  if (pv->streaming && !control)
+    {
+      if (masked)
+        {
+          if (len < at + 4)
+            return FALSE; /* need more data */
+          mask = header + at;
+          at += 4;
+        }
+      else
+        {
+          mask = NULL;
+        }
+
+      pv->incoming_offset += at;
+      return begin_streamed_frame (self, fin, compressed, opcode, mask, payload_len);
+    }
+
   /* Safety valve */
   if (payload_len >= MAX_PAYLOAD)
     {
@@ -903,17 +1848,18 @@ process_frame_rfc6455 (WebSocketConnection *self)
       if (len < at + payload_len)
         return FALSE; /* need more data */
 
-      xor_with_mask_rfc6455 (mask, payload, payload_len);
+      /* Also finds out how much of the payload is ASCII, to speed up validation */
+      ascii = _web_socket_unmask_rfc6455 (mask, payload, payload_len);
     }
 
   /*
    * Note that now that we've unmasked, we've modified the buffer, we can
    * only return below via discarding or processing the message
    */
-  process_contents_rfc6455 (self, control, fin, opcode, payload, payload_len);
+  process_contents_rfc6455 (self, control, fin, compressed, opcode, payload, payload_len, ascii);
 
-  /* Move past the parsed frame */
-  g_byte_array_remove_range (GET_PRIV(self)->incoming, 0, at + payload_len);
+  /* Move past the parsed frame, process_incoming() drops it later */
+  pv->incoming_offset += at + payload_len;
   return TRUE;
 }
 
@@ -943,6 +1889,15 @@ process_incoming (WebSocketConnection *self)
           more = process_frame_rfc6455 (self);
         }
       while (more);
+
+      deliver_batch (self);
+
+      /* Drop all the parsed frames at once, rather than moving the rest for each one */
+      if (pv->incoming_offset > 0)
+        {
+          g_byte_array_remove_range (pv->incoming, 0, pv->incoming_offset);
+          pv->incoming_offset = 0;
+        }
     }
 }
 
@@ -955,16 +1910,26 @@ on_web_socket_input (GObject *pollable_stream,
   GError *error = NULL;
   gboolean end = FALSE;
   gssize count;
+  gsize size;
   gsize len;
+  gint avail;
 
   do
     {
+      /* Read everything that's there at once, the frames are parsed afterwards */
+      size = INPUT_CHUNK;
+      if (pv->socket_fd >= 0)
+        {
+          if (ioctl (pv->socket_fd, FIONREAD, &avail) == 0)
+            size = MAX (avail, 1024);
+        }
+
       len = pv->incoming->len;
-      g_byte_array_set_size (pv->incoming, len + 1024);
+      g_byte_array_set_size (pv->incoming, len + size);
 
       count = g_pollable_input_stream_read_nonblocking (pv->input,
                                                         pv->incoming->data + len,
-                                                        1024, NULL, &error);
+                                                        size, NULL, &error);
 
       if (count < 0)
         {
@@ -1019,36 +1984,224 @@ start_input (WebSocketConnection *self)
   g_source_attach (pv->input_source, pv->main_context);
 }
 
+static gssize
+write_frames (WebSocketConnection *self,
+              GError **error)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  struct iovec vectors[MAX_OUTPUT_VECTORS];
+  struct msghdr msg = { .msg_iov = vectors };
+  Frame *frame;
+  gssize count;
+  GList *l;
+  int errn;
+
+  /* Not a socket, write what we can of the first frame */
+  if (pv->socket_fd < 0)
+    {
+      frame_vectors (g_queue_peek_head (&pv->outgoing), vectors, 1);
+      return g_pollable_output_stream_write_nonblocking (pv->output, vectors[0].iov_base,
+                                                         vectors[0].iov_len, NULL, error);
+    }
+
+  /* Otherwise as many frames as fit, but nothing after the last one */
+  for (l = pv->outgoing.head; l != NULL && msg.msg_iovlen < MAX_OUTPUT_VECTORS; l = g_list_next (l))
+    {
+      frame = l->data;
+      msg.msg_iovlen += frame_vectors (frame, vectors + msg.msg_iovlen,
+                                       MAX_OUTPUT_VECTORS - msg.msg_iovlen);
+      if (frame->last)
+        break;
+    }
+
+  do
+    count = sendmsg (pv->socket_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  while (count < 0 && errno == EINTR);
+
+  if (count < 0)
+    {
+      errn = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errn),
+                   "Error sending data: %s", g_strerror (errn));
+    }
+
+  return count;
+}
+
+static guint
+flow_weight (WebSocketConnection *self,
+             const gchar *name)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  gpointer weight;
+
+  weight = g_hash_table_lookup (pv->flow_weights, name);
+  return weight ? GPOINTER_TO_UINT (weight) : FLOW_DEFAULT_WEIGHT;
+}
+
+static void
+commit_frame (WebSocketConnection *self,
+              Frame *frame)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  gsize estimate;
+
+  /* This is the order the peer sees the messages in */
+  if (frame->compress)
+    {
+      estimate = frame->length;
+      frame_compress (self, frame);
+      g_assert (pv->output_queued >= estimate);
+      pv->output_queued = pv->output_queued - estimate + frame->length;
+    }
+
+  g_queue_push_tail (&pv->outgoing, frame);
+  pv->outgoing_length += frame->length;
+}
+
+/* Decide which of the queued frames go out next */
+static void
+schedule_frames (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  Frame *frame;
+  Flow *flow;
+
+  while (pv->outgoing_length < SCHEDULE_AHEAD)
+    {
+      flow = g_queue_peek_head (&pv->active_flows);
+
+      /* The close message goes after everything else */
+      if (flow == NULL)
+        {
+          frame = g_queue_pop_head (&pv->after_flows);
+          if (frame == NULL)
+            break;
+          commit_frame (self, frame);
+          continue;
+        }
+
+      if (!flow->visited)
+        {
+          flow->deficit += FLOW_QUANTUM * flow_weight (self, flow->name);
+          flow->visited = TRUE;
+        }
+
+      frame = g_queue_peek_head (&flow->frames);
+      if (frame->length <= flow->deficit || pv->active_flows.length == 1)
+        {
+          g_queue_pop_head (&flow->frames);
+          flow->deficit -= MIN (frame->length, flow->deficit);
+          commit_frame (self, frame);
+
+          if (g_queue_is_empty (&flow->frames))
+            {
+              g_queue_pop_head (&pv->active_flows);
+              g_hash_table_remove (pv->flows, flow->name);
+            }
+        }
+      else
+        {
+          /* The rest of its turn carries over to the next round */
+          flow->visited = FALSE;
+          g_queue_push_tail (&pv->active_flows, g_queue_pop_head (&pv->active_flows));
+        }
+    }
+}
+
+static void
+pressure_watermarks (WebSocketConnectionPrivate *pv,
+                     gsize *high,
+                     gsize *low)
+{
+  gdouble window;
+
+  *high = pv->queue_high;
+  *low = MIN (pv->queue_low, pv->queue_high - 1);
+
+  /* Don't queue more than the peer reads in a short while */
+  if (pv->queue_adaptive && pv->drain_rate > 0)
+    {
+      window = MAX (pv->drain_rate * PRESSURE_DELAY, PRESSURE_MIN_HIGH);
+      if (window < *high)
+        {
+          *low = (gsize)(*low * (window / *high));
+          *high = (gsize)window;
+        }
+    }
+}
+
+static void
+update_pressure (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  gsize high, low;
+
+  pressure_watermarks (pv, &high, &low);
+
+  /*
+   * If we have too much data queued, and are controlling another flow,
+   * tell it to stop sending data until the queue drains below the low mark.
+   */
+  if (!pv->queue_pressure && pv->output_queued >= high)
+    {
+      g_debug ("%" G_GSIZE_FORMAT " bytes queued, applying back pressure", pv->output_queued);
+      pv->queue_pressure = TRUE;
+      pv->pressure_since = g_get_monotonic_time ();
+      pv->pressure_count++;
+      cockpit_flow_emit_pressure (COCKPIT_FLOW (self), TRUE);
+    }
+  else if (pv->queue_pressure && pv->output_queued <= low)
+    {
+      g_debug ("%" G_GSIZE_FORMAT " bytes queued, relieving back pressure", pv->output_queued);
+      pv->queue_pressure = FALSE;
+      pv->pressure_time += g_get_monotonic_time () - pv->pressure_since;
+      cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
+    }
+}
+
+static void
+measure_drain (WebSocketConnectionPrivate *pv,
+               gsize written)
+{
+  gint64 now;
+  gdouble rate;
+
+  now = g_get_monotonic_time ();
+  pv->drain_bytes += written;
+  if (now - pv->drain_start < PRESSURE_INTERVAL)
+    return;
+
+  rate = (gdouble)pv->drain_bytes / (now - pv->drain_start);
+  if (pv->drain_rate > 0)
+    pv->drain_rate = (pv->drain_rate * 3 + rate) / 4;
+  else
+    pv->drain_rate = rate;
+
+  pv->drain_start = now;
+  pv->drain_bytes = 0;
+}
+
 static gboolean
 on_web_socket_output (GObject *pollable_stream,
                       gpointer user_data)
 {
   WebSocketConnection *self = WEB_SOCKET_CONNECTION (user_data);
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
-  const guint8 *data;
   GError *error = NULL;
-  gsize before;
   Frame *frame;
   gssize count;
-  gsize len;
-
-  frame = g_queue_peek_head (&pv->outgoing);
+  gsize left;
 
   /* No more frames to send */
-  if (frame == NULL)
+  schedule_frames (self);
+  if (g_queue_is_empty (&pv->outgoing))
     {
       stop_output (self);
       return TRUE;
     }
 
-  data = g_bytes_get_data (frame->data, &len);
-  g_assert (len > 0);
-  g_assert (len > frame->sent);
-
-  count = g_pollable_output_stream_write_nonblocking (pv->output,
-                                                      data + frame->sent,
-                                                      len - frame->sent,
-                                                      NULL, &error);
+  count = write_frames (self, &error);
 
   if (count < 0)
     {
@@ -1064,18 +2217,34 @@ on_web_socket_output (GObject *pollable_stream,
         }
     }
 
-  before = pv->output_queued;
+  /* Account for every byte written, not just for completed frames */
+  g_assert ((gsize)count <= pv->output_queued);
+  pv->output_queued -= count;
+  if (pv->output_queued == 0)
+    pv->drain_bytes = 0;
+  else if (pv->queue_adaptive && count > 0)
+    measure_drain (pv, count);
 
-  frame->sent += count;
-  if (frame->sent >= len)
+  /* The write may have completed any number of frames */
+  while ((frame = g_queue_peek_head (&pv->outgoing)) != NULL)
     {
+      g_assert (frame->length > frame->sent);
+      left = frame->length - frame->sent;
+      if ((gsize)count < left)
+        {
+          frame->sent += count;
+          pv->outgoing_length -= count;
+          break;
+        }
+
+      count -= left;
       g_debug ("sent frame");
       g_queue_pop_head (&pv->outgoing);
-      g_assert (len <= pv->output_queued);
-      pv->output_queued -= len;
+      pv->outgoing_length -= left;
 
       if (frame->last)
         {
+          g_assert (count == 0);
           if (pv->server_side)
             {
               close_io_stream (self);
@@ -1085,16 +2254,14 @@ on_web_socket_output (GObject *pollable_stream,
               shutdown_wr_io_stream (self);
               close_io_after_timeout (self);
             }
+          frame_free (frame);
+          break;
         }
       frame_free (frame);
     }
 
-  /*
-   * If we're controlling another flow, turn off back pressure when
-   * our output buffer size becomes less than the low mark.
-   */
-  if (before >= QUEUE_PRESSURE && GET_PRIV(self)->output_queued < QUEUE_PRESSURE)
-    cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
+  schedule_frames (self);
+  update_pressure (self);
 
   return TRUE;
 }
@@ -1113,31 +2280,30 @@ start_output (WebSocketConnection *self)
   g_source_attach (pv->output_source, pv->main_context);
 }
 
-void
-_web_socket_connection_queue (WebSocketConnection *self,
-                              WebSocketQueueFlags flags,
-                              gpointer data,
-                              gsize len,
-                              gsize amount)
+static void
+queue_frame (WebSocketConnection *self,
+             WebSocketQueueFlags flags,
+             const gchar *flow,
+             Frame *frame)
 {
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
-  gsize before;
-  Frame *frame;
   Frame *prev;
+  Flow *queue;
 
-  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
-  g_return_if_fail (pv->close_sent == FALSE);
-  g_return_if_fail (data != NULL);
-  g_return_if_fail (len > 0);
+  if (pv->close_sent)
+    {
+      frame_free (frame);
+      g_return_if_reached ();
+    }
 
-  frame = g_slice_new0 (Frame);
-  frame->data = g_bytes_new_take (data, len);
-  frame->amount = amount;
   frame->last = (flags & WEB_SOCKET_QUEUE_LAST) ? TRUE : FALSE;
 
   /* If urgent put at front of queue */
   if (flags & WEB_SOCKET_QUEUE_URGENT)
     {
+      if (frame->compress)
+        frame_compress (self, frame);
+
       /* But we can't interrupt a message already partially sent */
       prev = g_queue_pop_head (&pv->outgoing);
       if (prev == NULL)
@@ -1154,26 +2320,66 @@ _web_socket_connection_queue (WebSocketConnection *self,
           g_queue_push_head (&pv->outgoing, prev);
           g_queue_push_head (&pv->outgoing, frame);
         }
+      pv->outgoing_length += frame->length;
     }
+
+  /* Nothing may follow the close message, so it waits for all flows */
+  else if (frame->last || frame_is_close (frame))
+    {
+      g_queue_push_tail (&pv->after_flows, frame);
+    }
+
+  /* Data messages take turns with other flows, the default one included */
   else
     {
-      g_queue_push_tail (&pv->outgoing, frame);
+      if (!flow)
+        flow = "";
+
+      queue = g_hash_table_lookup (pv->flows, flow);
+      if (!queue)
+        {
+          queue = g_slice_new0 (Flow);
+          queue->name = g_strdup (flow);
+          g_queue_init (&queue->frames);
+          g_hash_table_insert (pv->flows, queue->name, queue);
+          g_queue_push_tail (&pv->active_flows, queue);
+        }
+      g_queue_push_tail (&queue->frames, frame);
     }
 
-  before = pv->output_queued;
-  g_return_if_fail (G_MAXSIZE - len > pv->output_queued);
-  pv->output_queued += len;
+  g_return_if_fail (G_MAXSIZE - frame->length > pv->output_queued);
+  if (pv->output_queued == 0)
+    pv->drain_start = g_get_monotonic_time ();
+  pv->output_queued += frame->length;
 
-  /*
-   * If we have two much data queued, and are controlling another flow
-   * tell it to stop sending data, each time we cross over the high bound.
-   */
-  if (before < QUEUE_PRESSURE && GET_PRIV(self)->output_queued >= QUEUE_PRESSURE)
-    cockpit_flow_emit_pressure (COCKPIT_FLOW (self), TRUE);
+  update_pressure (self);
 
+  schedule_frames (self);
   start_output (self);
 }
 
+void
+_web_socket_connection_queue (WebSocketConnection *self,
+                              WebSocketQueueFlags flags,
+                              gpointer data,
+                              gsize len,
+                              gsize amount)
+{
+  Frame *frame;
+
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  g_return_if_fail (data != NULL);
+  g_return_if_fail (len > 0);
+
+  /* Raw data, such as the handshake */
+  frame = g_slice_new0 (Frame);
+  frame->payload = g_bytes_new_take (data, len);
+  frame->length = len;
+  frame->amount = amount;
+
+  queue_frame (self, flags, NULL, frame);
+}
+
 static gboolean
 check_streams (WebSocketConnection *self)
 {
@@ -1243,6 +2449,13 @@ _web_socket_connection_take_io_stream (WebSocketConnection *self,
   if (G_IS_POLLABLE_OUTPUT_STREAM (os))
     pv->output = G_POLLABLE_OUTPUT_STREAM (os);
 
+  /*
+   * Sockets can write several frames at once, without putting them together,
+   * and tell us how much there is to read.
+   */
+  if (G_IS_SOCKET_CONNECTION (io_stream))
+    pv->socket_fd = g_socket_get_fd (g_socket_connection_get_socket (G_SOCKET_CONNECTION (io_stream)));
+
   pv->io_open = TRUE;
   g_object_notify (G_OBJECT (self), "io-stream");
 
@@ -1283,26 +2496,58 @@ web_socket_connection_get_property (GObject *object,
 {
   WebSocketConnection *self = WEB_SOCKET_CONNECTION (object);
 
-  switch (prop_id)
-    {
-    case PROP_URL:
-      g_value_set_string (value, web_socket_connection_get_url (self));
+  switch (prop_id)
+    {
+    case PROP_URL:
+      g_value_set_string (value, web_socket_connection_get_url (self));
+      break;
+
+    case PROP_PROTOCOL:
+      g_value_set_string (value, web_socket_connection_get_protocol (self));
+      break;
+
+    case PROP_READY_STATE:
+      g_value_set_int (value, web_socket_connection_get_ready_state (self));
+      break;
+
+    case PROP_BUFFERED_AMOUNT:
+      g_value_set_ulong (value, web_socket_connection_get_buffered_amount (self));
+      break;
+
+    case PROP_IO_STREAM:
+      g_value_set_object (value, web_socket_connection_get_io_stream (self));
+      break;
+
+    case PROP_PERMESSAGE_DEFLATE:
+      g_value_set_boolean (value, GET_PRIV(self)->deflate_enabled);
+      break;
+
+    case PROP_DEFLATE_WINDOW_BITS:
+      g_value_set_uint (value, GET_PRIV(self)->deflate_window_bits);
+      break;
+
+    case PROP_DEFLATE_MEMORY_LIMIT:
+      g_value_set_uint (value, GET_PRIV(self)->deflate_memory_limit);
       break;
 
-    case PROP_PROTOCOL:
-      g_value_set_string (value, web_socket_connection_get_protocol (self));
+    case PROP_STREAMING:
+      g_value_set_boolean (value, GET_PRIV(self)->streaming);
       break;
 
-    case PROP_READY_STATE:
-      g_value_set_int (value, web_socket_connection_get_ready_state (self));
+    case PROP_PRESSURE_HIGH:
+      g_value_set_uint (value, GET_PRIV(self)->queue_high);
       break;
 
-    case PROP_BUFFERED_AMOUNT:
-      g_value_set_ulong (value, web_socket_connection_get_buffered_amount (self));
+    case PROP_PRESSURE_LOW:
+      g_value_set_uint (value, GET_PRIV(self)->queue_low);
       break;
 
-    case PROP_IO_STREAM:
-      g_value_set_object (value, web_socket_connection_get_io_stream (self));
+    case PROP_ADAPTIVE_PRESSURE:
+      g_value_set_boolean (value, GET_PRIV(self)->queue_adaptive);
+      break;
+
+    case PROP_BATCH_MESSAGES:
+      g_value_set_boolean (value, GET_PRIV(self)->batching);
       break;
 
     default:
@@ -1335,6 +2580,46 @@ web_socket_connection_set_property (GObject *object,
         _web_socket_connection_take_io_stream (self, io_stream);
       break;
 
+    case PROP_PERMESSAGE_DEFLATE:
+      g_return_if_fail (!pv->handshake_done);
+      pv->deflate_enabled = g_value_get_boolean (value);
+      break;
+
+    case PROP_DEFLATE_WINDOW_BITS:
+      g_return_if_fail (!pv->handshake_done);
+      pv->deflate_window_bits = g_value_get_uint (value);
+      break;
+
+    case PROP_DEFLATE_MEMORY_LIMIT:
+      g_return_if_fail (!pv->handshake_done);
+      pv->deflate_memory_limit = g_value_get_uint (value);
+      break;
+
+    case PROP_STREAMING:
+      g_return_if_fail (pv->message_opcode == 0 && pv->frame_remaining == 0);
+      pv->streaming = g_value_get_boolean (value);
+      break;
+
+    case PROP_PRESSURE_HIGH:
+      pv->queue_high = g_value_get_uint (value);
+      update_pressure (self);
+      break;
+
+    case PROP_PRESSURE_LOW:
+      pv->queue_low = g_value_get_uint (value);
+      update_pressure (self);
+      break;
+
+    case PROP_ADAPTIVE_PRESSURE:
+      pv->queue_adaptive = g_value_get_boolean (value);
+      update_pressure (self);
+      break;
+
+    case PROP_BATCH_MESSAGES:
+      g_return_if_fail (pv->batch == NULL || pv->batch->len == 0);
+      pv->batching = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -1363,14 +2648,18 @@ web_socket_connection_finalize (GObject *object)
 
   g_free (pv->url);
   g_free (pv->chosen_protocol);
+  g_free (pv->chosen_extensions);
   g_free (pv->peer_close_data);
 
   g_main_context_unref (pv->main_context);
 
   if (pv->incoming)
     g_byte_array_free (pv->incoming, TRUE);
-  while (!g_queue_is_empty (&pv->outgoing))
-    frame_free (g_queue_pop_head (&pv->outgoing));
+  frames_clear (&pv->outgoing);
+  g_queue_clear (&pv->active_flows);
+  g_hash_table_destroy (pv->flows);
+  g_hash_table_destroy (pv->flow_weights);
+  frames_clear (&pv->after_flows);
   pv->output_queued = 0;
 
   g_clear_object (&pv->io_stream);
@@ -1384,6 +2673,12 @@ web_socket_connection_finalize (GObject *object)
     g_source_unref (pv->start_idle);
   if (pv->message_data)
     g_byte_array_free (pv->message_data, TRUE);
+  if (pv->batch)
+    {
+      clear_batch (pv->batch);
+      g_array_unref (pv->batch);
+    }
+  deflate_stop (self);
 
   G_OBJECT_CLASS (web_socket_connection_parent_class)->finalize (object);
 }
@@ -1459,6 +2754,109 @@ web_socket_connection_class_init (WebSocketConnectionClass *klass)
                                    g_param_spec_object ("io-stream", "IO Stream", "Underlying io stream", G_TYPE_IO_STREAM,
                                                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * WebSocketConnection:permessage-deflate:
+   *
+   * Whether to compress messages with the permessage-deflate extension
+   * (RFC 7692). Clients offer the extension, servers accept it when the
+   * client offers it. Must be set before the handshake.
+   *
+   * Use web_socket_connection_get_extensions() to find out whether it was
+   * negotiated.
+   */
+  g_object_class_install_property (gobject_class, PROP_PERMESSAGE_DEFLATE,
+                                   g_param_spec_boolean ("permessage-deflate", "Permessage deflate", "Compress messages",
+                                                         FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:deflate-window-bits:
+   *
+   * The maximum size of the window (as a power of two) used to compress
+   * outgoing messages. Smaller windows need less memory but compress
+   * worse. The peer may ask for a smaller window during the handshake.
+   */
+  g_object_class_install_property (gobject_class, PROP_DEFLATE_WINDOW_BITS,
+                                   g_param_spec_uint ("deflate-window-bits", "Deflate window bits", "Compression window size",
+                                                      9, 15, 15, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:deflate-memory-limit:
+   *
+   * The number of bytes the compression state of this connection may use
+   * in both directions together. The window sizes are reduced during
+   * negotiation to stay below it, and the extension is declined if even
+   * the smallest windows don't fit.
+   */
+  g_object_class_install_property (gobject_class, PROP_DEFLATE_MEMORY_LIMIT,
+                                   g_param_spec_uint ("deflate-memory-limit", "Deflate memory limit", "Compression memory limit",
+                                                      0, G_MAXUINT, DEFLATE_MEMORY_LIMIT,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:streaming:
+   *
+   * Whether to deliver messages in pieces as they arrive, rather than
+   * putting each one together first. When set, received messages are
+   * emitted with the #WebSocketConnection::message-begin,
+   * #WebSocketConnection::message-fragment and
+   * #WebSocketConnection::message-end signals instead of
+   * #WebSocketConnection::message, and their size is not limited.
+   *
+   * Can't be changed while a message is being received.
+   */
+  g_object_class_install_property (gobject_class, PROP_STREAMING,
+                                   g_param_spec_boolean ("streaming", "Streaming", "Deliver messages as they arrive",
+                                                         FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:pressure-high:
+   *
+   * The number of bytes queued for sending, including framing, at which
+   * the connection applies back pressure to whatever it is throttling
+   * with cockpit_flow_throttle(). Writes are accounted byte for byte, so
+   * partially sent frames count only with what is left of them.
+   */
+  g_object_class_install_property (gobject_class, PROP_PRESSURE_HIGH,
+                                   g_param_spec_uint ("pressure-high", "Pressure high", "Queue size that applies back pressure",
+                                                      1, G_MAXUINT, PRESSURE_HIGH,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:pressure-low:
+   *
+   * The number of bytes queued for sending at or below which back pressure
+   * is relieved again. It is always less than
+   * #WebSocketConnection:pressure-high, so that pressure isn't toggled for
+   * every message.
+   */
+  g_object_class_install_property (gobject_class, PROP_PRESSURE_LOW,
+                                   g_param_spec_uint ("pressure-low", "Pressure low", "Queue size that relieves back pressure",
+                                                      0, G_MAXUINT, PRESSURE_LOW,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:adaptive-pressure:
+   *
+   * Whether to measure how fast the peer reads, and lower the watermarks
+   * so that no more than a quarter of a second of output is queued. The
+   * configured watermarks remain the upper limit.
+   */
+  g_object_class_install_property (gobject_class, PROP_ADAPTIVE_PRESSURE,
+                                   g_param_spec_boolean ("adaptive-pressure", "Adaptive pressure", "Size the queue from the drain rate",
+                                                         FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:batch-messages:
+   *
+   * Whether to hand out all the messages received in one read together,
+   * with the #WebSocketConnection::messages signal, instead of emitting
+   * #WebSocketConnection::message for each one. This lets a consumer pass
+   * a burst of messages on at once. Streamed messages are not batched.
+   */
+  g_object_class_install_property (gobject_class, PROP_BATCH_MESSAGES,
+                                   g_param_spec_boolean ("batch-messages", "Batch messages", "Deliver messages together",
+                                                         FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   /**
    * WebSocketConnection::open:
    * @self: the WebSocket
@@ -1494,6 +2892,74 @@ web_socket_connection_class_init (WebSocketConnectionClass *klass)
                                    NULL, NULL, g_cclosure_marshal_generic,
                                    G_TYPE_NONE, 2, G_TYPE_INT, G_TYPE_BYTES);
 
+  /**
+   * WebSocketConnection::messages:
+   * @self: the WebSocket
+   * @messages: (array length=n_messages): the messages
+   * @n_messages: the number of messages
+   *
+   * Emitted with the messages received from the peer in one read, in
+   * the order they arrived, when #WebSocketConnection:batch-messages is
+   * set. The messages are only valid during the signal emission, so take
+   * a reference to the payloads to keep them.
+   */
+  signals[MESSAGES] = g_signal_new ("messages",
+                                    WEB_SOCKET_TYPE_CONNECTION,
+                                    G_SIGNAL_RUN_FIRST,
+                                    G_STRUCT_OFFSET (WebSocketConnectionClass, messages),
+                                    NULL, NULL, g_cclosure_marshal_generic,
+                                    G_TYPE_NONE, 2, G_TYPE_POINTER, G_TYPE_UINT);
+
+  /**
+   * WebSocketConnection::message-begin:
+   * @self: the WebSocket
+   * @type: the type of message contents
+   *
+   * Emitted when a message from the peer starts to arrive, if the
+   * #WebSocketConnection:streaming property is set. Its contents follow
+   * in #WebSocketConnection::message-fragment signals.
+   */
+  signals[MESSAGE_BEGIN] = g_signal_new ("message-begin",
+                                         WEB_SOCKET_TYPE_CONNECTION,
+                                         G_SIGNAL_RUN_FIRST,
+                                         G_STRUCT_OFFSET (WebSocketConnectionClass, message_begin),
+                                         NULL, NULL, g_cclosure_marshal_generic,
+                                         G_TYPE_NONE, 1, G_TYPE_INT);
+
+  /**
+   * WebSocketConnection::message-fragment:
+   * @self: the WebSocket
+   * @fragment: the next part of the message
+   *
+   * Emitted with each part of a message as it arrives, between
+   * #WebSocketConnection::message-begin and
+   * #WebSocketConnection::message-end. The parts don't line up with the
+   * frames the peer sent, except that text is never split within a
+   * character. Unlike with #WebSocketConnection::message the data is not
+   * null-terminated.
+   */
+  signals[MESSAGE_FRAGMENT] = g_signal_new ("message-fragment",
+                                            WEB_SOCKET_TYPE_CONNECTION,
+                                            G_SIGNAL_RUN_FIRST,
+                                            G_STRUCT_OFFSET (WebSocketConnectionClass, message_fragment),
+                                            NULL, NULL, g_cclosure_marshal_generic,
+                                            G_TYPE_NONE, 1, G_TYPE_BYTES);
+
+  /**
+   * WebSocketConnection::message-end:
+   * @self: the WebSocket
+   *
+   * Emitted when a streamed message is complete. If the message turns out
+   * to be invalid, the connection is closed with an error and this
+   * signal is not emitted for it.
+   */
+  signals[MESSAGE_END] = g_signal_new ("message-end",
+                                       WEB_SOCKET_TYPE_CONNECTION,
+                                       G_SIGNAL_RUN_FIRST,
+                                       G_STRUCT_OFFSET (WebSocketConnectionClass, message_end),
+                                       NULL, NULL, g_cclosure_marshal_generic,
+                                       G_TYPE_NONE, 0);
+
   /**
    * WebSocketConnection::error:
    * @self: the WebSocket
@@ -1584,6 +3050,25 @@ web_socket_connection_get_protocol (WebSocketConnection *self)
   return GET_PRIV(self)->chosen_protocol;
 }
 
+/**
+ * web_socket_connection_get_extensions:
+ * @self: the WebSocket
+ *
+ * Get the extensions negotiated with the peer, in the form of the
+ * Sec-WebSocket-Extensions header.
+ *
+ * This will be %NULL until the WebSocket is in the %WEB_SOCKET_STATE_OPEN
+ * state, or if no extensions are in use.
+ *
+ * Returns: the negotiated extensions or %NULL
+ */
+const gchar *
+web_socket_connection_get_extensions (WebSocketConnection *self)
+{
+  g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), NULL);
+  return GET_PRIV(self)->chosen_extensions;
+}
+
 /**
  * web_socket_connection_get_ready_state:
  * @self: the WebSocket
@@ -1621,21 +3106,58 @@ web_socket_connection_get_ready_state (WebSocketConnection *self)
 gsize
 web_socket_connection_get_buffered_amount (WebSocketConnection *self)
 {
-  gsize amount = 0;
-  Frame *frame;
+  WebSocketConnectionPrivate *pv;
+  gsize amount;
   GList *l;
 
   g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), 0);
 
-  for (l = GET_PRIV(self)->outgoing.head; l != NULL; l = g_list_next (l))
-    {
-      frame = l->data;
-      amount += frame->amount;
-    }
+  pv = web_socket_connection_get_instance_private (self);
+  amount = frames_amount (&pv->outgoing) + frames_amount (&pv->after_flows);
+  for (l = pv->active_flows.head; l != NULL; l = g_list_next (l))
+    amount += frames_amount (&((Flow *)l->data)->frames);
 
   return amount;
 }
 
+/**
+ * web_socket_connection_get_pressure_count:
+ * @self: the WebSocket
+ *
+ * Get how often the connection has applied back pressure because too
+ * much output was queued.
+ *
+ * Returns: the number of times
+ */
+guint
+web_socket_connection_get_pressure_count (WebSocketConnection *self)
+{
+  g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), 0);
+  return GET_PRIV(self)->pressure_count;
+}
+
+/**
+ * web_socket_connection_get_pressure_time:
+ * @self: the WebSocket
+ *
+ * Get how long the connection has applied back pressure, including
+ * the time up to now if it still does.
+ *
+ * Returns: the time in microseconds
+ */
+GTimeSpan
+web_socket_connection_get_pressure_time (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv;
+
+  g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), 0);
+
+  pv = web_socket_connection_get_instance_private (self);
+  if (pv->queue_pressure)
+    return pv->pressure_time + (g_get_monotonic_time () - pv->pressure_since);
+  return pv->pressure_time;
+}
+
 /**
  * web_socket_connection_get_io_stream:
  * @self: the WebSocket
@@ -1707,12 +3229,44 @@ web_socket_connection_get_close_data (WebSocketConnection *self)
  *
  * The optional @prefix can be a canned header to be prefixed to the message.
  * It can be specified as a separate argument for efficiency.
+ *
+ * The message is sent on the default flow, see
+ * web_socket_connection_send_full().
  */
 void
 web_socket_connection_send (WebSocketConnection *self,
                             WebSocketDataType type,
                             GBytes *prefix,
                             GBytes *message)
+{
+  web_socket_connection_send_full (self, type, prefix, message, NULL);
+}
+
+/**
+ * web_socket_connection_send_full:
+ * @self: the WebSocket
+ * @type: the data type of message
+ * @prefix: (allow-none): an optional prefix prepended to the message
+ * @message: the message contents
+ * @flow: (allow-none): the flow to send the message on
+ *
+ * Send a message to the peer, like web_socket_connection_send(), as part
+ * of @flow.
+ *
+ * Messages on the same flow are sent in order. When messages are queued
+ * on several flows, the flows take turns, each sending an amount that
+ * depends on its weight. So a flow with a lot of data queued doesn't hold
+ * up the messages of other flows for long. See
+ * web_socket_connection_set_flow_weight().
+ *
+ * A %NULL @flow is the default flow.
+ */
+void
+web_socket_connection_send_full (WebSocketConnection *self,
+                                 WebSocketDataType type,
+                                 GBytes *prefix,
+                                 GBytes *message,
+                                 const gchar *flow)
 {
   gconstpointer pref = NULL;
   gsize prefix_len = 0;
@@ -1737,8 +3291,8 @@ web_socket_connection_send (WebSocketConnection *self,
     {
     case WEB_SOCKET_DATA_TEXT:
       opcode = 0x01;
-      if (!g_utf8_validate (pref, prefix_len, NULL) ||
-          !g_utf8_validate (payload, payload_len, NULL))
+      if (!_web_socket_validate_utf8 (pref, prefix_len, 0) ||
+          !_web_socket_validate_utf8 (payload, payload_len, 0))
         {
           g_critical ("invalid non-UTF8 @data passed as text to web_socket_connection_send()");
           return;
@@ -1752,12 +3306,38 @@ web_socket_connection_send (WebSocketConnection *self,
       return;
     }
 
-  send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode,
-                                 pref, prefix_len, payload, payload_len);
+  send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, flow ? flow : "", opcode, prefix, message);
 
   g_object_notify (G_OBJECT (self), "buffered-amount");
 }
 
+/**
+ * web_socket_connection_set_flow_weight:
+ * @self: the WebSocket
+ * @flow: the flow
+ * @weight: the relative share of the connection, or zero for the default
+ *
+ * Set how much @flow may send when it competes with other flows for the
+ * connection. The default weight is 4. Data that is to be sent in bulk
+ * should have a lower weight than interactive messages.
+ */
+void
+web_socket_connection_set_flow_weight (WebSocketConnection *self,
+                                       const gchar *flow,
+                                       guint weight)
+{
+  WebSocketConnectionPrivate *pv;
+
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  g_return_if_fail (flow != NULL);
+
+  pv = web_socket_connection_get_instance_private (self);
+  if (weight == 0)
+    g_hash_table_remove (pv->flow_weights, flow);
+  else
+    g_hash_table_replace (pv->flow_weights, g_strdup (flow), GUINT_TO_POINTER (weight));
+}
+
 /**
  * web_socket_connection_close:
  * @self: the WebSocket
@@ -1915,6 +3495,278 @@ _web_socket_connection_choose_protocol (WebSocketConnection *self,
   return chosen;
 }
 
+typedef struct {
+  gboolean server_no_context_takeover;
+  gboolean client_no_context_takeover;
+  gint server_max_window_bits;  /* -1 when absent */
+  gint client_max_window_bits;  /* -1 when absent, 0 when without value */
+} DeflateParams;
+
+static gboolean
+parse_window_bits (const gchar *value,
+                   gint *bits)
+{
+  guint64 num;
+
+  if (!value || !g_ascii_string_to_unsigned (value, 10, 8, 15, &num, NULL))
+    return FALSE;
+
+  *bits = num;
+  return TRUE;
+}
+
+/*
+ * Parse one element of a Sec-WebSocket-Extensions header. Returns FALSE
+ * if it isn't permessage-deflate or has invalid or duplicate parameters.
+ */
+static gboolean
+parse_deflate_params (const gchar *element,
+                      DeflateParams *params)
+{
+  gboolean valid = TRUE;
+  gchar **parts;
+  gchar *value;
+  gchar *name;
+  gint i;
+
+  params->server_no_context_takeover = FALSE;
+  params->client_no_context_takeover = FALSE;
+  params->server_max_window_bits = -1;
+  params->client_max_window_bits = -1;
+
+  parts = g_strsplit (element, ";", -1);
+  if (!parts[0] || g_ascii_strcasecmp (g_strstrip (parts[0]), "permessage-deflate") != 0)
+    valid = FALSE;
+
+  for (i = 1; valid && parts[i] != NULL; i++)
+    {
+      name = g_strstrip (parts[i]);
+      value = strchr (name, '=');
+      if (value)
+        {
+          *value = '\0';
+          g_strchomp (name);
+          value = g_strchug (value + 1);
+
+          /* Values may be quoted */
+          if (value[0] == '"')
+            {
+              gsize len = strlen (value);
+              if (len < 2 || value[len - 1] != '"')
+                {
+                  valid = FALSE;
+                  break;
+                }
+              value[len - 1] = '\0';
+              value++;
+            }
+        }
+
+      if (g_str_equal (name, "server_no_context_takeover") && !value)
+        {
+          valid = !params->server_no_context_takeover;
+          params->server_no_context_takeover = TRUE;
+        }
+      else if (g_str_equal (name, "client_no_context_takeover") && !value)
+        {
+          valid = !params->client_no_context_takeover;
+          params->client_no_context_takeover = TRUE;
+        }
+      else if (g_str_equal (name, "server_max_window_bits"))
+        {
+          valid = params->server_max_window_bits < 0 &&
+                  parse_window_bits (value, &params->server_max_window_bits);
+        }
+      else if (g_str_equal (name, "client_max_window_bits"))
+        {
+          valid = params->client_max_window_bits < 0;
+          if (!valid)
+            break;
+          if (value)
+            valid = parse_window_bits (value, &params->client_max_window_bits);
+          else
+            params->client_max_window_bits = 0;
+        }
+      else
+        {
+          valid = FALSE;
+        }
+    }
+
+  g_strfreev (parts);
+  return valid;
+}
+
+static void
+deflate_negotiated (WebSocketConnection *self,
+                    gchar *extensions,
+                    guint own_bits,
+                    guint peer_bits)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+
+  g_free (pv->chosen_extensions);
+  pv->chosen_extensions = extensions;
+  deflate_start (self, own_bits, peer_bits);
+}
+
+/*
+ * Calculate the window sizes that a client asks for. Only the server
+ * window size can be requested, the client can always use a smaller one.
+ */
+static gboolean
+deflate_client_window_bits (WebSocketConnection *self,
+                            guint *own_bits,
+                            guint *peer_bits)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+
+  *own_bits = pv->deflate_window_bits;
+  *peer_bits = 15;
+  return deflate_fit_memory_limit (self, own_bits, peer_bits, TRUE);
+}
+
+gchar *
+_web_socket_connection_deflate_offer (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  guint own_bits, peer_bits;
+
+  if (!pv->deflate_enabled)
+    return NULL;
+
+  if (!deflate_client_window_bits (self, &own_bits, &peer_bits))
+    {
+      g_message ("not offering permessage-deflate: memory limit of %u bytes too small",
+                 pv->deflate_memory_limit);
+      return NULL;
+    }
+
+  if (peer_bits < 15)
+    return g_strdup_printf ("permessage-deflate; client_max_window_bits; server_max_window_bits=%u", peer_bits);
+  else
+    return g_strdup ("permessage-deflate; client_max_window_bits");
+}
+
+gboolean
+_web_socket_connection_deflate_accept (WebSocketConnection *self,
+                                       const gchar *value)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  DeflateParams params;
+  guint own_bits, peer_bits;
+
+  /* The server declined, or we didn't offer anything */
+  if (!value)
+    return TRUE;
+
+  if (!pv->deflate_enabled || !deflate_client_window_bits (self, &own_bits, &peer_bits))
+    {
+      g_message ("received unexpected Sec-WebSocket-Extensions: %s", value);
+      return FALSE;
+    }
+
+  /* We only offered one extension, so there can't be more in the response */
+  if (strchr (value, ',') || !parse_deflate_params (value, &params))
+    {
+      g_message ("received invalid or unsupported Sec-WebSocket-Extensions: %s", value);
+      return FALSE;
+    }
+
+  /*
+   * The server must confirm a requested server window size, and must not
+   * ask for a client window size that zlib can't produce.
+   */
+  if ((peer_bits < 15 && params.server_max_window_bits < 0) ||
+      params.server_max_window_bits > (gint)peer_bits ||
+      params.client_max_window_bits == 0 ||
+      (params.client_max_window_bits > 0 && params.client_max_window_bits < 9))
+    {
+      g_message ("received unacceptable permessage-deflate parameters: %s", value);
+      return FALSE;
+    }
+
+  if (params.server_max_window_bits > 0)
+    peer_bits = MAX (params.server_max_window_bits, 9);
+  if (params.client_max_window_bits > 0)
+    own_bits = MIN (own_bits, (guint)params.client_max_window_bits);
+
+  pv->deflate_no_context_takeover = params.client_no_context_takeover;
+  pv->inflate_no_context_takeover = params.server_no_context_takeover;
+  deflate_negotiated (self, g_strdup (value), own_bits, peer_bits);
+  return TRUE;
+}
+
+gchar *
+_web_socket_connection_deflate_respond (WebSocketConnection *self,
+                                        const gchar *value)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  DeflateParams params;
+  guint own_bits, peer_bits;
+  GString *response;
+  gchar **offers;
+  gint i;
+
+  if (!pv->deflate_enabled || !value)
+    return NULL;
+
+  offers = g_strsplit (value, ",", -1);
+
+  /* Accept the first offer in the client's order of preference that works */
+  for (i = 0; offers[i] != NULL; i++)
+    {
+      if (!parse_deflate_params (offers[i], &params))
+        continue;
+
+      /* zlib can't compress with a window of 8 bits */
+      own_bits = pv->deflate_window_bits;
+      if (params.server_max_window_bits > 0)
+        {
+          if (params.server_max_window_bits < 9)
+            continue;
+          own_bits = MIN (own_bits, (guint)params.server_max_window_bits);
+        }
+
+      /* But a larger window can always decompress */
+      peer_bits = 15;
+      if (params.client_max_window_bits > 0)
+        peer_bits = MAX (params.client_max_window_bits, 9);
+
+      if (!deflate_fit_memory_limit (self, &own_bits, &peer_bits, params.client_max_window_bits >= 0))
+        continue;
+
+      response = g_string_new ("permessage-deflate");
+      if (params.server_no_context_takeover)
+        g_string_append (response, "; server_no_context_takeover");
+      if (params.client_no_context_takeover)
+        g_string_append (response, "; client_no_context_takeover");
+      if (params.server_max_window_bits >= 0)
+        g_string_append_printf (response, "; server_max_window_bits=%u", own_bits);
+      if (params.client_max_window_bits >= 0 &&
+          peer_bits < (params.client_max_window_bits > 0 ? (guint)params.client_max_window_bits : 15))
+        g_string_append_printf (response, "; client_max_window_bits=%u", peer_bits);
+
+      pv->deflate_no_context_takeover = params.server_no_context_takeover;
+      pv->inflate_no_context_takeover = params.client_no_context_takeover;
+      deflate_negotiated (self, g_strdup (response->str), own_bits, peer_bits);
+
+      g_strfreev (offers);
+      return g_string_free (response, FALSE);
+    }
+
+  g_strfreev (offers);
+  g_debug ("declined Sec-WebSocket-Extensions: %s", value);
+  return NULL;
+}
+
+gsize
+_web_socket_connection_get_output_copied (WebSocketConnection *self)
+{
+  g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), 0);
+  return GET_PRIV(self)->output_copied;
+}
+
 GMainContext *
 _web_socket_connection_get_main_context (WebSocketConnection *self)
 {
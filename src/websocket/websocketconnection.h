@@ -26,6 +26,12 @@
 G_BEGIN_DECLS
 
 #define WEB_SOCKET_TYPE_CONNECTION (web_socket_connection_get_type ())
+
+typedef struct {
+  WebSocketDataType type;
+  GBytes *payload;
+} WebSocketMessage;
+
 G_DECLARE_DERIVABLE_TYPE(WebSocketConnection, web_socket_connection, WEB_SOCKET, CONNECTION, GObject)
 
 struct _WebSocketConnectionClass
@@ -46,6 +52,18 @@ struct _WebSocketConnectionClass
                              WebSocketDataType type,
                              GBytes *message);
 
+  void      (* message_begin)    (WebSocketConnection *self,
+                                  WebSocketDataType type);
+
+  void      (* message_fragment) (WebSocketConnection *self,
+                                  GBytes *fragment);
+
+  void      (* message_end)      (WebSocketConnection *self);
+
+  void      (* messages)    (WebSocketConnection *self,
+                             const WebSocketMessage *messages,
+                             guint n_messages);
+
   gboolean  (* error)       (WebSocketConnection *self,
                              GError *error);
 
@@ -60,10 +78,16 @@ const gchar *   web_socket_connection_get_url             (WebSocketConnection *
 
 const gchar *   web_socket_connection_get_protocol        (WebSocketConnection *self);
 
+const gchar *   web_socket_connection_get_extensions      (WebSocketConnection *self);
+
 WebSocketState  web_socket_connection_get_ready_state     (WebSocketConnection *self);
 
 gsize           web_socket_connection_get_buffered_amount (WebSocketConnection *self);
 
+guint           web_socket_connection_get_pressure_count  (WebSocketConnection *self);
+
+GTimeSpan       web_socket_connection_get_pressure_time   (WebSocketConnection *self);
+
 gushort         web_socket_connection_get_close_code      (WebSocketConnection *self);
 
 const gchar *   web_socket_connection_get_close_data      (WebSocketConnection *self);
@@ -75,6 +99,16 @@ void            web_socket_connection_send                (WebSocketConnection *
                                                            GBytes *prefix,
                                                            GBytes *payload);
 
+void            web_socket_connection_send_full           (WebSocketConnection *self,
+                                                           WebSocketDataType type,
+                                                           GBytes *prefix,
+                                                           GBytes *payload,
+                                                           const gchar *flow);
+
+void            web_socket_connection_set_flow_weight     (WebSocketConnection *self,
+                                                           const gchar *flow,
+                                                           guint weight);
+
 void            web_socket_connection_close               (WebSocketConnection *self,
                                                            gushort code,
                                                            const gchar *data);
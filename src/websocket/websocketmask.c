@@ -0,0 +1,341 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "websocket.h"
+#include "websocketprivate.h"
+
+#include <string.h>
+
+/*
+ * Unmasking and UTF-8 validation of frame payloads.
+ *
+ * Both look at every byte of every frame received from a client, so they
+ * work on as many bytes at once as the CPU allows. While unmasking we also
+ * note where the first non-ASCII byte is: most text is pure ASCII, and then
+ * the UTF-8 validation has nothing left to do.
+ *
+ * The implementation is chosen at runtime. On x86 that is AVX2 if the CPU
+ * has it, or else SSE2, which every x86_64 CPU has. Elsewhere eight bytes
+ * are handled at a time in a 64-bit word.
+ */
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define WITH_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef struct {
+  const gchar *name;
+  gsize (* unmask) (const guint8 *mask, guint8 *data, gsize len);
+  gsize (* ascii) (const guint8 *data, gsize len);
+} MaskImplementation;
+
+static gsize
+first_non_ascii (const guint8 *data,
+                 gsize len)
+{
+  gsize n;
+
+  for (n = 0; n < len; n++)
+    {
+      if (data[n] & 0x80)
+        break;
+    }
+
+  return n;
+}
+
+static gsize
+unmask_bytes (const guint8 *mask,
+              guint8 *data,
+              gsize len)
+{
+  gsize ascii = len;
+  gsize n;
+
+  for (n = 0; n < len; n++)
+    {
+      data[n] ^= mask[n & 3];
+      if (ascii == len && (data[n] & 0x80))
+        ascii = n;
+    }
+
+  return ascii;
+}
+
+static gsize
+unmask_words (const guint8 *mask,
+              guint8 *data,
+              gsize len)
+{
+  const guint64 high = G_GUINT64_CONSTANT (0x8080808080808080);
+  guint8 mask8[8];
+  guint64 mask64;
+  gsize ascii = len;
+  guint64 word;
+  gsize n;
+
+  memcpy (mask8, mask, 4);
+  memcpy (mask8 + 4, mask, 4);
+  memcpy (&mask64, mask8, 8);
+
+  for (n = 0; n + 8 <= len; n += 8)
+    {
+      memcpy (&word, data + n, 8);
+      word ^= mask64;
+      memcpy (data + n, &word, 8);
+      if (ascii == len && (word & high))
+        ascii = n + first_non_ascii (data + n, 8);
+    }
+
+  /* The tail starts at a multiple of four, so the mask lines up again */
+  if (ascii == len)
+    return n + unmask_bytes (mask, data + n, len - n);
+
+  unmask_bytes (mask, data + n, len - n);
+  return ascii;
+}
+
+static gsize
+ascii_words (const guint8 *data,
+             gsize len)
+{
+  const guint64 high = G_GUINT64_CONSTANT (0x8080808080808080);
+  guint64 word;
+  gsize n;
+
+  for (n = 0; n + 8 <= len; n += 8)
+    {
+      memcpy (&word, data + n, 8);
+      if (word & high)
+        break;
+    }
+
+  return n + first_non_ascii (data + n, len - n);
+}
+
+#ifdef WITH_X86_SIMD
+
+static gsize
+unmask_sse2 (const guint8 *mask,
+             guint8 *data,
+             gsize len)
+{
+  guint32 mask32;
+  __m128i mask128;
+  __m128i block;
+  gsize ascii = len;
+  gint high;
+  gsize n;
+
+  memcpy (&mask32, mask, 4);
+  mask128 = _mm_set1_epi32 (mask32);
+
+  for (n = 0; n + 16 <= len; n += 16)
+    {
+      block = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *)(data + n)), mask128);
+      _mm_storeu_si128 ((__m128i *)(data + n), block);
+      if (ascii == len)
+        {
+          high = _mm_movemask_epi8 (block);
+          if (high)
+            ascii = n + __builtin_ctz (high);
+        }
+    }
+
+  if (ascii == len)
+    return n + unmask_words (mask, data + n, len - n);
+
+  unmask_words (mask, data + n, len - n);
+  return ascii;
+}
+
+static gsize
+ascii_sse2 (const guint8 *data,
+            gsize len)
+{
+  gint high;
+  gsize n;
+
+  for (n = 0; n + 16 <= len; n += 16)
+    {
+      high = _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *)(data + n)));
+      if (high)
+        return n + __builtin_ctz (high);
+    }
+
+  return n + ascii_words (data + n, len - n);
+}
+
+__attribute__((target("avx2")))
+static gsize
+unmask_avx2 (const guint8 *mask,
+             guint8 *data,
+             gsize len)
+{
+  guint32 mask32;
+  __m256i mask256;
+  __m256i block;
+  gsize ascii = len;
+  gint high;
+  gsize n;
+
+  memcpy (&mask32, mask, 4);
+  mask256 = _mm256_set1_epi32 (mask32);
+
+  for (n = 0; n + 32 <= len; n += 32)
+    {
+      block = _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i *)(data + n)), mask256);
+      _mm256_storeu_si256 ((__m256i *)(data + n), block);
+      if (ascii == len)
+        {
+          high = _mm256_movemask_epi8 (block);
+          if (high)
+            ascii = n + __builtin_ctz (high);
+        }
+    }
+
+  if (ascii == len)
+    return n + unmask_sse2 (mask, data + n, len - n);
+
+  unmask_sse2 (mask, data + n, len - n);
+  return ascii;
+}
+
+__attribute__((target("avx2")))
+static gsize
+ascii_avx2 (const guint8 *data,
+            gsize len)
+{
+  gint high;
+  gsize n;
+
+  for (n = 0; n + 32 <= len; n += 32)
+    {
+      high = _mm256_movemask_epi8 (_mm256_loadu_si256 ((const __m256i *)(data + n)));
+      if (high)
+        return n + __builtin_ctz (high);
+    }
+
+  return n + ascii_sse2 (data + n, len - n);
+}
+
+#endif /* WITH_X86_SIMD */
+
+static const MaskImplementation implementations[] = {
+#ifdef WITH_X86_SIMD
+  { "avx2", unmask_avx2, ascii_avx2 },
+  { "sse2", unmask_sse2, ascii_sse2 },
+#endif
+  { "words", unmask_words, ascii_words },
+};
+
+static const MaskImplementation *implementation;
+
+static gboolean
+implementation_supported (const MaskImplementation *impl)
+{
+#ifdef WITH_X86_SIMD
+  __builtin_cpu_init ();
+  if (g_str_equal (impl->name, "avx2"))
+    return __builtin_cpu_supports ("avx2");
+#endif
+  return TRUE;
+}
+
+static const MaskImplementation *
+get_implementation (void)
+{
+  static gsize chosen = 0;
+  guint i;
+
+  if (g_once_init_enter (&chosen))
+    {
+      /* The best one comes first */
+      for (i = 0; i < G_N_ELEMENTS (implementations); i++)
+        {
+          if (implementation_supported (implementations + i))
+            break;
+        }
+      g_assert (i < G_N_ELEMENTS (implementations));
+      implementation = implementations + i;
+      g_debug ("using %s for unmasking", implementation->name);
+      g_once_init_leave (&chosen, 1);
+    }
+
+  return implementation;
+}
+
+/*
+ * Unmask @data in place with the four byte @mask, starting at the first
+ * byte of the mask. Returns the number of leading bytes of the result
+ * that are ASCII, which is @len if all of them are.
+ */
+gsize
+_web_socket_unmask_rfc6455 (const guint8 *mask,
+                            guint8 *data,
+                            gsize len)
+{
+  return get_implementation ()->unmask (mask, data, len);
+}
+
+/*
+ * Check that @data is valid UTF-8. The first @ascii bytes are already
+ * known to be ASCII, for example from _web_socket_unmask_rfc6455().
+ */
+gboolean
+_web_socket_validate_utf8 (const guint8 *data,
+                           gsize len,
+                           gsize ascii)
+{
+  g_assert (ascii <= len);
+
+  ascii += get_implementation ()->ascii (data + ascii, len - ascii);
+  if (ascii == len)
+    return TRUE;
+
+  return g_utf8_validate ((const gchar *)data + ascii, len - ascii, NULL);
+}
+
+/*
+ * Select the implementation named @name, for tests and benchmarks.
+ * Returns FALSE if it isn't available on this CPU.
+ */
+gboolean
+_web_socket_mask_set_implementation (const gchar *name)
+{
+  guint i;
+
+  get_implementation ();
+
+  for (i = 0; i < G_N_ELEMENTS (implementations); i++)
+    {
+      if (g_str_equal (implementations[i].name, name))
+        {
+          if (!implementation_supported (implementations + i))
+            return FALSE;
+          implementation = implementations + i;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
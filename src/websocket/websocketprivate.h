@@ -55,6 +55,8 @@ void             _web_socket_connection_queue             (WebSocketConnection *
 
 GMainContext *   _web_socket_connection_get_main_context  (WebSocketConnection *self);
 
+gsize            _web_socket_connection_get_output_copied (WebSocketConnection *self);
+
 gboolean         _web_socket_connection_error             (WebSocketConnection *self,
                                                            GError *error);
 
@@ -72,6 +74,24 @@ gboolean         _web_socket_connection_choose_protocol   (WebSocketConnection *
                                                            const gchar **protocols,
                                                            const gchar *value);
 
+gchar *          _web_socket_connection_deflate_offer     (WebSocketConnection *self);
+
+gboolean         _web_socket_connection_deflate_accept    (WebSocketConnection *self,
+                                                           const gchar *value);
+
+gchar *          _web_socket_connection_deflate_respond   (WebSocketConnection *self,
+                                                           const gchar *value);
+
+gsize            _web_socket_unmask_rfc6455               (const guint8 *mask,
+                                                           guint8 *data,
+                                                           gsize len);
+
+gboolean         _web_socket_validate_utf8                (const guint8 *data,
+                                                           gsize len,
+                                                           gsize ascii);
+
+gboolean         _web_socket_mask_set_implementation      (const gchar *name);
+
 gchar *          _web_socket_complete_accept_key_rfc6455  (const gchar *key);
 
 G_END_DECLS
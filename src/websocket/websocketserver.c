@@ -143,6 +143,7 @@ respond_handshake_rfc6455 (WebSocketServer *self,
                            GHashTable *headers)
 {
   const gchar *protocol;
+  gchar *extensions;
   const gchar *origin;
   const gchar *host;
   gchar *accept_key;
@@ -222,6 +223,11 @@ respond_handshake_rfc6455 (WebSocketServer *self,
   if (protocol)
     g_string_append_printf (handshake, "Sec-WebSocket-Protocol: %s\r\n", protocol);
 
+  extensions = _web_socket_connection_deflate_respond (conn, g_hash_table_lookup (headers, "Sec-WebSocket-Extensions"));
+  if (extensions)
+    g_string_append_printf (handshake, "Sec-WebSocket-Extensions: %s\r\n", extensions);
+  g_free (extensions);
+
   g_string_append (handshake, "\r\n");
 
   len = handshake->len;
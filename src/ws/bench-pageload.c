@@ -0,0 +1,293 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures loading the package files of a shell page.
+ *
+ * Each load is a new session, with a mock bridge behind it that knows the
+ * same package checksum. All the files of the page are requested through
+ * cockpit_channel_response_serve(), the way cockpit-ws serves them to a
+ * browser, and every time a channel is opened to the bridge to fetch one
+ * that counts as a round trip. The first load is cold, the ones after it
+ * can come out of the package cache.
+ *
+ * Each load is printed as one line of space separated key=value pairs,
+ * followed by the package cache counters. This is not run as part of the
+ * unit tests.
+ */
+
+#include "config.h"
+
+#include "ws/cockpitchannelresponse.h"
+#include "ws/cockpitpackagecache.h"
+#include "ws/cockpitwebservice.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpitwebresponse.h"
+#include "common/cockpitwebserver.h"
+#include "testlib/mock-transport.h"
+
+#include <string.h>
+
+#define CHECKSUM "0123456789abcdef"
+#define INIT_MESSAGE "{\"command\":\"init\",\"version\":1}"
+
+/* The bridge sends files in frames of this size */
+#define FRAME_SIZE (64 * 1024)
+
+static gint opt_loads = 5;
+static gint opt_cache_size = 16 * 1024;
+
+static GOptionEntry entries[] = {
+  { "loads", 0, 0, G_OPTION_ARG_INT, &opt_loads, "Number of page loads, each in a new session", "COUNT" },
+  { "cache-size", 0, 0, G_OPTION_ARG_INT, &opt_cache_size, "Size of the package cache in KiB, or 0 for none", "KIB" },
+  { NULL }
+};
+
+typedef struct {
+  const gchar *path;
+  const gchar *content_type;
+  gsize size;
+} PageFile;
+
+/* Roughly what a browser fetches for the shell and the overview page */
+static const PageFile page_files[] = {
+  { "/manifests.json", "application/json", 12 * 1024 },
+  { "/shell/index.js", "text/javascript", 900 * 1024 },
+  { "/shell/index.css", "text/css", 300 * 1024 },
+  { "/shell/po.js", "text/javascript", 40 * 1024 },
+  { "/base1/cockpit.js", "text/javascript", 150 * 1024 },
+  { "/base1/po.js", "text/javascript", 20 * 1024 },
+  { "/static/fonts/RedHatText-Regular.woff2", "font/woff2", 60 * 1024 },
+  { "/static/fonts/RedHatDisplay-Medium.woff2", "font/woff2", 60 * 1024 },
+  { "/system/index.html", "text/html", 2 * 1024 },
+  { "/system/index.js", "text/javascript", 700 * 1024 },
+  { "/system/index.css", "text/css", 200 * 1024 },
+  { "/system/po.js", "text/javascript", 30 * 1024 },
+};
+
+static const PageFile *
+find_page_file (const gchar *path)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (page_files); i++)
+    {
+      if (g_str_equal (page_files[i].path, path))
+        return page_files + i;
+    }
+
+  return NULL;
+}
+
+static void
+emit_control (CockpitTransport *transport,
+              const gchar *command,
+              const gchar *channel)
+{
+  GBytes *payload;
+
+  payload = cockpit_transport_build_control ("command", command, "channel", channel, NULL);
+  cockpit_transport_emit_recv (transport, NULL, payload);
+  g_bytes_unref (payload);
+}
+
+/* Does what cockpit-bridge does for a http-stream1 channel to "packages" */
+static void
+bridge_serve (CockpitTransport *transport,
+              const gchar *channel,
+              const gchar *path)
+{
+  const PageFile *file;
+  GBytes *payload;
+  gchar *meta;
+  gchar *data;
+  gsize offset;
+  gsize length;
+
+  file = find_page_file (path);
+  g_assert (file != NULL);
+
+  meta = g_strdup_printf ("{\"status\":200,\"reason\":\"OK\",\"headers\":"
+                          "{\"Content-Type\":\"%s\",\"X-Cockpit-Pkg-Checksum\":\"%s\"}}",
+                          file->content_type, CHECKSUM);
+  payload = g_bytes_new_take (meta, strlen (meta));
+  cockpit_transport_emit_recv (transport, channel, payload);
+  g_bytes_unref (payload);
+
+  for (offset = 0; offset < file->size; offset += length)
+    {
+      length = MIN (FRAME_SIZE, file->size - offset);
+      data = g_malloc (length);
+      memset (data, 'x', length);
+      payload = g_bytes_new_take (data, length);
+      cockpit_transport_emit_recv (transport, channel, payload);
+      g_bytes_unref (payload);
+    }
+
+  emit_control (transport, "done", channel);
+  emit_control (transport, "close", channel);
+}
+
+/* Answers the channels opened since last time, returns how many */
+static guint
+bridge_process (MockTransport *mock)
+{
+  const gchar *command;
+  const gchar *channel;
+  const gchar *path;
+  JsonObject *control;
+  guint opened = 0;
+
+  while ((control = mock_transport_pop_control (mock)) != NULL)
+    {
+      if (!cockpit_json_get_string (control, "command", NULL, &command) ||
+          g_strcmp0 (command, "open") != 0)
+        continue;
+
+      if (!cockpit_json_get_string (control, "channel", NULL, &channel) ||
+          !cockpit_json_get_string (control, "path", NULL, &path))
+        g_assert_not_reached ();
+
+      bridge_serve (COCKPIT_TRANSPORT (mock), channel, path);
+      opened++;
+    }
+
+  return opened;
+}
+
+static CockpitWebResponse *
+request_file (CockpitWebService *service,
+              const gchar *path)
+{
+  CockpitWebResponse *response;
+  GInputStream *input;
+  GOutputStream *output;
+  GIOStream *io;
+  GHashTable *headers;
+
+  headers = cockpit_web_server_new_table ();
+  g_hash_table_insert (headers, g_strdup ("Accept-Encoding"), g_strdup ("gzip, deflate, br"));
+  g_hash_table_insert (headers, g_strdup ("Cookie"), g_strdup ("CockpitLang=de-de"));
+
+  input = g_memory_input_stream_new ();
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = g_simple_io_stream_new (input, output);
+
+  response = cockpit_web_response_new (io, path, path, headers, "GET", "https");
+  cockpit_channel_response_serve (service, headers, response, "$" CHECKSUM, path);
+
+  g_object_unref (io);
+  g_object_unref (input);
+  g_object_unref (output);
+  g_hash_table_unref (headers);
+
+  return response;
+}
+
+static gboolean
+all_complete (CockpitWebResponse **responses)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (page_files); i++)
+    {
+      if (cockpit_web_response_get_state (responses[i]) != COCKPIT_WEB_RESPONSE_COMPLETE)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+load_page (guint load)
+{
+  CockpitWebResponse *responses[G_N_ELEMENTS (page_files)];
+  CockpitWebService *service;
+  CockpitCreds *creds;
+  MockTransport *mock;
+  GBytes *payload;
+  guint round_trips = 0;
+  gint64 start;
+  gdouble ms;
+  guint i;
+
+  mock = mock_transport_new ();
+  creds = cockpit_creds_new ("cockpit", COCKPIT_CRED_CSRF_TOKEN, "token", NULL);
+  service = cockpit_web_service_new (creds, COCKPIT_TRANSPORT (mock));
+  cockpit_web_service_set_host_checksum (service, "localhost", CHECKSUM);
+
+  payload = g_bytes_new_static (INIT_MESSAGE, strlen (INIT_MESSAGE));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (mock), NULL, payload);
+  g_bytes_unref (payload);
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < G_N_ELEMENTS (page_files); i++)
+    responses[i] = request_file (service, page_files[i].path);
+
+  while (!all_complete (responses))
+    {
+      g_main_context_iteration (NULL, FALSE);
+      round_trips += bridge_process (mock);
+    }
+
+  ms = (g_get_monotonic_time () - start) / 1000.0;
+  g_print ("load=%u files=%u bridge_round_trips=%u ms=%.2f\n",
+           load, (guint)G_N_ELEMENTS (page_files), round_trips, ms);
+
+  for (i = 0; i < G_N_ELEMENTS (page_files); i++)
+    g_object_unref (responses[i]);
+  g_object_unref (service);
+  cockpit_creds_unref (creds);
+  g_object_unref (mock);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  CockpitPackageCacheStats stats;
+  GOptionContext *context;
+  GError *error = NULL;
+  gint i;
+
+  context = g_option_context_new ("- measure loading a page of package files");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-pageload: %s\n", error->message);
+      return 2;
+    }
+  g_option_context_free (context);
+
+  cockpit_package_cache_set_default (cockpit_package_cache_new ((gsize)MAX (opt_cache_size, 0) * 1024));
+
+  for (i = 0; i < opt_loads; i++)
+    load_page (i);
+
+  cockpit_package_cache_get_stats (cockpit_package_cache_get_default (), &stats);
+  g_print ("cache_kb=%d hits=%" G_GUINT64_FORMAT " misses=%" G_GUINT64_FORMAT
+           " evictions=%" G_GUINT64_FORMAT " entries=%u size_kb=%" G_GSIZE_FORMAT "\n",
+           opt_cache_size, stats.hits, stats.misses, stats.evictions,
+           stats.entries, stats.size / 1024);
+
+  cockpit_package_cache_set_default (NULL);
+  return 0;
+}
@@ -217,7 +217,8 @@ cockpit_branding_serve (CockpitWebService *service,
                         const gchar *full_path,
                         const gchar *static_path,
                         GHashTable *local_os_release,
-                        const gchar **local_roots)
+                        const gchar **local_roots,
+                        const gchar *accept_encoding)
 {
   gboolean is_host = FALSE;
   gchar *application = cockpit_auth_parse_application (full_path, &is_host);
@@ -244,7 +245,7 @@ cockpit_branding_serve (CockpitWebService *service,
     }
   else
     {
-      cockpit_web_response_file (response, static_path, local_roots);
+      cockpit_web_response_file_or_compressed (response, accept_encoding, static_path, local_roots);
     }
 
 out:
@@ -34,7 +34,8 @@ void            cockpit_branding_serve                      (CockpitWebService *
                                                              const gchar *full_path,
                                                              const gchar *static_path,
                                                              GHashTable *local_os_release,
-                                                             const gchar **local_roots);
+                                                             const gchar **local_roots,
+                                                             const gchar *accept_encoding);
 
 G_END_DECLS
 
@@ -20,6 +20,7 @@
 #include "config.h"
 
 #include "cockpitchannelresponse.h"
+#include "cockpitpackagecache.h"
 
 #include "common/cockpitchannel.h"
 #include "common/cockpitconf.h"
@@ -149,6 +150,11 @@ typedef struct {
 
   /* Set when injecting data into response */
   CockpitChannelInject *inject;
+
+  /* Set when the response goes into the package cache */
+  gchar *cache_key;
+  GByteArray *cache_body;
+  guint status;
 } CockpitChannelResponse;
 
 typedef struct {
@@ -173,6 +179,9 @@ cockpit_channel_response_finalize (GObject *object)
   g_object_unref (self->response);
   g_hash_table_unref (self->headers);
   cockpit_channel_inject_free (self->inject);
+  g_free (self->cache_key);
+  if (self->cache_body)
+    g_byte_array_unref (self->cache_body);
 
   G_OBJECT_CLASS (cockpit_channel_response_parent_class)->finalize (object);
 }
@@ -193,6 +202,7 @@ ensure_headers (CockpitChannelResponse *self,
                                           cockpit_channel_get_transport (COCKPIT_CHANNEL (self)));
         }
       cockpit_web_response_headers_full (self->response, status, reason, length, self->headers);
+      self->status = status;
       return TRUE;
     }
 
@@ -387,6 +397,62 @@ cockpit_channel_response_recv (CockpitChannel *channel,
 
   ensure_headers (self, 200, "OK", -1);
   cockpit_web_response_queue (self->response, payload);
+
+  if (self->cache_body)
+    {
+      if (self->cache_body->len + g_bytes_get_size (payload) >
+          cockpit_package_cache_get_max_entry (cockpit_package_cache_get_default ()))
+        {
+          /* Too large to keep */
+          g_clear_pointer (&self->cache_body, g_byte_array_unref);
+        }
+      else
+        {
+          g_byte_array_append (self->cache_body, g_bytes_get_data (payload, NULL),
+                               g_bytes_get_size (payload));
+        }
+    }
+}
+
+static gboolean
+is_response_shareable (GHashTable *headers)
+{
+  const gchar *cache_control;
+
+  /* The bridge said this is only for this one response, or this one user */
+  cache_control = g_hash_table_lookup (headers, "Cache-Control");
+  if (cache_control &&
+      (strstr (cache_control, "no-store") ||
+       strstr (cache_control, "no-cache") ||
+       strstr (cache_control, "private")))
+    return FALSE;
+
+  if (g_hash_table_contains (headers, "Set-Cookie"))
+    return FALSE;
+
+  return TRUE;
+}
+
+static void
+cache_response (CockpitChannelResponse *self)
+{
+  GBytes *body;
+
+  if (!self->cache_key || !self->cache_body || self->status != 200)
+    return;
+
+  if (!is_response_shareable (self->headers))
+    {
+      g_debug ("%s: not keeping response in the package cache", self->logname);
+      return;
+    }
+
+  body = g_byte_array_free_to_bytes (self->cache_body);
+  self->cache_body = NULL;
+
+  cockpit_package_cache_insert (cockpit_package_cache_get_default (),
+                                self->cache_key, self->headers, body);
+  g_bytes_unref (body);
 }
 
 static gboolean
@@ -429,6 +495,7 @@ cockpit_channel_response_control (CockpitChannel *channel,
     {
       ensure_headers (self, 200, "OK", 0);
       cockpit_web_response_complete (self->response);
+      cache_response (self);
       return TRUE;
     }
 
@@ -576,6 +643,52 @@ parse_host_and_etag (CockpitWebService *service,
   return TRUE;
 }
 
+/*
+ * The checksum only covers the files in the package. The bridge also
+ * looks at the request headers we pass it: it builds the
+ * Content-Security-Policy from the host and protocol the browser used,
+ * translates the manifests, and may compress. So all of those go in the
+ * key, whatever the ETag already has. Header values can't contain a
+ * line break, so that separates them.
+ */
+static gchar *
+build_cache_key (GHashTable *headers,
+                 const gchar *etag,
+                 const gchar *host,
+                 const gchar *protocol,
+                 const gchar *path)
+{
+  const gchar *http_host;
+  const gchar *language;
+  const gchar *encoding;
+
+  http_host = g_hash_table_lookup (headers, "Host");
+  language = g_hash_table_lookup (headers, "Accept-Language");
+  encoding = g_hash_table_lookup (headers, "Accept-Encoding");
+
+  return g_strdup_printf ("%s\n%s\n%s\n%s://%s\n%s\n%s", etag, path, host,
+                          protocol, http_host ? http_host : "localhost",
+                          language ? language : "", encoding ? encoding : "");
+}
+
+static void
+serve_from_cache (CockpitWebService *service,
+                  CockpitWebResponse *response,
+                  const gchar *host,
+                  GHashTable *headers,
+                  GBytes *body)
+{
+  CockpitChannelInject *inject;
+
+  inject = cockpit_channel_inject_new (service, NULL, host);
+  cockpit_channel_inject_perform (inject, response, NULL);
+  cockpit_channel_inject_free (inject);
+
+  cockpit_web_response_headers_full (response, 200, "OK", g_bytes_get_size (body), headers);
+  cockpit_web_response_queue (response, body);
+  cockpit_web_response_complete (response);
+}
+
 void
 cockpit_channel_response_serve (CockpitWebService *service,
                                 GHashTable *in_headers,
@@ -588,8 +701,12 @@ cockpit_channel_response_serve (CockpitWebService *service,
   CockpitCacheType cache_type = COCKPIT_WEB_RESPONSE_CACHE;
   const gchar *injecting_base_path = NULL;
   const gchar *host = NULL;
-  const gchar *pragma;
+  const gchar *pragma = NULL;
   gchar *quoted_etag = NULL;
+  CockpitPackageCache *cache;
+  gchar *cache_key = NULL;
+  GHashTable *cached_headers;
+  GBytes *cached_body;
   GHashTable *out_headers = NULL;
   gchar *val = NULL;
   gboolean handled = FALSE;
@@ -639,6 +756,27 @@ cockpit_channel_response_serve (CockpitWebService *service,
     }
 
   cockpit_web_response_set_cache_type (response, cache_type);
+
+  /* A file with a checksum never changes, another session may have fetched it already */
+  if (quoted_etag)
+    {
+      cache = cockpit_package_cache_get_default ();
+      if (cockpit_package_cache_get_max_entry (cache) > 0)
+        {
+          cache_key = build_cache_key (in_headers, quoted_etag, host,
+                                       cockpit_web_response_get_protocol (response), path);
+          if ((!pragma || !strstr (pragma, "no-cache")) &&
+              cockpit_package_cache_lookup (cache, cache_key, &cached_headers, &cached_body))
+            {
+              serve_from_cache (service, response, host, cached_headers, cached_body);
+              g_hash_table_unref (cached_headers);
+              g_bytes_unref (cached_body);
+              handled = TRUE;
+              goto out;
+            }
+        }
+    }
+
   object = cockpit_transport_build_json ("command", "open",
                                          "payload", "http-stream1",
                                          "internal", "packages",
@@ -687,6 +825,7 @@ cockpit_channel_response_serve (CockpitWebService *service,
           g_ascii_strcasecmp (key, "Content-MD5") == 0 ||
           g_ascii_strcasecmp (key, "Content-Range") == 0 ||
           g_ascii_strcasecmp (key, "Range") == 0 ||
+          g_ascii_strcasecmp (key, "If-Range") == 0 ||
           g_ascii_strcasecmp (key, "TE") == 0 ||
           g_ascii_strcasecmp (key, "Trailer") == 0 ||
           g_ascii_strcasecmp (key, "Upgrade") == 0 ||
@@ -725,6 +864,11 @@ cockpit_channel_response_serve (CockpitWebService *service,
                                        out_headers, object);
 
   self->inject = cockpit_channel_inject_new (service, injecting_base_path, host);
+  if (cache_key)
+    {
+      self->cache_key = g_steal_pointer (&cache_key);
+      self->cache_body = g_byte_array_new ();
+    }
   handled = TRUE;
 
   /* Unref when the channel closes */
@@ -734,6 +878,7 @@ out:
   if (object)
     json_object_unref (object);
   g_free (quoted_etag);
+  g_free (cache_key);
   if (out_headers)
     g_hash_table_unref (out_headers);
   g_free (channel);
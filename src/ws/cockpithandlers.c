@@ -693,7 +693,8 @@ cockpit_handler_default (CockpitWebServer *server,
       else if (g_str_has_prefix (remainder, "/static/"))
         {
           cockpit_branding_serve (service, response, path, remainder + 8,
-                                  data->os_release, data->branding_roots);
+                                  data->os_release, data->branding_roots,
+                                  g_hash_table_lookup (headers, "Accept-Encoding"));
           return TRUE;
         }
     }
@@ -728,7 +729,8 @@ cockpit_handler_root (CockpitWebServer *server,
                       CockpitHandlerData *ws)
 {
   /* Don't cache forever */
-  cockpit_web_response_file (response, path, ws->branding_roots);
+  cockpit_web_response_file_or_compressed (response, g_hash_table_lookup (headers, "Accept-Encoding"),
+                                           path, ws->branding_roots);
   return TRUE;
 }
 
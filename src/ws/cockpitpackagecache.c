@@ -0,0 +1,299 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitpackagecache.h"
+
+#include "common/cockpitconf.h"
+#include "common/cockpitwebserver.h"
+
+#include <string.h>
+
+/*
+ * Package files that are requested by checksum never change, so once
+ * one has come from a bridge, cockpit-ws can keep it and serve it to
+ * any session that asks for the same checksum again.
+ *
+ * The cache is shared by all sessions in the process, and throws out the
+ * least recently used files when it gets bigger than its maximum size.
+ */
+
+/* Rough cost of an entry on top of its contents */
+#define ENTRY_OVERHEAD 256
+
+typedef struct {
+  gchar *key;
+  GHashTable *headers;
+  GBytes *body;
+  gsize size;
+  GList link;
+} CacheEntry;
+
+struct _CockpitPackageCache {
+  GHashTable *entries;
+  GQueue lru;
+  gsize max_size;
+  CockpitPackageCacheStats stats;
+};
+
+static CockpitPackageCache *default_cache;
+
+static GHashTable *
+copy_headers (GHashTable *headers)
+{
+  GHashTable *copy;
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+
+  copy = cockpit_web_server_new_table ();
+  g_hash_table_iter_init (&iter, headers);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_hash_table_insert (copy, g_strdup (key), g_strdup (value));
+
+  return copy;
+}
+
+static gsize
+measure_headers (GHashTable *headers)
+{
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+  gsize size = 0;
+
+  g_hash_table_iter_init (&iter, headers);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    size += strlen (key) + strlen (value) + 2;
+
+  return size;
+}
+
+static void
+cache_entry_free (gpointer data)
+{
+  CacheEntry *entry = data;
+
+  g_free (entry->key);
+  g_hash_table_unref (entry->headers);
+  g_bytes_unref (entry->body);
+  g_free (entry);
+}
+
+static void
+cache_remove (CockpitPackageCache *self,
+              CacheEntry *entry)
+{
+  g_queue_unlink (&self->lru, &entry->link);
+  self->stats.size -= entry->size;
+  self->stats.entries--;
+
+  /* Frees the entry */
+  g_hash_table_remove (self->entries, entry->key);
+}
+
+/**
+ * cockpit_package_cache_new:
+ * @max_size: the most bytes to keep
+ *
+ * Makes a cache. If @max_size is zero, the cache never keeps anything.
+ *
+ * Returns: (transfer full): the cache, free with cockpit_package_cache_free()
+ */
+CockpitPackageCache *
+cockpit_package_cache_new (gsize max_size)
+{
+  CockpitPackageCache *self;
+
+  self = g_new0 (CockpitPackageCache, 1);
+  self->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cache_entry_free);
+  g_queue_init (&self->lru);
+  self->max_size = max_size;
+
+  return self;
+}
+
+void
+cockpit_package_cache_free (CockpitPackageCache *self)
+{
+  if (!self)
+    return;
+
+  g_hash_table_destroy (self->entries);
+  g_free (self);
+}
+
+/**
+ * cockpit_package_cache_get_default:
+ *
+ * The cache shared by all the web services in this process. Its size is
+ * PackageCacheSize in cockpit.conf.
+ *
+ * Returns: (transfer none): the cache
+ */
+CockpitPackageCache *
+cockpit_package_cache_get_default (void)
+{
+  gsize max_size;
+
+  if (!default_cache)
+    {
+      /* Configured in KiB */
+      max_size = cockpit_conf_uint ("WebService", "PackageCacheSize", 16 * 1024, 1024 * 1024, 0);
+      default_cache = cockpit_package_cache_new (max_size * 1024);
+    }
+
+  return default_cache;
+}
+
+/**
+ * cockpit_package_cache_set_default:
+ * @cache: (transfer full): the new cache
+ *
+ * Replaces the default cache, for tests and benchmarks.
+ */
+void
+cockpit_package_cache_set_default (CockpitPackageCache *cache)
+{
+  cockpit_package_cache_free (default_cache);
+  default_cache = cache;
+}
+
+/**
+ * cockpit_package_cache_get_max_entry:
+ * @self: the cache
+ *
+ * A single file may only take up a quarter of the cache, so that one
+ * large file doesn't throw out everything else.
+ *
+ * Returns: the largest body that will be kept
+ */
+gsize
+cockpit_package_cache_get_max_entry (CockpitPackageCache *self)
+{
+  return self->max_size / 4;
+}
+
+/**
+ * cockpit_package_cache_lookup:
+ * @self: the cache
+ * @key: identifies the file
+ * @headers: (out) (transfer full): the response headers
+ * @body: (out) (transfer full): the response body
+ *
+ * Looks up a file, and counts a hit or a miss.
+ *
+ * Returns: TRUE if the file was in the cache
+ */
+gboolean
+cockpit_package_cache_lookup (CockpitPackageCache *self,
+                              const gchar *key,
+                              GHashTable **headers,
+                              GBytes **body)
+{
+  CacheEntry *entry;
+
+  g_return_val_if_fail (key != NULL, FALSE);
+
+  entry = g_hash_table_lookup (self->entries, key);
+  if (!entry)
+    {
+      self->stats.misses++;
+      return FALSE;
+    }
+
+  self->stats.hits++;
+
+  g_queue_unlink (&self->lru, &entry->link);
+  g_queue_push_head_link (&self->lru, &entry->link);
+
+  *headers = copy_headers (entry->headers);
+  *body = g_bytes_ref (entry->body);
+  return TRUE;
+}
+
+/**
+ * cockpit_package_cache_insert:
+ * @self: the cache
+ * @key: identifies the file
+ * @headers: the response headers
+ * @body: the response body
+ *
+ * Keeps a file, if it isn't too large, throwing out the least
+ * recently used files to make room for it.
+ */
+void
+cockpit_package_cache_insert (CockpitPackageCache *self,
+                              const gchar *key,
+                              GHashTable *headers,
+                              GBytes *body)
+{
+  CacheEntry *entry;
+  gsize size;
+
+  g_return_if_fail (key != NULL);
+  g_return_if_fail (headers != NULL);
+  g_return_if_fail (body != NULL);
+
+  if (g_bytes_get_size (body) > cockpit_package_cache_get_max_entry (self))
+    return;
+
+  size = ENTRY_OVERHEAD + strlen (key) + measure_headers (headers) + g_bytes_get_size (body);
+  if (size > self->max_size)
+    return;
+
+  entry = g_hash_table_lookup (self->entries, key);
+  if (entry)
+    cache_remove (self, entry);
+
+  while (self->stats.size + size > self->max_size)
+    {
+      entry = self->lru.tail->data;
+      g_debug ("evicting %s from package cache", entry->key);
+      cache_remove (self, entry);
+      self->stats.evictions++;
+    }
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->key = g_strdup (key);
+  entry->headers = copy_headers (headers);
+  entry->body = g_bytes_ref (body);
+  entry->size = size;
+  entry->link.data = entry;
+
+  g_hash_table_insert (self->entries, entry->key, entry);
+  g_queue_push_head_link (&self->lru, &entry->link);
+  self->stats.size += size;
+  self->stats.entries++;
+}
+
+/**
+ * cockpit_package_cache_get_stats:
+ * @self: the cache
+ * @stats: (out): filled in with the counters
+ *
+ * Reads the hit, miss and eviction counters, and how full the cache is.
+ */
+void
+cockpit_package_cache_get_stats (CockpitPackageCache *self,
+                                 CockpitPackageCacheStats *stats)
+{
+  *stats = self->stats;
+}
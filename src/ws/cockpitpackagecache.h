@@ -0,0 +1,62 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_PACKAGE_CACHE_H__
+#define __COCKPIT_PACKAGE_CACHE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _CockpitPackageCache CockpitPackageCache;
+
+typedef struct {
+  guint64 hits;
+  guint64 misses;
+  guint64 evictions;
+  gsize size;
+  guint entries;
+} CockpitPackageCacheStats;
+
+CockpitPackageCache *  cockpit_package_cache_new           (gsize max_size);
+
+void                   cockpit_package_cache_free          (CockpitPackageCache *self);
+
+CockpitPackageCache *  cockpit_package_cache_get_default   (void);
+
+void                   cockpit_package_cache_set_default   (CockpitPackageCache *cache);
+
+gsize                  cockpit_package_cache_get_max_entry (CockpitPackageCache *self);
+
+gboolean               cockpit_package_cache_lookup        (CockpitPackageCache *self,
+                                                            const gchar *key,
+                                                            GHashTable **headers,
+                                                            GBytes **body);
+
+void                   cockpit_package_cache_insert        (CockpitPackageCache *self,
+                                                            const gchar *key,
+                                                            GHashTable *headers,
+                                                            GBytes *body);
+
+void                   cockpit_package_cache_get_stats     (CockpitPackageCache *self,
+                                                            CockpitPackageCacheStats *stats);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_PACKAGE_CACHE_H__ */
@@ -0,0 +1,692 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitsocketthread.h"
+
+#include "common/cockpitconf.h"
+
+/*
+ * WebSocket connections that do their framing on a worker thread.
+ *
+ * The WebSocketConnection is created in, and only ever touched from, a
+ * worker thread with its own GMainContext. So reading, unmasking, parsing
+ * and writing frames for a connection doesn't wait on whatever else the
+ * main loop is busy with, like serving a large static file or talking to
+ * PAM.
+ *
+ * Everything else happens in the main thread. The main thread posts
+ * commands (send, close, ...) to the worker, and the worker posts events
+ * (open, messages, ...) back. Each direction is a GAsyncQueue and an idle
+ * source in the receiving context to drain it, so the order of commands
+ * and events is kept.
+ *
+ * The number of worker threads is set in cockpit.conf, and is zero by
+ * default. They're started when first needed, and live as long as the
+ * process does.
+ */
+
+typedef struct {
+  GAsyncQueue *queue;
+  GMainContext *context;
+  gint scheduled;
+  void (* process) (gpointer item);
+} Mailbox;
+
+typedef struct {
+  GThread *thread;
+  GMainContext *context;
+  GMainLoop *loop;
+  Mailbox commands;
+  Mailbox events;
+} SocketThread;
+
+struct _CockpitThreadedSocket {
+  gint refs;
+  SocketThread *thread;
+
+  /* Owned by the worker thread, only an identifier in the main thread */
+  WebSocketConnection *connection;
+
+  /* Only used in the main thread */
+  WebSocketState state;
+  guint pressure_count;
+  GTimeSpan pressure_time;
+  const CockpitThreadedSocketCallbacks *callbacks;
+  gpointer user_data;
+  gboolean freed;
+};
+
+typedef enum {
+  COMMAND_CREATE,
+  COMMAND_SEND,
+  COMMAND_FLOW_WEIGHT,
+  COMMAND_CLOSE,
+  COMMAND_FREE,
+} CommandType;
+
+typedef struct {
+  CommandType type;
+  CockpitThreadedSocket *socket;
+
+  /* COMMAND_CREATE, which the caller waits for */
+  CockpitThreadedSocketCreate create;
+  gpointer data;
+  gboolean done;
+
+  WebSocketDataType data_type;
+  GBytes *prefix;
+  GBytes *payload;
+  gchar *string;
+  guint number;
+} Command;
+
+typedef enum {
+  EVENT_OPEN,
+  EVENT_MESSAGES,
+  EVENT_CLOSING,
+  EVENT_CLOSE,
+} EventType;
+
+typedef struct {
+  EventType type;
+  CockpitThreadedSocket *socket;
+  GArray *messages;
+
+  /* EVENT_CLOSE, read from the connection in the worker */
+  guint pressure_count;
+  GTimeSpan pressure_time;
+} Event;
+
+static SocketThread *threads;
+static guint n_threads;
+static guint next_thread;
+
+static GMutex create_lock;
+static GCond create_cond;
+
+static CockpitThreadedSocket *
+threaded_socket_ref (CockpitThreadedSocket *self)
+{
+  g_atomic_int_inc (&self->refs);
+  return self;
+}
+
+static void
+threaded_socket_unref (CockpitThreadedSocket *self)
+{
+  if (g_atomic_int_dec_and_test (&self->refs))
+    g_free (self);
+}
+
+static gboolean
+on_mailbox_ready (gpointer user_data)
+{
+  Mailbox *mailbox = user_data;
+  gpointer item;
+  gint length;
+
+  g_atomic_int_set (&mailbox->scheduled, 0);
+
+  /* Anything posted from here on schedules another round */
+  length = g_async_queue_length (mailbox->queue);
+  while (length-- > 0)
+    {
+      item = g_async_queue_try_pop (mailbox->queue);
+      if (!item)
+        break;
+      mailbox->process (item);
+    }
+
+  return FALSE;
+}
+
+static void
+mailbox_post (Mailbox *mailbox,
+              gpointer item)
+{
+  GSource *source;
+
+  g_async_queue_push (mailbox->queue, item);
+
+  if (g_atomic_int_compare_and_exchange (&mailbox->scheduled, 0, 1))
+    {
+      source = g_idle_source_new ();
+      g_source_set_priority (source, G_PRIORITY_DEFAULT);
+      g_source_set_callback (source, on_mailbox_ready, mailbox, NULL);
+      g_source_attach (source, mailbox->context);
+      g_source_unref (source);
+    }
+}
+
+static void
+mailbox_init (Mailbox *mailbox,
+              GMainContext *context,
+              void (* process) (gpointer))
+{
+  mailbox->queue = g_async_queue_new ();
+  mailbox->context = g_main_context_ref (context);
+  mailbox->scheduled = 0;
+  mailbox->process = process;
+}
+
+/* ----------------------------------------------------------------------------
+ * Main thread
+ */
+
+static void
+event_free (Event *event)
+{
+  WebSocketMessage *message;
+  guint i;
+
+  if (event->messages)
+    {
+      for (i = 0; i < event->messages->len; i++)
+        {
+          message = &g_array_index (event->messages, WebSocketMessage, i);
+          g_bytes_unref (message->payload);
+        }
+      g_array_free (event->messages, TRUE);
+    }
+
+  threaded_socket_unref (event->socket);
+  g_free (event);
+}
+
+static void
+process_event (gpointer item)
+{
+  Event *event = item;
+  CockpitThreadedSocket *self = event->socket;
+  const CockpitThreadedSocketCallbacks *callbacks = self->callbacks;
+
+  /* The caller is gone, and isn't interested any more */
+  if (self->freed)
+    {
+      event_free (event);
+      return;
+    }
+
+  switch (event->type)
+    {
+    case EVENT_OPEN:
+      self->state = MAX (self->state, WEB_SOCKET_STATE_OPEN);
+      if (callbacks->open)
+        callbacks->open (self->connection, self->user_data);
+      break;
+    case EVENT_MESSAGES:
+      if (callbacks->messages)
+        {
+          callbacks->messages (self->connection,
+                               (const WebSocketMessage *)event->messages->data,
+                               event->messages->len, self->user_data);
+        }
+      break;
+    case EVENT_CLOSING:
+      self->state = MAX (self->state, WEB_SOCKET_STATE_CLOSING);
+      if (callbacks->closing)
+        callbacks->closing (self->connection, self->user_data);
+      break;
+    case EVENT_CLOSE:
+      self->state = WEB_SOCKET_STATE_CLOSED;
+      self->pressure_count = event->pressure_count;
+      self->pressure_time = event->pressure_time;
+      if (callbacks->close)
+        callbacks->close (self->connection, self->user_data);
+      break;
+    }
+
+  event_free (event);
+}
+
+/* ----------------------------------------------------------------------------
+ * Worker threads
+ */
+
+static Event *
+event_new (CockpitThreadedSocket *self,
+           EventType type)
+{
+  Event *event;
+
+  event = g_new0 (Event, 1);
+  event->type = type;
+  event->socket = threaded_socket_ref (self);
+  return event;
+}
+
+static void
+post_event (CockpitThreadedSocket *self,
+            EventType type,
+            GArray *messages)
+{
+  Event *event;
+
+  event = event_new (self, type);
+  event->messages = messages;
+
+  mailbox_post (&self->thread->events, event);
+}
+
+static void
+on_worker_open (WebSocketConnection *connection,
+                gpointer user_data)
+{
+  post_event (user_data, EVENT_OPEN, NULL);
+}
+
+static void
+on_worker_messages (WebSocketConnection *connection,
+                    const WebSocketMessage *messages,
+                    guint n_messages,
+                    gpointer user_data)
+{
+  WebSocketMessage message;
+  GArray *array;
+  guint i;
+
+  array = g_array_sized_new (FALSE, FALSE, sizeof (WebSocketMessage), n_messages);
+  for (i = 0; i < n_messages; i++)
+    {
+      message.type = messages[i].type;
+      message.payload = g_bytes_ref (messages[i].payload);
+      g_array_append_val (array, message);
+    }
+
+  post_event (user_data, EVENT_MESSAGES, array);
+}
+
+static gboolean
+on_worker_closing (WebSocketConnection *connection,
+                   gpointer user_data)
+{
+  post_event (user_data, EVENT_CLOSING, NULL);
+  return TRUE;
+}
+
+static void
+on_worker_close (WebSocketConnection *connection,
+                 gpointer user_data)
+{
+  CockpitThreadedSocket *self = user_data;
+  Event *event;
+
+  event = event_new (self, EVENT_CLOSE);
+  event->pressure_count = web_socket_connection_get_pressure_count (connection);
+  event->pressure_time = web_socket_connection_get_pressure_time (connection);
+
+  mailbox_post (&self->thread->events, event);
+}
+
+static void
+create_connection (Command *command)
+{
+  CockpitThreadedSocket *self = command->socket;
+
+  self->connection = command->create (command->data);
+
+  g_object_set (self->connection, "batch-messages", TRUE, NULL);
+  g_signal_connect (self->connection, "open", G_CALLBACK (on_worker_open), self);
+  g_signal_connect (self->connection, "messages", G_CALLBACK (on_worker_messages), self);
+  g_signal_connect (self->connection, "closing", G_CALLBACK (on_worker_closing), self);
+  g_signal_connect (self->connection, "close", G_CALLBACK (on_worker_close), self);
+
+  /* Held by the connection until COMMAND_FREE */
+  threaded_socket_ref (self);
+
+  g_mutex_lock (&create_lock);
+  command->done = TRUE;
+  g_cond_broadcast (&create_cond);
+  g_mutex_unlock (&create_lock);
+}
+
+static void
+command_free (Command *command)
+{
+  if (command->prefix)
+    g_bytes_unref (command->prefix);
+  if (command->payload)
+    g_bytes_unref (command->payload);
+  g_free (command->string);
+  threaded_socket_unref (command->socket);
+  g_free (command);
+}
+
+static void
+process_command (gpointer item)
+{
+  Command *command = item;
+  CockpitThreadedSocket *self = command->socket;
+  WebSocketConnection *connection = self->connection;
+
+  switch (command->type)
+    {
+    case COMMAND_CREATE:
+      /* Belongs to the caller, who is waiting for it */
+      create_connection (command);
+      return;
+    case COMMAND_SEND:
+      /* The main thread may not have heard yet that this is closing */
+      if (web_socket_connection_get_ready_state (connection) == WEB_SOCKET_STATE_OPEN)
+        {
+          web_socket_connection_send_full (connection, command->data_type, command->prefix,
+                                           command->payload, command->string);
+        }
+      break;
+    case COMMAND_FLOW_WEIGHT:
+      web_socket_connection_set_flow_weight (connection, command->string, command->number);
+      break;
+    case COMMAND_CLOSE:
+      if (web_socket_connection_get_ready_state (connection) < WEB_SOCKET_STATE_CLOSING)
+        web_socket_connection_close (connection, command->number, command->string);
+      break;
+    case COMMAND_FREE:
+      g_signal_handlers_disconnect_by_data (connection, self);
+      g_object_unref (connection);
+      threaded_socket_unref (self);
+      break;
+    }
+
+  command_free (command);
+}
+
+static Command *
+command_new (CommandType type,
+             CockpitThreadedSocket *self)
+{
+  Command *command;
+
+  command = g_new0 (Command, 1);
+  command->type = type;
+  command->socket = threaded_socket_ref (self);
+
+  return command;
+}
+
+static gpointer
+socket_thread_run (gpointer data)
+{
+  SocketThread *thread = data;
+
+  g_main_context_push_thread_default (thread->context);
+  g_main_loop_run (thread->loop);
+  g_main_context_pop_thread_default (thread->context);
+
+  return NULL;
+}
+
+static void
+socket_threads_start (void)
+{
+  GMainContext *main_context;
+  SocketThread *thread;
+  gchar *name;
+  guint i;
+
+  main_context = g_main_context_ref_thread_default ();
+
+  threads = g_new0 (SocketThread, n_threads);
+  for (i = 0; i < n_threads; i++)
+    {
+      thread = threads + i;
+      thread->context = g_main_context_new ();
+      thread->loop = g_main_loop_new (thread->context, FALSE);
+      mailbox_init (&thread->commands, thread->context, process_command);
+      mailbox_init (&thread->events, main_context, process_event);
+
+      name = g_strdup_printf ("websocket-%u", i);
+      thread->thread = g_thread_new (name, socket_thread_run, thread);
+      g_free (name);
+    }
+
+  g_debug ("started %u threads for web sockets", n_threads);
+  g_main_context_unref (main_context);
+}
+
+/* ----------------------------------------------------------------------------
+ * Public API, used from the main thread
+ */
+
+/**
+ * cockpit_threaded_socket_enabled:
+ *
+ * Whether WebSocketThreads is set in cockpit.conf, in which case web
+ * socket connections should be made with cockpit_threaded_socket_new().
+ *
+ * Returns: TRUE if there are worker threads for web sockets
+ */
+gboolean
+cockpit_threaded_socket_enabled (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      n_threads = cockpit_conf_uint ("WebService", "WebSocketThreads", 0, 64, 0);
+      if (n_threads > 0)
+        socket_threads_start ();
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return n_threads > 0;
+}
+
+/**
+ * cockpit_threaded_socket_new:
+ * @create: called in the worker thread to make the connection
+ * @data: passed to @create
+ * @callbacks: called in the main thread for the connection's signals
+ * @user_data: passed to @callbacks
+ *
+ * Makes a web socket connection on one of the worker threads. This waits
+ * until @create has run, so @data can point to things that only live as
+ * long as the caller. Don't connect to the signals of the returned
+ * connection, @callbacks are called for them instead.
+ *
+ * Returns: (transfer full): the socket, free with cockpit_threaded_socket_free()
+ */
+CockpitThreadedSocket *
+cockpit_threaded_socket_new (CockpitThreadedSocketCreate create,
+                             gpointer data,
+                             const CockpitThreadedSocketCallbacks *callbacks,
+                             gpointer user_data)
+{
+  CockpitThreadedSocket *self;
+  Command command = { COMMAND_CREATE, };
+
+  g_return_val_if_fail (cockpit_threaded_socket_enabled (), NULL);
+  g_return_val_if_fail (create != NULL, NULL);
+  g_return_val_if_fail (callbacks != NULL, NULL);
+
+  self = g_new0 (CockpitThreadedSocket, 1);
+  self->refs = 1;
+  self->thread = threads + (next_thread++ % n_threads);
+  self->state = WEB_SOCKET_STATE_CONNECTING;
+  self->callbacks = callbacks;
+  self->user_data = user_data;
+
+  command.socket = self;
+  command.create = create;
+  command.data = data;
+  mailbox_post (&self->thread->commands, &command);
+
+  g_mutex_lock (&create_lock);
+  while (!command.done)
+    g_cond_wait (&create_cond, &create_lock);
+  g_mutex_unlock (&create_lock);
+
+  return self;
+}
+
+/**
+ * cockpit_threaded_socket_get_connection:
+ * @self: the socket
+ *
+ * The connection is passed to the callbacks, and can be used to tell
+ * sockets apart. It belongs to the worker thread, so nothing may be
+ * called on it, or connected to it, from the main thread.
+ *
+ * Returns: (transfer none): the connection
+ */
+WebSocketConnection *
+cockpit_threaded_socket_get_connection (CockpitThreadedSocket *self)
+{
+  return self->connection;
+}
+
+/**
+ * cockpit_threaded_socket_get_ready_state:
+ * @self: the socket
+ *
+ * The state of the connection as far as the main thread knows. The
+ * connection itself may already be further along.
+ *
+ * Returns: the ready state
+ */
+WebSocketState
+cockpit_threaded_socket_get_ready_state (CockpitThreadedSocket *self)
+{
+  return self->state;
+}
+
+/**
+ * cockpit_threaded_socket_get_pressure_count:
+ * @self: the socket
+ *
+ * Like web_socket_connection_get_pressure_count(), but only known once
+ * the close callback has been called.
+ *
+ * Returns: the number of times back pressure was applied
+ */
+guint
+cockpit_threaded_socket_get_pressure_count (CockpitThreadedSocket *self)
+{
+  return self->pressure_count;
+}
+
+/**
+ * cockpit_threaded_socket_get_pressure_time:
+ * @self: the socket
+ *
+ * Like web_socket_connection_get_pressure_time(), but only known once
+ * the close callback has been called.
+ *
+ * Returns: the time spent under back pressure, in microseconds
+ */
+GTimeSpan
+cockpit_threaded_socket_get_pressure_time (CockpitThreadedSocket *self)
+{
+  return self->pressure_time;
+}
+
+/**
+ * cockpit_threaded_socket_send:
+ * @self: the socket
+ * @type: the data type of the message
+ * @prefix: (allow-none): bytes to send before @payload
+ * @payload: the message
+ * @flow: (allow-none): the flow to send it on
+ *
+ * Like web_socket_connection_send_full(). The message is dropped if the
+ * connection has started closing by the time the worker gets to it.
+ */
+void
+cockpit_threaded_socket_send (CockpitThreadedSocket *self,
+                              WebSocketDataType type,
+                              GBytes *prefix,
+                              GBytes *payload,
+                              const gchar *flow)
+{
+  Command *command;
+
+  g_return_if_fail (payload != NULL);
+
+  command = command_new (COMMAND_SEND, self);
+  command->data_type = type;
+  command->prefix = prefix ? g_bytes_ref (prefix) : NULL;
+  command->payload = g_bytes_ref (payload);
+  command->string = g_strdup (flow);
+  mailbox_post (&self->thread->commands, command);
+}
+
+/**
+ * cockpit_threaded_socket_set_flow_weight:
+ * @self: the socket
+ * @flow: the flow
+ * @weight: its weight, or zero to forget about it
+ *
+ * Like web_socket_connection_set_flow_weight().
+ */
+void
+cockpit_threaded_socket_set_flow_weight (CockpitThreadedSocket *self,
+                                         const gchar *flow,
+                                         guint weight)
+{
+  Command *command;
+
+  g_return_if_fail (flow != NULL);
+
+  command = command_new (COMMAND_FLOW_WEIGHT, self);
+  command->string = g_strdup (flow);
+  command->number = weight;
+  mailbox_post (&self->thread->commands, command);
+}
+
+/**
+ * cockpit_threaded_socket_close:
+ * @self: the socket
+ * @code: the close code
+ * @reason: (allow-none): the close reason
+ *
+ * Like web_socket_connection_close(), but does nothing if the
+ * connection is already closing.
+ */
+void
+cockpit_threaded_socket_close (CockpitThreadedSocket *self,
+                               gushort code,
+                               const gchar *reason)
+{
+  Command *command;
+
+  self->state = MAX (self->state, WEB_SOCKET_STATE_CLOSING);
+
+  command = command_new (COMMAND_CLOSE, self);
+  command->string = g_strdup (reason);
+  command->number = code;
+  mailbox_post (&self->thread->commands, command);
+}
+
+/**
+ * cockpit_threaded_socket_free:
+ * @self: the socket
+ *
+ * Drops the connection in its worker thread. No more callbacks are
+ * called after this.
+ */
+void
+cockpit_threaded_socket_free (CockpitThreadedSocket *self)
+{
+  g_return_if_fail (!self->freed);
+
+  self->freed = TRUE;
+  mailbox_post (&self->thread->commands, command_new (COMMAND_FREE, self));
+  threaded_socket_unref (self);
+}
@@ -0,0 +1,77 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_SOCKET_THREAD_H__
+#define __COCKPIT_SOCKET_THREAD_H__
+
+#include "websocket/websocket.h"
+
+G_BEGIN_DECLS
+
+typedef struct _CockpitThreadedSocket CockpitThreadedSocket;
+
+typedef WebSocketConnection * (* CockpitThreadedSocketCreate) (gpointer data);
+
+typedef struct {
+  void (* open) (WebSocketConnection *connection,
+                 gpointer user_data);
+  void (* messages) (WebSocketConnection *connection,
+                     const WebSocketMessage *messages,
+                     guint n_messages,
+                     gpointer user_data);
+  void (* closing) (WebSocketConnection *connection,
+                    gpointer user_data);
+  void (* close) (WebSocketConnection *connection,
+                  gpointer user_data);
+} CockpitThreadedSocketCallbacks;
+
+gboolean                cockpit_threaded_socket_enabled         (void);
+
+CockpitThreadedSocket * cockpit_threaded_socket_new             (CockpitThreadedSocketCreate create,
+                                                                 gpointer data,
+                                                                 const CockpitThreadedSocketCallbacks *callbacks,
+                                                                 gpointer user_data);
+
+WebSocketConnection *   cockpit_threaded_socket_get_connection  (CockpitThreadedSocket *self);
+
+WebSocketState          cockpit_threaded_socket_get_ready_state (CockpitThreadedSocket *self);
+
+guint                   cockpit_threaded_socket_get_pressure_count (CockpitThreadedSocket *self);
+
+GTimeSpan               cockpit_threaded_socket_get_pressure_time  (CockpitThreadedSocket *self);
+
+void                    cockpit_threaded_socket_send            (CockpitThreadedSocket *self,
+                                                                 WebSocketDataType type,
+                                                                 GBytes *prefix,
+                                                                 GBytes *payload,
+                                                                 const gchar *flow);
+
+void                    cockpit_threaded_socket_set_flow_weight (CockpitThreadedSocket *self,
+                                                                 const gchar *flow,
+                                                                 guint weight);
+
+void                    cockpit_threaded_socket_close           (CockpitThreadedSocket *self,
+                                                                 gushort code,
+                                                                 const gchar *reason);
+
+void                    cockpit_threaded_socket_free            (CockpitThreadedSocket *self);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_SOCKET_THREAD_H__ */
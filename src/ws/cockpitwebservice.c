@@ -22,6 +22,7 @@
 #include "cockpitwebservice.h"
 
 #include "cockpitcompat.h"
+#include "cockpitsocketthread.h"
 #include "cockpitws.h"
 
 #include <string.h>
@@ -53,6 +54,7 @@ guint cockpit_ws_ping_interval = 5;
 typedef struct {
   gchar *id;
   WebSocketConnection *connection;
+  CockpitThreadedSocket *threaded;
   GHashTable *channels;
   JsonObject *init_received;
 } CockpitSocket;
@@ -70,7 +72,10 @@ cockpit_socket_free (gpointer data)
   g_hash_table_unref (socket->channels);
   if (socket->init_received)
     json_object_unref (socket->init_received);
-  g_object_unref (socket->connection);
+  if (socket->threaded)
+    cockpit_threaded_socket_free (socket->threaded);
+  else
+    g_object_unref (socket->connection);
   g_free (socket->id);
   g_free (socket);
 }
@@ -94,6 +99,55 @@ cockpit_socket_lookup_by_connection (CockpitSockets *sockets,
   return g_hash_table_lookup (sockets->by_connection, connection);
 }
 
+/*
+ * A socket's connection either lives in this thread, or on one of the
+ * worker threads, in which case it's only talked to through these.
+ */
+
+static WebSocketState
+cockpit_socket_get_ready_state (CockpitSocket *socket)
+{
+  if (socket->threaded)
+    return cockpit_threaded_socket_get_ready_state (socket->threaded);
+  else
+    return web_socket_connection_get_ready_state (socket->connection);
+}
+
+static void
+cockpit_socket_send (CockpitSocket *socket,
+                     WebSocketDataType type,
+                     GBytes *prefix,
+                     GBytes *payload,
+                     const gchar *flow)
+{
+  if (socket->threaded)
+    cockpit_threaded_socket_send (socket->threaded, type, prefix, payload, flow);
+  else
+    web_socket_connection_send_full (socket->connection, type, prefix, payload, flow);
+}
+
+static void
+cockpit_socket_set_flow_weight (CockpitSocket *socket,
+                                const gchar *flow,
+                                guint weight)
+{
+  if (socket->threaded)
+    cockpit_threaded_socket_set_flow_weight (socket->threaded, flow, weight);
+  else
+    web_socket_connection_set_flow_weight (socket->connection, flow, weight);
+}
+
+static void
+cockpit_socket_close (CockpitSocket *socket,
+                      gushort code,
+                      const gchar *problem)
+{
+  if (socket->threaded)
+    cockpit_threaded_socket_close (socket->threaded, code, problem);
+  else
+    web_socket_connection_close (socket->connection, code, problem);
+}
+
 inline static CockpitSocket *
 cockpit_socket_lookup_by_channel (CockpitSockets *sockets,
                                   const gchar *channel)
@@ -107,6 +161,7 @@ cockpit_socket_remove_channel (CockpitSockets *sockets,
                                const gchar *channel)
 {
   g_debug ("%s remove channel %s for socket", socket->id, channel);
+  cockpit_socket_set_flow_weight (socket, channel, 0);
   g_hash_table_remove (sockets->by_channel, channel);
   g_hash_table_remove (socket->channels, channel);
 }
@@ -128,13 +183,20 @@ cockpit_socket_add_channel (CockpitSockets *sockets,
 
 static CockpitSocket *
 cockpit_socket_track (CockpitSockets *sockets,
-                      WebSocketConnection *connection)
+                      WebSocketConnection *connection,
+                      CockpitThreadedSocket *threaded)
 {
   CockpitSocket *socket;
 
   socket = g_new0 (CockpitSocket, 1);
   socket->id = g_strdup_printf ("%u:", sockets->next_socket_id++);
-  socket->connection = g_object_ref (connection);
+
+  /* A threaded connection belongs to its worker thread */
+  socket->threaded = threaded;
+  if (threaded)
+    socket->connection = connection;
+  else
+    socket->connection = g_object_ref (connection);
   socket->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
   g_debug ("%s new socket", socket->id);
@@ -176,8 +238,8 @@ cockpit_sockets_close (CockpitSockets *sockets,
   g_hash_table_iter_init (&iter, sockets->by_connection);
   while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&socket))
     {
-      if (web_socket_connection_get_ready_state (socket->connection) < WEB_SOCKET_STATE_CLOSING)
-        web_socket_connection_close (socket->connection, WEB_SOCKET_CLOSE_GOING_AWAY, problem);
+      if (cockpit_socket_get_ready_state (socket) < WEB_SOCKET_STATE_CLOSING)
+        cockpit_socket_close (socket, WEB_SOCKET_CLOSE_GOING_AWAY, problem);
     }
 }
 
@@ -374,8 +436,8 @@ process_ping (CockpitWebService *self,
   /* Respond to a ping without a channel, by saying "pong" */
   json_object_set_string_member (options, "command", "pong");
   payload = cockpit_json_write_bytes (options);
-  if (web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
-    web_socket_connection_send (socket->connection, WEB_SOCKET_DATA_TEXT, self->control_prefix, payload);
+  if (cockpit_socket_get_ready_state (socket) == WEB_SOCKET_STATE_OPEN)
+    cockpit_socket_send (socket, WEB_SOCKET_DATA_TEXT, self->control_prefix, payload, NULL);
   g_bytes_unref (payload);
 
   return TRUE;
@@ -741,10 +803,11 @@ on_transport_control (CockpitTransport *transport,
       if (forward)
         {
           /* Forward this message to the right websocket */
-          if (socket && web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
+          if (socket && cockpit_socket_get_ready_state (socket) == WEB_SOCKET_STATE_OPEN)
             {
-              web_socket_connection_send (socket->connection, WEB_SOCKET_DATA_TEXT,
-                                          self->control_prefix, payload);
+              /* On the channel's flow, so it stays in order with the channel's data */
+              cockpit_socket_send (socket, WEB_SOCKET_DATA_TEXT,
+                                   self->control_prefix, payload, channel);
             }
         }
     }
@@ -774,12 +837,12 @@ on_transport_recv (CockpitTransport *transport,
 
   /* Forward the message to the right socket */
   socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
-  if (socket && web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
+  if (socket && cockpit_socket_get_ready_state (socket) == WEB_SOCKET_STATE_OPEN)
     {
       string = g_strdup_printf ("%s\n", channel);
       prefix = g_bytes_new_take (string, strlen (string));
       data_type = GPOINTER_TO_INT (g_hash_table_lookup (socket->channels, channel));
-      web_socket_connection_send (socket->connection, data_type, prefix, payload);
+      cockpit_socket_send (socket, data_type, prefix, payload, channel);
       g_bytes_unref (prefix);
       return TRUE;
     }
@@ -902,6 +965,10 @@ cockpit_web_service_parse_external (JsonObject *options,
   return TRUE;
 }
 
+/* Payloads that transfer data in bulk, and their share of a WebSocket */
+static const gchar * const bulk_payloads[] = { "fsread1", "http-stream1", "http-stream2", NULL };
+#define BULK_CHANNEL_WEIGHT 1
+
 static gboolean
 process_and_relay_open (CockpitWebService *self,
                         CockpitSocket *socket,
@@ -909,6 +976,7 @@ process_and_relay_open (CockpitWebService *self,
                         JsonObject *options)
 {
   WebSocketDataType data_type = WEB_SOCKET_DATA_TEXT;
+  const gchar *payload_type;
   GBytes *payload;
 
   if (self->closing)
@@ -933,7 +1001,15 @@ process_and_relay_open (CockpitWebService *self,
     return FALSE;
 
   if (socket)
-    cockpit_socket_add_channel (&self->sockets, socket, channel, data_type);
+    {
+      cockpit_socket_add_channel (&self->sockets, socket, channel, data_type);
+
+      /* Don't let downloads and such hold up interactive channels on the same socket */
+      if (!cockpit_json_get_string (options, "payload", NULL, &payload_type))
+        payload_type = NULL;
+      if (payload_type && g_strv_contains (bulk_payloads, payload_type))
+        cockpit_socket_set_flow_weight (socket, channel, BULK_CHANNEL_WEIGHT);
+    }
 
   if (!self->sent_done)
     {
@@ -988,7 +1064,7 @@ process_socket_init (CockpitWebService *self,
 
 static void
 inbound_protocol_error (CockpitWebService *self,
-                        WebSocketConnection *connection,
+                        CockpitSocket *socket,
                         const gchar *problem)
 {
   GBytes *payload;
@@ -996,12 +1072,12 @@ inbound_protocol_error (CockpitWebService *self,
   if (problem == NULL)
     problem = "protocol-error";
 
-  if (web_socket_connection_get_ready_state (connection) == WEB_SOCKET_STATE_OPEN)
+  if (cockpit_socket_get_ready_state (socket) == WEB_SOCKET_STATE_OPEN)
     {
       payload = cockpit_transport_build_control ("command", "close", "problem", problem, NULL);
-      web_socket_connection_send (connection, WEB_SOCKET_DATA_TEXT, self->control_prefix, payload);
+      cockpit_socket_send (socket, WEB_SOCKET_DATA_TEXT, self->control_prefix, payload, NULL);
       g_bytes_unref (payload);
-      web_socket_connection_close (connection, WEB_SOCKET_CLOSE_SERVER_ERROR, problem);
+      cockpit_socket_close (socket, WEB_SOCKET_CLOSE_SERVER_ERROR, problem);
     }
 }
 
@@ -1077,23 +1153,18 @@ dispatch_inbound_command (CockpitWebService *self,
 
 out:
   if (!valid)
-    inbound_protocol_error (self, socket->connection, problem);
+    inbound_protocol_error (self, socket, problem);
   if (options)
     json_object_unref (options);
 }
 
 static void
-on_web_socket_message (WebSocketConnection *connection,
-                       WebSocketDataType type,
-                       GBytes *message,
-                       CockpitWebService *self)
+receive_web_socket_message (CockpitWebService *self,
+                            CockpitSocket *socket,
+                            GBytes *message)
 {
-  CockpitSocket *socket;
   g_autofree gchar *channel = NULL;
 
-  socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
-  g_return_if_fail (socket != NULL);
-
   g_autoptr(GBytes) payload = cockpit_transport_parse_frame (message, &channel);
   if (!payload)
     return;
@@ -1110,6 +1181,27 @@ on_web_socket_message (WebSocketConnection *connection,
     }
 }
 
+/*
+ * All the messages from one read of the WebSocket come together, and are
+ * queued on the transport before it gets to write any of them. That way
+ * a burst of messages goes to the session in a few writes.
+ */
+static void
+on_web_socket_messages (WebSocketConnection *connection,
+                        const WebSocketMessage *messages,
+                        guint n_messages,
+                        CockpitWebService *self)
+{
+  CockpitSocket *socket;
+  guint i;
+
+  socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
+  g_return_if_fail (socket != NULL);
+
+  for (i = 0; i < n_messages; i++)
+    receive_web_socket_message (self, socket, messages[i].payload);
+}
+
 static void
 on_web_socket_open (WebSocketConnection *connection,
                     CockpitWebService *self)
@@ -1151,11 +1243,16 @@ on_web_socket_open (WebSocketConnection *connection,
   command = cockpit_json_write_bytes (object);
   json_object_unref (object);
 
-  web_socket_connection_send (connection, WEB_SOCKET_DATA_TEXT, self->control_prefix, command);
+  cockpit_socket_send (socket, WEB_SOCKET_DATA_TEXT, self->control_prefix, command, NULL);
   g_bytes_unref (command);
 
-  g_signal_connect (connection, "message",
-                    G_CALLBACK (on_web_socket_message), self);
+  /* Threaded connections always hand over their messages in batches */
+  if (!socket->threaded)
+    {
+      g_object_set (connection, "batch-messages", TRUE, NULL);
+      g_signal_connect (connection, "messages",
+                        G_CALLBACK (on_web_socket_messages), self);
+    }
 }
 
 static gboolean
@@ -1205,19 +1302,36 @@ on_web_socket_close (WebSocketConnection *connection,
                      CockpitWebService *self)
 {
   CockpitSocket *socket;
+  GTimeSpan pressure_time;
+  guint pressure_count;
 
   if (cockpit_creds_get_rhost (self->creds))
     g_info ("Connection from %s to session %s closed", cockpit_creds_get_rhost (self->creds), self->id);
   else
     g_info ("Connection to session %s closed", self->id);
 
-  g_signal_handlers_disconnect_by_func (connection, on_web_socket_open, self);
-  g_signal_handlers_disconnect_by_func (connection, on_web_socket_closing, self);
-  g_signal_handlers_disconnect_by_func (connection, on_web_socket_close, self);
-
   socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
   g_return_if_fail (socket != NULL);
 
+  /* A threaded socket's connection belongs to its worker thread */
+  if (socket->threaded)
+    {
+      pressure_count = cockpit_threaded_socket_get_pressure_count (socket->threaded);
+      pressure_time = cockpit_threaded_socket_get_pressure_time (socket->threaded);
+    }
+  else
+    {
+      g_signal_handlers_disconnect_by_func (connection, on_web_socket_open, self);
+      g_signal_handlers_disconnect_by_func (connection, on_web_socket_closing, self);
+      g_signal_handlers_disconnect_by_func (connection, on_web_socket_close, self);
+
+      pressure_count = web_socket_connection_get_pressure_count (connection);
+      pressure_time = web_socket_connection_get_pressure_time (connection);
+    }
+
+  g_debug ("%s: applied back pressure %u times for %" G_GINT64_FORMAT " ms", self->id,
+           pressure_count, pressure_time / G_TIME_SPAN_MILLISECOND);
+
   cockpit_socket_destroy (&self->sockets, socket);
 
   caller_end (self);
@@ -1227,17 +1341,17 @@ static gboolean
 on_ping_time (gpointer user_data)
 {
   CockpitWebService *self = user_data;
-  WebSocketConnection *connection;
+  CockpitSocket *socket;
   GHashTableIter iter;
   GBytes *payload;
 
   payload = cockpit_transport_build_control ("command", "ping", NULL);
 
   g_hash_table_iter_init (&iter, self->sockets.by_connection);
-  while (g_hash_table_iter_next (&iter, (gpointer *)&connection, NULL))
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&socket))
     {
-      if (web_socket_connection_get_ready_state (connection) == WEB_SOCKET_STATE_OPEN)
-        web_socket_connection_send (connection, WEB_SOCKET_DATA_TEXT, self->control_prefix, payload);
+      if (cockpit_socket_get_ready_state (socket) == WEB_SOCKET_STATE_OPEN)
+        cockpit_socket_send (socket, WEB_SOCKET_DATA_TEXT, self->control_prefix, payload, NULL);
     }
 
   g_bytes_unref (payload);
@@ -1336,6 +1450,22 @@ cockpit_web_service_create_socket (const gchar **protocols,
                                                  cockpit_web_request_get_io_stream (request),
                                                  cockpit_web_request_get_headers (request),
                                                  cockpit_web_request_get_buffer (request));
+
+  if (cockpit_conf_bool ("WebService", "WebSocketCompression", FALSE))
+    {
+      g_object_set (connection,
+                    "permessage-deflate", TRUE,
+                    "deflate-window-bits", cockpit_conf_uint ("WebService", "WebSocketCompressionWindowBits", 15, 15, 9),
+                    NULL);
+    }
+
+  /* Configured in KiB */
+  g_object_set (connection,
+                "pressure-high", cockpit_conf_uint ("WebService", "WebSocketQueueHigh", 1024, 1024 * 1024, 16) * 1024,
+                "pressure-low", cockpit_conf_uint ("WebService", "WebSocketQueueLow", 256, 1024 * 1024, 0) * 1024,
+                "adaptive-pressure", cockpit_conf_bool ("WebService", "WebSocketAdaptiveQueue", FALSE),
+                NULL);
+
   g_free (allocated);
   g_free (url);
   g_free (origin);
@@ -1343,6 +1473,33 @@ cockpit_web_service_create_socket (const gchar **protocols,
   return connection;
 }
 
+typedef struct {
+  const gchar **protocols;
+  CockpitWebRequest *request;
+} ThreadedSocketCreate;
+
+/* Runs in the worker thread, while the main thread waits for it */
+static WebSocketConnection *
+create_threaded_socket (gpointer data)
+{
+  ThreadedSocketCreate *create = data;
+  return cockpit_web_service_create_socket (create->protocols, create->request);
+}
+
+static void
+on_threaded_socket_closing (WebSocketConnection *connection,
+                            gpointer user_data)
+{
+  on_web_socket_closing (connection, user_data);
+}
+
+static const CockpitThreadedSocketCallbacks threaded_socket_callbacks = {
+  .open = (void (*) (WebSocketConnection *, gpointer))on_web_socket_open,
+  .messages = (void (*) (WebSocketConnection *, const WebSocketMessage *, guint, gpointer))on_web_socket_messages,
+  .closing = on_threaded_socket_closing,
+  .close = (void (*) (WebSocketConnection *, gpointer))on_web_socket_close,
+};
+
 /**
  * cockpit_web_service_socket:
  * @io_stream: the stream to talk on
@@ -1362,15 +1519,27 @@ cockpit_web_service_socket (CockpitWebService *self,
 {
   const gchar *protocols[] = { "cockpit1", NULL };
   WebSocketConnection *connection;
+  CockpitThreadedSocket *threaded;
+  ThreadedSocketCreate create = { protocols, request };
 
-  connection = cockpit_web_service_create_socket (protocols, request);
+  if (cockpit_threaded_socket_enabled ())
+    {
+      threaded = cockpit_threaded_socket_new (create_threaded_socket, &create,
+                                              &threaded_socket_callbacks, self);
+      connection = cockpit_threaded_socket_get_connection (threaded);
+      cockpit_socket_track (&self->sockets, connection, threaded);
+    }
+  else
+    {
+      connection = cockpit_web_service_create_socket (protocols, request);
 
-  g_signal_connect (connection, "open", G_CALLBACK (on_web_socket_open), self);
-  g_signal_connect (connection, "closing", G_CALLBACK (on_web_socket_closing), self);
-  g_signal_connect (connection, "close", G_CALLBACK (on_web_socket_close), self);
+      g_signal_connect (connection, "open", G_CALLBACK (on_web_socket_open), self);
+      g_signal_connect (connection, "closing", G_CALLBACK (on_web_socket_closing), self);
+      g_signal_connect (connection, "close", G_CALLBACK (on_web_socket_close), self);
 
-  cockpit_socket_track (&self->sockets, connection);
-  g_object_unref (connection);
+      cockpit_socket_track (&self->sockets, connection, NULL);
+      g_object_unref (connection);
+    }
 
   caller_begin (self);
 }
@@ -38,6 +38,7 @@
 #include "common/cockpitmemory.h"
 #include "common/cockpitsystem.h"
 #include "common/cockpitwebcertificate.h"
+#include "common/cockpitwebindex.h"
 
 /* ---------------------------------------------------------------------------------------------------- */
 
@@ -188,6 +189,7 @@ main (int argc,
   roots = setup_static_roots (data.os_release);
 
   data.branding_roots = (const gchar **)roots;
+  cockpit_web_index_add_roots (data.branding_roots);
   login_html = g_strdup (DATADIR "/cockpit/static/login.html");
   data.login_html = (const gchar *)login_html;
   login_po_js = g_strdup (DATADIR "/cockpit/static/po.js");
@@ -306,6 +308,7 @@ out:
     g_hash_table_unref (data.os_release);
   g_free (opt_address);
   g_free (opt_local_session);
+  cockpit_web_index_cleanup ();
   cockpit_conf_cleanup ();
   return ret;
 }
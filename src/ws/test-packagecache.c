@@ -0,0 +1,464 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ws/cockpitchannelresponse.h"
+#include "ws/cockpitpackagecache.h"
+#include "ws/cockpitwebservice.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpitwebresponse.h"
+#include "common/cockpitwebserver.h"
+#include "testlib/cockpittest.h"
+#include "testlib/mock-transport.h"
+
+#include <string.h>
+
+static void
+insert_file (CockpitPackageCache *cache,
+             const gchar *key,
+             gsize length)
+{
+  GHashTable *headers;
+  GBytes *body;
+
+  headers = cockpit_web_server_new_table ();
+  g_hash_table_insert (headers, g_strdup ("Content-Type"), g_strdup ("text/javascript"));
+  body = g_bytes_new_take (g_malloc0 (length), length);
+
+  cockpit_package_cache_insert (cache, key, headers, body);
+
+  g_hash_table_unref (headers);
+  g_bytes_unref (body);
+}
+
+static gboolean
+lookup_file (CockpitPackageCache *cache,
+             const gchar *key)
+{
+  GHashTable *headers;
+  GBytes *body;
+
+  if (!cockpit_package_cache_lookup (cache, key, &headers, &body))
+    return FALSE;
+
+  g_assert_cmpstr (g_hash_table_lookup (headers, "content-type"), ==, "text/javascript");
+  g_hash_table_unref (headers);
+  g_bytes_unref (body);
+  return TRUE;
+}
+
+static void
+test_hit_miss (void)
+{
+  CockpitPackageCache *cache;
+  CockpitPackageCacheStats stats;
+  GHashTable *headers;
+  GBytes *body;
+
+  cache = cockpit_package_cache_new (64 * 1024);
+
+  g_assert (!lookup_file (cache, "\"$abc-C\" /shell/index.js gzip"));
+
+  insert_file (cache, "\"$abc-C\" /shell/index.js gzip", 1000);
+  g_assert (cockpit_package_cache_lookup (cache, "\"$abc-C\" /shell/index.js gzip", &headers, &body));
+  g_assert_cmpuint (g_bytes_get_size (body), ==, 1000);
+  g_hash_table_unref (headers);
+  g_bytes_unref (body);
+
+  /* Another language is another file */
+  g_assert (!lookup_file (cache, "\"$abc-de\" /shell/index.js gzip"));
+
+  cockpit_package_cache_get_stats (cache, &stats);
+  g_assert_cmpuint (stats.hits, ==, 1);
+  g_assert_cmpuint (stats.misses, ==, 2);
+  g_assert_cmpuint (stats.evictions, ==, 0);
+  g_assert_cmpuint (stats.entries, ==, 1);
+  g_assert_cmpuint (stats.size, >, 1000);
+
+  cockpit_package_cache_free (cache);
+}
+
+static void
+test_replace (void)
+{
+  CockpitPackageCache *cache;
+  CockpitPackageCacheStats stats;
+
+  cache = cockpit_package_cache_new (64 * 1024);
+
+  insert_file (cache, "one", 1000);
+  insert_file (cache, "one", 2000);
+
+  cockpit_package_cache_get_stats (cache, &stats);
+  g_assert_cmpuint (stats.entries, ==, 1);
+  g_assert_cmpuint (stats.size, >, 2000);
+  g_assert_cmpuint (stats.size, <, 3000);
+  g_assert_cmpuint (stats.evictions, ==, 0);
+
+  cockpit_package_cache_free (cache);
+}
+
+static void
+test_evict (void)
+{
+  CockpitPackageCache *cache;
+  CockpitPackageCacheStats stats;
+
+  cache = cockpit_package_cache_new (64 * 1024);
+
+  insert_file (cache, "one", 15000);
+  insert_file (cache, "two", 15000);
+  insert_file (cache, "three", 15000);
+  insert_file (cache, "four", 15000);
+
+  /* Now "one" is the most recently used */
+  g_assert (lookup_file (cache, "one"));
+
+  insert_file (cache, "five", 15000);
+
+  g_assert (lookup_file (cache, "one"));
+  g_assert (!lookup_file (cache, "two"));
+  g_assert (lookup_file (cache, "three"));
+  g_assert (lookup_file (cache, "four"));
+  g_assert (lookup_file (cache, "five"));
+
+  cockpit_package_cache_get_stats (cache, &stats);
+  g_assert_cmpuint (stats.evictions, ==, 1);
+  g_assert_cmpuint (stats.entries, ==, 4);
+  g_assert_cmpuint (stats.size, <=, 64 * 1024);
+
+  cockpit_package_cache_free (cache);
+}
+
+static void
+test_too_large (void)
+{
+  CockpitPackageCache *cache;
+  CockpitPackageCacheStats stats;
+
+  cache = cockpit_package_cache_new (64 * 1024);
+  g_assert_cmpuint (cockpit_package_cache_get_max_entry (cache), ==, 16 * 1024);
+
+  insert_file (cache, "small", 1000);
+  insert_file (cache, "large", 20000);
+
+  /* Didn't throw anything out for it either */
+  g_assert (lookup_file (cache, "small"));
+  g_assert (!lookup_file (cache, "large"));
+
+  cockpit_package_cache_get_stats (cache, &stats);
+  g_assert_cmpuint (stats.evictions, ==, 0);
+  g_assert_cmpuint (stats.entries, ==, 1);
+
+  cockpit_package_cache_free (cache);
+}
+
+static void
+test_disabled (void)
+{
+  CockpitPackageCache *cache;
+  CockpitPackageCacheStats stats;
+
+  cache = cockpit_package_cache_new (0);
+  g_assert_cmpuint (cockpit_package_cache_get_max_entry (cache), ==, 0);
+
+  insert_file (cache, "one", 10);
+  g_assert (!lookup_file (cache, "one"));
+
+  cockpit_package_cache_get_stats (cache, &stats);
+  g_assert_cmpuint (stats.entries, ==, 0);
+  g_assert_cmpuint (stats.size, ==, 0);
+
+  cockpit_package_cache_free (cache);
+}
+
+/* ----------------------------------------------------------------------------
+ * Through cockpit_channel_response_serve(), one session after another
+ */
+
+#define CHECKSUM "0123456789abcdef"
+#define INIT_MESSAGE "{\"command\":\"init\",\"version\":1}"
+
+typedef struct {
+  const gchar *cache_control;
+  guint opened;
+} TestServe;
+
+static void
+setup_serve (TestServe *test,
+             gconstpointer data)
+{
+  test->cache_control = data;
+  cockpit_package_cache_set_default (cockpit_package_cache_new (64 * 1024));
+}
+
+static void
+teardown_serve (TestServe *test,
+                gconstpointer data)
+{
+  cockpit_package_cache_set_default (NULL);
+  cockpit_assert_expected ();
+}
+
+static void
+emit_control (CockpitTransport *transport,
+              const gchar *command,
+              const gchar *channel)
+{
+  GBytes *payload;
+
+  payload = cockpit_transport_build_control ("command", command, "channel", channel, NULL);
+  cockpit_transport_emit_recv (transport, NULL, payload);
+  g_bytes_unref (payload);
+}
+
+/* Like cockpit-bridge, the answer depends on how the browser got here */
+static void
+bridge_serve (TestServe *test,
+              CockpitTransport *transport,
+              const gchar *channel,
+              JsonObject *heads)
+{
+  const gchar *forwarded_host;
+  const gchar *forwarded_proto;
+  const gchar *language;
+  JsonObject *meta;
+  JsonObject *headers;
+  GBytes *payload;
+  gchar *policy;
+  gchar *body;
+
+  if (!cockpit_json_get_string (heads, "X-Forwarded-Host", NULL, &forwarded_host) ||
+      !cockpit_json_get_string (heads, "X-Forwarded-Proto", NULL, &forwarded_proto) ||
+      !cockpit_json_get_string (heads, "Accept-Language", "", &language))
+    g_assert_not_reached ();
+
+  headers = json_object_new ();
+  json_object_set_string_member (headers, "Content-Type", "application/json");
+  json_object_set_string_member (headers, "X-Cockpit-Pkg-Checksum", CHECKSUM);
+  policy = g_strdup_printf ("default-src 'self'; connect-src 'self' %s://%s",
+                            g_str_equal (forwarded_proto, "https") ? "wss" : "ws", forwarded_host);
+  json_object_set_string_member (headers, "Content-Security-Policy", policy);
+  g_free (policy);
+  if (test->cache_control)
+    json_object_set_string_member (headers, "Cache-Control", test->cache_control);
+
+  meta = json_object_new ();
+  json_object_set_int_member (meta, "status", 200);
+  json_object_set_string_member (meta, "reason", "OK");
+  json_object_set_object_member (meta, "headers", headers);
+  payload = cockpit_json_write_bytes (meta);
+  cockpit_transport_emit_recv (transport, channel, payload);
+  g_bytes_unref (payload);
+  json_object_unref (meta);
+
+  body = g_strdup_printf ("{\"language\":\"%s\"}", language);
+  payload = g_bytes_new_take (body, strlen (body));
+  cockpit_transport_emit_recv (transport, channel, payload);
+  g_bytes_unref (payload);
+
+  emit_control (transport, "done", channel);
+  emit_control (transport, "close", channel);
+}
+
+static void
+bridge_process (TestServe *test,
+                MockTransport *mock)
+{
+  const gchar *command;
+  const gchar *channel;
+  JsonObject *control;
+  JsonObject *heads;
+
+  while ((control = mock_transport_pop_control (mock)) != NULL)
+    {
+      if (!cockpit_json_get_string (control, "command", NULL, &command) ||
+          g_strcmp0 (command, "open") != 0)
+        continue;
+
+      if (!cockpit_json_get_string (control, "channel", NULL, &channel) ||
+          !cockpit_json_get_object (control, "headers", NULL, &heads))
+        g_assert_not_reached ();
+
+      bridge_serve (test, COCKPIT_TRANSPORT (mock), channel, heads);
+      test->opened++;
+    }
+}
+
+/* Fetches /manifests.json in a new session, returns the whole HTTP response */
+static gchar *
+fetch_manifests (TestServe *test,
+                 const gchar *http_host,
+                 const gchar *protocol,
+                 const gchar *language)
+{
+  CockpitWebResponse *response;
+  CockpitWebService *service;
+  CockpitCreds *creds;
+  MockTransport *mock;
+  GInputStream *input;
+  GOutputStream *output;
+  GIOStream *io;
+  GHashTable *headers;
+  GBytes *payload;
+  gchar *result;
+
+  mock = mock_transport_new ();
+  creds = cockpit_creds_new ("cockpit", COCKPIT_CRED_CSRF_TOKEN, "token", NULL);
+  service = cockpit_web_service_new (creds, COCKPIT_TRANSPORT (mock));
+  cockpit_web_service_set_host_checksum (service, "localhost", CHECKSUM);
+
+  payload = g_bytes_new_static (INIT_MESSAGE, strlen (INIT_MESSAGE));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (mock), NULL, payload);
+  g_bytes_unref (payload);
+
+  headers = cockpit_web_server_new_table ();
+  g_hash_table_insert (headers, g_strdup ("Host"), g_strdup (http_host));
+  g_hash_table_insert (headers, g_strdup ("Accept-Language"), g_strdup (language));
+
+  input = g_memory_input_stream_new ();
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = g_simple_io_stream_new (input, output);
+
+  response = cockpit_web_response_new (io, "/manifests.json", "/manifests.json", headers, "GET", protocol);
+  cockpit_channel_response_serve (service, headers, response, "$" CHECKSUM, "/manifests.json");
+
+  while (cockpit_web_response_get_state (response) != COCKPIT_WEB_RESPONSE_COMPLETE)
+    {
+      g_main_context_iteration (NULL, FALSE);
+      bridge_process (test, mock);
+    }
+
+  result = g_strndup (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output)),
+                      g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output)));
+
+  g_object_unref (response);
+  g_object_unref (io);
+  g_object_unref (input);
+  g_object_unref (output);
+  g_hash_table_unref (headers);
+  g_object_unref (service);
+  cockpit_creds_unref (creds);
+  g_object_unref (mock);
+
+  return result;
+}
+
+static void
+assert_manifests (const gchar *output,
+                  const gchar *connect_src,
+                  const gchar *language)
+{
+  gchar *expected;
+
+  g_assert (g_str_has_prefix (output, "HTTP/1.1 200 OK\r\n"));
+
+  expected = g_strdup_printf ("\r\nContent-Security-Policy: default-src 'self'; connect-src 'self' %s\r\n",
+                              connect_src);
+  g_assert (strstr (output, expected) != NULL);
+  g_free (expected);
+
+  expected = g_strdup_printf ("\r\n\r\n{\"language\":\"%s\"}", language);
+  g_assert (g_str_has_suffix (output, expected));
+  g_free (expected);
+}
+
+static void
+test_serve_per_origin (TestServe *test,
+                       gconstpointer data)
+{
+  CockpitPackageCacheStats stats;
+  gchar *output;
+
+  output = fetch_manifests (test, "one.example.com", "https", "de-de");
+  assert_manifests (output, "wss://one.example.com", "de-de");
+  g_assert_cmpuint (test->opened, ==, 1);
+  g_free (output);
+
+  /* Same checksum, but another name and language */
+  output = fetch_manifests (test, "two.example.com", "https", "fr-fr");
+  assert_manifests (output, "wss://two.example.com", "fr-fr");
+  g_assert_cmpuint (test->opened, ==, 2);
+  g_free (output);
+
+  /* Same name, but plain http */
+  output = fetch_manifests (test, "one.example.com", "http", "de-de");
+  assert_manifests (output, "ws://one.example.com", "de-de");
+  g_assert_cmpuint (test->opened, ==, 3);
+  g_free (output);
+
+  /* Just like the first one, so that one is used */
+  output = fetch_manifests (test, "one.example.com", "https", "de-de");
+  assert_manifests (output, "wss://one.example.com", "de-de");
+  g_assert_cmpuint (test->opened, ==, 3);
+  g_free (output);
+
+  cockpit_package_cache_get_stats (cockpit_package_cache_get_default (), &stats);
+  g_assert_cmpuint (stats.hits, ==, 1);
+  g_assert_cmpuint (stats.entries, ==, 3);
+}
+
+static void
+test_serve_no_store (TestServe *test,
+                     gconstpointer data)
+{
+  CockpitPackageCacheStats stats;
+  gchar *output;
+
+  output = fetch_manifests (test, "one.example.com", "https", "de-de");
+  assert_manifests (output, "wss://one.example.com", "de-de");
+  g_free (output);
+
+  output = fetch_manifests (test, "one.example.com", "https", "de-de");
+  assert_manifests (output, "wss://one.example.com", "de-de");
+  g_free (output);
+
+  /* The bridge said not to keep it, so it was asked both times */
+  g_assert_cmpuint (test->opened, ==, 2);
+
+  cockpit_package_cache_get_stats (cockpit_package_cache_get_default (), &stats);
+  g_assert_cmpuint (stats.hits, ==, 0);
+  g_assert_cmpuint (stats.entries, ==, 0);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add_func ("/package-cache/hit-miss", test_hit_miss);
+  g_test_add_func ("/package-cache/replace", test_replace);
+  g_test_add_func ("/package-cache/evict", test_evict);
+  g_test_add_func ("/package-cache/too-large", test_too_large);
+  g_test_add_func ("/package-cache/disabled", test_disabled);
+
+  g_test_add ("/package-cache/serve/per-origin", TestServe, NULL,
+              setup_serve, test_serve_per_origin, teardown_serve);
+  g_test_add ("/package-cache/serve/no-store", TestServe, "no-store",
+              setup_serve, test_serve_no_store, teardown_serve);
+  g_test_add ("/package-cache/serve/no-cache", TestServe, "no-cache",
+              setup_serve, test_serve_no_store, teardown_serve);
+  g_test_add ("/package-cache/serve/private", TestServe, "private, max-age=60",
+              setup_serve, test_serve_no_store, teardown_serve);
+
+  return g_test_run ();
+}
@@ -0,0 +1,343 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitsocketthread.h"
+
+#include "common/cockpitconf.h"
+#include "common/cockpitsocket.h"
+#include "websocket/websocket.h"
+#include "testlib/cockpittest.h"
+
+#include <string.h>
+
+extern const gchar *cockpit_config_file;
+
+#define WAIT_UNTIL(cond) \
+  G_STMT_START \
+    while (!(cond)) g_main_context_iteration (NULL, TRUE); \
+  G_STMT_END
+
+typedef struct {
+  CockpitThreadedSocket *threaded;
+  WebSocketConnection *connection;
+  GIOStream *server_io;
+  gboolean freed;
+
+  guint n_open;
+  guint n_closing;
+  guint n_close;
+  GPtrArray *received;
+
+  WebSocketConnection *client;
+  GPtrArray *client_received;
+  gboolean client_closed;
+} Test;
+
+/* Called in the worker thread */
+static WebSocketConnection *
+create_server (gpointer data)
+{
+  Test *test = data;
+  return web_socket_server_new_for_stream ("ws://localhost/unix", NULL, NULL,
+                                           test->server_io, NULL, NULL);
+}
+
+static void
+on_threaded_open (WebSocketConnection *connection,
+                  gpointer user_data)
+{
+  Test *test = user_data;
+
+  g_assert (!test->freed);
+  g_assert (connection == test->connection);
+  test->n_open++;
+}
+
+static void
+on_threaded_messages (WebSocketConnection *connection,
+                      const WebSocketMessage *messages,
+                      guint n_messages,
+                      gpointer user_data)
+{
+  Test *test = user_data;
+  guint i;
+
+  g_assert (!test->freed);
+  g_assert (connection == test->connection);
+
+  for (i = 0; i < n_messages; i++)
+    {
+      g_assert_cmpint (messages[i].type, ==, WEB_SOCKET_DATA_TEXT);
+      g_ptr_array_add (test->received, g_bytes_ref (messages[i].payload));
+    }
+}
+
+static void
+on_threaded_closing (WebSocketConnection *connection,
+                     gpointer user_data)
+{
+  Test *test = user_data;
+
+  g_assert (!test->freed);
+  g_assert (connection == test->connection);
+  test->n_closing++;
+}
+
+static void
+on_threaded_close (WebSocketConnection *connection,
+                   gpointer user_data)
+{
+  Test *test = user_data;
+
+  g_assert (!test->freed);
+  g_assert (connection == test->connection);
+  g_assert_cmpint (cockpit_threaded_socket_get_ready_state (test->threaded), ==, WEB_SOCKET_STATE_CLOSED);
+
+  /* Carried over from the worker, nothing pushed back here */
+  g_assert_cmpuint (cockpit_threaded_socket_get_pressure_count (test->threaded), ==, 0);
+  g_assert_cmpint (cockpit_threaded_socket_get_pressure_time (test->threaded), ==, 0);
+
+  test->n_close++;
+}
+
+static const CockpitThreadedSocketCallbacks callbacks = {
+  .open = on_threaded_open,
+  .messages = on_threaded_messages,
+  .closing = on_threaded_closing,
+  .close = on_threaded_close,
+};
+
+static void
+on_client_message (WebSocketConnection *ws,
+                   WebSocketDataType type,
+                   GBytes *message,
+                   gpointer user_data)
+{
+  Test *test = user_data;
+
+  g_assert_cmpint (type, ==, WEB_SOCKET_DATA_TEXT);
+  g_ptr_array_add (test->client_received, g_bytes_ref (message));
+}
+
+static void
+on_client_close (WebSocketConnection *ws,
+                 gpointer user_data)
+{
+  Test *test = user_data;
+
+  g_assert (!test->client_closed);
+  test->client_closed = TRUE;
+}
+
+static void
+setup (Test *test,
+       gconstpointer data)
+{
+  GIOStream *io;
+
+  g_assert (cockpit_threaded_socket_enabled ());
+
+  test->received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  test->client_received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+
+  cockpit_socket_streampair (&io, &test->server_io);
+
+  test->client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io);
+  g_signal_connect (test->client, "message", G_CALLBACK (on_client_message), test);
+  g_signal_connect (test->client, "close", G_CALLBACK (on_client_close), test);
+  g_object_unref (io);
+
+  /* Waits for create_server() to run on the worker */
+  test->threaded = cockpit_threaded_socket_new (create_server, test, &callbacks, test);
+  test->connection = cockpit_threaded_socket_get_connection (test->threaded);
+  g_assert (test->connection != NULL);
+  g_clear_object (&test->server_io);
+
+  WAIT_UNTIL (test->n_open == 1 &&
+              web_socket_connection_get_ready_state (test->client) == WEB_SOCKET_STATE_OPEN);
+  g_assert_cmpint (cockpit_threaded_socket_get_ready_state (test->threaded), ==, WEB_SOCKET_STATE_OPEN);
+}
+
+static void
+teardown (Test *test,
+          gconstpointer data)
+{
+  if (!test->freed)
+    cockpit_threaded_socket_free (test->threaded);
+  g_object_unref (test->client);
+
+  g_ptr_array_unref (test->received);
+  g_ptr_array_unref (test->client_received);
+
+  cockpit_assert_expected ();
+}
+
+static void
+client_send (Test *test,
+             const gchar *text)
+{
+  GBytes *payload = g_bytes_new (text, strlen (text));
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, payload);
+  g_bytes_unref (payload);
+}
+
+static void
+threaded_send (Test *test,
+               const gchar *text)
+{
+  GBytes *payload = g_bytes_new (text, strlen (text));
+  cockpit_threaded_socket_send (test->threaded, WEB_SOCKET_DATA_TEXT, NULL, payload, NULL);
+  g_bytes_unref (payload);
+}
+
+static void
+assert_payload (GPtrArray *array,
+                guint index,
+                const gchar *text)
+{
+  g_assert_cmpuint (index, <, array->len);
+  cockpit_assert_bytes_eq (array->pdata[index], text, -1);
+}
+
+static void
+test_messages (Test *test,
+               gconstpointer data)
+{
+  client_send (test, "one");
+  client_send (test, "two");
+  client_send (test, "three");
+
+  WAIT_UNTIL (test->received->len == 3);
+  assert_payload (test->received, 0, "one");
+  assert_payload (test->received, 1, "two");
+  assert_payload (test->received, 2, "three");
+
+  threaded_send (test, "reply");
+
+  WAIT_UNTIL (test->client_received->len == 1);
+  assert_payload (test->client_received, 0, "reply");
+
+  web_socket_connection_close (test->client, WEB_SOCKET_CLOSE_NORMAL, NULL);
+
+  WAIT_UNTIL (test->n_close == 1 && test->client_closed);
+  g_assert_cmpuint (test->n_closing, ==, 1);
+  g_assert_cmpuint (test->n_open, ==, 1);
+  g_assert_cmpuint (test->received->len, ==, 3);
+  g_assert_cmpint (web_socket_connection_get_close_code (test->client), ==, WEB_SOCKET_CLOSE_NORMAL);
+}
+
+static void
+test_close_pending (Test *test,
+                    gconstpointer data)
+{
+  gchar *text;
+  guint i;
+
+  for (i = 0; i < 100; i++)
+    {
+      text = g_strdup_printf ("message %u", i);
+      threaded_send (test, text);
+      g_free (text);
+    }
+
+  cockpit_threaded_socket_close (test->threaded, WEB_SOCKET_CLOSE_GOING_AWAY, "bye");
+  g_assert_cmpint (cockpit_threaded_socket_get_ready_state (test->threaded), ==, WEB_SOCKET_STATE_CLOSING);
+
+  /* Too late, dropped on the worker */
+  threaded_send (test, "dropped");
+
+  WAIT_UNTIL (test->n_close == 1 && test->client_closed);
+  g_assert_cmpuint (test->n_closing, ==, 1);
+
+  /* Everything sent before the close went out before it, in order */
+  g_assert_cmpuint (test->client_received->len, ==, 100);
+  for (i = 0; i < 100; i++)
+    {
+      text = g_strdup_printf ("message %u", i);
+      assert_payload (test->client_received, i, text);
+      g_free (text);
+    }
+
+  g_assert_cmpint (web_socket_connection_get_close_code (test->client), ==, WEB_SOCKET_CLOSE_GOING_AWAY);
+  g_assert_cmpstr (web_socket_connection_get_close_data (test->client), ==, "bye");
+}
+
+static gboolean
+on_timeout_set_flag (gpointer user_data)
+{
+  gboolean *flag = user_data;
+  *flag = TRUE;
+  return FALSE;
+}
+
+static void
+test_free_in_flight (Test *test,
+                     gconstpointer data)
+{
+  gboolean timeout = FALSE;
+  gchar *text;
+  guint i;
+
+  for (i = 0; i < 50; i++)
+    {
+      text = g_strdup_printf ("message %u", i);
+      client_send (test, text);
+      g_free (text);
+    }
+
+  WAIT_UNTIL (web_socket_connection_get_buffered_amount (test->client) == 0);
+
+  /* Let the worker post events that this thread doesn't look at yet */
+  g_usleep (G_USEC_PER_SEC / 10);
+
+  cockpit_threaded_socket_free (test->threaded);
+  test->freed = TRUE;
+
+  /* The worker drops the connection without closing it */
+  cockpit_expect_log ("WebSocket", G_LOG_LEVEL_MESSAGE, "connection unexpectedly closed by peer");
+  WAIT_UNTIL (test->client_closed);
+
+  /* No callbacks, even for the events that were already posted */
+  g_timeout_add (100, on_timeout_set_flag, &timeout);
+  WAIT_UNTIL (timeout);
+
+  g_assert_cmpuint (test->n_close, ==, 0);
+  g_assert_cmpuint (test->n_closing, ==, 0);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  /* Before anything asks whether there are worker threads */
+  cockpit_config_file = SRCDIR "/src/ws/mock-config/cockpit/cockpit-threads.conf";
+
+  g_test_add ("/socket-thread/messages", Test, NULL,
+              setup, test_messages, teardown);
+  g_test_add ("/socket-thread/close-pending", Test, NULL,
+              setup, test_close_pending, teardown);
+  g_test_add ("/socket-thread/free-in-flight", Test, NULL,
+              setup, test_free_in_flight, teardown);
+
+  return g_test_run ();
+}